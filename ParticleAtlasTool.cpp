@@ -0,0 +1,1036 @@
+﻿// Offline build step that packs the particle textures into texture atlas pages.
+//
+// Reads the PARTICLE_TEXTURES list from ParticleEnums.h, so the atlas always follows the ParticleEffect order,
+// loads each .dds from the particle asset folder, and packs them into as few pages as fit --max-size. Every
+// texture is surrounded by --padding texels copied from its edges, and the pages get a mip chain no deeper
+// than the padding can absorb, so neither bilinear filtering nor mipmapping bleeds between neighbours.
+//
+// Writes ParticleAtlas<page>.dds into the output folder and the generated ParticleAtlas.h with the page
+// files and the UV rect of every effect, which ParticleRenderer uses when PARTICLE_USE_ATLAS is defined.
+//
+// --format picks the format of the pages. bc, the default, compresses them again like the sources: BC1
+// (half a byte per texel) when every source is BC1, BC3 (one byte per texel) otherwise. rgba writes
+// R8G8B8A8_UNORM, four bytes per texel, so four to eight times the memory and sampling bandwidth of the
+// compressed sources; it is only worth it to compare against. With bc every cell is aligned to a block at
+// every mip level, so no block holds texels of two textures.
+//
+// Supported inputs: uncompressed 32 bit RGBA/BGRA and BC1/BC2/BC3 (DXT1/DXT3/DXT5), legacy or DX10 header.
+//
+// Usage: ParticleAtlasTool --enums ParticleEnums.h --input Assets\Particles --output Assets\Particles
+//            --header ParticleAtlas.h [--max-size n] [--padding n] [--format bc|rgba]
+
+#include "ParticleToolFiles.h"
+
+#include <algorithm>
+#include <climits>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct Image
+	{
+		std::string name;		// file name without extension, as in ParticleEffect
+		int width, height;
+		std::vector<uint32_t> texels;	// R8G8B8A8, red in the lowest byte
+		bool bc1;				// read from BC1, so alpha is only ever 0 or 255
+	};
+
+	// Where an image went in the atlas.
+	struct Placement
+	{
+		int page;
+		int x, y;				// top left of the image itself, inside its padding
+	};
+
+	uint32_t MakeFourCC(char a, char b, char c, char d)
+	{
+		return (uint32_t)(uint8_t)a | ((uint32_t)(uint8_t)b << 8) | ((uint32_t)(uint8_t)c << 16) | ((uint32_t)(uint8_t)d << 24);
+	}
+
+	const uint32_t DDS_MAGIC = 0x20534444;	// "DDS "
+	const uint32_t DDPF_ALPHAPIXELS = 0x1;
+	const uint32_t DDPF_FOURCC = 0x4;
+	const uint32_t DDPF_RGB = 0x40;
+
+	// DXGI_FORMAT values of the DX10 header formats we read.
+	const uint32_t DXGI_R8G8B8A8_UNORM = 28;
+	const uint32_t DXGI_R8G8B8A8_UNORM_SRGB = 29;
+	const uint32_t DXGI_BC1_UNORM = 71;
+	const uint32_t DXGI_BC1_UNORM_SRGB = 72;
+	const uint32_t DXGI_BC2_UNORM = 74;
+	const uint32_t DXGI_BC2_UNORM_SRGB = 75;
+	const uint32_t DXGI_BC3_UNORM = 77;
+	const uint32_t DXGI_BC3_UNORM_SRGB = 78;
+	const uint32_t DXGI_B8G8R8A8_UNORM = 87;
+	const uint32_t DXGI_B8G8R8A8_UNORM_SRGB = 91;
+
+	struct DdsPixelFormat
+	{
+		uint32_t size, flags, fourCC, rgbBitCount;
+		uint32_t redMask, greenMask, blueMask, alphaMask;
+	};
+
+	struct DdsHeader
+	{
+		uint32_t size, flags, height, width, pitchOrLinearSize, depth, mipMapCount;
+		uint32_t reserved1[11];
+		DdsPixelFormat pixelFormat;
+		uint32_t caps, caps2, caps3, caps4, reserved2;
+	};
+
+	struct DdsHeaderDx10
+	{
+		uint32_t dxgiFormat, resourceDimension, miscFlag, arraySize, miscFlags2;
+	};
+
+	enum SourceFormat
+	{
+		FormatUnknown,
+		FormatMasked32,
+		FormatBC1,
+		FormatBC2,
+		FormatBC3
+	};
+
+	uint32_t PackRgba(uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+	{
+		return r | (g << 8) | (b << 16) | (a << 24);
+	}
+
+	// Extract the channel selected by mask and scale it to 8 bits.
+	uint32_t ExtractChannel(uint32_t texel, uint32_t mask, uint32_t defaultValue)
+	{
+		if (mask == 0)
+		{
+			return defaultValue;
+		}
+
+		int shift = 0;
+		while (((mask >> shift) & 1) == 0)
+		{
+			++shift;
+		}
+
+		uint32_t max = mask >> shift;
+		return (((texel & mask) >> shift) * 255 + max / 2) / max;
+	}
+
+	// RGB565 to 8 bits per channel.
+	void DecodeColor565(uint16_t color, uint32_t* rgb)
+	{
+		rgb[0] = ((color >> 11) & 31) * 255 / 31;
+		rgb[1] = ((color >> 5) & 63) * 255 / 63;
+		rgb[2] = (color & 31) * 255 / 31;
+	}
+
+	// The four colors of a BC1/BC2/BC3 color block with endpoints c0 and c1. BC1 blocks with c0 <= c1 use
+	// the three color plus transparent mode.
+	void DecodeColorPalette(uint16_t c0, uint16_t c1, bool allowTransparent, uint32_t palette[4][4])
+	{
+		DecodeColor565(c0, palette[0]);
+		DecodeColor565(c1, palette[1]);
+		palette[0][3] = 255;
+		palette[1][3] = 255;
+
+		if (c0 > c1 || !allowTransparent)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			palette[2][3] = 255;
+			palette[3][3] = 255;
+		}
+		else
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+				palette[3][c] = 0;
+			}
+			palette[2][3] = 255;
+			palette[3][3] = 0;
+		}
+	}
+
+	// Decode the color part of a BC1/BC2/BC3 block.
+	void DecodeColorBlock(const uint8_t* block, bool allowTransparent, uint32_t* texels)
+	{
+		uint16_t c0 = (uint16_t)(block[0] | (block[1] << 8));
+		uint16_t c1 = (uint16_t)(block[2] | (block[3] << 8));
+		uint32_t palette[4][4];
+		DecodeColorPalette(c0, c1, allowTransparent, palette);
+
+		uint32_t indices = (uint32_t)block[4] | ((uint32_t)block[5] << 8) | ((uint32_t)block[6] << 16) | ((uint32_t)block[7] << 24);
+		for (int i = 0; i < 16; ++i)
+		{
+			const uint32_t* color = palette[(indices >> (i * 2)) & 3];
+			texels[i] = PackRgba(color[0], color[1], color[2], color[3]);
+		}
+	}
+
+	// Decode the explicit 4 bit alpha of a BC2 block over the decoded colors.
+	void DecodeExplicitAlpha(const uint8_t* block, uint32_t* texels)
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			uint32_t alpha = (block[i / 2] >> ((i & 1) * 4)) & 15;
+			texels[i] = (texels[i] & 0x00FFFFFF) | ((alpha * 17) << 24);
+		}
+	}
+
+	// The eight alphas of a BC3 alpha block with endpoints a0 and a1.
+	void DecodeAlphaPalette(uint32_t a0, uint32_t a1, uint32_t* a)
+	{
+		a[0] = a0;
+		a[1] = a1;
+		if (a[0] > a[1])
+		{
+			for (int i = 1; i < 7; ++i)
+			{
+				a[i + 1] = ((7 - i) * a[0] + i * a[1]) / 7;
+			}
+		}
+		else
+		{
+			for (int i = 1; i < 5; ++i)
+			{
+				a[i + 1] = ((5 - i) * a[0] + i * a[1]) / 5;
+			}
+			a[6] = 0;
+			a[7] = 255;
+		}
+	}
+
+	// Decode the interpolated alpha of a BC3 block over the decoded colors.
+	void DecodeInterpolatedAlpha(const uint8_t* block, uint32_t* texels)
+	{
+		uint32_t a[8];
+		DecodeAlphaPalette(block[0], block[1], a);
+
+		uint64_t indices = 0;
+		for (int i = 0; i < 6; ++i)
+		{
+			indices |= (uint64_t)block[2 + i] << (i * 8);
+		}
+
+		for (int i = 0; i < 16; ++i)
+		{
+			uint32_t alpha = a[(indices >> (i * 3)) & 7];
+			texels[i] = (texels[i] & 0x00FFFFFF) | (alpha << 24);
+		}
+	}
+
+	// Load the top mip of a DDS file as R8G8B8A8.
+	bool LoadDds(const std::string& path, Image& image)
+	{
+		std::vector<uint8_t> data;
+		if (!ReadFile(path, data))
+		{
+			fprintf(stderr, "Can't read %s\n", path.c_str());
+			return false;
+		}
+
+		uint32_t magic = 0;
+		DdsHeader header;
+		if (data.size() < sizeof(magic) + sizeof(header))
+		{
+			fprintf(stderr, "%s is too small for a DDS file\n", path.c_str());
+			return false;
+		}
+
+		memcpy(&magic, &data[0], sizeof(magic));
+		memcpy(&header, &data[sizeof(magic)], sizeof(header));
+		if (magic != DDS_MAGIC || header.size != sizeof(DdsHeader))
+		{
+			fprintf(stderr, "%s is not a DDS file\n", path.c_str());
+			return false;
+		}
+
+		size_t offset = sizeof(magic) + sizeof(header);
+		const DdsPixelFormat& pf = header.pixelFormat;
+		SourceFormat format = FormatUnknown;
+		uint32_t masks[4] = { pf.redMask, pf.greenMask, pf.blueMask, (pf.flags & DDPF_ALPHAPIXELS) ? pf.alphaMask : 0 };
+
+		if ((pf.flags & DDPF_FOURCC) && pf.fourCC == MakeFourCC('D', 'X', '1', '0'))
+		{
+			DdsHeaderDx10 dx10;
+			if (data.size() < offset + sizeof(dx10))
+			{
+				fprintf(stderr, "%s has a truncated DX10 header\n", path.c_str());
+				return false;
+			}
+
+			memcpy(&dx10, &data[offset], sizeof(dx10));
+			offset += sizeof(dx10);
+
+			switch (dx10.dxgiFormat)
+			{
+			case DXGI_R8G8B8A8_UNORM:
+			case DXGI_R8G8B8A8_UNORM_SRGB:
+				format = FormatMasked32;
+				masks[0] = 0x000000FF; masks[1] = 0x0000FF00; masks[2] = 0x00FF0000; masks[3] = 0xFF000000;
+				break;
+			case DXGI_B8G8R8A8_UNORM:
+			case DXGI_B8G8R8A8_UNORM_SRGB:
+				format = FormatMasked32;
+				masks[0] = 0x00FF0000; masks[1] = 0x0000FF00; masks[2] = 0x000000FF; masks[3] = 0xFF000000;
+				break;
+			case DXGI_BC1_UNORM:
+			case DXGI_BC1_UNORM_SRGB:
+				format = FormatBC1;
+				break;
+			case DXGI_BC2_UNORM:
+			case DXGI_BC2_UNORM_SRGB:
+				format = FormatBC2;
+				break;
+			case DXGI_BC3_UNORM:
+			case DXGI_BC3_UNORM_SRGB:
+				format = FormatBC3;
+				break;
+			}
+		}
+		else if (pf.flags & DDPF_FOURCC)
+		{
+			if (pf.fourCC == MakeFourCC('D', 'X', 'T', '1'))
+			{
+				format = FormatBC1;
+			}
+			else if (pf.fourCC == MakeFourCC('D', 'X', 'T', '2') || pf.fourCC == MakeFourCC('D', 'X', 'T', '3'))
+			{
+				format = FormatBC2;
+			}
+			else if (pf.fourCC == MakeFourCC('D', 'X', 'T', '4') || pf.fourCC == MakeFourCC('D', 'X', 'T', '5'))
+			{
+				format = FormatBC3;
+			}
+		}
+		else if ((pf.flags & DDPF_RGB) && pf.rgbBitCount == 32)
+		{
+			format = FormatMasked32;
+		}
+
+		if (format == FormatUnknown)
+		{
+			fprintf(stderr, "%s uses an unsupported pixel format\n", path.c_str());
+			return false;
+		}
+
+		image.width = (int)header.width;
+		image.height = (int)header.height;
+		image.bc1 = format == FormatBC1;
+		image.texels.resize((size_t)image.width * image.height);
+
+		if (format == FormatMasked32)
+		{
+			if (data.size() < offset + image.texels.size() * 4)
+			{
+				fprintf(stderr, "%s is truncated\n", path.c_str());
+				return false;
+			}
+
+			for (size_t i = 0; i < image.texels.size(); ++i)
+			{
+				uint32_t texel;
+				memcpy(&texel, &data[offset + i * 4], sizeof(texel));
+				image.texels[i] = PackRgba(
+					ExtractChannel(texel, masks[0], 0),
+					ExtractChannel(texel, masks[1], 0),
+					ExtractChannel(texel, masks[2], 0),
+					ExtractChannel(texel, masks[3], 255));
+			}
+
+			return true;
+		}
+
+		int blockSize = (format == FormatBC1) ? 8 : 16;
+		int blocksX = (image.width + 3) / 4;
+		int blocksY = (image.height + 3) / 4;
+		if (data.size() < offset + (size_t)blocksX * blocksY * blockSize)
+		{
+			fprintf(stderr, "%s is truncated\n", path.c_str());
+			return false;
+		}
+
+		for (int by = 0; by < blocksY; ++by)
+		{
+			for (int bx = 0; bx < blocksX; ++bx)
+			{
+				const uint8_t* block = &data[offset + ((size_t)by * blocksX + bx) * blockSize];
+				uint32_t texels[16];
+
+				if (format == FormatBC1)
+				{
+					DecodeColorBlock(block, true, texels);
+				}
+				else
+				{
+					DecodeColorBlock(block + 8, false, texels);
+					if (format == FormatBC2)
+					{
+						DecodeExplicitAlpha(block, texels);
+					}
+					else
+					{
+						DecodeInterpolatedAlpha(block, texels);
+					}
+				}
+
+				for (int i = 0; i < 16; ++i)
+				{
+					int x = bx * 4 + (i & 3);
+					int y = by * 4 + (i >> 2);
+					if (x < image.width && y < image.height)
+					{
+						image.texels[(size_t)y * image.width + x] = texels[i];
+					}
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Shelf packer: images sorted by height, placed left to right on rows, rows top to bottom,
+	// pages one after another. Positions are rounded up to 'align' so every mip level stays aligned.
+	int PackImages(const std::vector<Image>& images, int pageSize, int padding, int align, std::vector<Placement>& placements, std::vector<int>& pageHeights)
+	{
+		std::vector<int> order(images.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			order[i] = (int)i;
+		}
+
+		struct ByHeight
+		{
+			const std::vector<Image>* images;
+			bool operator()(int a, int b) const
+			{
+				const Image& ia = (*images)[a];
+				const Image& ib = (*images)[b];
+				return ia.height != ib.height ? ia.height > ib.height : a < b;
+			}
+		};
+		ByHeight byHeight = { &images };
+		std::sort(order.begin(), order.end(), byHeight);
+
+		placements.assign(images.size(), Placement());
+		pageHeights.clear();
+
+		int page = 0;
+		int x = 0;
+		int y = 0;
+		int rowHeight = 0;
+		pageHeights.push_back(0);
+
+		for (size_t n = 0; n < order.size(); ++n)
+		{
+			const Image& image = images[order[n]];
+			int cellWidth = (image.width + 2 * padding + align - 1) / align * align;
+			int cellHeight = (image.height + 2 * padding + align - 1) / align * align;
+			if (cellWidth > pageSize || cellHeight > pageSize)
+			{
+				fprintf(stderr, "%s (%dx%d) doesn't fit a %d page\n", image.name.c_str(), image.width, image.height, pageSize);
+				return -1;
+			}
+
+			if (x + cellWidth > pageSize)
+			{
+				// Next row.
+				x = 0;
+				y += rowHeight;
+				rowHeight = 0;
+			}
+
+			if (y + cellHeight > pageSize)
+			{
+				// Next page.
+				++page;
+				x = 0;
+				y = 0;
+				rowHeight = 0;
+				pageHeights.push_back(0);
+			}
+
+			placements[order[n]].page = page;
+			placements[order[n]].x = x + padding;
+			placements[order[n]].y = y + padding;
+
+			x += cellWidth;
+			rowHeight = std::max(rowHeight, cellHeight);
+			pageHeights[page] = std::max(pageHeights[page], y + rowHeight);
+		}
+
+		return page + 1;
+	}
+
+	int NextPowerOfTwo(int value)
+	{
+		int result = 1;
+		while (result < value)
+		{
+			result *= 2;
+		}
+		return result;
+	}
+
+	// Copy the image and replicate its edge texels into the padding around it.
+	void BlitPadded(const Image& image, int padding, int destX, int destY, int pageWidth, std::vector<uint32_t>& page)
+	{
+		for (int y = -padding; y < image.height + padding; ++y)
+		{
+			int sy = std::min(std::max(y, 0), image.height - 1);
+			for (int x = -padding; x < image.width + padding; ++x)
+			{
+				int sx = std::min(std::max(x, 0), image.width - 1);
+				page[(size_t)(destY + y) * pageWidth + destX + x] = image.texels[(size_t)sy * image.width + sx];
+			}
+		}
+	}
+
+	// 2x2 box filter down to the next mip level.
+	void Downsample(const std::vector<uint32_t>& source, int width, int height, std::vector<uint32_t>& dest)
+	{
+		int destWidth = std::max(width / 2, 1);
+		int destHeight = std::max(height / 2, 1);
+		dest.resize((size_t)destWidth * destHeight);
+
+		for (int y = 0; y < destHeight; ++y)
+		{
+			for (int x = 0; x < destWidth; ++x)
+			{
+				int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+				int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+				uint32_t t[4] =
+				{
+					source[(size_t)y0 * width + x0], source[(size_t)y0 * width + x1],
+					source[(size_t)y1 * width + x0], source[(size_t)y1 * width + x1]
+				};
+
+				uint32_t result = 0;
+				for (int c = 0; c < 32; c += 8)
+				{
+					uint32_t sum = ((t[0] >> c) & 0xFF) + ((t[1] >> c) & 0xFF) + ((t[2] >> c) & 0xFF) + ((t[3] >> c) & 0xFF);
+					result |= ((sum + 2) / 4) << c;
+				}
+				dest[(size_t)y * destWidth + x] = result;
+			}
+		}
+	}
+
+	// Formats of the atlas pages.
+	enum PageFormat
+	{
+		PageRgba,
+		PageBC1,
+		PageBC3
+	};
+
+	// 8 bits per channel to RGB565, rounded.
+	uint16_t EncodeColor565(const float* rgb)
+	{
+		int r = (int)(std::min(std::max(rgb[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+		int g = (int)(std::min(std::max(rgb[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+		int b = (int)(std::min(std::max(rgb[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+		return (uint16_t)((r << 11) | (g << 5) | b);
+	}
+
+	// Encode the color part of a BC1/BC3 block. The endpoints are the extremes of the colors along their
+	// principal axis. With 'transparent', a BC1 block with texels of alpha below 128 uses the three color
+	// plus transparent mode and makes those texels transparent; otherwise blocks use the four color mode,
+	// which BC3 always decodes.
+	void EncodeColorBlock(const uint32_t* texels, bool transparent, uint8_t* block)
+	{
+		bool opaque[16];
+		bool anyTransparent = false;
+		int count = 0;
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; ++i)
+		{
+			opaque[i] = !transparent || (texels[i] >> 24) >= 128;
+			anyTransparent = anyTransparent || !opaque[i];
+			if (opaque[i])
+			{
+				for (int c = 0; c < 3; ++c)
+				{
+					mean[c] += (float)((texels[i] >> (c * 8)) & 0xFF);
+				}
+				++count;
+			}
+		}
+
+		float endpoints[2][3] = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+		if (count > 0)
+		{
+			float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+			for (int c = 0; c < 3; ++c)
+			{
+				mean[c] /= (float)count;
+			}
+			for (int i = 0; i < 16; ++i)
+			{
+				if (opaque[i])
+				{
+					float d[3];
+					for (int c = 0; c < 3; ++c)
+					{
+						d[c] = (float)((texels[i] >> (c * 8)) & 0xFF) - mean[c];
+					}
+					covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+					covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+				}
+			}
+
+			// A few power iterations from the luminance axis find the principal axis closely enough.
+			float axis[3] = { 0.299f, 0.587f, 0.114f };
+			for (int iteration = 0; iteration < 4; ++iteration)
+			{
+				float next[3] =
+				{
+					covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+					covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+					covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+				};
+				float length = std::max(std::max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+				if (length == 0.0f)
+				{
+					break;
+				}
+				for (int c = 0; c < 3; ++c)
+				{
+					axis[c] = next[c] / length;
+				}
+			}
+
+			float minT = 0.0f;
+			float maxT = 0.0f;
+			float axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+			for (int i = 0; i < 16; ++i)
+			{
+				if (opaque[i])
+				{
+					float t = 0.0f;
+					for (int c = 0; c < 3; ++c)
+					{
+						t += ((float)((texels[i] >> (c * 8)) & 0xFF) - mean[c]) * axis[c];
+					}
+					t /= axisLength;
+					minT = std::min(minT, t);
+					maxT = std::max(maxT, t);
+				}
+			}
+
+			for (int c = 0; c < 3; ++c)
+			{
+				endpoints[0][c] = mean[c] + axis[c] * maxT;
+				endpoints[1][c] = mean[c] + axis[c] * minT;
+			}
+		}
+
+		uint16_t c0 = EncodeColor565(endpoints[0]);
+		uint16_t c1 = EncodeColor565(endpoints[1]);
+
+		// c0 > c1 selects the four color mode, c0 <= c1 the three color plus transparent one.
+		if ((anyTransparent && c0 > c1) || (!anyTransparent && c0 < c1))
+		{
+			std::swap(c0, c1);
+		}
+
+		uint32_t palette[4][4];
+		DecodeColorPalette(c0, c1, anyTransparent, palette);
+
+		// Equal endpoints decode as the three color mode, whose fourth color is transparent: only use the first.
+		int numColors = anyTransparent || c0 == c1 ? 3 : 4;
+		uint32_t indices = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			int best = 3;
+			if (opaque[i])
+			{
+				int bestDistance = INT_MAX;
+				for (int p = 0; p < numColors; ++p)
+				{
+					int distance = 0;
+					for (int c = 0; c < 3; ++c)
+					{
+						int d = (int)((texels[i] >> (c * 8)) & 0xFF) - (int)palette[p][c];
+						distance += d * d;
+					}
+					if (distance < bestDistance)
+					{
+						bestDistance = distance;
+						best = p;
+					}
+				}
+			}
+			indices |= (uint32_t)best << (i * 2);
+		}
+
+		block[0] = (uint8_t)c0;
+		block[1] = (uint8_t)(c0 >> 8);
+		block[2] = (uint8_t)c1;
+		block[3] = (uint8_t)(c1 >> 8);
+		for (int i = 0; i < 4; ++i)
+		{
+			block[4 + i] = (uint8_t)(indices >> (i * 8));
+		}
+	}
+
+	// Encode the interpolated alpha of a BC3 block, between the smallest and the largest alpha.
+	void EncodeAlphaBlock(const uint32_t* texels, uint8_t* block)
+	{
+		uint32_t a0 = 0;
+		uint32_t a1 = 255;
+		for (int i = 0; i < 16; ++i)
+		{
+			a0 = std::max(a0, texels[i] >> 24);
+			a1 = std::min(a1, texels[i] >> 24);
+		}
+
+		uint32_t a[8];
+		DecodeAlphaPalette(a0, a1, a);
+
+		uint64_t indices = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			int alpha = (int)(texels[i] >> 24);
+			int best = 0;
+			for (int p = 1; p < 8; ++p)
+			{
+				if (abs(alpha - (int)a[p]) < abs(alpha - (int)a[best]))
+				{
+					best = p;
+				}
+			}
+			indices |= (uint64_t)best << (i * 3);
+		}
+
+		block[0] = (uint8_t)a0;
+		block[1] = (uint8_t)a1;
+		for (int i = 0; i < 6; ++i)
+		{
+			block[2 + i] = (uint8_t)(indices >> (i * 8));
+		}
+	}
+
+	// Encode one mip level as BC1 or BC3 blocks. Texels past the edge of a level smaller than a block
+	// repeat the last row and column.
+	void EncodeBlocks(const std::vector<uint32_t>& texels, int width, int height, PageFormat format, std::vector<uint8_t>& blocks)
+	{
+		int blockSize = (format == PageBC1) ? 8 : 16;
+		int blocksX = (width + 3) / 4;
+		int blocksY = (height + 3) / 4;
+		blocks.resize((size_t)blocksX * blocksY * blockSize);
+
+		for (int by = 0; by < blocksY; ++by)
+		{
+			for (int bx = 0; bx < blocksX; ++bx)
+			{
+				uint32_t block[16];
+				for (int i = 0; i < 16; ++i)
+				{
+					int x = std::min(bx * 4 + (i & 3), width - 1);
+					int y = std::min(by * 4 + (i >> 2), height - 1);
+					block[i] = texels[(size_t)y * width + x];
+				}
+
+				uint8_t* dest = &blocks[((size_t)by * blocksX + bx) * blockSize];
+				if (format == PageBC1)
+				{
+					EncodeColorBlock(block, true, dest);
+				}
+				else
+				{
+					EncodeAlphaBlock(block, dest);
+					EncodeColorBlock(block, false, dest + 8);
+				}
+			}
+		}
+	}
+
+	// Write a DDS in 'format' with a legacy header, which DDSTextureLoader reads on every feature level.
+	// The mips are filtered from the uncompressed level above, not from its blocks.
+	bool WriteDds(const std::string& path, const std::vector<uint32_t>& texels, int width, int height, int mipLevels, PageFormat format)
+	{
+		const uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PITCH = 0x8;
+		const uint32_t DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000, DDSD_LINEARSIZE = 0x80000;
+		const uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS_MIPMAP = 0x400000;
+
+		DdsHeader header;
+		memset(&header, 0, sizeof(header));
+		header.size = sizeof(DdsHeader);
+		header.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT;
+		header.height = (uint32_t)height;
+		header.width = (uint32_t)width;
+		header.mipMapCount = (uint32_t)mipLevels;
+		header.pixelFormat.size = sizeof(DdsPixelFormat);
+		if (format == PageRgba)
+		{
+			header.flags |= DDSD_PITCH;
+			header.pitchOrLinearSize = (uint32_t)width * 4;
+			header.pixelFormat.flags = DDPF_RGB | DDPF_ALPHAPIXELS;
+			header.pixelFormat.rgbBitCount = 32;
+			header.pixelFormat.redMask = 0x000000FF;
+			header.pixelFormat.greenMask = 0x0000FF00;
+			header.pixelFormat.blueMask = 0x00FF0000;
+			header.pixelFormat.alphaMask = 0xFF000000;
+		}
+		else
+		{
+			header.flags |= DDSD_LINEARSIZE;
+			header.pitchOrLinearSize = (uint32_t)(((width + 3) / 4) * ((height + 3) / 4) * (format == PageBC1 ? 8 : 16));
+			header.pixelFormat.flags = DDPF_FOURCC;
+			header.pixelFormat.fourCC = format == PageBC1 ? MakeFourCC('D', 'X', 'T', '1') : MakeFourCC('D', 'X', 'T', '5');
+		}
+		header.caps = DDSCAPS_TEXTURE | (mipLevels > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0);
+
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == nullptr)
+		{
+			fprintf(stderr, "Can't write %s\n", path.c_str());
+			return false;
+		}
+
+		bool ok = fwrite(&DDS_MAGIC, sizeof(DDS_MAGIC), 1, file) == 1 && fwrite(&header, sizeof(header), 1, file) == 1;
+
+		std::vector<uint32_t> level = texels;
+		std::vector<uint32_t> next;
+		std::vector<uint8_t> blocks;
+		int levelWidth = width;
+		int levelHeight = height;
+		for (int mip = 0; mip < mipLevels && ok; ++mip)
+		{
+			if (format == PageRgba)
+			{
+				ok = fwrite(&level[0], sizeof(uint32_t), level.size(), file) == level.size();
+			}
+			else
+			{
+				EncodeBlocks(level, levelWidth, levelHeight, format, blocks);
+				ok = fwrite(&blocks[0], 1, blocks.size(), file) == blocks.size();
+			}
+
+			Downsample(level, levelWidth, levelHeight, next);
+			level.swap(next);
+			levelWidth = std::max(levelWidth / 2, 1);
+			levelHeight = std::max(levelHeight / 2, 1);
+		}
+
+		fclose(file);
+		if (!ok)
+		{
+			fprintf(stderr, "Can't write %s\n", path.c_str());
+		}
+		return ok;
+	}
+
+	bool WriteHeader(const std::string& path, const std::vector<Image>& images, const std::vector<Placement>& placements,
+		const std::vector<int>& pageWidths, const std::vector<int>& pageHeights, const std::string& assetFolder)
+	{
+		FILE* file = fopen(path.c_str(), "w");
+		if (file == nullptr)
+		{
+			fprintf(stderr, "Can't write %s\n", path.c_str());
+			return false;
+		}
+
+		fprintf(file, "// AUTO-GENERATED by ParticleAtlasTool. Do not modify.\n\n");
+		fprintf(file, "// Texture atlas pages for the PARTICLE_TEXTURES in ParticleEnums.h, and the texture rect of every ParticleEffect.\n\n");
+		fprintf(file, "#pragma once\n\n");
+		fprintf(file, "struct ParticleAtlasEntry\n{\n\tint page;\t\t// index into PARTICLE_ATLAS_PAGES\n");
+		fprintf(file, "\tfloat left, top, right, bottom;\n};\n\n");
+
+		fprintf(file, "static const int PARTICLE_ATLAS_NUM_PAGES = %d;\n\n", (int)pageWidths.size());
+		fprintf(file, "static const wchar_t * PARTICLE_ATLAS_PAGES[] =\n{\n");
+		for (size_t page = 0; page < pageWidths.size(); ++page)
+		{
+			fprintf(file, "\tL\"%sParticleAtlas%d.dds\",\t// %dx%d\n", assetFolder.c_str(), (int)page, pageWidths[page], pageHeights[page]);
+		}
+		fprintf(file, "};\n\n");
+
+		fprintf(file, "static const ParticleAtlasEntry PARTICLE_ATLAS_ENTRIES[] =\n{\n");
+		for (size_t i = 0; i < images.size(); ++i)
+		{
+			const Placement& p = placements[i];
+			float width = (float)pageWidths[p.page];
+			float height = (float)pageHeights[p.page];
+			fprintf(file, "\t{ %d, %.9gf, %.9gf, %.9gf, %.9gf },\t// %s\n", p.page,
+				p.x / width, p.y / height, (p.x + images[i].width) / width, (p.y + images[i].height) / height,
+				images[i].name.c_str());
+		}
+		fprintf(file, "};\n");
+
+		fclose(file);
+		return true;
+	}
+
+	const char* const PAGE_FORMAT_NAMES[] = { "R8G8B8A8_UNORM", "BC1", "BC3" };
+
+	// Asset folder of the pages in the generated header, the same as the PARTICLE_TEXTURES entries.
+	const char* PAGE_ASSET_FOLDER = "Assets\\\\Particles\\\\";
+}
+
+int main(int argc, char** argv)
+{
+	std::string enumsPath;
+	std::string inputFolder;
+	std::string outputFolder;
+	std::string headerPath;
+	int maxSize = 2048;
+	int padding = 8;
+	bool compress = true;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--enums") == 0 && i + 1 < argc)
+		{
+			enumsPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+		{
+			inputFolder = argv[++i];
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+		{
+			outputFolder = argv[++i];
+		}
+		else if (strcmp(argv[i], "--header") == 0 && i + 1 < argc)
+		{
+			headerPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+		{
+			maxSize = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--padding") == 0 && i + 1 < argc)
+		{
+			padding = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "bc") == 0 || strcmp(argv[i + 1], "rgba") == 0))
+		{
+			compress = strcmp(argv[++i], "bc") == 0;
+		}
+		else
+		{
+			enumsPath.clear();
+			break;
+		}
+	}
+
+	if (enumsPath.empty() || inputFolder.empty() || outputFolder.empty() || headerPath.empty() || maxSize <= 0 || padding < 0)
+	{
+		printf("Usage: %s --enums ParticleEnums.h --input folder --output folder --header ParticleAtlas.h [--max-size n] [--padding n] [--format bc|rgba]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<std::string> names;
+	if (!ReadTextureNames(enumsPath, names))
+	{
+		return 1;
+	}
+
+	std::vector<Image> images(names.size());
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		images[i].name = names[i];
+		if (!LoadDds(inputFolder + "/" + names[i] + ".dds", images[i]))
+		{
+			return 1;
+		}
+	}
+
+	// Mip level n blurs 2^n texels, so the padding limits how many levels stay clean.
+	int mipLevels = 1;
+	while ((2 << (mipLevels - 1)) <= padding)
+	{
+		++mipLevels;
+	}
+	int align = 1 << (mipLevels - 1);
+
+	// BC1 keeps the sources' cost when they all are BC1, otherwise BC3 keeps their alpha. The cells are
+	// then aligned to whole blocks down to the last mip level.
+	PageFormat format = PageRgba;
+	if (compress)
+	{
+		format = PageBC1;
+		for (size_t i = 0; i < images.size(); ++i)
+		{
+			if (!images[i].bc1)
+			{
+				format = PageBC3;
+			}
+		}
+		align *= 4;
+	}
+
+	// Use the smallest square page that holds everything, and only spill into more pages at the maximum size.
+	std::vector<Placement> placements;
+	std::vector<int> usedHeights;
+	int numPages = 0;
+	for (int pageSize = std::min(256, maxSize); ; pageSize = std::min(pageSize * 2, maxSize))
+	{
+		numPages = PackImages(images, pageSize, padding, align, placements, usedHeights);
+		if (numPages < 0)
+		{
+			if (pageSize == maxSize)
+			{
+				return 1;
+			}
+			continue;
+		}
+
+		if (numPages == 1 || pageSize == maxSize)
+		{
+			break;
+		}
+	}
+
+	std::vector<int> pageWidths(numPages, 0);
+	std::vector<int> pageHeights(numPages, 0);
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		const Placement& p = placements[i];
+		pageWidths[p.page] = std::max(pageWidths[p.page], p.x + images[i].width + padding);
+	}
+
+	for (int page = 0; page < numPages; ++page)
+	{
+		// Power of two pages, feature level 9_x needs them for mipmaps.
+		pageWidths[page] = NextPowerOfTwo(pageWidths[page]);
+		pageHeights[page] = NextPowerOfTwo(usedHeights[page]);
+
+		std::vector<uint32_t> texels((size_t)pageWidths[page] * pageHeights[page], 0);
+		for (size_t i = 0; i < images.size(); ++i)
+		{
+			if (placements[i].page == page)
+			{
+				BlitPadded(images[i], padding, placements[i].x, placements[i].y, pageWidths[page], texels);
+			}
+		}
+
+		char fileName[64];
+		sprintf(fileName, "/ParticleAtlas%d.dds", page);
+		if (!WriteDds(outputFolder + fileName, texels, pageWidths[page], pageHeights[page], mipLevels, format))
+		{
+			return 1;
+		}
+
+		printf("ParticleAtlas%d.dds: %dx%d, %d mip levels, %s\n", page, pageWidths[page], pageHeights[page], mipLevels,
+			PAGE_FORMAT_NAMES[format]);
+	}
+
+	if (!WriteHeader(headerPath, images, placements, pageWidths, pageHeights, PAGE_ASSET_FOLDER))
+	{
+		return 1;
+	}
+
+	printf("%d textures packed into %d pages, %s written\n", (int)images.size(), numPages, headerPath.c_str());
+	return 0;
+}
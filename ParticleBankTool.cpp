@@ -0,0 +1,375 @@
+﻿// Offline build step that compiles the emitter presets from their text source into a ParticleEffectBank.
+//
+// The source has one section per effect, named in brackets, followed by "key = value" lines; '#' starts
+// a comment. Keys are the fields of ParticleEmitterRecord (colors take four values, red green blue alpha),
+// plus:
+//   texture          ParticleEffect name, resolved from the PARTICLE_TEXTURES table of ParticleEnums.h
+//   blend            Additive, Opaque, AlphaBlend or NonPremultiplied
+//   autoPlay         0 or 1
+//   textureRotation  0 or 1
+//   keyMode          integrate or evaluate
+//   rotationMode     angle or complex
+// Fields that aren't given keep their defaults: autoPlay 1, colors opaque white, duration -1 (emit
+// forever), maxSteps 1, everything else 0. Every section needs a texture.
+//
+//   [fire]
+//   texture = fire
+//   maxParticles = 200
+//   emissionRate = 80
+//   lifetime = 1.5
+//   endColor = 1 0.5 0.2 0
+//
+// Usage: ParticleBankTool --enums ParticleEnums.h --input ParticleEffects.txt --output ParticleEffects.pfxb
+
+#include "ParticleEffectBank.h"
+#include "ParticleToolFiles.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+	enum FieldType
+	{
+		FloatField,
+		IntField
+	};
+
+	// A numeric field of ParticleEmitterRecord the source can set.
+	struct Field
+	{
+		const char* key;
+		size_t offset;
+		FieldType type;
+		int count;
+	};
+
+	#define BANK_FIELD(name, type, count) { #name, offsetof(ParticleEmitterRecord, name), type, count }
+
+	const Field FIELDS[] =
+	{
+		BANK_FIELD(maxParticles, IntField, 1),
+		BANK_FIELD(emissionRate, IntField, 1),
+		BANK_FIELD(startPosX, FloatField, 1),
+		BANK_FIELD(startPosY, FloatField, 1),
+		BANK_FIELD(devPosX, FloatField, 1),
+		BANK_FIELD(devPosY, FloatField, 1),
+		BANK_FIELD(angle, FloatField, 1),
+		BANK_FIELD(angleVar, FloatField, 1),
+		BANK_FIELD(speed, FloatField, 1),
+		BANK_FIELD(speedVar, FloatField, 1),
+		BANK_FIELD(startSize, FloatField, 1),
+		BANK_FIELD(startSizeVar, FloatField, 1),
+		BANK_FIELD(middleSize, FloatField, 1),
+		BANK_FIELD(middleSizeVar, FloatField, 1),
+		BANK_FIELD(endSize, FloatField, 1),
+		BANK_FIELD(endSizeVar, FloatField, 1),
+		BANK_FIELD(lifetime, FloatField, 1),
+		BANK_FIELD(lifetimeVar, FloatField, 1),
+		BANK_FIELD(startColor, FloatField, 4),
+		BANK_FIELD(startColorVar, FloatField, 4),
+		BANK_FIELD(middleColor, FloatField, 4),
+		BANK_FIELD(middleColorVar, FloatField, 4),
+		BANK_FIELD(endColor, FloatField, 4),
+		BANK_FIELD(endColorVar, FloatField, 4),
+		BANK_FIELD(gravityX, FloatField, 1),
+		BANK_FIELD(gravityY, FloatField, 1),
+		BANK_FIELD(radialAccel, FloatField, 1),
+		BANK_FIELD(radialAccelVar, FloatField, 1),
+		BANK_FIELD(tangentialAccel, FloatField, 1),
+		BANK_FIELD(tangentialAccelVar, FloatField, 1),
+		BANK_FIELD(duration, FloatField, 1),
+		BANK_FIELD(startTime, FloatField, 1),
+		BANK_FIELD(rotationSpeed, FloatField, 1),
+		BANK_FIELD(rotationSpeedVar, FloatField, 1),
+		BANK_FIELD(fixedTimeStep, FloatField, 1),
+		BANK_FIELD(maxSteps, IntField, 1),
+	};
+
+	#undef BANK_FIELD
+
+	const int NUM_FIELDS = sizeof(FIELDS) / sizeof(FIELDS[0]);
+
+	// In BlendStates order.
+	const char* BLEND_STATE_NAMES[] = { "Additive", "Opaque", "AlphaBlend", "NonPremultiplied" };
+	const int NUM_BLEND_STATES = sizeof(BLEND_STATE_NAMES) / sizeof(BLEND_STATE_NAMES[0]);
+
+	std::string Trim(const std::string& text)
+	{
+		size_t first = text.find_first_not_of(" \t\r\n");
+		if (first == std::string::npos)
+		{
+			return std::string();
+		}
+		size_t last = text.find_last_not_of(" \t\r\n");
+		return text.substr(first, last - first + 1);
+	}
+
+	void InitDefaults(ParticleEmitterRecord& record)
+	{
+		memset(&record, 0, sizeof(record));
+		record.flags = EmitterAutoPlay;
+		record.duration = -1.0f;
+		record.maxSteps = 1;
+		for (int channel = 0; channel < 4; ++channel)
+		{
+			record.startColor[channel] = 1.0f;
+			record.middleColor[channel] = 1.0f;
+			record.endColor[channel] = 1.0f;
+		}
+	}
+
+	void SetFlag(ParticleEmitterRecord& record, uint32_t flag, bool set)
+	{
+		record.flags = set ? (record.flags | flag) : (record.flags & ~flag);
+	}
+
+	// Parses 'count' numbers into the field; false if there are more, fewer, or they aren't numbers.
+	bool ParseNumbers(const std::string& value, const Field& field, ParticleEmitterRecord& record)
+	{
+		char* data = (char*)&record + field.offset;
+		const char* pos = value.c_str();
+		for (int n = 0; n < field.count; ++n)
+		{
+			char* end = nullptr;
+			if (field.type == IntField)
+			{
+				long number = strtol(pos, &end, 10);
+				((int32_t*)data)[n] = (int32_t)number;
+			}
+			else
+			{
+				((float*)data)[n] = strtof(pos, &end);
+			}
+
+			if (end == pos)
+			{
+				return false;
+			}
+			pos = end;
+		}
+
+		return Trim(pos).empty();
+	}
+
+	// Applies one "key = value" line to the record; prints the error and returns false if it is invalid.
+	bool ParseLine(const std::string& key, const std::string& value, const std::vector<std::string>& textures,
+		ParticleEmitterRecord& record, bool* hasTexture, const char* location)
+	{
+		if (key == "texture")
+		{
+			for (size_t t = 0; t < textures.size(); ++t)
+			{
+				if (textures[t] == value)
+				{
+					record.effect = (uint32_t)t;
+					*hasTexture = true;
+					return true;
+				}
+			}
+			fprintf(stderr, "%s: unknown texture '%s'\n", location, value.c_str());
+			return false;
+		}
+
+		if (key == "blend")
+		{
+			for (int b = 0; b < NUM_BLEND_STATES; ++b)
+			{
+				if (value == BLEND_STATE_NAMES[b])
+				{
+					record.blendState = (uint32_t)b;
+					return true;
+				}
+			}
+			fprintf(stderr, "%s: unknown blend state '%s'\n", location, value.c_str());
+			return false;
+		}
+
+		if (key == "autoPlay" || key == "textureRotation")
+		{
+			if (value != "0" && value != "1")
+			{
+				fprintf(stderr, "%s: %s must be 0 or 1\n", location, key.c_str());
+				return false;
+			}
+			SetFlag(record, key == "autoPlay" ? EmitterAutoPlay : EmitterTextureRotation, value == "1");
+			return true;
+		}
+
+		if (key == "keyMode")
+		{
+			if (value != "integrate" && value != "evaluate")
+			{
+				fprintf(stderr, "%s: keyMode must be integrate or evaluate\n", location);
+				return false;
+			}
+			SetFlag(record, EmitterEvaluateKeys, value == "evaluate");
+			return true;
+		}
+
+		if (key == "rotationMode")
+		{
+			if (value != "angle" && value != "complex")
+			{
+				fprintf(stderr, "%s: rotationMode must be angle or complex\n", location);
+				return false;
+			}
+			SetFlag(record, EmitterComplexRotation, value == "complex");
+			return true;
+		}
+
+		for (int f = 0; f < NUM_FIELDS; ++f)
+		{
+			if (key == FIELDS[f].key)
+			{
+				if (!ParseNumbers(value, FIELDS[f], record))
+				{
+					fprintf(stderr, "%s: %s takes %d number%s\n", location, key.c_str(), FIELDS[f].count, FIELDS[f].count > 1 ? "s" : "");
+					return false;
+				}
+				return true;
+			}
+		}
+
+		fprintf(stderr, "%s: unknown key '%s'\n", location, key.c_str());
+		return false;
+	}
+
+	bool ParseSource(const std::string& path, const std::vector<std::string>& textures, std::vector<ParticleEmitterRecord>& records)
+	{
+		std::vector<uint8_t> data;
+		if (!ReadFile(path, data))
+		{
+			fprintf(stderr, "Can't read %s\n", path.c_str());
+			return false;
+		}
+		std::string text(data.begin(), data.end());
+
+		bool ok = true;
+		bool hasTexture = true;
+		size_t pos = 0;
+		for (int lineNumber = 1; pos < text.size(); ++lineNumber)
+		{
+			size_t end = text.find('\n', pos);
+			if (end == std::string::npos)
+			{
+				end = text.size();
+			}
+			std::string line = text.substr(pos, end - pos);
+			pos = end + 1;
+
+			size_t comment = line.find('#');
+			if (comment != std::string::npos)
+			{
+				line.erase(comment);
+			}
+			line = Trim(line);
+			if (line.empty())
+			{
+				continue;
+			}
+
+			char number[16];
+			sprintf(number, "%d", lineNumber);
+			std::string location = path + "(" + number + ")";
+
+			if (line[0] == '[')
+			{
+				if (!hasTexture)
+				{
+					fprintf(stderr, "%s: effect '%s' has no texture\n", location.c_str(), records.back().name);
+					ok = false;
+				}
+
+				std::string name = Trim(line.substr(1, line.find(']') - 1));
+				if (line[line.size() - 1] != ']' || name.empty() || name.size() >= sizeof(records[0].name))
+				{
+					fprintf(stderr, "%s: effect names are [name], at most %d characters\n", location.c_str(), (int)sizeof(records[0].name) - 1);
+					return false;
+				}
+
+				records.push_back(ParticleEmitterRecord());
+				InitDefaults(records.back());
+				strcpy(records.back().name, name.c_str());
+				hasTexture = false;
+				continue;
+			}
+
+			size_t equals = line.find('=');
+			if (records.empty() || equals == std::string::npos)
+			{
+				fprintf(stderr, "%s: expected [name] or key = value\n", location.c_str());
+				return false;
+			}
+
+			ok = ParseLine(Trim(line.substr(0, equals)), Trim(line.substr(equals + 1)), textures, records.back(), &hasTexture, location.c_str()) && ok;
+		}
+
+		if (!hasTexture)
+		{
+			fprintf(stderr, "%s: effect '%s' has no texture\n", path.c_str(), records.back().name);
+			ok = false;
+		}
+
+		return ok;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string enumsPath;
+	std::string inputPath;
+	std::string outputPath;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--enums") == 0 && i + 1 < argc)
+		{
+			enumsPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+		{
+			inputPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+		{
+			outputPath = argv[++i];
+		}
+		else
+		{
+			enumsPath.clear();
+			break;
+		}
+	}
+
+	if (enumsPath.empty() || inputPath.empty() || outputPath.empty())
+	{
+		printf("Usage: %s --enums ParticleEnums.h --input ParticleEffects.txt --output ParticleEffects.pfxb\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<std::string> textures;
+	if (!ReadTextureNames(enumsPath, textures))
+	{
+		return 1;
+	}
+
+	std::vector<ParticleEmitterRecord> records;
+	if (!ParseSource(inputPath, textures, records))
+	{
+		return 1;
+	}
+
+	if (!ParticleEffectBank::Write(outputPath.c_str(), records.empty() ? nullptr : &records[0], (int)records.size()))
+	{
+		fprintf(stderr, "Can't write %s, or two effects have the same name\n", outputPath.c_str());
+		return 1;
+	}
+
+	printf("%d effects compiled into %s\n", (int)records.size(), outputPath.c_str());
+	return 0;
+}
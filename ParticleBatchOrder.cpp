@@ -0,0 +1,58 @@
+﻿#include "ParticleBatchOrder.h"
+#include "ParticleMath.h"
+
+using namespace ParticleMath;
+
+int ParticleBatchOrder::Add(int textureKey, int blendState, bool additive, const ParticleBounds* bounds)
+{
+	// Walk back from the last batch while the emitter could still be drawn ahead of the batches passed.
+	int batchIndex = (int)m_batches.size() - 1;
+	for (; batchIndex >= 0; --batchIndex)
+	{
+		const Batch& batch = m_batches[batchIndex];
+		if (batch.textureKey == textureKey && batch.blendState == blendState)
+		{
+			break;
+		}
+
+		bool commutes = additive && batch.additive;
+		bool disjoint = bounds != nullptr && batch.hasBounds &&
+			(bounds->maxX < batch.bounds.minX || bounds->minX > batch.bounds.maxX ||
+			bounds->maxY < batch.bounds.minY || bounds->minY > batch.bounds.maxY);
+		if (!commutes && !disjoint)
+		{
+			batchIndex = -1;
+			break;
+		}
+	}
+
+	if (batchIndex < 0)
+	{
+		Batch batch;
+		batch.textureKey = textureKey;
+		batch.blendState = blendState;
+		batch.additive = additive;
+		batch.hasBounds = bounds != nullptr;
+		if (bounds != nullptr)
+		{
+			batch.bounds = *bounds;
+		}
+		m_batches.push_back(batch);
+		return (int)m_batches.size() - 1;
+	}
+
+	// A batch without bounds overlaps everything, and keeps doing so.
+	Batch& batch = m_batches[batchIndex];
+	if (bounds == nullptr)
+	{
+		batch.hasBounds = false;
+	}
+	else if (batch.hasBounds)
+	{
+		batch.bounds.minX = Min(batch.bounds.minX, bounds->minX);
+		batch.bounds.minY = Min(batch.bounds.minY, bounds->minY);
+		batch.bounds.maxX = Max(batch.bounds.maxX, bounds->maxX);
+		batch.bounds.maxY = Max(batch.bounds.maxY, bounds->maxY);
+	}
+	return batchIndex;
+}
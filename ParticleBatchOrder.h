@@ -0,0 +1,40 @@
+﻿#pragma once
+
+#include <vector>
+#include "ParticleSystem.h"
+
+// Decides which draw of ParticleBatchRenderer each emitter goes into, without Direct3D, so the
+// headless build can check it.
+//
+// Batches are drawn in the order they are created, so joining an earlier batch draws an emitter ahead
+// of every batch created after it. An emitter only joins an earlier batch of its texture and blend
+// state when that can't change the image: every batch it moves ahead of blends additively, as it does,
+// so the order of the sums doesn't matter, or doesn't overlap it on screen. Otherwise it starts a new
+// batch: A(texture 1), B(texture 2), C(texture 1), alpha blended on top of each other, are three draws.
+class ParticleBatchOrder
+{
+public:
+
+	// Forget the batches of the last frame.
+	void Clear() { m_batches.clear(); }
+
+	// Place the next emitter in submission order and return the index of its batch, which is the batch
+	// count before the call when it starts a new one. 'bounds' is the box around its quads, nullptr when
+	// there is none, which overlaps everything.
+	int Add(int textureKey, int blendState, bool additive, const ParticleBounds* bounds);
+
+	int GetBatchCount() const { return (int)m_batches.size(); }
+
+private:
+
+	struct Batch
+	{
+		int textureKey;
+		int blendState;
+		bool additive;
+		bool hasBounds;
+		ParticleBounds bounds;		// around the quads of all its emitters
+	};
+
+	std::vector<Batch> m_batches;
+};
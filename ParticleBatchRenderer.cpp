@@ -0,0 +1,292 @@
+﻿#include "pch.h"
+#include "ParticleBatchRenderer.h"
+#include "ParticleStats.h"
+#include "DirectXHelper.h"
+
+using namespace DirectX;
+using namespace Microsoft::WRL;
+using namespace LanguageGameWp8DxComponent;
+
+// Particles the shared vertex buffer holds before it first has to grow.
+const int INITIAL_BATCH_CAPACITY = 1024;
+
+ParticleBatchRenderer::ParticleBatchRenderer(
+	Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice,
+	Microsoft::WRL::ComPtr<ID3D11DeviceContext1> d3dContext,
+	Microsoft::WRL::ComPtr<ID3D11RenderTargetView> renderTargetView,
+	Microsoft::WRL::ComPtr<ID3D11DepthStencilView> depthStencilView) :
+
+	m_d3dDevice(d3dDevice)
+	,m_d3dContext(d3dContext)
+	,m_renderTargetView(renderTargetView)
+	,m_depthStencilView(depthStencilView)
+	,m_commonStates(nullptr)
+	,m_vertexBufferCapacity(0)
+	,m_drawCount(0)
+	,m_loaded(false)
+	,m_hasViewBounds(false)
+{
+}
+
+ParticleBatchRenderer::~ParticleBatchRenderer()
+{
+}
+
+void ParticleBatchRenderer::CreateDeviceResources()
+{
+	m_loaded = false;
+
+	// Same shaders and vertex format as ParticleRenderer::QuadVertices, shared with the emitters.
+	ParticleDeviceResources& deviceResources = ParticleDeviceResources::GetInstance();
+	deviceResources.SetDevice(m_d3dDevice);
+
+	m_commonStates = deviceResources.GetCommonStates();
+	deviceResources.GetVertexShader(ParticleDeviceResources::QuadVertexFormat, &m_vertexShader, &m_inputLayout);
+	m_pixelShader = deviceResources.GetPixelShader();
+	m_constantBuffer = deviceResources.GetConstantBuffer();
+	m_indexBuffer = deviceResources.GetIndexBuffer(MAX_PARTICLES_PER_DRAW);
+
+	m_vertexBuffer = nullptr;
+	m_vertexBufferCapacity = 0;
+	ReserveVertexBuffer(INITIAL_BATCH_CAPACITY);
+
+	m_loaded = true;
+}
+
+void ParticleBatchRenderer::CreateWindowSizeDependentResources(float width, float height)
+{
+	ParticleRenderer::ComputeViewProjection(width, height, m_constantBufferData);
+	m_constantBufferData.textureRect = XMFLOAT4(0.0f, 0.0f, 1.0f, 1.0f);
+	ParticleRenderer::ComputeViewBounds(m_constantBufferData, &m_viewBounds);
+	m_hasViewBounds = true;
+}
+
+void ParticleBatchRenderer::Render(ParticleRenderer* const* emitters, int numEmitters)
+{
+	m_drawCount = 0;
+
+	if (!m_loaded)
+	{
+		return;
+	}
+
+	GatherBatches(emitters, numEmitters);
+	if (m_batches.empty())
+	{
+		return;
+	}
+
+	const Batch& lastBatch = m_batches.back();
+	ReserveVertexBuffer(lastBatch.firstParticle + lastBatch.particleCount);
+	BuildVertexBuffer();
+
+	// The draws cover several emitters, so they are only counted in the totals of ParticleStats.
+	ParticleStageTimer timer(nullptr, ParticleStageRender);
+	timer.SetParticles(lastBatch.firstParticle + lastBatch.particleCount);
+
+	m_d3dContext->OMSetRenderTargets(
+		1,
+		m_renderTargetView.GetAddressOf(),
+		m_depthStencilView.Get()
+		);
+
+	SetPipelineState();
+
+	// Only change the blend state and texture between batches that differ.
+	ID3D11BlendState* currentBlendState = nullptr;
+	ID3D11ShaderResourceView* currentTextureView = nullptr;
+
+	for (size_t b = 0; b < m_batches.size(); ++b)
+	{
+		const Batch& batch = m_batches[b];
+
+		if (batch.blendState != currentBlendState || b == 0)
+		{
+			currentBlendState = batch.blendState;
+			m_d3dContext->OMSetBlendState(currentBlendState, nullptr, 0xFFFFFFFF);
+		}
+
+		if (batch.textureView != currentTextureView || b == 0)
+		{
+			currentTextureView = batch.textureView;
+			m_d3dContext->PSSetShaderResources(0, 1, &currentTextureView);
+		}
+
+		for (int first = 0; first < batch.particleCount; first += MAX_PARTICLES_PER_DRAW)
+		{
+			int count = batch.particleCount - first;
+			if (count > MAX_PARTICLES_PER_DRAW)
+			{
+				count = MAX_PARTICLES_PER_DRAW;
+			}
+
+			m_d3dContext->DrawIndexed(count * 6, 0, (batch.firstParticle + first) * 4);
+			++m_drawCount;
+		}
+	}
+}
+
+void ParticleBatchRenderer::GatherBatches(ParticleRenderer* const* emitters, int numEmitters)
+{
+	m_batches.clear();
+	m_batchOrder.Clear();
+	m_readyEmitters.clear();
+	m_emitterBatch.clear();
+
+	// Pass 1: assign every ready emitter to a batch of its texture and blend state, in submission
+	// order. It starts a new batch unless ParticleBatchOrder can merge it without changing the image.
+	for (int i = 0; i < numEmitters; ++i)
+	{
+		ParticleRenderer* emitter = emitters[i];
+		if (emitter == nullptr || !emitter->IsReadyToDraw())
+		{
+			continue;
+		}
+
+		// The emitters are drawn with this view, so they cull against it; those entirely offscreen are
+		// left out of the batches.
+		if (m_hasViewBounds)
+		{
+			emitter->SetViewBounds(m_viewBounds);
+		}
+		if (emitter->IsOffscreen())
+		{
+			continue;
+		}
+
+		int textureKey = emitter->GetTextureKey();
+		BlendStates blendStateId = emitter->GetBlendStateId();
+
+		ParticleBounds bounds;
+		bool hasBounds = emitter->GetBounds(&bounds);
+		int batchIndex = m_batchOrder.Add(textureKey, (int)blendStateId, blendStateId == BlendStates::Additive,
+			hasBounds ? &bounds : nullptr);
+
+		if (batchIndex == (int)m_batches.size())
+		{
+			Batch batch;
+			batch.textureKey = textureKey;
+			batch.blendStateId = blendStateId;
+			batch.textureView = emitter->GetTextureView();
+			batch.blendState = emitter->GetBlendState();
+			batch.firstParticle = 0;
+			batch.particleCount = 0;
+			batch.firstEmitter = 0;
+			batch.emitterCount = 0;
+			m_batches.push_back(batch);
+		}
+
+		m_batches[batchIndex].particleCount += emitter->GetParticleCount();
+		++m_batches[batchIndex].emitterCount;
+		m_readyEmitters.push_back(emitter);
+		m_emitterBatch.push_back(batchIndex);
+	}
+
+	// Pass 2: lay the batches out one after another, in the vertex buffer and in m_batchedEmitters. The
+	// particle counts are upper bounds until BuildVertexBuffer knows how many particles were culled.
+	int firstParticle = 0;
+	int firstEmitter = 0;
+	for (size_t b = 0; b < m_batches.size(); ++b)
+	{
+		m_batches[b].firstParticle = firstParticle;
+		m_batches[b].firstEmitter = firstEmitter;
+		firstParticle += m_batches[b].particleCount;
+		firstEmitter += m_batches[b].emitterCount;
+	}
+
+	// Pass 3: order the emitters by batch, keeping submission order within a batch.
+	m_batchedEmitters.resize(m_readyEmitters.size());
+	for (size_t b = 0; b < m_batches.size(); ++b)
+	{
+		m_batches[b].emitterCount = 0;
+	}
+
+	for (size_t e = 0; e < m_readyEmitters.size(); ++e)
+	{
+		Batch& batch = m_batches[m_emitterBatch[e]];
+		m_batchedEmitters[batch.firstEmitter + batch.emitterCount++] = m_readyEmitters[e];
+	}
+}
+
+void ParticleBatchRenderer::ReserveVertexBuffer(int numParticles)
+{
+	if (m_vertexBuffer != nullptr && numParticles <= m_vertexBufferCapacity)
+	{
+		return;
+	}
+
+	// Grow geometrically so a slowly rising particle count doesn't recreate the buffer every frame.
+	int capacity = m_vertexBufferCapacity * 2;
+	if (capacity < numParticles)
+	{
+		capacity = numParticles;
+	}
+
+	CD3D11_BUFFER_DESC vertexBufferDesc(
+		sizeof(ParticleVertex) * 4 * capacity,	// byteWidth
+		D3D11_BIND_VERTEX_BUFFER,				// bindFlags
+		D3D11_USAGE_DYNAMIC,					// usage
+		D3D11_CPU_ACCESS_WRITE					// cpuaccessFlags
+		);
+
+	m_vertexBuffer = nullptr;
+	DX::ThrowIfFailed(
+		m_d3dDevice->CreateBuffer(
+			&vertexBufferDesc,
+			nullptr,
+			&m_vertexBuffer
+			)
+		);
+
+	m_vertexBufferCapacity = capacity;
+}
+
+void ParticleBatchRenderer::BuildVertexBuffer()
+{
+	ParticleStageTimer timer(nullptr, ParticleStageUpload);
+
+	D3D11_MAPPED_SUBRESOURCE mappedResource;
+	DX::ThrowIfFailed(m_d3dContext->Map(m_vertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
+
+	// The emitters are already in batch order, so each batch ends up in one contiguous range, packed
+	// after the one before as the emitters may leave culled particles out.
+	ParticleVertex* vertices = (ParticleVertex*)mappedResource.pData;
+	for (size_t b = 0; b < m_batches.size(); ++b)
+	{
+		Batch& batch = m_batches[b];
+		batch.firstParticle = (int)(vertices - (ParticleVertex*)mappedResource.pData) / 4;
+		for (int e = batch.firstEmitter; e < batch.firstEmitter + batch.emitterCount; ++e)
+		{
+			vertices += m_batchedEmitters[e]->BuildVertices(vertices);
+		}
+		batch.particleCount = (int)(vertices - (ParticleVertex*)mappedResource.pData) / 4 - batch.firstParticle;
+	}
+	timer.SetParticles((int)(vertices - (ParticleVertex*)mappedResource.pData) / 4);
+	timer.SetBytes((char*)vertices - (char*)mappedResource.pData);
+
+	m_d3dContext->Unmap(m_vertexBuffer.Get(), 0);
+}
+
+void ParticleBatchRenderer::SetPipelineState()
+{
+	unsigned int stride = sizeof(ParticleVertex);
+	unsigned int offset = 0;
+	m_d3dContext->IASetInputLayout(m_inputLayout.Get());
+	m_d3dContext->IASetVertexBuffers(0, 1, m_vertexBuffer.GetAddressOf(), &stride, &offset);
+	m_d3dContext->IASetIndexBuffer(m_indexBuffer.Get(), DXGI_FORMAT_R16_UINT, 0);
+	m_d3dContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	D3D11_MAPPED_SUBRESOURCE mappedResource;
+	DX::ThrowIfFailed(m_d3dContext->Map(m_constantBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
+	// The texture rects are already applied to the vertices, so textureRect stays at the whole texture.
+	*(ViewProjectionConstantBuffer*)mappedResource.pData = m_constantBufferData;
+	m_d3dContext->Unmap(m_constantBuffer.Get(), 0);
+
+	m_d3dContext->VSSetShader(m_vertexShader.Get(), nullptr, 0);
+	m_d3dContext->VSSetConstantBuffers(0, 1, m_constantBuffer.GetAddressOf());
+	m_d3dContext->PSSetShader(m_pixelShader.Get(), nullptr, 0);
+
+	auto samplerState = m_commonStates->LinearWrap();
+	m_d3dContext->PSSetSamplers(0, 1, &samplerState);
+	m_d3dContext->OMSetDepthStencilState(m_commonStates->DepthDefault(), 0);
+}
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <vector>
+#include "ParticleBatchOrder.h"
+#include "ParticleRenderer.h"
+
+// This class draws many batched ParticleRenderer emitters together. The vertices of all the emitters
+// are built into one shared dynamic vertex buffer, and emitters with the same texture (or atlas page,
+// see ParticleRenderer::GetTextureKey) and blend state are merged into one draw, so the pipeline state
+// is set once per frame instead of once per emitter.
+//
+// The image is the one the emitters give drawn in submission order: consecutive emitters with the same
+// texture and blend state always share a draw, and others only when ParticleBatchOrder finds that
+// drawing them earlier can't change the image.
+class ParticleBatchRenderer
+{
+public:
+
+	ParticleBatchRenderer(
+		Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice,
+		Microsoft::WRL::ComPtr<ID3D11DeviceContext1> d3dContext,
+		Microsoft::WRL::ComPtr<ID3D11RenderTargetView> renderTargetView,
+		Microsoft::WRL::ComPtr<ID3D11DepthStencilView> depthStencilView);
+
+	~ParticleBatchRenderer();
+
+	// Direct3DBase methods.
+	void CreateDeviceResources();
+	void CreateWindowSizeDependentResources(float width, float height);
+
+	// Draw the emitters that are ready to draw, in as few draws as their textures and blend states allow.
+	// The emitters should be batched (see ParticleRenderer::SetBatched), otherwise they also draw themselves.
+	void Render(ParticleRenderer* const* emitters, int numEmitters);
+
+	// Number of draws issued by the last Render, for profiling.
+	int GetDrawCount() const { return m_drawCount; }
+
+private:
+
+	// Emitters that share a texture and blend state, drawn with one DrawIndexed.
+	struct Batch
+	{
+		int textureKey;
+		LanguageGameWp8DxComponent::BlendStates blendStateId;
+		ID3D11ShaderResourceView* textureView;
+		ID3D11BlendState* blendState;
+		int firstParticle;
+		int particleCount;
+		int firstEmitter;		// in m_batchedEmitters
+		int emitterCount;
+	};
+
+	// 16 bit indices address at most 65536 vertices, so a batch is drawn in chunks of this many quads.
+	static const int MAX_PARTICLES_PER_DRAW = ParticleDeviceResources::MAX_INDEXED_QUADS;
+
+	void GatherBatches(ParticleRenderer* const* emitters, int numEmitters);
+	void ReserveVertexBuffer(int numParticles);
+	void BuildVertexBuffer();
+	void SetPipelineState();
+
+	Microsoft::WRL::ComPtr<ID3D11Device1> m_d3dDevice;
+	Microsoft::WRL::ComPtr<ID3D11DeviceContext1> m_d3dContext;
+	Microsoft::WRL::ComPtr<ID3D11RenderTargetView> m_renderTargetView;
+	Microsoft::WRL::ComPtr<ID3D11DepthStencilView> m_depthStencilView;
+
+	// All shared through ParticleDeviceResources, except the vertex buffer.
+	Microsoft::WRL::ComPtr<ID3D11InputLayout> m_inputLayout;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_vertexBuffer;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_indexBuffer;
+	Microsoft::WRL::ComPtr<ID3D11VertexShader> m_vertexShader;
+	Microsoft::WRL::ComPtr<ID3D11PixelShader> m_pixelShader;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_constantBuffer;
+	ViewProjectionConstantBuffer m_constantBufferData;
+
+	DirectX::CommonStates* m_commonStates;
+
+	int m_vertexBufferCapacity;		// in particles
+	int m_drawCount;
+	bool m_loaded;
+
+	// Of m_constantBufferData, set by CreateWindowSizeDependentResources.
+	ParticleBounds m_viewBounds;
+	bool m_hasViewBounds;
+
+	// Rebuilt every Render, kept to reuse their storage.
+	std::vector<Batch> m_batches;
+	ParticleBatchOrder m_batchOrder;					// decides which batch each ready emitter joins
+	std::vector<ParticleRenderer*> m_readyEmitters;		// emitters ready to draw, in submission order
+	std::vector<int> m_emitterBatch;					// batch index of each ready emitter
+	std::vector<ParticleRenderer*> m_batchedEmitters;	// the ready emitters grouped by batch, in draw order
+};
@@ -0,0 +1,237 @@
+﻿// Headless benchmark for the particle simulation.
+//
+// Drives a ParticleSystem for every ParticleEffect preset at several capacities and reports the
+// cost of each Frame() stage (emit, update, kill, vertex build, instance build) in nanoseconds per particle.
+// Emit is measured per spawned particle, kill per expired particle, the others per live particle.
+// The fixed variant steps inside Simulate, so all of it is reported as update.
+// The correctness checks of the same presets are ParticleSystemTests, so the timings here run without
+// any of their instrumentation.
+// --threads sets the number of threads of ParticleThreadPool, counting the calling thread.
+// --stats also prints the ParticleStats summary of every stage over the whole run.
+//
+// Usage: ParticleBenchmark [--effect name] [--max-count n] [--min-count n] [--variant base|rotated|infinite|keyed|complex|fixed] [--threads n] [--stats]
+
+#include "ParticleBenchmarkPresets.h"
+#include "ParticleStats.h"
+#include "ParticleSystem.h"
+#include "ParticleThreadPool.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace
+{
+	const char* const STAGE_NAMES[NUM_PARTICLE_STAGES] = { "emit", "update", "kill", "build", "upload", "render" };
+
+	typedef std::chrono::steady_clock Clock;
+
+	double ElapsedNs(Clock::time_point start)
+	{
+		return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	}
+
+	struct StageTimes
+	{
+		double emitNs, updateNs, killNs, vertexNs, quantizedNs, instanceNs;
+		double spawned, updated, killed, built;
+		int frames;
+	};
+
+	StageTimes RunPreset(const BenchmarkPreset& preset, Variant variant, int maxParticles,
+		OutputBuffers& buffers)
+	{
+		StageTimes times;
+		memset(&times, 0, sizeof(times));
+
+		BenchmarkParticleSystem system;
+		if (!InitPreset(system, preset, variant, maxParticles))
+		{
+			fprintf(stderr, "Can't create particle list for %d particles\n", maxParticles);
+			return times;
+		}
+
+		// Warm up until the emitter reaches its steady-state population.
+		int warmupFrames = (int)((preset.lifetime + preset.lifetimeVar) / FRAME_TIME) + 1;
+		for (int frame = 0; frame < warmupFrames; ++frame)
+		{
+			if (system.Simulate(FRAME_TIME))
+			{
+				system.BuildVertices(&buffers.vertices[0]);
+			}
+		}
+
+		// Keep the amount of work per configuration roughly constant across capacities.
+		int frames = 4000000 / maxParticles;
+		times.frames = frames < 5 ? 5 : (frames > 600 ? 600 : frames);
+
+		for (int frame = 0; frame < times.frames; ++frame)
+		{
+			int before = system.GetParticleCount();
+			Clock::time_point start = Clock::now();
+
+			// The steps are taken inside Simulate, so its whole cost counts as update.
+			if (variant == VariantFixed)
+			{
+				system.Simulate(FRAME_TIME);
+				times.updateNs += ElapsedNs(start);
+				times.updated += system.GetParticleCount();
+			}
+			else
+			{
+				system.Emit(FRAME_TIME);
+				times.emitNs += ElapsedNs(start);
+				times.spawned += system.GetParticleCount() - before;
+
+				start = Clock::now();
+				int numExpired = system.Update(FRAME_TIME);
+				times.updateNs += ElapsedNs(start);
+				times.updated += system.GetParticleCount();
+
+				start = Clock::now();
+				system.Kill(numExpired);
+				times.killNs += ElapsedNs(start);
+				times.killed += numExpired;
+			}
+
+			start = Clock::now();
+			system.BuildVertices(&buffers.vertices[0]);
+			times.vertexNs += ElapsedNs(start);
+			times.built += system.GetParticleCount();
+
+			start = Clock::now();
+			system.BuildQuantizedVertices(&buffers.quantized[0]);
+			times.quantizedNs += ElapsedNs(start);
+
+			start = Clock::now();
+			system.BuildInstances(&buffers.instances[0]);
+			times.instanceNs += ElapsedNs(start);
+		}
+
+		return times;
+	}
+
+	double PerParticle(double ns, double particles)
+	{
+		return particles > 0.0 ? ns / particles : 0.0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* effectFilter = nullptr;
+	int minCount = 100;
+	int maxCount = 1000000;
+	int variantFilter = -1;
+	bool stats = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--effect") == 0 && i + 1 < argc)
+		{
+			effectFilter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--max-count") == 0 && i + 1 < argc)
+		{
+			maxCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--min-count") == 0 && i + 1 < argc)
+		{
+			minCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			ParticleThreadPool::GetInstance().SetThreadCount(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--stats") == 0)
+		{
+			stats = true;
+		}
+		else if (strcmp(argv[i], "--variant") == 0 && i + 1 < argc)
+		{
+			++i;
+			for (int v = 0; v < NumVariants; ++v)
+			{
+				if (strcmp(argv[i], VARIANT_NAMES[v]) == 0)
+				{
+					variantFilter = v;
+				}
+			}
+		}
+		else
+		{
+			printf("Usage: %s [--effect name] [--max-count n] [--min-count n] [--variant base|rotated|infinite|keyed|complex|fixed] [--threads n] [--stats]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	OutputBuffers buffers;
+	buffers.vertices.resize((size_t)maxCount * 4);
+	buffers.quantized.resize((size_t)maxCount * 4);
+	buffers.instances.resize((size_t)maxCount);
+
+	printf("%-18s %-9s %9s %9s %12s %12s %12s %12s %12s %12s\n",
+		"effect", "variant", "capacity", "live", "emit ns/p", "update ns/p", "kill ns/p", "vertex ns/p", "quant ns/p", "inst ns/p");
+
+	for (int e = 0; e < NUM_PRESETS; ++e)
+	{
+		const BenchmarkPreset& preset = PRESETS[e];
+		if (effectFilter && strcmp(effectFilter, preset.name) != 0)
+		{
+			continue;
+		}
+
+		for (int v = 0; v < NumVariants; ++v)
+		{
+			if (variantFilter >= 0 && variantFilter != v)
+			{
+				continue;
+			}
+
+			for (int count = 100; count <= maxCount; count *= 10)
+			{
+				if (count < minCount)
+				{
+					continue;
+				}
+
+				StageTimes times = RunPreset(preset, (Variant)v, count, buffers);
+				if (times.frames == 0)
+				{
+					continue;
+				}
+
+				printf("%-18s %-9s %9d %9.0f %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n",
+					preset.name, VARIANT_NAMES[v], count, times.updated / times.frames,
+					PerParticle(times.emitNs, times.spawned),
+					PerParticle(times.updateNs, times.updated),
+					PerParticle(times.killNs, times.killed),
+					PerParticle(times.vertexNs, times.built),
+					PerParticle(times.quantizedNs, times.built),
+					PerParticle(times.instanceNs, times.built));
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (stats)
+	{
+		printf("\n%-9s %9s %12s %12s %12s %12s %14s %14s\n",
+			"stage", "runs", "min ns", "avg ns", "p99 ns", "max ns", "particles", "bytes");
+		for (int stage = 0; stage < NUM_PARTICLE_STAGES; ++stage)
+		{
+			ParticleStageSummary summary;
+			if (ParticleStats::Query(nullptr, (ParticleStage)stage, &summary))
+			{
+				printf("%-9s %9d %12u %12u %12u %12u %14llu %14llu\n",
+					STAGE_NAMES[stage], summary.samples, summary.minNanoseconds, summary.averageNanoseconds,
+					summary.p99Nanoseconds, summary.maxNanoseconds, (unsigned long long)summary.particles,
+					(unsigned long long)summary.bytes);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+﻿#pragma once
+
+#include "ParticleSystem.h"
+#include <vector>
+
+// Emitter presets shared by ParticleBenchmark and ParticleSystemTests, so the checks play the same
+// emitters the benchmark times.
+
+// Representative emitter settings for each effect. The rows follow the order of the
+// ParticleEffect enum in ParticleEnums.h, which cannot be included here because it is C++/CX.
+struct BenchmarkPreset
+{
+	const char* name;
+	float angle, angleVar;
+	float speed, speedVar;
+	float startSize, middleSize, endSize;
+	float lifetime, lifetimeVar;
+	float startAlpha, middleAlpha, endAlpha;
+	float gravityX, gravityY;
+	float radialAccel, tangentialAccel;
+	float rotationSpeed;
+};
+
+const BenchmarkPreset PRESETS[] =
+{
+	//	name				angle	var		speed	var		sizes					life	var		alphas				gravity			radial	tang	rot
+	{ "bubble",				90.0f,	30.0f,	0.20f,	0.05f,	0.02f, 0.03f, 0.04f,	3.0f,	1.0f,	0.8f, 0.8f, 0.0f,	0.0f, 0.05f,	0.0f,	0.0f,	0.0f },
+	{ "dot01",				0.0f,	360.0f,	0.10f,	0.05f,	0.01f, 0.01f, 0.01f,	1.0f,	0.5f,	1.0f, 1.0f, 0.0f,	0.0f, 0.0f,		0.0f,	0.0f,	0.0f },
+	{ "fire",				90.0f,	15.0f,	0.40f,	0.10f,	0.06f, 0.04f, 0.01f,	1.0f,	0.3f,	0.6f, 1.0f, 0.0f,	0.0f, 0.20f,	0.0f,	0.0f,	0.0f },
+	{ "firework",			0.0f,	360.0f,	0.80f,	0.20f,	0.02f, 0.02f, 0.00f,	1.5f,	0.5f,	1.0f, 1.0f, 0.0f,	0.0f, -0.50f,	0.3f,	0.0f,	0.0f },
+	{ "flash",				0.0f,	360.0f,	0.00f,	0.00f,	0.05f, 0.30f, 0.40f,	0.3f,	0.1f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		0.0f,	0.0f,	0.0f },
+	{ "flash01",			0.0f,	360.0f,	0.05f,	0.02f,	0.05f, 0.20f, 0.30f,	0.4f,	0.1f,	1.0f, 0.6f, 0.0f,	0.0f, 0.0f,		0.0f,	0.0f,	0.0f },
+	{ "flower01",			270.0f,	40.0f,	0.15f,	0.05f,	0.04f, 0.04f, 0.03f,	4.0f,	1.0f,	1.0f, 1.0f, 0.0f,	0.02f, -0.05f,	0.0f,	0.0f,	45.0f },
+	{ "fly",				0.0f,	360.0f,	0.10f,	0.05f,	0.02f, 0.02f, 0.02f,	5.0f,	2.0f,	1.0f, 1.0f, 1.0f,	0.0f, 0.0f,		0.0f,	0.3f,	0.0f },
+	{ "glow",				0.0f,	360.0f,	0.02f,	0.01f,	0.10f, 0.15f, 0.10f,	2.0f,	0.5f,	0.3f, 0.8f, 0.0f,	0.0f, 0.0f,		0.0f,	0.0f,	0.0f },
+	{ "halo",				0.0f,	360.0f,	0.00f,	0.00f,	0.10f, 0.20f, 0.30f,	1.0f,	0.2f,	0.0f, 0.8f, 0.0f,	0.0f, 0.0f,		0.0f,	0.0f,	20.0f },
+	{ "light",				90.0f,	180.0f,	0.05f,	0.02f,	0.05f, 0.08f, 0.05f,	2.0f,	0.5f,	0.0f, 1.0f, 0.0f,	0.0f, 0.02f,	0.0f,	0.0f,	0.0f },
+	{ "orbask01",			0.0f,	360.0f,	0.15f,	0.05f,	0.03f, 0.03f, 0.01f,	1.5f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		-0.2f,	0.4f,	0.0f },
+	{ "orbask02",			0.0f,	360.0f,	0.15f,	0.05f,	0.03f, 0.03f, 0.01f,	1.5f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		-0.2f,	0.4f,	0.0f },
+	{ "orbask03",			0.0f,	360.0f,	0.15f,	0.05f,	0.03f, 0.03f, 0.01f,	1.5f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		-0.2f,	0.4f,	0.0f },
+	{ "orbcollect01",		0.0f,	360.0f,	0.30f,	0.10f,	0.02f, 0.03f, 0.00f,	1.0f,	0.3f,	1.0f, 1.0f, 0.0f,	0.0f, 0.0f,		-0.6f,	0.0f,	0.0f },
+	{ "orbcollect02",		0.0f,	360.0f,	0.30f,	0.10f,	0.02f, 0.03f, 0.00f,	1.0f,	0.3f,	1.0f, 1.0f, 0.0f,	0.0f, 0.0f,		-0.6f,	0.0f,	0.0f },
+	{ "orbcollect03",		0.0f,	360.0f,	0.30f,	0.10f,	0.02f, 0.03f, 0.00f,	1.0f,	0.3f,	1.0f, 1.0f, 0.0f,	0.0f, 0.0f,		-0.6f,	0.0f,	0.0f },
+	{ "orbcollect03_key",	0.0f,	360.0f,	0.30f,	0.10f,	0.02f, 0.03f, 0.00f,	1.0f,	0.3f,	1.0f, 1.0f, 0.0f,	0.0f, 0.0f,		-0.6f,	0.0f,	0.0f },
+	{ "orbhunt01",			0.0f,	360.0f,	0.20f,	0.05f,	0.03f, 0.04f, 0.02f,	2.0f,	0.5f,	1.0f, 0.7f, 0.0f,	0.0f, 0.0f,		0.2f,	0.2f,	0.0f },
+	{ "orbhunt02",			0.0f,	360.0f,	0.20f,	0.05f,	0.03f, 0.04f, 0.02f,	2.0f,	0.5f,	1.0f, 0.7f, 0.0f,	0.0f, 0.0f,		0.2f,	0.2f,	0.0f },
+	{ "orbhunt04",			0.0f,	360.0f,	0.20f,	0.05f,	0.03f, 0.04f, 0.02f,	2.0f,	0.5f,	1.0f, 0.7f, 0.0f,	0.0f, 0.0f,		0.2f,	0.2f,	0.0f },
+	{ "orbhunt04_key",		0.0f,	360.0f,	0.20f,	0.05f,	0.03f, 0.04f, 0.02f,	2.0f,	0.5f,	1.0f, 0.7f, 0.0f,	0.0f, 0.0f,		0.2f,	0.2f,	0.0f },
+	{ "orbreflect01",		90.0f,	60.0f,	0.25f,	0.05f,	0.03f, 0.03f, 0.02f,	1.5f,	0.5f,	1.0f, 0.9f, 0.0f,	0.0f, -0.2f,	0.0f,	0.0f,	90.0f },
+	{ "orbreflect02",		90.0f,	60.0f,	0.25f,	0.05f,	0.03f, 0.03f, 0.02f,	1.5f,	0.5f,	1.0f, 0.9f, 0.0f,	0.0f, -0.2f,	0.0f,	0.0f,	90.0f },
+	{ "orbreflect04",		90.0f,	60.0f,	0.25f,	0.05f,	0.03f, 0.03f, 0.02f,	1.5f,	0.5f,	1.0f, 0.9f, 0.0f,	0.0f, -0.2f,	0.0f,	0.0f,	90.0f },
+	{ "rain04",				280.0f,	5.0f,	1.50f,	0.30f,	0.02f, 0.02f, 0.02f,	1.2f,	0.3f,	0.7f, 0.7f, 0.7f,	0.0f, -1.00f,	0.0f,	0.0f,	0.0f },
+	{ "rain05",				280.0f,	5.0f,	1.50f,	0.30f,	0.02f, 0.02f, 0.02f,	1.2f,	0.3f,	0.7f, 0.7f, 0.7f,	0.0f, -1.00f,	0.0f,	0.0f,	0.0f },
+	{ "rain07",				280.0f,	5.0f,	1.50f,	0.30f,	0.02f, 0.02f, 0.02f,	1.2f,	0.3f,	0.7f, 0.7f, 0.7f,	0.0f, -1.00f,	0.0f,	0.0f,	0.0f },
+	{ "smoke",				90.0f,	20.0f,	0.15f,	0.05f,	0.05f, 0.10f, 0.20f,	3.0f,	1.0f,	0.0f, 0.5f, 0.0f,	0.02f, 0.05f,	0.0f,	0.0f,	10.0f },
+	{ "smoke02",			90.0f,	20.0f,	0.15f,	0.05f,	0.05f, 0.10f, 0.20f,	3.0f,	1.0f,	0.0f, 0.5f, 0.0f,	0.02f, 0.05f,	0.0f,	0.0f,	10.0f },
+	{ "smoke03",			90.0f,	20.0f,	0.15f,	0.05f,	0.05f, 0.10f, 0.20f,	3.0f,	1.0f,	0.0f, 0.5f, 0.0f,	0.02f, 0.05f,	0.0f,	0.0f,	10.0f },
+	{ "smoke05",			90.0f,	20.0f,	0.15f,	0.05f,	0.05f, 0.10f, 0.20f,	3.0f,	1.0f,	0.0f, 0.5f, 0.0f,	0.02f, 0.05f,	0.0f,	0.0f,	10.0f },
+	{ "snow",				270.0f,	20.0f,	0.10f,	0.05f,	0.02f, 0.02f, 0.02f,	6.0f,	2.0f,	1.0f, 1.0f, 0.0f,	0.01f, -0.02f,	0.0f,	0.0f,	30.0f },
+	{ "star03",				0.0f,	360.0f,	0.30f,	0.10f,	0.03f, 0.04f, 0.00f,	1.5f,	0.5f,	1.0f, 1.0f, 0.0f,	0.0f, -0.10f,	0.0f,	0.0f,	180.0f },
+	{ "swirl",				0.0f,	360.0f,	0.10f,	0.05f,	0.04f, 0.05f, 0.02f,	2.0f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		0.1f,	0.8f,	120.0f },
+	{ "swirl01",			0.0f,	360.0f,	0.10f,	0.05f,	0.04f, 0.05f, 0.02f,	2.0f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		0.1f,	0.8f,	120.0f },
+	{ "swirl02",			0.0f,	360.0f,	0.10f,	0.05f,	0.04f, 0.05f, 0.02f,	2.0f,	0.5f,	1.0f, 0.8f, 0.0f,	0.0f, 0.0f,		0.1f,	0.8f,	120.0f },
+	{ "wind",				180.0f,	10.0f,	0.60f,	0.20f,	0.03f, 0.05f, 0.03f,	2.0f,	0.5f,	0.0f, 0.6f, 0.0f,	-0.2f, 0.0f,	0.0f,	0.0f,	0.0f },
+};
+
+const int NUM_PRESETS = sizeof(PRESETS) / sizeof(PRESETS[0]);
+
+enum Variant
+{
+	VariantBase,		// presets as listed
+	VariantRotated,		// enableTextureRotation on
+	VariantInfinite,	// negative lifetime, particles ping-pong forever
+	VariantKeyed,		// color and size evaluated from the keys when building vertices
+	VariantComplex,		// enableTextureRotation on, rotation stored as a unit complex number
+	VariantFixed,		// simulated in fixed steps of FIXED_TIME_STEP, vertices interpolated in between
+
+	NumVariants
+};
+
+const char* const VARIANT_NAMES[NumVariants] = { "base", "rotated", "infinite", "keyed", "complex", "fixed" };
+
+const float FRAME_TIME = 1.0f / 60.0f;
+
+// Step of VariantFixed: every other frame, interpolated in between.
+const float FIXED_TIME_STEP = 1.0f / 30.0f;
+const int FIXED_MAX_STEPS = 4;
+
+// Exposes the individual Frame() stages of ParticleSystem so they can be timed separately.
+class BenchmarkParticleSystem : public ParticleSystem
+{
+public:
+	void Emit(float delta) { EmitParticles(delta); }
+	int Update(float delta) { return UpdateParticles(delta); }
+	void Kill(int numExpired) { KillParticles(numExpired); }
+};
+
+// Destination of every vertex format, sized for the largest capacity.
+struct OutputBuffers
+{
+	std::vector<ParticleVertex> vertices;
+	std::vector<ParticleQuantizedVertex> quantized;
+	std::vector<ParticleInstance> instances;
+};
+
+// Sets 'system' up as 'preset' in 'variant', with a capacity of 'maxParticles'.
+inline bool InitPreset(BenchmarkParticleSystem& system, const BenchmarkPreset& preset, Variant variant, int maxParticles)
+{
+	float lifetime = preset.lifetime;
+	float averageLifetime = preset.lifetime + preset.lifetimeVar * 0.5f;
+
+	// Emit just fast enough to keep the emitter full in steady state.
+	int emissionRate = (int)(maxParticles / averageLifetime) + 1;
+
+	if (variant == VariantInfinite)
+	{
+		lifetime = -lifetime;
+	}
+
+	// Fixed seed, so runs are comparable.
+	system.SetRandomSeed(1);
+	system.SetKeyMode(variant == VariantKeyed ? ParticleSystem::EvaluateKeys : ParticleSystem::IntegrateKeys);
+	system.SetRotationMode(variant == VariantComplex ? ParticleSystem::ComplexRotation : ParticleSystem::AngleRotation);
+	system.SetFixedTimeStep(variant == VariantFixed ? FIXED_TIME_STEP : 0.0f, FIXED_MAX_STEPS);
+
+	return system.InitParticleProperties(
+		0.0f, 0.0f,
+		0.05f, 0.05f,
+		maxParticles,
+		emissionRate,
+		preset.angle, preset.angleVar,
+		preset.speed, preset.speedVar,
+		preset.startSize, preset.startSize * 0.25f,
+		preset.middleSize, preset.middleSize * 0.25f,
+		preset.endSize, preset.endSize * 0.25f,
+		lifetime, preset.lifetimeVar,
+		1.0f, 1.0f, 1.0f, preset.startAlpha,
+		0.0f, 0.1f, 0.1f, 0.0f,
+		1.0f, 0.8f, 0.6f, preset.middleAlpha,
+		0.0f, 0.1f, 0.1f, 0.0f,
+		1.0f, 0.5f, 0.2f, preset.endAlpha,
+		0.0f, 0.1f, 0.1f, 0.0f,
+		preset.gravityX, preset.gravityY,
+		preset.radialAccel, preset.radialAccel * 0.5f,
+		preset.tangentialAccel, preset.tangentialAccel * 0.5f,
+		-1.0f,		// emit forever
+		true,
+		0.0f,
+		preset.rotationSpeed, preset.rotationSpeed * 0.5f,
+		variant == VariantRotated || variant == VariantComplex
+		);
+}
@@ -0,0 +1,149 @@
+﻿#include "ParticleBudget.h"
+#include "ParticleStats.h"
+#include "ParticleSystem.h"
+#include <algorithm>
+#include <climits>
+#include <math.h>
+
+const float ParticleBudget::TIME_SMOOTHING = 0.1f;
+const float ParticleBudget::RESTORE_RATE = 0.5f;
+
+ParticleBudget& ParticleBudget::GetInstance()
+{
+	static ParticleBudget instance;
+	return instance;
+}
+
+ParticleBudget::ParticleBudget() :
+	m_particleBudget(0)
+	,m_timeBudget(0.0f)
+	,m_liveParticles(0)
+	,m_simulationTime(0.0f)
+{
+}
+
+void ParticleBudget::Add(ParticleSystem* emitter)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	if (!emitter->m_budgeted)
+	{
+		emitter->m_budgeted = true;
+		emitter->m_budgetTicks.store(0, std::memory_order_relaxed);
+		emitter->m_budgetParticles.store(emitter->GetParticleCount(), std::memory_order_relaxed);
+		m_emitters.push_back(emitter);
+	}
+}
+
+void ParticleBudget::Remove(ParticleSystem* emitter)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::vector<ParticleSystem*>::iterator it = std::find(m_emitters.begin(), m_emitters.end(), emitter);
+	if (it != m_emitters.end())
+	{
+		m_emitters.erase(it);
+		emitter->m_budgeted = false;
+		emitter->m_budgetShare.store(1.0f, std::memory_order_relaxed);
+	}
+}
+
+int ParticleBudget::GetDemand(const ParticleSystem* emitter)
+{
+	int liveParticles = emitter->m_budgetParticles.load(std::memory_order_relaxed);
+	bool emitting = emitter->m_state == ParticleSystem::Playing && emitter->m_emissionRate > 0 &&
+		(emitter->m_duration < 0.0f || emitter->m_accumulatedTime < emitter->m_duration);
+	if (!emitting)
+	{
+		return liveParticles;
+	}
+
+	// Infinite particles never make room, so the emitter fills up whatever its rate.
+	int demand = emitter->m_maxParticles;
+	if (!emitter->m_isPartInfiniteLifetime)
+	{
+		float steadyState = emitter->m_emissionRate * (emitter->m_lifetime + emitter->m_lifetimeVar * 0.5f);
+		if (steadyState < (float)demand)
+		{
+			demand = (int)ceilf(steadyState);
+		}
+	}
+	return std::max(demand, liveParticles);
+}
+
+void ParticleBudget::Update(float deltaTime)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	// Measure the frame.
+	int liveParticles = 0;
+	uint64_t ticks = 0;
+	for (size_t e = 0; e < m_emitters.size(); ++e)
+	{
+		liveParticles += m_emitters[e]->m_budgetParticles.load(std::memory_order_relaxed);
+		ticks += m_emitters[e]->m_budgetTicks.exchange(0, std::memory_order_relaxed);
+	}
+
+	float simulationTime = (float)(ticks * ParticleStats::GetTickPeriod() * 1.0e-6);
+	m_simulationTime += (simulationTime - m_simulationTime) * TIME_SMOOTHING;
+	m_liveParticles = liveParticles;
+
+	// Particles the budget allows, at the cost per particle of the last frames.
+	int allowed = m_particleBudget > 0 ? m_particleBudget : INT_MAX;
+	if (m_timeBudget > 0.0f && liveParticles > 0 && m_simulationTime > 0.0f)
+	{
+		float timeAllowed = m_timeBudget / m_simulationTime * liveParticles;
+		if (timeAllowed < allowed)
+		{
+			allowed = (int)timeAllowed;
+		}
+	}
+
+	// Highest priority first; insertion sort keeps emitters of the same priority in the order they were
+	// added, and the list is short and barely changes between frames.
+	for (size_t e = 1; e < m_emitters.size(); ++e)
+	{
+		ParticleSystem* emitter = m_emitters[e];
+		size_t slot = e;
+		while (slot > 0 && m_emitters[slot - 1]->m_budgetPriority < emitter->m_budgetPriority)
+		{
+			m_emitters[slot] = m_emitters[slot - 1];
+			--slot;
+		}
+		m_emitters[slot] = emitter;
+	}
+
+	// Share out the allowed particles a priority at a time, at what the emitters need.
+	int remaining = allowed;
+	size_t first = 0;
+	while (first < m_emitters.size())
+	{
+		int priority = m_emitters[first]->m_budgetPriority;
+		size_t last = first;
+		int64_t demand = 0;
+		while (last < m_emitters.size() && m_emitters[last]->m_budgetPriority == priority)
+		{
+			demand += GetDemand(m_emitters[last]);
+			++last;
+		}
+
+		float share = 1.0f;
+		if (demand > remaining)
+		{
+			share = demand > 0 ? (float)remaining / (float)demand : 1.0f;
+			remaining = 0;
+		}
+		else
+		{
+			remaining -= (int)demand;
+		}
+
+		// Drop at once, come back gradually.
+		for (size_t e = first; e < last; ++e)
+		{
+			std::atomic<float>& current = m_emitters[e]->m_budgetShare;
+			float restored = current.load(std::memory_order_relaxed) + RESTORE_RATE * deltaTime;
+			current.store(share < restored ? share : restored, std::memory_order_relaxed);
+		}
+
+		first = last;
+	}
+}
@@ -0,0 +1,73 @@
+﻿#pragma once
+
+#include <mutex>
+#include <vector>
+
+class ParticleSystem;
+
+// Process-wide budget the emitters share, so stacked effects can't blow the frame on low-end devices:
+// at most so many live particles, or so many milliseconds of simulation per frame, across every emitter
+// added to it. ParticleRenderer adds itself.
+//
+// Once a frame, Update measures the particles and simulation time of the emitters and shares the budget
+// out by priority, in live particles: the emitters of the highest priority get the particles they need
+// first, and the ones of the priority that doesn't fit get the same share each of what is left. An
+// emitter needs what it keeps alive without a budget: its emission rate times the average lifetime of
+// its particles, up to its capacity, or only the particles it has once it stops emitting. So emitters
+// far below their capacity don't hold budget they don't use. An emitter's share scales
+// its emission rate and the capacity it emits up to; its settings are left as they are, and the
+// particles it already has live out their lifetime. Shares drop at once and come back gradually as
+// headroom returns, so an effect doesn't flicker in and out at the edge of the budget.
+class ParticleBudget
+{
+public:
+
+	static ParticleBudget& GetInstance();
+
+	// Most live particles of all the emitters together; 0, the default, for no limit.
+	int GetParticleBudget() const { return m_particleBudget; }
+	void SetParticleBudget(int particles) { m_particleBudget = particles; }
+
+	// Most milliseconds the emitters may spend in ParticleSystem::Simulate per frame, on all threads
+	// together; 0, the default, for no limit. The cost of a particle is estimated from the last frames.
+	float GetTimeBudget() const { return m_timeBudget; }
+	void SetTimeBudget(float milliseconds) { m_timeBudget = milliseconds; }
+
+	// An emitter shares the budget from the time it is added until it is removed or destroyed.
+	void Add(ParticleSystem* emitter);
+	void Remove(ParticleSystem* emitter);
+
+	// Measures the last frame and updates the share of every emitter, for their next Simulate. Called
+	// once per frame, after the emitters are updated, with the frame's time step in seconds.
+	void Update(float deltaTime);
+
+	// Live particles and simulation milliseconds of the emitters as of the last Update. The time is
+	// averaged over the last frames.
+	int GetLiveParticles() const { return m_liveParticles; }
+	float GetSimulationTime() const { return m_simulationTime; }
+
+private:
+
+	// Weight of the last frame in the averaged simulation time.
+	static const float TIME_SMOOTHING;
+
+	// Share regained per second once there is headroom again.
+	static const float RESTORE_RATE;
+
+	ParticleBudget();
+
+	// Live particles the emitter needs, see the class comment.
+	static int GetDemand(const ParticleSystem* emitter);
+
+	std::mutex m_lock;					// guards m_emitters
+	std::vector<ParticleSystem*> m_emitters;	// by decreasing priority after each Update
+
+	int m_particleBudget;
+	float m_timeBudget;
+	int m_liveParticles;
+	float m_simulationTime;
+
+	// Copying is not allowed.
+	ParticleBudget(const ParticleBudget&);
+	ParticleBudget& operator=(const ParticleBudget&);
+};
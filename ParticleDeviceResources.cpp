@@ -0,0 +1,249 @@
+﻿#include "pch.h"
+#include <vector>
+#include "ParticleDeviceResources.h"
+#include "ParticleRenderer.h"
+#include "DirectXHelper.h"
+
+using namespace DirectX;
+using namespace Microsoft::WRL;
+
+const ParticleCorner PARTICLE_CORNERS[4] =
+{
+	{ 1.0f, -1.0f, 1.0f, 1.0f },
+	{ -1.0f, -1.0f, 0.0f, 1.0f },
+	{ -1.0f, 1.0f, 0.0f, 0.0f },
+	{ 1.0f, 1.0f, 1.0f, 0.0f },
+};
+
+// Smallest index buffer created, in quads, so small emitters don't each grow it a little.
+const int MIN_INDEXED_QUADS = 256;
+
+ParticleDeviceResources& ParticleDeviceResources::GetInstance()
+{
+	static ParticleDeviceResources instance;
+	return instance;
+}
+
+ParticleDeviceResources::ParticleDeviceResources() :
+	m_loader(nullptr)
+	,m_indexBufferQuads(0)
+{
+}
+
+void ParticleDeviceResources::SetDevice(ComPtr<ID3D11Device1> d3dDevice)
+{
+	if (m_d3dDevice.Get() != d3dDevice.Get())
+	{
+		Release();
+		m_d3dDevice = d3dDevice;
+		m_loader = ref new BasicLoader(m_d3dDevice.Get());
+	}
+}
+
+void ParticleDeviceResources::Release()
+{
+	m_commonStates.reset();
+	for (int i = 0; i < NumVertexFormats; ++i)
+	{
+		m_vertexShaders[i] = nullptr;
+		m_inputLayouts[i] = nullptr;
+	}
+	m_pixelShader = nullptr;
+	m_constantBuffer = nullptr;
+	m_cornerBuffer = nullptr;
+	m_indexBuffer = nullptr;
+	m_indexBufferQuads = 0;
+
+	m_loader = nullptr;
+	m_d3dDevice = nullptr;
+}
+
+CommonStates* ParticleDeviceResources::GetCommonStates()
+{
+	if (m_commonStates == nullptr)
+	{
+		m_commonStates.reset(new CommonStates(m_d3dDevice.Get()));
+	}
+
+	return m_commonStates.get();
+}
+
+void ParticleDeviceResources::GetVertexShader(VertexFormat format, ComPtr<ID3D11VertexShader>* vertexShader, ComPtr<ID3D11InputLayout>* inputLayout)
+{
+	if (m_vertexShaders[format] == nullptr)
+	{
+		D3D11_INPUT_ELEMENT_DESC layoutDesc[] =
+		{
+			{ "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 8, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "COLOR",    0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+		};
+
+		// Same elements for ParticleQuantizedVertex. The input assembler unpacks them to the floats the shader reads,
+		// so it shares ParticleVertexShader.
+		D3D11_INPUT_ELEMENT_DESC quantizedLayoutDesc[] =
+		{
+			{ "POSITION", 0, DXGI_FORMAT_R16G16_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "COLOR",    0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, 4,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "TEXCOORD", 0, DXGI_FORMAT_R16G16_SNORM, 0, 8,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
+		};
+
+		// Slot 0 holds the four static quad corners, slot 1 one ParticleInstance per particle.
+		D3D11_INPUT_ELEMENT_DESC instanceLayoutDesc[] =
+		{
+			{ "CORNER",   0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 1, 0,  D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+			{ "SIZE",     0, DXGI_FORMAT_R32_FLOAT, 1, 8,  D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+			{ "ROTATION", 0, DXGI_FORMAT_R32_FLOAT, 1, 12, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+			{ "COLOR",    0, DXGI_FORMAT_R8G8B8A8_UNORM, 1, 16, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+		};
+
+		if (format == InstanceVertexFormat)
+		{
+			m_loader->LoadShader(
+				L"ParticleInstanceVertexShader.cso",
+				instanceLayoutDesc,
+				ARRAYSIZE(instanceLayoutDesc),
+				&m_vertexShaders[format],
+				&m_inputLayouts[format]
+				);
+		}
+		else if (format == QuantizedVertexFormat)
+		{
+			m_loader->LoadShader(
+				L"ParticleVertexShader.cso",
+				quantizedLayoutDesc,
+				ARRAYSIZE(quantizedLayoutDesc),
+				&m_vertexShaders[format],
+				&m_inputLayouts[format]
+				);
+		}
+		else
+		{
+			m_loader->LoadShader(
+				L"ParticleVertexShader.cso",
+				layoutDesc,
+				ARRAYSIZE(layoutDesc),
+				&m_vertexShaders[format],
+				&m_inputLayouts[format]
+				);
+		}
+	}
+
+	*vertexShader = m_vertexShaders[format];
+	*inputLayout = m_inputLayouts[format];
+}
+
+ComPtr<ID3D11PixelShader> ParticleDeviceResources::GetPixelShader()
+{
+	if (m_pixelShader == nullptr)
+	{
+		m_loader->LoadShader(
+			L"ParticlePixelShader.cso",
+			&m_pixelShader
+			);
+	}
+
+	return m_pixelShader;
+}
+
+ComPtr<ID3D11Buffer> ParticleDeviceResources::GetConstantBuffer()
+{
+	if (m_constantBuffer == nullptr)
+	{
+		CD3D11_BUFFER_DESC constantBufferDesc(
+			sizeof(ViewProjectionConstantBuffer),
+			D3D11_BIND_CONSTANT_BUFFER,
+			D3D11_USAGE_DYNAMIC,
+			D3D11_CPU_ACCESS_WRITE
+			);
+
+		DX::ThrowIfFailed(
+			m_d3dDevice->CreateBuffer(
+				&constantBufferDesc,
+				nullptr,
+				&m_constantBuffer
+				)
+			);
+	}
+
+	return m_constantBuffer;
+}
+
+ComPtr<ID3D11Buffer> ParticleDeviceResources::GetCornerBuffer()
+{
+	if (m_cornerBuffer == nullptr)
+	{
+		CD3D11_BUFFER_DESC cornerBufferDesc(sizeof(PARTICLE_CORNERS), D3D11_BIND_VERTEX_BUFFER, D3D11_USAGE_IMMUTABLE);
+		D3D11_SUBRESOURCE_DATA cornerBufferData = {0};
+		cornerBufferData.pSysMem = PARTICLE_CORNERS;
+
+		DX::ThrowIfFailed(
+			m_d3dDevice->CreateBuffer(
+				&cornerBufferDesc,
+				&cornerBufferData,
+				&m_cornerBuffer
+				)
+			);
+	}
+
+	return m_cornerBuffer;
+}
+
+ComPtr<ID3D11Buffer> ParticleDeviceResources::GetIndexBuffer(int numQuads)
+{
+	if (numQuads > MAX_INDEXED_QUADS)
+	{
+		numQuads = MAX_INDEXED_QUADS;
+	}
+
+	if (m_indexBuffer != nullptr && numQuads <= m_indexBufferQuads)
+	{
+		return m_indexBuffer;
+	}
+
+	// Grow geometrically, so emitters of slowly increasing capacity don't recreate it every time.
+	int capacity = m_indexBufferQuads < MIN_INDEXED_QUADS ? MIN_INDEXED_QUADS : m_indexBufferQuads;
+	while (capacity < numQuads)
+	{
+		capacity *= 2;
+	}
+	if (capacity > MAX_INDEXED_QUADS)
+	{
+		capacity = MAX_INDEXED_QUADS;
+	}
+
+	std::vector<unsigned short> indices(capacity * 6);
+	for (int i = 0; i < capacity; ++i)
+	{
+		unsigned short i4 = (unsigned short)(i * 4);
+		indices[i * 6 + 0] = i4 + 0;
+		indices[i * 6 + 1] = i4 + 1;
+		indices[i * 6 + 2] = i4 + 2;
+		indices[i * 6 + 3] = i4 + 0;
+		indices[i * 6 + 4] = i4 + 2;
+		indices[i * 6 + 5] = i4 + 3;
+	}
+
+	CD3D11_BUFFER_DESC indexBufferDesc(
+		(UINT)(sizeof(unsigned short) * indices.size()),
+		D3D11_BIND_INDEX_BUFFER,
+		D3D11_USAGE_IMMUTABLE
+		);
+
+	D3D11_SUBRESOURCE_DATA indexData = {0};
+	indexData.pSysMem = &indices[0];
+
+	// Emitters holding the previous, smaller buffer keep it until they release it.
+	m_indexBuffer = nullptr;
+	DX::ThrowIfFailed(
+		m_d3dDevice->CreateBuffer(
+			&indexBufferDesc,
+			&indexData,
+			&m_indexBuffer
+			)
+		);
+
+	m_indexBufferQuads = capacity;
+	return m_indexBuffer;
+}
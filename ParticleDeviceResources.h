@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include <memory>
+#include "CommonStates.h"
+#include "ParticleSystem.h"
+#include "Engine\Common\BasicLoader.h"
+
+// One corner of the quad every particle instance is expanded from: direction from the particle
+// center and texture coordinate, in the order bottom right, bottom left, top left, top right.
+struct ParticleCorner
+{
+	float cornerX, cornerY;
+	float textureU, textureV;
+};
+
+// Device resources that are the same for every emitter: shaders, input layouts, the constant buffer,
+// the static quad index and corner buffers, and the common states. They are created once per device
+// on first use and handed to every ParticleRenderer and ParticleBatchRenderer, so creating an emitter
+// only creates its own vertex buffer.
+//
+// Used from the rendering thread.
+class ParticleDeviceResources
+{
+public:
+
+	// The vertex formats ParticleRenderer can draw with, each with its own vertex shader and input layout.
+	enum VertexFormat
+	{
+		QuadVertexFormat,		// ParticleVertex
+		QuantizedVertexFormat,	// ParticleQuantizedVertex
+		InstanceVertexFormat,	// ParticleCorner in slot 0, ParticleInstance in slot 1
+
+		NumVertexFormats
+	};
+
+	// 16 bit indices address at most 65536 vertices, so the index buffer holds at most this many quads.
+	static const int MAX_INDEXED_QUADS = 65536 / 4;
+
+	static ParticleDeviceResources& GetInstance();
+
+	// Releases everything created for a previous device. Call before the getters, with the device the
+	// caller renders with.
+	void SetDevice(Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice);
+
+	// Releases every resource; those still referenced by emitters live until they release them.
+	void Release();
+
+	DirectX::CommonStates* GetCommonStates();
+
+	void GetVertexShader(
+		VertexFormat format,
+		Microsoft::WRL::ComPtr<ID3D11VertexShader>* vertexShader,
+		Microsoft::WRL::ComPtr<ID3D11InputLayout>* inputLayout);
+
+	Microsoft::WRL::ComPtr<ID3D11PixelShader> GetPixelShader();
+
+	// A dynamic ViewProjectionConstantBuffer. Every user maps it with D3D11_MAP_WRITE_DISCARD before
+	// drawing, so sharing it doesn't make draws wait on each other.
+	Microsoft::WRL::ComPtr<ID3D11Buffer> GetConstantBuffer();
+
+	// The four ParticleCorner of the instanced quad.
+	Microsoft::WRL::ComPtr<ID3D11Buffer> GetCornerBuffer();
+
+	// Static 16 bit index buffer of at least numQuads quads (at most MAX_INDEXED_QUADS), six indices per
+	// quad. It grows to the largest count asked for; a buffer handed out before it grew stays valid for
+	// the count it was asked for. More quads than MAX_INDEXED_QUADS are drawn in several draws, each with
+	// the first vertex of its quads as the base vertex.
+	Microsoft::WRL::ComPtr<ID3D11Buffer> GetIndexBuffer(int numQuads);
+
+private:
+
+	ParticleDeviceResources();
+
+	Microsoft::WRL::ComPtr<ID3D11Device1> m_d3dDevice;
+	BasicLoader^ m_loader;
+
+	std::unique_ptr<DirectX::CommonStates> m_commonStates;
+	Microsoft::WRL::ComPtr<ID3D11VertexShader> m_vertexShaders[NumVertexFormats];
+	Microsoft::WRL::ComPtr<ID3D11InputLayout> m_inputLayouts[NumVertexFormats];
+	Microsoft::WRL::ComPtr<ID3D11PixelShader> m_pixelShader;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_constantBuffer;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_cornerBuffer;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_indexBuffer;
+	int m_indexBufferQuads;
+
+	// Copying is not allowed.
+	ParticleDeviceResources(const ParticleDeviceResources&);
+	ParticleDeviceResources& operator=(const ParticleDeviceResources&);
+};
@@ -0,0 +1,225 @@
+﻿#include "ParticleEffectBank.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	bool CompareNames(const ParticleEmitterRecord& a, const ParticleEmitterRecord& b)
+	{
+		return strncmp(a.name, b.name, sizeof(a.name)) < 0;
+	}
+}
+
+ParticleEffectBank::ParticleEffectBank() :
+	m_records(nullptr)
+	,m_count(0)
+	,m_view(nullptr)
+	,m_viewBytes(0)
+#if defined(_WIN32)
+	,m_file(INVALID_HANDLE_VALUE)
+	,m_mapping(nullptr)
+#endif
+{
+}
+
+ParticleEffectBank::~ParticleEffectBank()
+{
+	Close();
+}
+
+bool ParticleEffectBank::Open(const char* path)
+{
+	Close();
+
+#if defined(_WIN32)
+	wchar_t widePath[MAX_PATH];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, widePath, MAX_PATH) == 0)
+	{
+		return false;
+	}
+
+	m_file = CreateFile2(widePath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	FILE_STANDARD_INFO info;
+	if (!GetFileInformationByHandleEx(m_file, FileStandardInfo, &info, sizeof(info)) || info.EndOfFile.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	m_mapping = CreateFileMappingFromApp(m_file, nullptr, PAGE_READONLY, 0, nullptr);
+	m_view = m_mapping != nullptr ? MapViewOfFileFromApp(m_mapping, FILE_MAP_READ, 0, 0) : nullptr;
+	m_viewBytes = (size_t)info.EndOfFile.QuadPart;
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	// The mapping keeps the file open by itself.
+	struct stat info;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (view != MAP_FAILED)
+		{
+			m_view = view;
+			m_viewBytes = (size_t)info.st_size;
+		}
+	}
+	close(file);
+#endif
+
+	if (m_view == nullptr || !Validate(m_view, m_viewBytes))
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool ParticleEffectBank::Attach(const void* data, size_t bytes)
+{
+	Close();
+
+	if (data == nullptr || ((uintptr_t)data & 3) != 0 || !Validate(data, bytes))
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool ParticleEffectBank::Validate(const void* data, size_t bytes)
+{
+	if (bytes < sizeof(ParticleEffectBankHeader))
+	{
+		return false;
+	}
+
+	const ParticleEffectBankHeader* header = (const ParticleEffectBankHeader*)data;
+	if (header->magic != PARTICLE_EFFECT_BANK_MAGIC || header->version != PARTICLE_EFFECT_BANK_VERSION ||
+		header->recordSize != sizeof(ParticleEmitterRecord) || (header->recordOffset & 3) != 0)
+	{
+		return false;
+	}
+
+	// The records must fit in the data, checked without overflowing.
+	if (header->recordOffset > bytes || header->recordCount > (bytes - header->recordOffset) / sizeof(ParticleEmitterRecord))
+	{
+		return false;
+	}
+
+	m_records = (const ParticleEmitterRecord*)((const char*)data + header->recordOffset);
+	m_count = (int)header->recordCount;
+	return true;
+}
+
+void ParticleEffectBank::Close()
+{
+#if defined(_WIN32)
+	if (m_view != nullptr)
+	{
+		UnmapViewOfFile(m_view);
+	}
+	if (m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = nullptr;
+	}
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (m_view != nullptr)
+	{
+		munmap(m_view, m_viewBytes);
+	}
+#endif
+
+	m_view = nullptr;
+	m_viewBytes = 0;
+	m_records = nullptr;
+	m_count = 0;
+}
+
+const ParticleEmitterRecord* ParticleEffectBank::FindEffect(const char* name) const
+{
+	int first = 0;
+	int last = m_count;
+	while (first < last)
+	{
+		int middle = (first + last) / 2;
+		int order = strncmp(m_records[middle].name, name, sizeof(m_records[middle].name));
+		if (order == 0)
+		{
+			return &m_records[middle];
+		}
+
+		if (order < 0)
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			last = middle;
+		}
+	}
+
+	return nullptr;
+}
+
+bool ParticleEffectBank::Write(const char* path, const ParticleEmitterRecord* records, int count)
+{
+	std::vector<ParticleEmitterRecord> sorted(records, records + count);
+	std::sort(sorted.begin(), sorted.end(), CompareNames);
+
+	// FindEffect needs the names unique and terminated.
+	for (int i = 0; i < count; ++i)
+	{
+		if (memchr(sorted[i].name, 0, sizeof(sorted[i].name)) == nullptr ||
+			(i > 0 && strcmp(sorted[i - 1].name, sorted[i].name) == 0))
+		{
+			return false;
+		}
+	}
+
+	ParticleEffectBankHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PARTICLE_EFFECT_BANK_MAGIC;
+	header.version = PARTICLE_EFFECT_BANK_VERSION;
+	header.recordSize = sizeof(ParticleEmitterRecord);
+	header.recordCount = (uint32_t)count;
+	header.recordOffset = sizeof(header);
+
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		(count == 0 || fwrite(&sorted[0], sizeof(ParticleEmitterRecord), count, file) == (size_t)count);
+	ok = fclose(file) == 0 && ok;
+	return ok;
+}
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An effect bank is one file holding the emitter presets of the game, compiled by ParticleBankTool from
+// its text source. The records are laid out exactly as ParticleEmitterRecord, so the bank is mapped
+// into memory and emitters are initialized straight from the mapped records: loading a level reads no
+// text and parses nothing.
+//
+// Layout: a ParticleEffectBankHeader, then recordCount records from recordOffset, sorted by name.
+// Every field is 32 bits, little-endian, as on every device the game runs on.
+
+const uint32_t PARTICLE_EFFECT_BANK_MAGIC = 0x42584650;	// "PFXB"
+
+// Bumped on any change to the header or the records; banks of another version are rejected.
+const uint32_t PARTICLE_EFFECT_BANK_VERSION = 1;
+
+struct ParticleEffectBankHeader
+{
+	uint32_t magic;			// PARTICLE_EFFECT_BANK_MAGIC
+	uint32_t version;		// PARTICLE_EFFECT_BANK_VERSION
+	uint32_t recordSize;	// sizeof(ParticleEmitterRecord), catches a mismatched layout
+	uint32_t recordCount;
+	uint32_t recordOffset;	// from the start of the file
+	uint32_t reserved[3];
+};
+
+// ParticleEmitterRecord::flags.
+enum ParticleEmitterFlags
+{
+	EmitterAutoPlay = 1,
+	EmitterTextureRotation = 2,
+	EmitterEvaluateKeys = 4,		// ParticleSystem::EvaluateKeys instead of IntegrateKeys
+	EmitterComplexRotation = 8		// ParticleSystem::ComplexRotation instead of AngleRotation
+};
+
+// One emitter preset: the arguments of ParticleSystem::InitParticleProperties, and the modes and
+// render state of the effect. Colors are red, green, blue, alpha.
+struct ParticleEmitterRecord
+{
+	char name[32];				// NUL-terminated, unique in the bank
+	uint32_t effect;			// ParticleEffect, the texture
+	uint32_t blendState;		// BlendStates
+	uint32_t flags;				// ParticleEmitterFlags
+	int32_t maxParticles;
+	int32_t emissionRate;		// particles per second
+	float startPosX, startPosY;
+	float devPosX, devPosY;
+	float angle, angleVar;		// in degrees
+	float speed, speedVar;
+	float startSize, startSizeVar;
+	float middleSize, middleSizeVar;
+	float endSize, endSizeVar;
+	float lifetime, lifetimeVar;	// negative lifetime: the particles restart forever
+	float startColor[4], startColorVar[4];
+	float middleColor[4], middleColorVar[4];
+	float endColor[4], endColorVar[4];
+	float gravityX, gravityY;
+	float radialAccel, radialAccelVar;
+	float tangentialAccel, tangentialAccelVar;
+	float duration;				// negative: emit forever
+	float startTime;
+	float rotationSpeed, rotationSpeedVar;
+	float fixedTimeStep;		// see ParticleSystem::SetFixedTimeStep, 0 for none
+	int32_t maxSteps;
+};
+
+static_assert(sizeof(ParticleEmitterRecord) == 260, "ParticleEmitterRecord is a file format, bump PARTICLE_EFFECT_BANK_VERSION");
+static_assert(sizeof(ParticleEffectBankHeader) == 32, "ParticleEffectBankHeader is a file format, bump PARTICLE_EFFECT_BANK_VERSION");
+
+// A bank mapped into memory, read-only. The records stay valid until the bank is closed; emitters
+// don't keep pointers to them, so the bank may be closed once they are initialized.
+class ParticleEffectBank
+{
+public:
+
+	ParticleEffectBank();
+	~ParticleEffectBank();
+
+	// Maps the bank file. Returns false, leaving the bank closed, if it can't be mapped or isn't a bank
+	// of this version.
+	bool Open(const char* path);
+
+	// Uses a bank already in memory, e.g. read by BasicLoader, without copying it. The data must stay
+	// alive and 4-byte aligned until Close.
+	bool Attach(const void* data, size_t bytes);
+
+	void Close();
+	bool IsOpen() const { return m_records != nullptr; }
+
+	int GetEffectCount() const { return m_count; }
+	const ParticleEmitterRecord& GetEffect(int index) const { return m_records[index]; }
+
+	// Binary search by name; nullptr if the bank has no such effect.
+	const ParticleEmitterRecord* FindEffect(const char* name) const;
+
+	// Writes 'count' records as a bank file, sorted by name. Used by ParticleBankTool.
+	static bool Write(const char* path, const ParticleEmitterRecord* records, int count);
+
+private:
+
+	// Checks the header and points m_records into 'data'.
+	bool Validate(const void* data, size_t bytes);
+
+	const ParticleEmitterRecord* m_records;
+	int m_count;
+
+	// The mapped view and what it takes to unmap it, when opened from a file.
+	void* m_view;
+	size_t m_viewBytes;
+#if defined(_WIN32)
+	void* m_file;
+	void* m_mapping;
+#endif
+
+	// Copying is not allowed.
+	ParticleEffectBank(const ParticleEffectBank&);
+	ParticleEffectBank& operator=(const ParticleEffectBank&);
+};
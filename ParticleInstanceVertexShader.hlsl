@@ -0,0 +1,52 @@
+﻿// Vertex shader for ParticleRenderer::Instanced: expands one ParticleInstance into a quad corner.
+// The output matches ParticleVertexShader, so the particle pixel shader is shared between modes,
+// and the corner math matches ExpandParticleInstance in ParticleSystem.cpp.
+
+cbuffer ViewProjectionConstantBuffer : register(b0)
+{
+	matrix view;
+	matrix projection;
+	float4 textureRect;		// left, top, right, bottom of the effect in its texture or atlas page
+};
+
+struct VertexShaderInput
+{
+	// Per vertex: direction of the corner from the particle center, and its texture coordinate.
+	float4 corner : CORNER;
+
+	// Per instance.
+	float2 position : POSITION;
+	float size : SIZE;
+	float rotation : ROTATION;
+	float4 color : COLOR;
+};
+
+struct PixelShaderInput
+{
+	float4 position : SV_POSITION;
+	float2 tex : TEXCOORD0;
+	float4 color : COLOR0;
+};
+
+PixelShaderInput main(VertexShaderInput input)
+{
+	PixelShaderInput output;
+
+	float sr;
+	float cr;
+	sincos(input.rotation, sr, cr);
+
+	float2 corner = input.corner.xy * input.size;
+	float2 position = float2(corner.x * cr - corner.y * sr, corner.x * sr + corner.y * cr) + input.position;
+
+	// Same transform as ParticleVertexShader.
+	float4 pos = float4(position, 0.0f, 1.0f);
+	pos = mul(pos, view);
+	pos = mul(pos, projection);
+	output.position = pos;
+
+	output.tex = textureRect.xy + input.corner.zw * (textureRect.zw - textureRect.xy);
+	output.color = input.color;
+
+	return output;
+}
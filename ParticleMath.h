@@ -0,0 +1,164 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// SinCos's range reduction and the vector kernels built on these helpers depend on every multiply and
+// add being rounded on its own. The CMake build turns contraction into fused multiply-adds off for the
+// whole library; this also holds for any project that includes the header without those options.
+#if defined(__FAST_MATH__) || defined(_M_FP_FAST)
+#error The particle kernels need IEEE rounding of every operation; build without fast math.
+#endif
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+// Portable replacements for the Engine\Common\BasicMath.h helpers the simulation uses,
+// so the particle core builds without the engine.
+namespace ParticleMath
+{
+	const float PI = 3.14159265359f;
+	const float TWO_PI = 6.28318530718f;
+
+	inline float DegreesToRadians(float degrees)
+	{
+		return degrees * (PI / 180.0f);
+	}
+
+	// Same comparison order as the Windows max/min macros: "a > b ? a : b".
+	inline float Max(float a, float b)
+	{
+		return a > b ? a : b;
+	}
+
+	inline float Min(float a, float b)
+	{
+		return a < b ? a : b;
+	}
+
+	inline float Clamp(float x, float lo, float hi)
+	{
+		return Max(lo, Min(x, hi));
+	}
+
+	// Maps a uniform random value in [0, 1) to [-1, 1), exactly like ParticleRandom::NextMinus1To1.
+	inline float ToMinus1To1(float value0To1)
+	{
+		return 2.0f * value0To1 - 1.0f;
+	}
+
+	// Constants of SinCos, shared with ParticleSimd::SinCos.
+	const float SINCOS_ROUND = 12582912.0f;		// 1.5 * 2^23: adding then subtracting it rounds to the nearest integer
+	const float TWO_OVER_PI = 0.636619772367581f;
+	const float PI_OVER_2_HI = 1.5703125f;		// pi / 2 in three parts (Cody and Waite); the first two have few
+	const float PI_OVER_2_MID = 4.837512969970703125e-4f;	// enough bits that multiplying them by the quadrant is exact
+	const float PI_OVER_2_LO = 7.54978995489188216e-8f;
+	const float SIN_C1 = -1.6666654611e-1f;		// minimax polynomials on [-pi/4, pi/4] (Cephes sinf and cosf)
+	const float SIN_C2 = 8.3321608736e-3f;
+	const float SIN_C3 = -1.9515295891e-4f;
+	const float COS_C1 = 4.166664568298827e-2f;
+	const float COS_C2 = -1.388731625493765e-3f;
+	const float COS_C3 = 2.443315711809948e-5f;
+
+	// Sine and cosine of x (radians) at once, branch free. Only uses operations ParticleSimd rounds the
+	// same way, so ParticleSimd::SinCos returns the exact same bits and loops over many angles vectorize,
+	// provided neither is contracted into fused multiply-adds (see the top of this file): the rounding
+	// constant SINCOS_ROUND and the Cody-Waite reduction rely on each product being rounded first.
+	// Within 2e-7 of libm for |x| <= 8192, which ParticleSystemTests checks; less accurate beyond.
+	inline void SinCos(float x, float* sine, float* cosine)
+	{
+		// Nearest multiple of pi/2, and x reduced to [-pi/4, pi/4] around it.
+		float quadrant = (x * TWO_OVER_PI + SINCOS_ROUND) - SINCOS_ROUND;
+		float r = ((x - quadrant * PI_OVER_2_HI) - quadrant * PI_OVER_2_MID) - quadrant * PI_OVER_2_LO;
+
+		// The quadrant modulo 4. quadrant / 4 - 0.375 is never halfway between integers, so it rounds
+		// to the integer below quadrant / 4.
+		float turns = ((quadrant * 0.25f - 0.375f) + SINCOS_ROUND) - SINCOS_ROUND;
+		float q = quadrant - turns * 4.0f;
+
+		float z = r * r;
+		float s = ((SIN_C3 * z + SIN_C2) * z + SIN_C1) * z * r + r;
+		float c = ((COS_C3 * z + COS_C2) * z + COS_C1) * z * z - 0.5f * z + 1.0f;
+
+		// sin(r + q pi/2) is s, c, -s, -c and cos(r + q pi/2) is c, -s, -c, s for q = 0, 1, 2, 3.
+		bool swap = (q == 1.0f || q == 3.0f);
+		float sinValue = swap ? c : s;
+		float cosValue = swap ? s : c;
+		*sine = (q >= 2.0f) ? -sinValue : sinValue;
+		*cosine = (q == 1.0f || q == 2.0f) ? -cosValue : cosValue;
+	}
+
+	// Convert to IEEE half precision (DXGI_FORMAT_R16_FLOAT), rounding to nearest even.
+	// Values too large for a half become infinity, NaN stays NaN.
+	inline uint16_t FloatToHalf(float value)
+	{
+		const uint32_t F32_INFINITY = 255u << 23;
+		const uint32_t F16_MAX = (127u + 16u) << 23;	// first float that rounds to half infinity
+		const uint32_t DENORM_MAGIC_BITS = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		uint32_t sign = bits & 0x80000000u;
+		bits ^= sign;
+
+		uint32_t half;
+		if (bits >= F16_MAX)
+		{
+			half = (bits > F32_INFINITY) ? 0x7E00u : 0x7C00u;
+		}
+		else if (bits < (113u << 23))
+		{
+			// Half denormal or zero: let the float adder do the shift and the rounding.
+			float denormMagic;
+			memcpy(&denormMagic, &DENORM_MAGIC_BITS, sizeof(denormMagic));
+			float shifted;
+			memcpy(&shifted, &bits, sizeof(shifted));
+			shifted += denormMagic;
+			memcpy(&bits, &shifted, sizeof(bits));
+			half = bits - DENORM_MAGIC_BITS;
+		}
+		else
+		{
+			// Rebias the exponent and round the mantissa to nearest even.
+			uint32_t mantissaOdd = (bits >> 13) & 1u;
+			bits += ((uint32_t)(15 - 127) << 23) + 0xFFFu;
+			bits += mantissaOdd;
+			half = bits >> 13;
+		}
+
+		return (uint16_t)(half | (sign >> 16));
+	}
+
+	inline float HalfToFloat(uint16_t half)
+	{
+		const uint32_t SHIFTED_EXPONENT = 0x7C00u << 13;
+		const uint32_t MAGIC_BITS = 113u << 23;
+
+		uint32_t bits = ((uint32_t)half & 0x7FFFu) << 13;
+		uint32_t exponent = bits & SHIFTED_EXPONENT;
+		bits += (127u - 15u) << 23;
+
+		float value;
+		if (exponent == SHIFTED_EXPONENT)
+		{
+			// Infinity or NaN.
+			bits += (128u - 16u) << 23;
+			memcpy(&value, &bits, sizeof(value));
+		}
+		else if (exponent == 0)
+		{
+			// Zero or denormal: renormalize.
+			bits += 1u << 23;
+			float magic;
+			memcpy(&magic, &MAGIC_BITS, sizeof(magic));
+			memcpy(&value, &bits, sizeof(value));
+			value -= magic;
+		}
+		else
+		{
+			memcpy(&value, &bits, sizeof(value));
+		}
+
+		return ((half & 0x8000u) != 0) ? -value : value;
+	}
+}
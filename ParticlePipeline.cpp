@@ -0,0 +1,117 @@
+﻿#include "ParticlePipeline.h"
+
+ParticlePipeline::ParticlePipeline(ParticleSystem& system) :
+	m_system(system)
+	,m_format(QuadVertices)
+	,m_front(0)
+	,m_deltaTime(0.0f)
+	,m_inFlight(false)
+	,m_changed(false)
+{
+	m_counts[0] = 0;
+	m_counts[1] = 0;
+}
+
+ParticlePipeline::~ParticlePipeline()
+{
+	Wait();
+}
+
+void ParticlePipeline::SetFormat(Format format)
+{
+	Wait();
+
+	if (format != m_format)
+	{
+		m_format = format;
+		m_counts[0] = 0;
+		m_counts[1] = 0;
+		m_changed = false;
+	}
+}
+
+int ParticlePipeline::GetBytesPerParticle() const
+{
+	if (m_format == Instances)
+	{
+		return sizeof(ParticleInstance);
+	}
+
+	return m_format == QuantizedVertices ? sizeof(ParticleQuantizedVertex) * 4 : sizeof(ParticleVertex) * 4;
+}
+
+void ParticlePipeline::Start(float deltaTime)
+{
+	Wait();
+
+	// Sized here, while no frame is in flight, so the frame itself never allocates. Only grows, so an
+	// emitter whose capacity goes back and forth doesn't reallocate.
+	int back = 1 - m_front;
+	size_t bytes = (size_t)m_system.GetMaxParticles() * GetBytesPerParticle();
+	if (m_buffers[back].size() < bytes)
+	{
+		m_buffers[back].resize(bytes);
+	}
+
+	m_deltaTime = deltaTime;
+	m_changed = false;
+	m_inFlight = true;
+	ParticleThreadPool::GetInstance().Start(m_task, 1, 1, &ParticlePipeline::RunFrame, this);
+}
+
+void ParticlePipeline::RunFrame(void* context, int, int)
+{
+	ParticlePipeline* pipeline = (ParticlePipeline*)context;
+	ParticleSystem& system = pipeline->m_system;
+
+	pipeline->m_changed = system.Simulate(pipeline->m_deltaTime);
+	if (!pipeline->m_changed)
+	{
+		return;
+	}
+
+	int back = 1 - pipeline->m_front;
+	void* buffer = pipeline->m_buffers[back].empty() ? nullptr : &pipeline->m_buffers[back][0];
+	if (pipeline->m_format == Instances)
+	{
+		pipeline->m_counts[back] = system.BuildInstances((ParticleInstance*)buffer);
+	}
+	else if (pipeline->m_format == QuantizedVertices)
+	{
+		pipeline->m_counts[back] = system.BuildQuantizedVertices((ParticleQuantizedVertex*)buffer) / 4;
+	}
+	else
+	{
+		pipeline->m_counts[back] = system.BuildVertices((ParticleVertex*)buffer) / 4;
+	}
+}
+
+void ParticlePipeline::Wait()
+{
+	if (m_inFlight)
+	{
+		ParticleThreadPool::GetInstance().Wait(m_task);
+		m_inFlight = false;
+	}
+}
+
+bool ParticlePipeline::Swap()
+{
+	Wait();
+	if (!m_changed)
+	{
+		return false;
+	}
+
+	m_front = 1 - m_front;
+	m_changed = false;
+	return true;
+}
+
+void ParticlePipeline::Clear()
+{
+	Wait();
+	m_counts[0] = 0;
+	m_counts[1] = 0;
+	m_changed = false;
+}
@@ -0,0 +1,76 @@
+﻿#pragma once
+
+#include "ParticleSystem.h"
+#include "ParticleThreadPool.h"
+#include <vector>
+
+// Double-buffered simulation of one emitter, so simulating it is off the critical path of the frame.
+// Start simulates the next frame and builds its output into the back buffer on ParticleThreadPool,
+// while the caller uploads and draws the front buffer of the frame before. Swap is the sync point: it
+// waits for the frame in flight and makes its output the front buffer. What is drawn is one frame
+// behind the simulation.
+//
+// While a frame is in flight, from Start until Wait or Swap return, nothing else may use the emitter.
+class ParticlePipeline
+{
+public:
+
+	// Output the frames are built into, see ParticleSystem::BuildVertices and the builders after it.
+	enum Format
+	{
+		QuadVertices,		// four ParticleVertex per particle
+		QuantizedVertices,	// four ParticleQuantizedVertex per particle
+		Instances			// one ParticleInstance per particle
+	};
+
+	explicit ParticlePipeline(ParticleSystem& system);
+	~ParticlePipeline();
+
+	// Changing the format waits for the frame in flight and empties both buffers.
+	Format GetFormat() const { return m_format; }
+	void SetFormat(Format format);
+
+	// Simulates the emitter by deltaTime seconds and builds the output of the frame into the back buffer,
+	// in the background. Waits for the previous frame first if it is still in flight.
+	void Start(float deltaTime);
+
+	// Waits for the frame in flight, if any.
+	void Wait();
+
+	// Waits for the frame in flight and makes its output the front buffer. Returns false, keeping the
+	// front buffer, if no frame was started since the last swap or it didn't change the particles.
+	bool Swap();
+
+	// Output of the last frame swapped in: GetFrontCount() particles in the current format.
+	const void* GetFrontBuffer() const { return m_buffers[m_front].empty() ? nullptr : &m_buffers[m_front][0]; }
+	int GetFrontCount() const { return m_counts[m_front]; }
+	int GetFrontBytes() const { return m_counts[m_front] * GetBytesPerParticle(); }
+
+	// Waits for the frame in flight and drops its output and the front buffer, e.g. when the emitter
+	// is reset.
+	void Clear();
+
+private:
+
+	int GetBytesPerParticle() const;
+
+	// Body of the frame in flight.
+	static void RunFrame(void* context, int begin, int end);
+
+	ParticleSystem& m_system;
+	Format m_format;
+
+	std::vector<unsigned char> m_buffers[2];
+	int m_counts[2];	// particles in each buffer
+	int m_front;
+
+	// Frame in flight. m_changed is written by the frame and only read once it is done.
+	ParticleThreadPool::Task m_task;
+	float m_deltaTime;
+	bool m_inFlight;
+	bool m_changed;
+
+	// Copying is not allowed.
+	ParticlePipeline(const ParticlePipeline&);
+	ParticlePipeline& operator=(const ParticlePipeline&);
+};
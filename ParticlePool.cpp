@@ -0,0 +1,233 @@
+﻿#include "ParticlePool.h"
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+namespace
+{
+	#define PARTICLE_POOL_COUNT_STREAM(name) + 1
+	const int NUM_STREAMS = 0 PARTICLE_POOL_STREAMS(PARTICLE_POOL_COUNT_STREAM) PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(PARTICLE_POOL_COUNT_STREAM)
+		PARTICLE_POOL_INTERPOLATION_STREAMS(PARTICLE_POOL_COUNT_STREAM);
+	#undef PARTICLE_POOL_COUNT_STREAM
+
+	void* AlignedAlloc(size_t bytes)
+	{
+#if defined(_MSC_VER)
+		return _aligned_malloc(bytes, 32);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, 32, bytes) != 0)
+		{
+			return nullptr;
+		}
+		return memory;
+#endif
+	}
+
+	void AlignedFree(void* memory)
+	{
+#if defined(_MSC_VER)
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+
+	// Blocks are cached in size classes of 64, 128, ... 131072 particles; larger ones go straight to the heap.
+	const int MIN_SIZE_CLASS_STRIDE = 64;
+	const int NUM_SIZE_CLASSES = 12;
+
+	// Blocks released by pools, one free list per size class. The first bytes of a free block point
+	// to the next free block of its class. Pools can be allocated from any thread, so it is locked.
+	struct BlockCache
+	{
+		std::mutex lock;
+		void* freeBlocks[NUM_SIZE_CLASSES];
+		int heapAllocations;
+	};
+
+	BlockCache blockCache;
+
+	size_t GetBlockBytes(int stride)
+	{
+		return sizeof(float) * stride * NUM_STREAMS + sizeof(int) * stride;
+	}
+
+	// Size class of a pool of 'capacity' particles, or -1 if it is too large to be cached.
+	int GetSizeClass(int capacity)
+	{
+		int stride = MIN_SIZE_CLASS_STRIDE;
+		for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; ++sizeClass, stride *= 2)
+		{
+			if (capacity <= stride)
+			{
+				return sizeClass;
+			}
+		}
+
+		return -1;
+	}
+
+	void* AcquireBlock(int sizeClass, size_t bytes)
+	{
+		std::lock_guard<std::mutex> guard(blockCache.lock);
+
+		if (sizeClass >= 0 && blockCache.freeBlocks[sizeClass] != nullptr)
+		{
+			void* block = blockCache.freeBlocks[sizeClass];
+			blockCache.freeBlocks[sizeClass] = *(void**)block;
+			return block;
+		}
+
+		++blockCache.heapAllocations;
+		return AlignedAlloc(bytes);
+	}
+
+	void ReleaseBlock(int sizeClass, void* block)
+	{
+		std::lock_guard<std::mutex> guard(blockCache.lock);
+
+		if (sizeClass >= 0)
+		{
+			*(void**)block = blockCache.freeBlocks[sizeClass];
+			blockCache.freeBlocks[sizeClass] = block;
+		}
+		else
+		{
+			AlignedFree(block);
+		}
+	}
+}
+
+ParticlePool::ParticlePool() :
+	m_memory(nullptr)
+	,m_capacity(0)
+	,m_stride(0)
+	,m_sizeClass(-1)
+	,m_optionalStreams(0)
+{
+	#define PARTICLE_POOL_CLEAR_STREAM(name) name = nullptr;
+	PARTICLE_POOL_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	PARTICLE_POOL_INTERPOLATION_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	#undef PARTICLE_POOL_CLEAR_STREAM
+	expired = nullptr;
+}
+
+ParticlePool::~ParticlePool()
+{
+	Release();
+}
+
+bool ParticlePool::Allocate(int capacity, int optionalStreams)
+{
+	if (capacity <= 0)
+	{
+		Release();
+		return true;
+	}
+
+	int sizeClass = GetSizeClass(capacity);
+	int stride = sizeClass >= 0 ? MIN_SIZE_CLASS_STRIDE << sizeClass : (capacity + STREAM_ALIGNMENT - 1) & ~(STREAM_ALIGNMENT - 1);
+
+	// Size class strides are powers of two, which would put the same slot of every stream in the same
+	// cache set: writing one particle across all the streams then keeps evicting itself from L1.
+	// A cache line of padding staggers the streams.
+	stride += STREAM_PADDING;
+	size_t bytes = GetBlockBytes(stride);
+
+	// Keep the current block if it has the right size, so a reset doesn't touch the allocator.
+	if (m_memory == nullptr || stride != m_stride)
+	{
+		Release();
+
+		m_memory = AcquireBlock(sizeClass, bytes);
+		if (m_memory == nullptr)
+		{
+			return false;
+		}
+
+		m_stride = stride;
+		m_sizeClass = sizeClass;
+	}
+
+	// Carve the single block into one stream per attribute.
+	float* stream = (float*)m_memory;
+	#define PARTICLE_POOL_BIND_STREAM(name) name = stream; stream += m_stride;
+	PARTICLE_POOL_STREAMS(PARTICLE_POOL_BIND_STREAM)
+	#undef PARTICLE_POOL_BIND_STREAM
+	#define PARTICLE_POOL_BIND_OPTIONAL_STREAM(name) name = (optionalStreams & flag) != 0 ? stream : nullptr; stream += m_stride;
+	int flag = ComplexRotationStreams;
+	PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(PARTICLE_POOL_BIND_OPTIONAL_STREAM)
+	flag = InterpolationStreams;
+	PARTICLE_POOL_INTERPOLATION_STREAMS(PARTICLE_POOL_BIND_OPTIONAL_STREAM)
+	#undef PARTICLE_POOL_BIND_OPTIONAL_STREAM
+	expired = (int*)stream;
+	m_optionalStreams = optionalStreams;
+
+	memset(m_memory, 0, bytes);
+
+	m_capacity = capacity;
+	return true;
+}
+
+void ParticlePool::Release()
+{
+	if (m_memory)
+	{
+		ReleaseBlock(m_sizeClass, m_memory);
+		m_memory = nullptr;
+	}
+
+	#define PARTICLE_POOL_CLEAR_STREAM(name) name = nullptr;
+	PARTICLE_POOL_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	PARTICLE_POOL_INTERPOLATION_STREAMS(PARTICLE_POOL_CLEAR_STREAM)
+	#undef PARTICLE_POOL_CLEAR_STREAM
+	expired = nullptr;
+
+	m_capacity = 0;
+	m_stride = 0;
+	m_sizeClass = -1;
+	m_optionalStreams = 0;
+}
+
+void ParticlePool::TrimBlockCache()
+{
+	std::lock_guard<std::mutex> guard(blockCache.lock);
+
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; ++sizeClass)
+	{
+		while (blockCache.freeBlocks[sizeClass] != nullptr)
+		{
+			void* block = blockCache.freeBlocks[sizeClass];
+			blockCache.freeBlocks[sizeClass] = *(void**)block;
+			AlignedFree(block);
+		}
+	}
+}
+
+int ParticlePool::GetHeapAllocationCount()
+{
+	std::lock_guard<std::mutex> guard(blockCache.lock);
+	return blockCache.heapAllocations;
+}
+
+void ParticlePool::Move(int dst, int src)
+{
+	#define PARTICLE_POOL_MOVE_STREAM(name) name[dst] = name[src];
+	PARTICLE_POOL_STREAMS(PARTICLE_POOL_MOVE_STREAM)
+	if ((m_optionalStreams & ComplexRotationStreams) != 0)
+	{
+		PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(PARTICLE_POOL_MOVE_STREAM)
+	}
+	if ((m_optionalStreams & InterpolationStreams) != 0)
+	{
+		PARTICLE_POOL_INTERPOLATION_STREAMS(PARTICLE_POOL_MOVE_STREAM)
+	}
+	#undef PARTICLE_POOL_MOVE_STREAM
+}
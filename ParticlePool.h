@@ -0,0 +1,140 @@
+﻿#pragma once
+
+// Every per-particle attribute, in storage order.
+#define PARTICLE_POOL_STREAMS(X) \
+	X(positionX) X(positionY) \
+	X(velocityX) X(velocityY) \
+	X(red) X(green) X(blue) X(alpha) \
+	X(redDelta1) X(greenDelta1) X(blueDelta1) X(alphaDelta1) \
+	X(redDelta2) X(greenDelta2) X(blueDelta2) X(alphaDelta2) \
+	X(size) X(sizeDelta1) X(sizeDelta2) \
+	X(lifetime) X(halfLifeTime) \
+	X(radialAccel) X(tangentialAccel) \
+	X(rotation) X(rotateSpeed)
+
+// Attributes only bound when the pool is allocated for ParticleSystem::ComplexRotation, so the
+// passes that touch every stream don't pay for them otherwise.
+#define PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(X) \
+	X(rotationCos) X(rotationSin) \
+	X(rotationStepCos) X(rotationStepSin)
+
+// Attributes only bound for emitters with a fixed time step, which draw in between their last two steps.
+#define PARTICLE_POOL_INTERPOLATION_STREAMS(X) \
+	X(previousPositionX) X(previousPositionY) \
+	X(previousRed) X(previousGreen) X(previousBlue) X(previousAlpha) \
+	X(previousSize) X(previousLifetime)
+
+// Structure-of-arrays storage for the particles of one emitter.
+// Every attribute lives in its own contiguous array, so each pass over the particles
+// only streams the fields it actually reads or writes through the cache.
+// Live particles always occupy the range [0, count) of every array.
+struct ParticlePool
+{
+	ParticlePool();
+	~ParticlePool();
+
+	// Groups of attributes that are only bound when asked for, see Allocate.
+	enum OptionalStreams
+	{
+		ComplexRotationStreams = 1,	// PARTICLE_POOL_COMPLEX_ROTATION_STREAMS
+		InterpolationStreams = 2	// PARTICLE_POOL_INTERPOLATION_STREAMS
+	};
+
+	// (Re)allocate storage for at least 'capacity' particles. Existing particles are discarded.
+	// Storage is handed out in power-of-two size classes: if the current block already has the size
+	// class of 'capacity' it is cleared and reused in place, otherwise it is swapped for a block of the
+	// right class from a process-wide cache, so emitters that are reset, or created and retired
+	// repeatedly, don't go back to the heap once the cache is warm.
+	// The optional streams are nullptr unless their OptionalStreams flag is in 'optionalStreams'. Blocks
+	// always have room for them, so switching doesn't change the size class.
+	bool Allocate(int capacity, int optionalStreams);
+
+	// Return the storage to the block cache.
+	void Release();
+
+	// Free the cached blocks no pool is using, e.g. after a level is unloaded.
+	static void TrimBlockCache();
+
+	// Number of blocks allocated from the heap since startup, for profiling.
+	static int GetHeapAllocationCount();
+
+	// Copy every attribute of particle 'src' into slot 'dst'.
+	void Move(int dst, int src);
+
+	int GetCapacity() const { return m_capacity; }
+
+	float* positionX;
+	float* positionY;
+
+	float* velocityX;
+	float* velocityY;
+
+	// With ParticleSystem::EvaluateKeys the color and size streams hold the start, middle and end keys
+	// instead of the current value and the two deltas.
+	float* red;			// Current color value drawn
+	float* green;
+	float* blue;
+	float* alpha;
+
+	float* redDelta1;	// From Start to Middle
+	float* greenDelta1;
+	float* blueDelta1;
+	float* alphaDelta1;
+
+	float* redDelta2;	// From Middle to End
+	float* greenDelta2;
+	float* blueDelta2;
+	float* alphaDelta2;
+
+	float* size;
+	float* sizeDelta1;
+	float* sizeDelta2;
+
+	float* lifetime;
+	float* halfLifeTime;
+
+	float* radialAccel;
+	float* tangentialAccel;
+
+	float* rotation;	// direction (-/+) and current angle
+	float* rotateSpeed;	// Scalar value to change rotation value
+
+	// With ParticleSystem::ComplexRotation, the rotation as a unit complex number, and the one it is
+	// multiplied by every update: rotateSpeed times the time step, for the last time step.
+	float* rotationCos;
+	float* rotationSin;
+	float* rotationStepCos;
+	float* rotationStepSin;
+
+	// With a fixed time step, the position, color, size and lifetime as of the step before the last one,
+	// which the vertices are interpolated from.
+	float* previousPositionX;
+	float* previousPositionY;
+	float* previousRed;
+	float* previousGreen;
+	float* previousBlue;
+	float* previousAlpha;
+	float* previousSize;
+	float* previousLifetime;
+
+	// Scratch list of the slots whose lifetime ran out during the last update pass,
+	// in ascending order, so they can be compacted without rescanning the pool.
+	int* expired;
+
+	// Each stream is padded to a multiple of this many floats and aligned to 32 bytes,
+	// so wide loads/stores never straddle two streams.
+	static const int STREAM_ALIGNMENT = 8;
+
+	// Floats added to every stream, so streams don't start a multiple of 4 KB apart.
+	static const int STREAM_PADDING = 16;
+
+private:
+	ParticlePool(const ParticlePool&);
+	ParticlePool& operator=(const ParticlePool&);
+
+	void* m_memory;
+	int m_capacity;
+	int m_stride;		// floats per stream: capacity rounded up to the size class or to STREAM_ALIGNMENT, plus STREAM_PADDING
+	int m_sizeClass;	// -1 for blocks too large to be cached
+	int m_optionalStreams;	// OptionalStreams flags of the bound streams
+};
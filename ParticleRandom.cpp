@@ -0,0 +1,170 @@
+﻿#include "ParticleRandom.h"
+#include "ParticleSimd.h"
+#include <atomic>
+#include <string.h>
+
+namespace
+{
+	// 2^-24: the top 24 bits of a 32 bit number, scaled to [0, 1). Every value is exact in a float.
+	const float UNIT_SCALE = 1.0f / 16777216.0f;
+
+	// SplitMix32 (Steele, Lea and Flood), used to spread a seed over the state of all the lanes.
+	uint32_t SplitMix32(uint32_t& state)
+	{
+		uint32_t z = (state += 0x9E3779B9u);
+		z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+		z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+		return z ^ (z >> 16);
+	}
+
+	std::atomic<uint32_t> nextSeed(0);
+}
+
+ParticleRandom::ParticleRandom(uint32_t seed)
+{
+	Seed(seed);
+}
+
+void ParticleRandom::Seed(uint32_t seed)
+{
+	m_seed = seed;
+
+	uint32_t mix = seed;
+	for (int lane = 0; lane < LANES; ++lane)
+	{
+		for (int word = 0; word < 4; ++word)
+		{
+			m_state[word][lane] = SplitMix32(mix);
+		}
+
+		// xoshiro must not start from the all zero state.
+		if ((m_state[0][lane] | m_state[1][lane] | m_state[2][lane] | m_state[3][lane]) == 0)
+		{
+			m_state[0][lane] = 1;
+		}
+	}
+
+	m_next = BUFFER_SIZE;
+}
+
+uint32_t ParticleRandom::NewSeed()
+{
+	uint32_t counter = nextSeed++;
+	return SplitMix32(counter);
+}
+
+void ParticleRandom::FillRefilling(float* values, int count)
+{
+	while (count > 0)
+	{
+		if (m_next == BUFFER_SIZE)
+		{
+			Refill();
+		}
+
+		int available = BUFFER_SIZE - m_next;
+		int n = count < available ? count : available;
+		memcpy(values, m_buffer + m_next, sizeof(float) * n);
+
+		m_next += n;
+		values += n;
+		count -= n;
+	}
+}
+
+// xoshiro128+ (Blackman and Vigna) on every lane. Only the top 24 bits are kept, which skips the weak
+// low bits of the + scrambler.
+#if defined(PARTICLE_SIMD_AVX) || defined(PARTICLE_SIMD_SSE2)
+
+// AVX has no 256 bit integer operations, so both use SSE2 for the generator.
+void ParticleRandom::Refill()
+{
+	__m128i s0 = _mm_loadu_si128((const __m128i*)m_state[0]);
+	__m128i s1 = _mm_loadu_si128((const __m128i*)m_state[1]);
+	__m128i s2 = _mm_loadu_si128((const __m128i*)m_state[2]);
+	__m128i s3 = _mm_loadu_si128((const __m128i*)m_state[3]);
+	const __m128 scale = _mm_set1_ps(UNIT_SCALE);
+
+	for (int i = 0; i < BUFFER_SIZE; i += LANES)
+	{
+		__m128i result = _mm_add_epi32(s0, s3);
+		__m128i t = _mm_slli_epi32(s1, 9);
+
+		s2 = _mm_xor_si128(s2, s0);
+		s3 = _mm_xor_si128(s3, s1);
+		s1 = _mm_xor_si128(s1, s2);
+		s0 = _mm_xor_si128(s0, s3);
+		s2 = _mm_xor_si128(s2, t);
+		s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+		// Below 2^24, so the signed conversion is exact.
+		_mm_storeu_ps(m_buffer + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(result, 8)), scale));
+	}
+
+	_mm_storeu_si128((__m128i*)m_state[0], s0);
+	_mm_storeu_si128((__m128i*)m_state[1], s1);
+	_mm_storeu_si128((__m128i*)m_state[2], s2);
+	_mm_storeu_si128((__m128i*)m_state[3], s3);
+
+	m_next = 0;
+}
+
+#elif defined(PARTICLE_SIMD_NEON)
+
+void ParticleRandom::Refill()
+{
+	uint32x4_t s0 = vld1q_u32(m_state[0]);
+	uint32x4_t s1 = vld1q_u32(m_state[1]);
+	uint32x4_t s2 = vld1q_u32(m_state[2]);
+	uint32x4_t s3 = vld1q_u32(m_state[3]);
+	const float32x4_t scale = vdupq_n_f32(UNIT_SCALE);
+
+	for (int i = 0; i < BUFFER_SIZE; i += LANES)
+	{
+		uint32x4_t result = vaddq_u32(s0, s3);
+		uint32x4_t t = vshlq_n_u32(s1, 9);
+
+		s2 = veorq_u32(s2, s0);
+		s3 = veorq_u32(s3, s1);
+		s1 = veorq_u32(s1, s2);
+		s0 = veorq_u32(s0, s3);
+		s2 = veorq_u32(s2, t);
+		s3 = vorrq_u32(vshlq_n_u32(s3, 11), vshrq_n_u32(s3, 21));
+
+		vst1q_f32(m_buffer + i, vmulq_f32(vcvtq_f32_u32(vshrq_n_u32(result, 8)), scale));
+	}
+
+	vst1q_u32(m_state[0], s0);
+	vst1q_u32(m_state[1], s1);
+	vst1q_u32(m_state[2], s2);
+	vst1q_u32(m_state[3], s3);
+
+	m_next = 0;
+}
+
+#else
+
+void ParticleRandom::Refill()
+{
+	for (int i = 0; i < BUFFER_SIZE; i += LANES)
+	{
+		for (int lane = 0; lane < LANES; ++lane)
+		{
+			uint32_t result = m_state[0][lane] + m_state[3][lane];
+			uint32_t t = m_state[1][lane] << 9;
+
+			m_state[2][lane] ^= m_state[0][lane];
+			m_state[3][lane] ^= m_state[1][lane];
+			m_state[1][lane] ^= m_state[2][lane];
+			m_state[0][lane] ^= m_state[3][lane];
+			m_state[2][lane] ^= t;
+			m_state[3][lane] = (m_state[3][lane] << 11) | (m_state[3][lane] >> 21);
+
+			m_buffer[i + lane] = (float)(result >> 8) * UNIT_SCALE;
+		}
+	}
+
+	m_next = 0;
+}
+
+#endif
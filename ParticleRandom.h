@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <stdint.h>
+
+// Seedable random number generator owned by one emitter, replacing the CRT rand() and its hidden
+// global state. Four xoshiro128+ generators run side by side, one per SIMD lane, and fill a small
+// buffer of floats at a time, so drawing a number is usually just a load. The scalar build steps
+// the same four generators, so a seed gives the same numbers on every instruction set.
+//
+// Numbers come out in the same order whether they are drawn one at a time or with Fill, so the
+// same seed and the same sequence of draws always reproduce the same effect.
+class ParticleRandom
+{
+public:
+
+	explicit ParticleRandom(uint32_t seed);
+
+	// Restart the sequence of the seed.
+	void Seed(uint32_t seed);
+	uint32_t GetSeed() const { return m_seed; }
+
+	// Uniform random value in [0, 1).
+	float Next0To1()
+	{
+		if (m_next == BUFFER_SIZE)
+		{
+			Refill();
+		}
+		return m_buffer[m_next++];
+	}
+
+	// Uniform random value in [-1, 1).
+	float NextMinus1To1()
+	{
+		return 2.0f * Next0To1() - 1.0f;
+	}
+
+	// Same values as calling Next0To1 or NextMinus1To1 'count' times.
+	void Fill0To1(float* values, int count)
+	{
+		// Small batches usually fit in what is left of the buffer.
+		if (count <= BUFFER_SIZE - m_next)
+		{
+			const float* buffer = m_buffer + m_next;
+			for (int i = 0; i < count; ++i)
+			{
+				values[i] = buffer[i];
+			}
+			m_next += count;
+		}
+		else
+		{
+			FillRefilling(values, count);
+		}
+	}
+
+	void FillMinus1To1(float* values, int count)
+	{
+		Fill0To1(values, count);
+		for (int i = 0; i < count; ++i)
+		{
+			values[i] = 2.0f * values[i] - 1.0f;
+		}
+	}
+
+	// A different seed on every call, for emitters that aren't seeded explicitly.
+	static uint32_t NewSeed();
+
+private:
+
+	static const int LANES = 4;
+	static const int BUFFER_SIZE = 64;
+
+	void Refill();
+	void FillRefilling(float* values, int count);
+
+	uint32_t m_state[4][LANES];	// xoshiro128+ state word, then lane, so each word loads as one vector
+	uint32_t m_seed;
+	int m_next;
+	float m_buffer[BUFFER_SIZE];
+};
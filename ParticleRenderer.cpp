@@ -1,11 +1,16 @@
 ﻿#include "pch.h"
 #include "ParticleRenderer.h"
+#include "ParticleBudget.h"
+#include "ParticleStats.h"
 #include "Engine\Common\BasicMath.h"
 #include <math.h>
+#include <string.h>
 #include <DirectXColors.h>
 #include "DirectXHelper.h"
-#include <DDSTextureLoader.h>
 #include "Engine\Common\BasicLoader.h"
+#ifdef PARTICLE_USE_ATLAS
+#include "ParticleAtlas.h"
+#endif
 
 
 #include <Windows.h>
@@ -25,13 +30,11 @@ using namespace Windows::Foundation;
 using namespace Windows::UI::Core;
 using namespace LanguageGameWp8DxComponent;
 
-const float Y_OFFSCREEN_VALUE = -1.0f;
 const int X_INDEX = 0;
 const int Y_INDEX = 0;
 
 float SCALE_VALUES = 0.00875f;
 
-
 ParticleRenderer::ParticleRenderer(
 	Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice, 
 	Microsoft::WRL::ComPtr<ID3D11DeviceContext1> d3dContext,
@@ -40,24 +43,32 @@ ParticleRenderer::ParticleRenderer(
 
 	m_loadingComplete(Idle)
 	,m_indexCount(0)
-	,m_state(Paused)
+	,m_drawParticleCount(0)
+	,m_renderMode(QuadVertices)
 	,m_commonStates(nullptr)
 	,m_d3dDevice(d3dDevice)
 	,m_d3dContext(d3dContext)
 	,m_renderTargetView(renderTargetView)
 	,m_depthStencilView(depthStencilView)
 	,m_deletionRequested(false)
-	,m_isPartInfiniteLifetime(false)
-	,m_enableTextureRotation(false)
+	,m_batched(false)
+	,m_pipelined(false)
+	,m_pipeline(*this)
 {		
 	//==================================
 	// Setup calculated data, for optimizing
 	//==================================
-	m_sizeVertexType = sizeof(VertexType);
+	m_sizeVertexType = sizeof(ParticleVertex);
+
+	// Every emitter shares the particle budget; ParticleSystem leaves it when destroyed.
+	ParticleBudget::GetInstance().Add(this);
 }
 
 ParticleRenderer::~ParticleRenderer()
 {	
+	// The frame in flight uses the particles, which go away with ParticleSystem.
+	WaitForSimulation();
+
 	//OutputDebugString(L"~ParticleRenderer destructor called\n");
 	//Shutdown();
 }
@@ -65,47 +76,121 @@ ParticleRenderer::~ParticleRenderer()
 
 void ParticleRenderer::CreateDeviceResources()
 {
-	m_commonStates = new CommonStates(m_d3dDevice.Get());
+	// Owned by ParticleDeviceResources, which creates them once per device.
+	ParticleDeviceResources::GetInstance().SetDevice(m_d3dDevice);
+	m_commonStates = ParticleDeviceResources::GetInstance().GetCommonStates();
 	SetBlendStateId(m_blendStateId);
 	m_depthStencilState = m_commonStates->DepthDefault();
 
 	//==================================
-	// Load the texture that is used for the particles.
+	// Get the texture that is used for the particles; it may still be loading.
 	//==================================
-	bool isTextureLoaded = LoadTexture();
-	if (isTextureLoaded)
+	LoadTexture();
+	CreateResources();
+
+	m_loadingComplete = Loading;
+	UpdateLoadState();
+}
+
+void ParticleRenderer::UpdateLoadState()
+{
+	if (m_loadingComplete != Loading)
+	{
+		return;
+	}
+
+	ParticleTexture::State textureState = m_texture->GetState();
+	if (textureState == ParticleTexture::Ready)
 	{
-		CreateResources();
 		//OutputDebugString(L"FINAL!!!\n");
 		m_loadingComplete = Completed;
 	}
+	else if (textureState == ParticleTexture::Failed)
+	{
+		m_loadingComplete = Idle;
+	}
 }
 
 
 void ParticleRenderer::CreateWindowSizeDependentResources(float width, float height)
+{
+	ComputeViewProjection(width, height, m_constantBufferData);
+
+	// The emitter culls against the view from its next build on, which may be in flight.
+	ParticleBounds viewBounds;
+	ComputeViewBounds(m_constantBufferData, &viewBounds);
+	WaitForSimulation();
+	SetViewBounds(viewBounds);
+}
+
+void ParticleRenderer::ComputeViewProjection(float width, float height, ViewProjectionConstantBuffer& constantBufferData)
 {
 	// WVGA portrait: 768/480 = 1.60
 	float screenAspect = height / width; 
 	
 	// WORKS!
 	XMMATRIX tmpMatrix = XMMatrixSet(screenAspect, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
-	XMStoreFloat4x4(&m_constantBufferData.projection, tmpMatrix); 
+	XMStoreFloat4x4(&constantBufferData.projection, tmpMatrix); 
 		
 	// Finally create the view matrix from the three updated vectors.
 	XMVECTOR eye = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f);
 	XMVECTOR at = XMVectorSet(0.0f, 0.0f, 0.1f, 0.0f);
 	XMVECTOR up = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
-	XMStoreFloat4x4(&m_constantBufferData.view, XMMatrixLookAtRH(eye, at, up));	
+	XMStoreFloat4x4(&constantBufferData.view, XMMatrixLookAtRH(eye, at, up));	
+}
+
+void ParticleRenderer::ComputeViewBounds(const ViewProjectionConstantBuffer& constantBufferData, ParticleBounds* bounds)
+{
+	// The particles are drawn at z = 0, so the corners of the screen map back to the particle plane at
+	// the depth the plane's origin projects to.
+	XMMATRIX viewProjection = XMMatrixMultiply(XMLoadFloat4x4(&constantBufferData.view), XMLoadFloat4x4(&constantBufferData.projection));
+	XMMATRIX inverse = XMMatrixInverse(nullptr, viewProjection);
+	float depth = XMVectorGetZ(XMVector3TransformCoord(XMVectorZero(), viewProjection));
+
+	static const float CORNER_X[4] = { -1.0f, 1.0f, -1.0f, 1.0f };
+	static const float CORNER_Y[4] = { -1.0f, -1.0f, 1.0f, 1.0f };
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		XMVECTOR position = XMVector3TransformCoord(XMVectorSet(CORNER_X[corner], CORNER_Y[corner], depth, 1.0f), inverse);
+		float x = XMVectorGetX(position);
+		float y = XMVectorGetY(position);
+		if (corner == 0)
+		{
+			bounds->minX = bounds->maxX = x;
+			bounds->minY = bounds->maxY = y;
+			continue;
+		}
+
+		bounds->minX = x < bounds->minX ? x : bounds->minX;
+		bounds->minY = y < bounds->minY ? y : bounds->minY;
+		bounds->maxX = x > bounds->maxX ? x : bounds->maxX;
+		bounds->maxY = y > bounds->maxY ? y : bounds->maxY;
+	}
+}
+
+bool ParticleRenderer::IsReadyToDraw()
+{
+	// The frame in flight owns the particles; what gets drawn is the frame uploaded by the last Update.
+	if (IsSimulatedInBackground())
+	{
+		return m_loadingComplete == Completed && !m_deletionRequested && m_drawParticleCount > 0;
+	}
+
+	// Only draw the particles once they are loaded (loading is asynchronous).
+	return m_loadingComplete == Completed && !m_deletionRequested && m_state == Playing && GetParticleCount() > 0;
 }
 
 void ParticleRenderer::Render()
 {
-	// Only draw the cube once it is loaded (loading is asynchronous).
-	if (m_loadingComplete != Completed || m_deletionRequested || m_state != Playing)
+	// Batched emitters are drawn by ParticleBatchRenderer.
+	if (m_batched || !IsReadyToDraw() || m_drawParticleCount == 0)
 	{
 		return;
 	}
 
+	ParticleStageTimer timer(this, ParticleStageRender);
+	timer.SetParticles(m_drawParticleCount);
+
 	m_d3dContext->OMSetRenderTargets(
 		1,
 		m_renderTargetView.GetAddressOf(),
@@ -128,148 +213,79 @@ void ParticleRenderer::RenderParticleSystem()
 
 void ParticleRenderer::CreateResources()
 {
-	BasicLoader^ loader = ref new BasicLoader(m_d3dDevice.Get());
-
-    D3D11_INPUT_ELEMENT_DESC layoutDesc[] =
-    {
-        { "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-		{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 8, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-		{ "COLOR",    0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-    };
-    
-	OutputDebugString(L"1. Before VS\n");
-
-    loader->LoadShader(
-        L"ParticleVertexShader.cso",
-        layoutDesc,
-        ARRAYSIZE(layoutDesc),
-        &m_vertexShader,
-        &m_inputLayout
-        );
-
-	//OutputDebugString(L"2. Before PS\n");
+	// The shaders, input layout, constant buffer and static buffers are shared by every emitter.
+	ParticleDeviceResources& deviceResources = ParticleDeviceResources::GetInstance();
 
-	loader->LoadShader(
-        L"ParticlePixelShader.cso",
-        &m_pixelShader
-        );
-
-
-	//OutputDebugString(L"3. Const Buffer\n");
-
-	// Setup the description of the dynamic matrix constant buffer that is in the vertex shader.
-	D3D11_BUFFER_DESC matrixBufferDesc;
-	matrixBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
-	matrixBufferDesc.ByteWidth = sizeof(ViewProjectionConstantBuffer);
-	matrixBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-	matrixBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-	matrixBufferDesc.MiscFlags = 0;
-	matrixBufferDesc.StructureByteStride = 0;
-
-	DX::ThrowIfFailed(
-		m_d3dDevice->CreateBuffer(
-			&matrixBufferDesc,
-			nullptr,
-			&m_constantBuffer
-			)
-		);
+	ParticleDeviceResources::VertexFormat vertexFormat = ParticleDeviceResources::QuadVertexFormat;
+	if (m_renderMode == Instanced)
+	{
+		vertexFormat = ParticleDeviceResources::InstanceVertexFormat;
+	}
+	else if (m_renderMode == QuantizedVertices)
+	{
+		vertexFormat = ParticleDeviceResources::QuantizedVertexFormat;
+	}
 
-	//OutputDebugString(L"4. After Const Buffer\n");
+	deviceResources.GetVertexShader(vertexFormat, &m_vertexShader, &m_inputLayout);
+	m_pixelShader = deviceResources.GetPixelShader();
+	m_constantBuffer = deviceResources.GetConstantBuffer();
 
 	// Set the maximum number of vertices in the vertex array.
 	m_vertexCount = m_maxParticles * 4; // Change to 4, to render a quad with 4 vertices, // Use to be: 2 triangles with 3 vertices = 6;
+	m_sizeVertexType = (m_renderMode == QuantizedVertices) ? sizeof(ParticleQuantizedVertex) : sizeof(ParticleVertex);
+
+	if (m_renderMode == Instanced)
+	{
+		// One instance per particle, the quad comes from the corner buffer.
+		m_vertexCount = m_maxParticles;
+		m_sizeVertexType = sizeof(ParticleInstance);
+
+		m_cornerBuffer = deviceResources.GetCornerBuffer();
+	}
 
 	// Set the maximum number of indices in the index array.
 	m_indexCount = m_maxParticles * 6; // indices will determine which vertex will be used for a triangle to make up the quad, // Use to be: m_vertexCount;
 
-	// Create the vertex array for the particles that will be rendered.
-	m_vertices = new VertexType[m_vertexCount];
-	ASSERT_MSG(m_vertices != nullptr, L"Can't create the vertex array\n");
-		
-	if (m_vertices != nullptr)
+	// Nothing is drawn until UpdateBuffers writes the first live particles.
+	m_drawParticleCount = 0;
+
+	// The frames of the pipeline are built in the format of the new buffer, which starts empty.
+	ParticlePipeline::Format pipelineFormat = ParticlePipeline::QuadVertices;
+	if (m_renderMode == Instanced)
 	{
-		// Initialize vertex array to zeros at first.
-		m_totalSizeVertices = m_sizeVertexType * m_vertexCount;
-		memset(m_vertices, 0, m_totalSizeVertices);
-		D3D11_SUBRESOURCE_DATA vertexBufferData = {0};
-		vertexBufferData.pSysMem = m_vertices;
-		vertexBufferData.SysMemPitch = 0;
-		vertexBufferData.SysMemSlicePitch = 0;
-
-		int sizeOfMVertices = sizeof(m_vertices);
-		CD3D11_BUFFER_DESC vertexBufferDesc(
-			m_totalSizeVertices,			// byteWidth
-			D3D11_BIND_VERTEX_BUFFER,	// bindFlags
-			D3D11_USAGE_DYNAMIC,		// D3D11_USAGE usage = D3D11_USAGE_DEFAULT
-			D3D11_CPU_ACCESS_WRITE,		// cpuaccessFlags
-			0,							// miscFlags
-			0							// structureByteStride
-			);
-
-		//OutputDebugString(L"5. Before Vertex Buffer\n");
-
-		DX::ThrowIfFailed(
-			m_d3dDevice->CreateBuffer(
-				&vertexBufferDesc,
-				&vertexBufferData,
-				&m_vertexBuffer
-				)
-			);
+		pipelineFormat = ParticlePipeline::Instances;
 	}
-
-	unsigned short * indices = new unsigned short[m_indexCount];
-	ASSERT_MSG(indices != nullptr, L"Can't create the index array\n");
-
-	if (indices != nullptr)
+	else if (m_renderMode == QuantizedVertices)
 	{
-		// Initialize the index array.
-		unsigned short i6 = 0;
-		unsigned short i4 = 0;
-		for(unsigned short i = 0; i < m_maxParticles; ++i)
-		{
-			i6 = i*6;
-			i4 = i*4;
-			indices[i6+0] = i4+0;
-			indices[i6+1] = i4+1;
-			indices[i6+2] = i4+2;
-			indices[i6+3] = i4+0;
-			indices[i6+4] = i4+2;
-			indices[i6+5] = i4+3;
-		}
+		pipelineFormat = ParticlePipeline::QuantizedVertices;
+	}
+	m_pipeline.SetFormat(pipelineFormat);
+	m_pipeline.Clear();
 
-		// Set up the description of the static index buffer.
-		// Create the index array.
-		D3D11_BUFFER_DESC indexBufferDesc;
-		indexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-		indexBufferDesc.ByteWidth = sizeof(unsigned short) * m_indexCount;
-		indexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-		indexBufferDesc.CPUAccessFlags = 0;
-		indexBufferDesc.MiscFlags = 0;
-		indexBufferDesc.StructureByteStride = 0;
-
-		// Give the subresource structure a pointer to the index data.
-		D3D11_SUBRESOURCE_DATA indexData;		
-		indexData.pSysMem = indices;
-		indexData.SysMemPitch = 0;
-		indexData.SysMemSlicePitch = 0;
-
-		//OutputDebugString(L"6. Before Index Buffer\n");
-
-		// Create the index buffer.
-		DX::ThrowIfFailed(
-			m_d3dDevice->CreateBuffer(
-				&indexBufferDesc,
-				&indexData,
-				&m_indexBuffer
-				)
-			);
-		
-		// Release the index array since it is no longer needed.
-		delete [] indices;
-		indices = nullptr;
+	// The vertex buffer is sized for the maximum number of particles, but it is filled directly by
+	// UpdateBuffers with the live particles only, so it needs no initial data or CPU side copy.
+	m_totalSizeVertices = m_sizeVertexType * m_vertexCount;
+	CD3D11_BUFFER_DESC vertexBufferDesc(
+		m_totalSizeVertices,			// byteWidth
+		D3D11_BIND_VERTEX_BUFFER,	// bindFlags
+		D3D11_USAGE_DYNAMIC,		// D3D11_USAGE usage = D3D11_USAGE_DEFAULT
+		D3D11_CPU_ACCESS_WRITE,		// cpuaccessFlags
+		0,							// miscFlags
+		0							// structureByteStride
+		);
 
-	}
+	//OutputDebugString(L"5. Before Vertex Buffer\n");
+
+	DX::ThrowIfFailed(
+		m_d3dDevice->CreateBuffer(
+			&vertexBufferDesc,
+			nullptr,
+			&m_vertexBuffer
+			)
+		);
 
+	// Shared with the other emitters; sized for the largest of them.
+	m_indexBuffer = deviceResources.GetIndexBuffer(m_maxParticles);
 }
 
 int ParticleRenderer::GetIndexCount()
@@ -277,27 +293,23 @@ int ParticleRenderer::GetIndexCount()
 	return m_indexCount;
 }
 
-bool ParticleRenderer::LoadTexture()
+void ParticleRenderer::LoadTexture()
 {
-	HRESULT hr = S_OK;
-	
-	hr = CreateDDSTextureFromFile(m_d3dDevice.Get(), PARTICLE_TEXTURES[(int)m_particleEffect], nullptr, &m_textureView );
-
-	if (FAILED(hr))
-	{
-		OutputDebugString(L"FAILED to LoadTexture");
-	}
+	// The cache only reads the file the first time any emitter uses it.
+	m_texture = ParticleTextureCache::GetInstance().Acquire(m_d3dDevice, m_particleEffect);
 
-    return (hr == S_OK);	
+#ifdef PARTICLE_USE_ATLAS
+	// Map the quads into the effect's part of its atlas page.
+	const ParticleAtlasEntry& entry = PARTICLE_ATLAS_ENTRIES[(int)m_particleEffect];
+	ParticleTextureRect textureRect = { entry.left, entry.top, entry.right, entry.bottom };
+	SetTextureRect(textureRect);
+#endif
 }
 
 void ParticleRenderer::ReleaseTexture()
 {
-	// Release the texture object.
-	if(m_textureView != nullptr)
-	{	
-		m_textureView = nullptr;	
-	}
+	// Release our handle; the cache keeps the texture for other emitters until it is trimmed.
+	m_texture = nullptr;
 }
 
 bool ParticleRenderer::InitParticleProperties(
@@ -330,529 +342,139 @@ bool ParticleRenderer::InitParticleProperties(
 		bool enableTextureRotation
 		)
 {
-	//==================================
-	// Set Particle's Properties
-	//==================================
+	WaitForSimulation();
 	m_particleEffect = effectId;
-	m_startPosX = startPosX;
-	m_startPosY = startPosY;
-
-	// Set the random deviation of where the particles can be located when emitted.
-	m_startPosXVar = devPosX;
-	m_startPosYVar = devPosY;
-
-	// Set the maximsum number of particles allowed in the particle system.
-	m_maxParticles = maxNumParticles;
-
-	// Set the number of particles to emit per second.
-	m_emissionRate = numParticlesPerSec;
-
-	m_angle = angle;
-	m_angleVar = angleVar;
-
-	// Set the speed and speed variation of particles.
-	m_speed = speed; 
-	m_speedVar = speedVar;
+	m_blendStateId = blendState;
 
-	// Set the physical size of the particles.
-	m_startSize = startSize; 
-	m_startSizeVar = startSizeVar;
-	m_middleSize = middleSize; 
-	m_middleSizeVar = middleSizeVar;
-	m_endSize = endSize; 
-	m_endSizeVar = endSizeVar;
+	bool isReset = ParticleSystem::InitParticleProperties(
+		startPosX, startPosY,
+		devPosX, devPosY,
+		maxNumParticles,
+		numParticlesPerSec,
+		angle, angleVar,
+		speed, speedVar,
+		startSize, startSizeVar,
+		middleSize, middleSizeVar,
+		endSize, endSizeVar,
+		lifetime, lifetimeVar,
+		startRed, startGreen, startBlue, startAlpha,
+		startRedVar, startGreenVar, startBlueVar, startAlphaVar,
+		middleRed, middleGreen, middleBlue, middleAlpha,
+		middleRedVar, middleGreenVar, middleBlueVar, middleAlphaVar,
+		endRed, endGreen, endBlue, endAlpha,
+		endRedVar, endGreenVar, endBlueVar, endAlphaVar,
+		gravityX, gravityY,
+		radialAccel, radialAccelVar,
+		tangentialAccel, tangentialAccelVar,
+		duration,
+		autoPlay,
+		startTime,
+		rotationSpeed, rotationSpeedVar,
+		enableTextureRotation
+		);
 
-	if (lifetime < 0.0f)
-	{
-		m_isPartInfiniteLifetime = true;
-	}
-	else
+	if (!isReset)
 	{
-		m_isPartInfiniteLifetime = false;
+		OutputDebugString(L"Can't create particle list");
 	}
 
-	m_lifetime = abs(lifetime);
-	m_lifetimeVar = lifetimeVar;
-
-	// Set start, middle, and end colors
-	m_startRed = startRed;
-	m_startGreen = startGreen;
-	m_startBlue = startBlue;
-	m_startAlpha = startAlpha;
-	m_startRedVar = startRedVar;
-	m_startGreenVar = startGreenVar;
-	m_startBlueVar = startBlueVar;
-	m_startAlphaVar = startAlphaVar;
-	m_middleRed = middleRed;
-	m_middleGreen = middleGreen;
-	m_middleBlue = middleBlue;
-	m_middleAlpha = middleAlpha;
-	m_middleRedVar = middleRedVar;
-	m_middleGreenVar = middleGreenVar;
-	m_middleBlueVar = middleBlueVar;
-	m_middleAlphaVar = middleAlphaVar;
-	m_endRed = endRed;
-	m_endGreen = endGreen;
-	m_endBlue = endBlue;
-	m_endAlpha = endAlpha;
-	m_endRedVar = endRedVar;
-	m_endGreenVar = endGreenVar;
-	m_endBlueVar = endBlueVar;
-	m_endAlphaVar = endAlphaVar;
-
-	m_gravityX = gravityX;
-	m_gravityY = gravityY;
-
-	m_radialAccel = radialAccel;
-	m_radialAccelVar = radialAccelVar;
-
-	m_tangentialAccel = tangentialAccel;
-	m_tangentialAccelVar = tangentialAccelVar;
-
-	m_duration = duration;
-	
-	m_blendStateId = blendState;
-
-	ONE_OVER_EMISSIONRATE = 1.0f / m_emissionRate;
+	return true;
+}
 
-	if (autoPlay)
-	{
-		m_state = Playing;
-	}
-	else
+bool ParticleRenderer::InitParticleProperties(const ParticleEmitterRecord& record)
+{
+	if (record.effect >= (uint32_t)ParticleEffect::NumOfEffects || record.blendState >= (uint32_t)BlendStates::NumBlendStates)
 	{
-		m_state = Paused;
+		OutputDebugString(L"Particle effect record out of range");
+		return false;
 	}
 
-	m_startTime = startTime;
-
-	m_rotationSpeed = rotationSpeed;
-	m_rotationSpeedVar = rotationSpeedVar;
+	WaitForSimulation();
+	m_particleEffect = (ParticleEffect)record.effect;
+	m_blendStateId = (BlendStates)record.blendState;
 
-	m_enableTextureRotation = enableTextureRotation;
-	ResetParticles();
+	if (!ParticleSystem::InitParticleProperties(record))
+	{
+		OutputDebugString(L"Can't create particle list");
+	}
 
 	return true;
 }
 
 
-void ParticleRenderer::ShutdownParticleSystem()
-{
-	// Release the particle list.
-	if(m_particleList)
-	{
-		delete [] m_particleList;
-		m_particleList = nullptr;
-	}
-}
-
 void ParticleRenderer::ShutdownBuffers()
 {
-	// Release the index buffer.
-	if(m_indexBuffer)
-	{
-		m_indexBuffer.Get()->Release();
-		m_indexBuffer = nullptr;
-	}
-
-	// Release the vertex buffer.
-	if(m_vertexBuffer)
-	{
-		m_vertexBuffer.Get()->Release();
-		m_vertexBuffer = nullptr;
-	}
+	// Release our references; the index buffer is shared with the other emitters.
+	m_indexBuffer = nullptr;
+	m_vertexBuffer = nullptr;
 	
 }
 
 
-void ParticleRenderer::EmitParticles(float delta)
+bool ParticleRenderer::Update(float timeTotal, float timeDelta)
 {
-	m_accumulatedTime += delta;
+	// Sync point of the pipelined mode: the emitter can be read and changed again once the frame in
+	// flight is done.
+	WaitForSimulation();
 
-	if (m_startTime > 0.0f)
-	{
-		// Start playing a paused emitter after m_startTime has passed
-		if (m_accumulatedTime >= m_startTime)
-		{
-			m_state = Playing;
-		}
-		else
-		{
-			return;
-		}
-	}
-	else if ((m_duration < 0.0f) || (m_accumulatedTime < m_duration))	// If duration < 0, go into infinity mode, emit particles forever
+	if (m_deletionRequested)
 	{
-		m_state = Playing;
+		// Try to delete particles
+		Shutdown();
 	}
 	else
 	{
-		m_state = Finished;
-		return;
-	}
+		UpdateLoadState();
 
-	if (m_emissionRate > 0.0f) 
-	{
-		// emit new particles based on how much time has passed and the emission rate
-		float rate = ONE_OVER_EMISSIONRATE; //1.0 / m_emissionRate;
-		m_elapsedTimeSinceEmitParticle += delta;
-		while (		(m_currentParticleCount != m_maxParticles)
-				&&	(m_elapsedTimeSinceEmitParticle > rate) )
+		if (m_loadingComplete == Completed && IsSimulatedInBackground())
 		{
-			AddParticle();
-			m_elapsedTimeSinceEmitParticle -= rate;
+			// Draw the frame that just finished and simulate the next one while it renders. The state is
+			// read before the next frame starts, which then owns the emitter until the next Update.
+			UploadPipelinedFrame();
+			bool updating = IsParticlesUpdating();
+			m_pipeline.Start(timeDelta);
+			return updating;
 		}
-	}
-}
-
-void ParticleRenderer::AddParticle()
-{
-	// Now generate the randomized particle properties.
-	float positionX = m_startPosX + m_startPosXVar * RANDOM_MINUS1_1();
-	float positionY = m_startPosY + m_startPosYVar * RANDOM_MINUS1_1();
-		
-	float angle = m_angle + m_angleVar * RANDOM_MINUS1_1();
-	float speed = m_speed + m_speedVar * RANDOM_MINUS1_1();
-
-	float angleRad = DEGREES_TO_RADIANS(angle);
-	float velocityX = cosf(angleRad) * speed;
-	float velocityY = -sinf(angleRad) * speed;
-	
-	float red = m_startRed + m_startRedVar * RANDOM_MINUS1_1();
-	float green = m_startGreen + m_startGreenVar * RANDOM_MINUS1_1();
-	float blue = m_startBlue + m_startBlueVar * RANDOM_MINUS1_1();
-	float alpha = m_startAlpha + m_startAlphaVar * RANDOM_MINUS1_1();
-	red = clampf(red, 0.0f, 1.0f);	
-	green = clampf(red, 0.0f, 1.0f);	
-	blue = clampf(red, 0.0f, 1.0f);	
-	alpha = clampf(red, 0.0f, 1.0f);	
-
-	float radialAccel = m_radialAccel + m_radialAccelVar * RANDOM_0_1();
-	float tangentialAccel = m_tangentialAccel + m_tangentialAccelVar * RANDOM_0_1();
-	radialAccel = max(0.0f, radialAccel);
-	tangentialAccel = max(0.0f, tangentialAccel);
-
-	float lifetime = m_lifetime + m_lifetimeVar * RANDOM_0_1();
-	const float OVER_HALF_LIFETIME = 1.0f / (lifetime * 0.5f);
-
-	float startSize = m_startSize + m_startSizeVar * RANDOM_MINUS1_1();
-	float middleSize = m_middleSize + m_middleSizeVar * RANDOM_MINUS1_1();
-	float endSize = m_endSize + m_endSizeVar * RANDOM_MINUS1_1();
-	startSize = max(startSize, 0.0f);
-	middleSize = max(middleSize, 0.0f);
-	endSize = max(endSize, 0.0f);
-	
-	float deltaSize1 = 0.0f;
-	float deltaSize2 = 0.0f;
 
-	if (m_startSize != m_middleSize) 
-	{
-		deltaSize1  = (middleSize - startSize) * OVER_HALF_LIFETIME;
-	}
-	if (m_endSize != m_middleSize) 
-	{
-		deltaSize2  = (endSize - middleSize) * OVER_HALF_LIFETIME;
-	}
-
-	float startR = m_startRed + m_startRedVar * RANDOM_MINUS1_1();
-	float startG = m_startGreen + m_startGreenVar * RANDOM_MINUS1_1();
-	float startB = m_startBlue + m_startBlueVar * RANDOM_MINUS1_1();
-	float startA = m_startAlpha + m_startAlphaVar * RANDOM_MINUS1_1();
-
-	// if there is no middle or end color, then the particle will end up staying at startColor the whole time
-	float middleR = startR;
-	float middleG = startG;
-	float middleB = startB;
-	float middleA = startA;
-
-	float endR = startR;
-	float endG = startG;
-	float endB = startB;
-	float endA = startA;
-
-	float deltaR1 = 0.0f;
-	float deltaG1 = 0.0f;
-	float deltaB1 = 0.0f;
-	float deltaA1 = 0.0f;
-	float deltaR2 = 0.0f;
-	float deltaG2 = 0.0f;
-	float deltaB2 = 0.0f;
-	float deltaA2 = 0.0f;
-
-	if (	m_startRed != m_middleRed 
-		||	m_startGreen != m_middleGreen 
-		||	m_startBlue != m_middleBlue 
-		||	m_startAlpha != m_middleAlpha) 
-	{
-		middleR = m_middleRed + m_middleRedVar * RANDOM_MINUS1_1();
-		middleG = m_middleGreen + m_middleGreenVar * RANDOM_MINUS1_1();
-		middleB = m_middleBlue + m_middleBlueVar * RANDOM_MINUS1_1();
-		middleA = m_middleAlpha + m_middleAlphaVar * RANDOM_MINUS1_1();
-
-		deltaR1 = (middleR - startR) * OVER_HALF_LIFETIME;
-		deltaG1 = (middleG - startG) * OVER_HALF_LIFETIME;
-		deltaB1 = (middleB - startB) * OVER_HALF_LIFETIME;
-		deltaA1 = (middleA - startA) * OVER_HALF_LIFETIME;
-	}
-
-	if (	m_middleRed != m_endRed 
-		||	m_middleGreen != m_endGreen 
-		||	m_middleBlue != m_endBlue 
-		||	m_middleAlpha != m_endAlpha) 
-	{
-		endR = m_endRed + m_endRedVar * RANDOM_MINUS1_1();
-		endG = m_endGreen + m_endGreenVar * RANDOM_MINUS1_1();
-		endB = m_endBlue + m_endBlueVar * RANDOM_MINUS1_1();
-		endA = m_endAlpha + m_endAlphaVar * RANDOM_MINUS1_1();
-	
-		deltaR2 = (endR - middleR) * OVER_HALF_LIFETIME;
-		deltaG2 = (endG - middleG) * OVER_HALF_LIFETIME;
-		deltaB2 = (endB - middleB) * OVER_HALF_LIFETIME;
-		deltaA2 = (endA - middleA) * OVER_HALF_LIFETIME;
-	}
-	
-	// rotation
-	float rotationSpeed = m_rotationSpeed + m_rotationSpeedVar* RANDOM_MINUS1_1();
-	rotationSpeed = DEGREES_TO_RADIANS(rotationSpeed);
-
-	int index = m_currentParticleCount;
-	++m_currentParticleCount;
-	m_particleList[index].positionX = positionX;
-	m_particleList[index].positionY = positionY;	
-
-	m_particleList[index].red       = startR;
-	m_particleList[index].green     = startG;
-	m_particleList[index].blue      = startB;
-	m_particleList[index].alpha		= startA;
-
-	m_particleList[index].redDelta1	= deltaR1;
-	m_particleList[index].greenDelta1     = deltaG1;
-	m_particleList[index].blueDelta1      = deltaB1;
-	m_particleList[index].alphaDelta1      = deltaA1;
-	
-	m_particleList[index].redDelta2	= deltaR2;
-	m_particleList[index].greenDelta2     = deltaG2;
-	m_particleList[index].blueDelta2      = deltaB2;
-	m_particleList[index].alphaDelta2      = deltaA2;
-	
-	m_particleList[index].velocityX  = velocityX;
-	m_particleList[index].velocityY  = velocityY;
-
-	m_particleList[index].size		= startSize;
-	m_particleList[index].sizeDelta1 = deltaSize1;
-	m_particleList[index].sizeDelta2 = deltaSize2;
-	
-	m_particleList[index].lifetime  = lifetime;
-	m_particleList[index].halfLifeTime  = lifetime * 0.5f;
-	m_particleList[index].active    = true;
-	m_particleList[index].radialAccel    = radialAccel;
-	m_particleList[index].tangentialAccel    = tangentialAccel;
-
-	if (m_enableTextureRotation)
-	{
-		m_particleList[index].rotation = angleRad; // rotate the texture in this direction, so the particle will move in this direction.
-	}
-	else
-	{
-		m_particleList[index].rotation = 0.0f;
-	}
-
-	m_particleList[index].rotateSpeed = rotationSpeed;
-
-}
-
-
-void ParticleRenderer::UpdateParticles(float delta)
-{
-	// Each frame we update all the particles by making them move downwards using their position, velocity, and the frame time.
-	for(int i = 0; i < m_currentParticleCount; ++i)
-	{
-		ParticleType *particle = &m_particleList[i];
-		if (!m_isPartInfiniteLifetime) 
+		if (m_loadingComplete == Completed)
 		{
-			particle->lifetime -= delta; 
-			if (particle->lifetime > 0.0f)
-			{
-				UpdateParticle(delta, particle);
-			}
+			// Only draw the particles once it is loaded (loading is asynchronous).
+			Frame(timeTotal, timeDelta);
 		}
-		else
-		{
-			particle->lifetime -= delta; 
-			if (particle->lifetime > 0.0f)
-			{
-				UpdateParticle(delta, particle);				
-			}
-			else
-			{
-				//DBOUT("RESTART: " << particle->red << ", " << particle->green << ", " << particle->blue << ", " << particle->alpha << "\r\n");
-					
-				// Ran out of time on previous particle, but continue to update particle by resetting lifetime
-				// back to original time
-				particle->lifetime = particle->halfLifeTime * 2.0f;
-
-				float temp = -particle->sizeDelta2;
-				particle->sizeDelta2 = -particle->sizeDelta1;
-				particle->sizeDelta1 = temp;
-
-				temp = -particle->redDelta2;
-				particle->redDelta2 = -particle->redDelta1;
-				particle->redDelta1 = temp;
-
-				temp = -particle->greenDelta2;
-				particle->greenDelta2 = -particle->greenDelta1;
-				particle->greenDelta1 = temp;
-
-				temp = -particle->blueDelta2;
-				particle->blueDelta2 = -particle->blueDelta1;
-				particle->blueDelta1 = temp;
-
-				temp = -particle->alphaDelta2;
-				particle->alphaDelta2 = -particle->alphaDelta1;
-				particle->alphaDelta1 = temp;
-
-				UpdateParticle(delta, particle);
-			}
-		}		
-	}
-}
-
-void ParticleRenderer::UpdateParticle(float delta, ParticleType *particle)
-{
-	// temp storage
-	float forcesX = 0.0f;
-	float forcesY = 0.0f;
-	float radialX = 0.0f;
-	float radialY = 0.0f;
-	float tangentialX = 0.0f;
-	float tangentialY = 0.0f;
-
-	// dont apply radial forces until moved away from the emitter
-	if ((particle->positionX != m_startPosX || particle->positionY != m_startPosY) 
-		&& (m_radialAccel > 0.0f || m_tangentialAccel > 0.0f)) 
-	{
-		radialX = particle->positionX - m_startPosX;
-		radialY = particle->positionY - m_startPosY;
-
-		// normalize
-		float length = sqrtf(radialX * radialX + radialY * radialY);
-		radialX /= length;
-		radialY /= length;
-	}
-
-	tangentialX = radialX;
-	tangentialY = radialY;
-
-	radialX *= particle->radialAccel;
-	radialY *= particle->radialAccel;
-
-	float newy = tangentialX;
-	tangentialX = -tangentialY;
-	tangentialY = newy;
-
-	tangentialX *= particle->tangentialAccel;
-	tangentialY *= particle->tangentialAccel;
-
-	forcesX = radialX + tangentialX + m_gravityX;
-	forcesY = radialY + tangentialY + m_gravityY;
-
-	forcesX *= delta;
-	forcesY *= delta;
-
-	particle->velocityX += forcesX;
-	particle->velocityY += forcesY;
-
-	particle->positionX += particle->velocityX * delta;
-	particle->positionY += particle->velocityY * delta;
-
-	if (particle->lifetime >= particle->halfLifeTime)
-	{
-		particle->red += clampf(particle->redDelta1 * delta, -1.0f, 1.0f);
-		particle->green += clampf(particle->greenDelta1 * delta, -1.0f, 1.0f);
-		particle->blue += clampf(particle->blueDelta1 * delta, -1.0f, 1.0f);
-		particle->alpha += clampf(particle->alphaDelta1 * delta, -1.0f, 1.0f);
-
-		particle->size += (particle->sizeDelta1 * delta);
 	}
-	else
-	{
-		particle->red += clampf(particle->redDelta2 * delta, -1.0f, 1.0f);
-		particle->green += clampf(particle->greenDelta2 * delta, -1.0f, 1.0f);
-		particle->blue += clampf(particle->blueDelta2 * delta, -1.0f, 1.0f);
-		particle->alpha += clampf(particle->alphaDelta2 * delta, -1.0f, 1.0f);
-
-		particle->size += (particle->sizeDelta2 * delta);			
-	}
-
-	particle->red = clampf(particle->red, 0.0f, 1.0f);
-	particle->green = clampf(particle->green, 0.0f, 1.0f);
-	particle->blue = clampf(particle->blue, 0.0f, 1.0f);
-	particle->alpha = clampf(particle->alpha, 0.0f, 1.0f);
-
-	particle->size = max(0, particle->size);
 
-	// Continuous rotation in a circle based on speed in radians
-	particle->rotation += (particle->rotateSpeed * delta);
-	if (particle->rotation > TWO_PI_F)
-	{
-		particle->rotation -= TWO_PI_F;
-	}
+	return IsParticlesUpdating();
 }
 
-void ParticleRenderer::KillParticles()
+bool ParticleRenderer::IsSimulatedInBackground()
 {
-	// Kill all the particles that have gone below a certain height range.
-	int i = 0;
-	while (i < m_maxParticles)
-	{
-		if(m_particleList != nullptr && (m_particleList[i].active == true) && (m_particleList[i].lifetime <= 0.0f))
-		{
-			m_particleList[i].active = false;
-			--m_currentParticleCount;
-			
-			// Swap the last particle to the newly inactive particle at index i
-			m_particleList[i] = m_particleList[m_currentParticleCount];
-			m_particleList[m_currentParticleCount].active = false;
-
-			// Don't increment i, as we need to next check this newly swapped in particle at i
-		}
-		else
-		{
-			++i;
-		}
-	}
-
+	return m_pipelined && !m_batched;
 }
 
-bool ParticleRenderer::Update(float timeTotal, float timeDelta)
+void ParticleRenderer::UploadPipelinedFrame()
 {
-	if (m_deletionRequested)
+	if (m_pipeline.Swap() && m_pipeline.GetFrontCount() > 0)
 	{
-		// Try to delete particles
-		Shutdown();
-	}
-	else if (m_loadingComplete == Completed)
-	{
-		// Only draw the particles once it is loaded (loading is asynchronous).
-		Frame(timeTotal, timeDelta);		
+		// The frame was built in the vertex buffer's format, so it is copied as is.
+		ParticleStageTimer timer(this, ParticleStageUpload);
+		timer.SetParticles(m_pipeline.GetFrontCount());
+		timer.SetBytes(m_pipeline.GetFrontBytes());
+
+		D3D11_MAPPED_SUBRESOURCE mappedResource;
+		DX::ThrowIfFailed(m_d3dContext->Map(m_vertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
+		memcpy(mappedResource.pData, m_pipeline.GetFrontBuffer(), m_pipeline.GetFrontBytes());
+		m_d3dContext->Unmap(m_vertexBuffer.Get(), 0);
 	}
 
-	return IsParticlesUpdating();
+	// Same condition as IsReadyToDraw without the pipeline.
+	m_drawParticleCount = m_state == Playing ? m_pipeline.GetFrontCount() : 0;
 }
 
 void ParticleRenderer::Frame(float frameTime, float deltaTime)
 {
-	// Release old particles.
-	KillParticles();
-	
-	// Emit new particles.
-	if (m_state == Playing)
+	// Emit, move and kill the particles. Batched emitters have their vertices built by ParticleBatchRenderer instead.
+	if (Simulate(deltaTime) && !m_batched)
 	{
-		EmitParticles(deltaTime);
-
-		// Update the position of the particles.
-		UpdateParticles(deltaTime);
-
 		// Update the dynamic vertex buffer with the new position of each particle.
 		UpdateBuffers();	
 	}	
@@ -860,112 +482,45 @@ void ParticleRenderer::Frame(float frameTime, float deltaTime)
 
 bool ParticleRenderer::UpdateBuffers()
 {
-	// Initialize vertex array to zeros at first.
-	memset(m_vertices, 0, m_totalSizeVertices);
-
-	// Now build the vertex array from the particle list array.  Each particle is a quad made out of two triangles.
-	int index = 0;
-	XMFLOAT4 color;
-	for(int i = 0; i < m_currentParticleCount; ++i)
+	// Nothing to upload or draw when no particle is alive, or all of them are offscreen.
+	if (GetParticleCount() == 0 || IsOffscreen())
 	{
-		ParticleType particle = m_particleList[i];
-		color = XMFLOAT4(particle.red, particle.green, particle.blue, particle.alpha);
-
-		if (!m_enableTextureRotation)
-		{
-			// Draw a Quad with position, texture, and color
-			// Bottom right.
-			m_vertices[index].position =  XMFLOAT2(particle.positionX + particle.size, particle.positionY - particle.size);
-			m_vertices[index].texture =  XMFLOAT2(1.0f, 1.0f);
-			m_vertices[index].color = color;
-			index++;
-
-			// Bottom left.
-			m_vertices[index].position = XMFLOAT2(particle.positionX - particle.size, particle.positionY - particle.size);
-			m_vertices[index].texture =  XMFLOAT2(0.0f, 1.0f);
-			m_vertices[index].color = color;
-			index++;
-				
-			// Top left.
-			m_vertices[index].position =  XMFLOAT2(particle.positionX - particle.size, particle.positionY + particle.size);
-			m_vertices[index].texture =  XMFLOAT2(0.0f, 0.0f);
-			m_vertices[index].color = color;
-			index++;
-		
-			// Top right.
-			m_vertices[index].position =  XMFLOAT2(particle.positionX + particle.size, particle.positionY + particle.size);
-			m_vertices[index].texture =  XMFLOAT2(1.0f, 0.0f);
-			m_vertices[index].color = color;
-			index++;
-		}
-		else
-		{
-			// Code from Cocos2dx CCParticleSystemQuad.cpp updateQuadWithParticle()
-			float size_2 = particle.size;
-			float x1 = -size_2;
-			float y1 = -size_2;
-
-			float x2 = size_2;
-			float y2 = size_2;
-			float x = particle.positionX;
-			float y = particle.positionY;
-
-			float r = (float)-(particle.rotation);
-			float cr = cosf(r);
-			float sr = sinf(r);
-			float ax = x1 * cr - y1 * sr + x;
-			float ay = x1 * sr + y1 * cr + y;
-			float bx = x2 * cr - y1 * sr + x;
-			float by = x2 * sr + y1 * cr + y;
-			float cx = x2 * cr - y2 * sr + x;
-			float cy = x2 * sr + y2 * cr + y;
-			float dx = x1 * cr - y2 * sr + x;
-			float dy = x1 * sr + y2 * cr + y;
-
-			// Bottom right.
-			m_vertices[index].position =  XMFLOAT2(bx, by);
-			m_vertices[index].texture =  XMFLOAT2(1.0f, 1.0f);
-			m_vertices[index].color = color;
-			index++;
-
-			// Bottom left.
-			m_vertices[index].position = XMFLOAT2(ax, ay);
-			m_vertices[index].texture =  XMFLOAT2(0.0f, 1.0f);
-			m_vertices[index].color = color;
-			index++;
-				
-			// Top left.
-			m_vertices[index].position =  XMFLOAT2(dx, dy);
-			m_vertices[index].texture =  XMFLOAT2(0.0f, 0.0f);
-			m_vertices[index].color = color;
-			index++;
-		
-			// Top right.
-			m_vertices[index].position =  XMFLOAT2(cx, cy);
-			m_vertices[index].texture =  XMFLOAT2(1.0f, 0.0f);
-			m_vertices[index].color = color;
-			index++;
-		}
-		
+		m_drawParticleCount = 0;
+		return true;
 	}
 
-	DirectX::XMMATRIX sample = XMMatrixIdentity();
-
+	ParticleStageTimer timer(this, ParticleStageUpload);
 
 	D3D11_MAPPED_SUBRESOURCE mappedResource;	
 	
 	// Lock the vertex buffer.
 	DX::ThrowIfFailed(m_d3dContext->Map(m_vertexBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
 
-	// Get a pointer to the data in the vertex buffer.
-	VertexType * verticesPtr = (VertexType*)mappedResource.pData;
+	if (m_renderMode == Instanced)
+	{
+		// One compact record per live particle, the vertex shader expands it into a quad.
+		m_drawParticleCount = BuildInstances((ParticleInstance*)mappedResource.pData);
+	}
+	else if (m_renderMode == QuantizedVertices)
+	{
+		m_drawParticleCount = BuildQuantizedVertices((ParticleQuantizedVertex*)mappedResource.pData) / 4;
+	}
+	else
+	{
+		// Get a pointer to the data in the vertex buffer.
+		ParticleVertex * verticesPtr = (ParticleVertex*)mappedResource.pData;
 
-	// Copy the data into the vertex buffer.
-	memcpy(verticesPtr, (void*)m_vertices, m_totalSizeVertices);
+		// Build the quads of the live particles straight into the vertex buffer. Each particle is a quad made out of two triangles.
+		m_drawParticleCount = BuildVertices(verticesPtr) / 4;
+	}
 
 	// Unlock the vertex buffer.
 	m_d3dContext->Unmap(m_vertexBuffer.Get(), 0);
 
+	// The particles culled against the view are left out.
+	timer.SetParticles(m_drawParticleCount);
+	timer.SetBytes((size_t)m_drawParticleCount * (m_renderMode == Instanced ? 1 : 4) * m_sizeVertexType);
+
 	return true;
 }
 
@@ -979,6 +534,9 @@ void ParticleRenderer::SetShaderParameters()
 	dataPtr = (ViewProjectionConstantBuffer*)mappedResource.pData;
 	dataPtr->view = m_constantBufferData.view;
 	dataPtr->projection = m_constantBufferData.projection;
+
+	const ParticleTextureRect& textureRect = GetTextureRect();
+	dataPtr->textureRect = XMFLOAT4(textureRect.left, textureRect.top, textureRect.right, textureRect.bottom);
 	
 	m_d3dContext->Unmap(m_constantBuffer.Get(), 0);
 
@@ -986,7 +544,8 @@ void ParticleRenderer::SetShaderParameters()
 	m_d3dContext->VSSetConstantBuffers(0, 1, m_constantBuffer.GetAddressOf() );
 
 	// Set shader texture resource in the pixel shader.
-	m_d3dContext->PSSetShaderResources(0, 1, m_textureView.GetAddressOf());	
+	ID3D11ShaderResourceView* textureView = m_texture->GetView();
+	m_d3dContext->PSSetShaderResources(0, 1, &textureView);
 }
 
 void ParticleRenderer::RenderParticleShader()
@@ -1013,8 +572,26 @@ void ParticleRenderer::RenderParticleShader()
 	auto samplerState = m_commonStates->LinearWrap();
     m_d3dContext->PSSetSamplers(0, 1, &samplerState);
 
-	// Render the triangle.
-	m_d3dContext->DrawIndexed(m_indexCount, 0, 0);
+	// Render the quads of the live particles only, 6 indices per quad.
+	if (m_renderMode == Instanced)
+	{
+		m_d3dContext->DrawIndexedInstanced(6, m_drawParticleCount, 0, 0, 0);
+	}
+	else
+	{
+		// 16 bit indices address at most MAX_INDEXED_QUADS quads, so larger emitters are drawn in chunks
+		// of that many, each with its first vertex as the base vertex.
+		for (int first = 0; first < m_drawParticleCount; first += ParticleDeviceResources::MAX_INDEXED_QUADS)
+		{
+			int count = m_drawParticleCount - first;
+			if (count > ParticleDeviceResources::MAX_INDEXED_QUADS)
+			{
+				count = ParticleDeviceResources::MAX_INDEXED_QUADS;
+			}
+
+			m_d3dContext->DrawIndexed(count * 6, 0, first * 4);
+		}
+	}
 }
 
 void ParticleRenderer::RenderBuffers()
@@ -1024,7 +601,18 @@ void ParticleRenderer::RenderBuffers()
 	unsigned int offset = 0;
     
 	// Set the vertex buffer to active in the input assembler so it can be rendered.
-	m_d3dContext->IASetVertexBuffers(0, 1, m_vertexBuffer.GetAddressOf(), &stride, &offset);
+	if (m_renderMode == Instanced)
+	{
+		// The first quad of the index buffer indexes the corner buffer, the instances step once per quad.
+		ID3D11Buffer* buffers[2] = { m_cornerBuffer.Get(), m_vertexBuffer.Get() };
+		unsigned int strides[2] = { sizeof(ParticleCorner), stride };
+		unsigned int offsets[2] = { 0, 0 };
+		m_d3dContext->IASetVertexBuffers(0, 2, buffers, strides, offsets);
+	}
+	else
+	{
+		m_d3dContext->IASetVertexBuffers(0, 1, m_vertexBuffer.GetAddressOf(), &stride, &offset);
+	}
 
     // Set the index buffer to active in the input assembler so it can be rendered.
     m_d3dContext->IASetIndexBuffer(m_indexBuffer.Get(), DXGI_FORMAT_R16_UINT, 0);
@@ -1035,10 +623,11 @@ void ParticleRenderer::RenderBuffers()
 
 void ParticleRenderer::Shutdown()
 {
+	WaitForSimulation();
 	m_state = Finished;
 	
-	// only delete if completed loading.
-	if (m_loadingComplete == Completed)
+	// only delete if loading was started.
+	if (m_loadingComplete == Completed || m_loadingComplete == Loading)
 	{
 		OutputDebugString(L"Shutdown\n");
 
@@ -1064,6 +653,7 @@ void ParticleRenderer::Shutdown()
 void ParticleRenderer::ForceShutdown()
 {
 	OutputDebugString(L"ForceShutdown\n");
+	WaitForSimulation();
 	m_state = Finished;
 	
 	// Release the buffers.
@@ -1083,118 +673,114 @@ void ParticleRenderer::ForceShutdown()
 	
 }
 
-void ParticleRenderer::ResetParticles()
+ParticleEffect ParticleRenderer::GetParticleEffectId()
 {
-	m_elapsedTimeSinceEmitParticle = 0.0f;
-	m_accumulatedTime = 0.0f;	
-
-	// Initialize the current particle count to zero since none are emitted yet.
-	m_currentParticleCount = 0;
-
-	ShutdownParticleSystem();
+	return m_particleEffect;
+}
 
-	m_particleList = new ParticleType[m_maxParticles];
-	if(!m_particleList)
+void ParticleRenderer::SetParticleEffectId(ParticleEffect effectId)
+{
+	if (m_particleEffect != effectId)
 	{
-		OutputDebugString(L"Can't create particle list");
-		assert(true);
-	}
+		m_particleEffect = effectId;
 
-	// Initialize the particle list.
-	for (int i = 0; i < m_maxParticles; ++i)
-	{
-		m_particleList[i].active = false;
+		// Only the texture depends on the effect. Wait for the new one before drawing again; with a
+		// preloaded texture that is immediate.
+		if (m_loadingComplete == Loading || m_loadingComplete == Completed)
+		{
+			LoadTexture();
+			m_loadingComplete = Loading;
+			UpdateLoadState();
+		}
 	}
-
 }
 
-float ParticleRenderer::GetDuration()
+void ParticleRenderer::SetMaxParticles(int var, bool reload)
 {
-	return m_duration;
+	WaitForSimulation();
+	ParticleSystem::SetMaxParticles(var);
+
+	if (reload)
+	{
+		m_loadingComplete = Idle;
+		m_state = Playing;
+		if (!ResetParticles())
+		{
+			OutputDebugString(L"Can't create particle list");
+		}
+		CreateDeviceResources();
+	}
 }
 
-void ParticleRenderer::SetDuration(float var)
+ParticleRenderer::RenderMode ParticleRenderer::GetRenderMode()
 {
-	m_duration = var;
-	m_elapsedTimeSinceEmitParticle = 0.0f;
-	m_accumulatedTime = 0.0f;
-	m_state = Playing;
+	return m_renderMode;
 }
 
-int ParticleRenderer::GetEmissionRate()
+void ParticleRenderer::SetRenderMode(RenderMode mode)
 {
-	return m_emissionRate;
+	WaitForSimulation();
+	if (m_renderMode != mode)
+	{
+		m_renderMode = mode;
+
+		// The input layout, vertex shader and buffers depend on the mode.
+		if (m_loadingComplete == Completed || m_loadingComplete == Loading)
+		{
+			m_loadingComplete = Idle;
+			CreateDeviceResources();
+		}
+	}
 }
 
-void ParticleRenderer::SetEmissionRate(int var)
+void ParticleRenderer::SetBatched(bool value)
 {
-	m_emissionRate = var;
-	ONE_OVER_EMISSIONRATE = 1.0f / m_emissionRate;
+	WaitForSimulation();
+	m_batched = value;
+	m_drawParticleCount = 0;
+	m_pipeline.Clear();
 }
 
-float ParticleRenderer::GetLifetime()
+bool ParticleRenderer::IsBatched()
 {
-	if (m_isPartInfiniteLifetime)
-	{
-		return -m_lifetime;
-	}
-
-	return m_lifetime;
+	return m_batched;
 }
-void ParticleRenderer::SetLifetime(float var)
+
+void ParticleRenderer::SetPipelined(bool value)
 {
-	if (var < 0.0f)
+	if (m_pipelined != value)
 	{
-		m_isPartInfiniteLifetime = true;
+		// The vertex buffer is refilled by the next Update, in either mode.
+		WaitForSimulation();
+		m_pipelined = value;
+		m_drawParticleCount = 0;
+		m_pipeline.Clear();
 	}
-	else
-	{
-		m_isPartInfiniteLifetime = false;
-	}
-
-	m_lifetime = abs(var);
 }
 
-float ParticleRenderer::GetStartTime()
-{
-	return m_startTime;
-}
-void ParticleRenderer::SetStartTime(float var)
+bool ParticleRenderer::IsPipelined()
 {
-	m_accumulatedTime = 0.0f; // reset
-	m_startTime = var;
+	return m_pipelined;
 }
 
-ParticleEffect ParticleRenderer::GetParticleEffectId()
+void ParticleRenderer::WaitForSimulation()
 {
-	return m_particleEffect;
+	m_pipeline.Wait();
 }
 
-void ParticleRenderer::SetParticleEffectId(ParticleEffect effectId)
+ID3D11ShaderResourceView* ParticleRenderer::GetTextureView()
 {
-	if (m_particleEffect != effectId)
-	{
-		m_particleEffect = effectId;
-		CreateDeviceResources();
-	}
+	return m_texture != nullptr ? m_texture->GetView() : nullptr;
 }
 
-int ParticleRenderer::GetMaxParticles()
+int ParticleRenderer::GetTextureKey()
 {
-	return m_maxParticles;
+	return ParticleTextureCache::GetTextureKey(m_particleEffect);
 }
 
-void ParticleRenderer::SetMaxParticles(int var, bool reload)
+ID3D11BlendState* ParticleRenderer::GetBlendState()
 {
-	m_maxParticles = var;
-
-	if (reload)
-	{
-		m_loadingComplete = Idle;
-		m_state = Playing;
-		ResetParticles();	
-		CreateDeviceResources();
-	}
+	return m_blendState;
 }
 
 BlendStates ParticleRenderer::GetBlendStateId()
@@ -1232,16 +818,6 @@ void ParticleRenderer::SetBlendStateId(BlendStates state)
 	}
 }
 
-bool ParticleRenderer::IsParticlesUpdating()
-{
-	return (m_state != Finished);
-}
-
-void ParticleRenderer::PlayParticle()
-{
-	m_state = Playing;
-}
-
 void ParticleRenderer::SetDeletionRequested(bool value)
 {
 	if (m_loadingComplete != DoneShutdown)
@@ -1255,20 +831,6 @@ bool ParticleRenderer::GetDeletionRequested()
 	return m_deletionRequested;
 }
 
-void ParticleRenderer::Pause()
-{
-	m_state = Paused;
-}
-
-void ParticleRenderer::Play(bool reset)
-{
-	if (reset)
-	{
-		ResetParticles();
-	}
-	m_state = Playing;
-}
-
 bool ParticleRenderer::IsLoaded()
 {
 	return (m_loadingComplete == LoadState::Completed);
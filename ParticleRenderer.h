@@ -2,6 +2,10 @@
 
 #include "CommonStates.h"
 #include "ParticleEnums.h"
+#include "ParticleDeviceResources.h"
+#include "ParticlePipeline.h"
+#include "ParticleSystem.h"
+#include "ParticleTextureCache.h"
 #include "Engine\Common\BasicLoader.h"
 
 
@@ -38,46 +42,12 @@ struct ViewProjectionConstantBuffer
 {
 	DirectX::XMFLOAT4X4 view;
 	DirectX::XMFLOAT4X4 projection;
+	DirectX::XMFLOAT4 textureRect;	// left, top, right, bottom; only read by the instance vertex shader
 };
 
-struct ParticleType
-{
-	float positionX, positionY;
-
-	float red, green, blue, alpha;	// Current color value drawn
-	float redDelta1, greenDelta1, blueDelta1, alphaDelta1;	// From Start to Middle
-	float redDelta2, greenDelta2, blueDelta2, alphaDelta2;	// From Middle to End
-	
-	float velocityX, velocityY;
-	float size, sizeDelta1, sizeDelta2;
-	float lifetime, halfLifeTime;
-	bool active;
-	float radialAccel;
-	float tangentialAccel;
-	float rotation;		// direction (-/+) and current angle
-	float rotateSpeed;	// Scalar value to change rotation value
-};
-
-struct VertexType
-{
-	DirectX::XMFLOAT2 position;
-	DirectX::XMFLOAT2 texture;
-	DirectX::XMFLOAT4 color;		
-};
-
-#define PROPERTY_DEFINE_MEMBER(varType, varName) private: varType varName
-
-#define PROPERTY_DEFINE_FUNC(varType, varName, funcName) \
-public: varType Get##funcName(void) { return varName; } \
-public: void Set##funcName(varType var) { varName = var; } \
-
-#define PROPERTY_DEFINE(varType, varName, funcName) \
-private: varType varName; \
-public: varType Get##funcName(void) { return varName; } \
-public: void Set##funcName(varType var) { varName = var; } \
-
-// This class renders a particle emitter.
-class ParticleRenderer
+// This class renders a particle emitter. The simulation itself lives in ParticleSystem;
+// this class owns the Direct3D resources and draws the quads it builds.
+class ParticleRenderer : public ParticleSystem
 {
 public:
 
@@ -88,13 +58,6 @@ public:
 		Microsoft::WRL::ComPtr<ID3D11DepthStencilView> depthStencilView);
 
 	~ParticleRenderer();
-	
-	enum State
-	{
-		Paused,		// particles are not emitted, can play particle, to be active
-		Playing,	// active particles playing/emitting
-		Finished	// inactive, finished playing particles, can't emit any more particles, ready for deletion
-	};
 
 	enum LoadState
 	{
@@ -104,13 +67,32 @@ public:
 		DoneShutdown
 	};
 
+	// How particles are sent to the GPU.
+	enum RenderMode
+	{
+		QuadVertices,		// four ParticleVertex per particle built on the CPU
+		QuantizedVertices,	// four ParticleQuantizedVertex per particle built on the CPU
+		Instanced			// one ParticleInstance per particle, expanded into a quad by the vertex shader
+	};
+
 	// Direct3DBase methods.
 	void CreateDeviceResources();
 	void CreateWindowSizeDependentResources(float width, float height);
 	void Render();
+
+	// Shared by ParticleBatchRenderer, so every emitter uses the same view and projection.
+	static void ComputeViewProjection(float width, float height, ViewProjectionConstantBuffer& constantBufferData);
+
+	// Part of the particle plane the view and projection put on screen, which the emitters cull against.
+	static void ComputeViewBounds(const ViewProjectionConstantBuffer& constantBufferData, ParticleBounds* bounds);
+
+	// Loaded, playing, not waiting for deletion, and has live particles.
+	bool IsReadyToDraw();
 	
 	// Method for updating time-dependent objects.
 	// Return m_active, so we know if the particle emitter is completed and can be deleted.
+	// In pipelined mode this is the sync point: it waits for the frame simulated since the last Update,
+	// uploads it for Render, and starts simulating the next one in the background.
 	bool Update(float timeTotal, float timeDelta);
 	
 	bool InitParticleProperties(
@@ -142,15 +124,12 @@ public:
 		bool enableTextureRotation
 		);
 
-	void ResetParticles();
-	void ShutdownParticleSystem();
-	bool IsParticlesUpdating();
-	void PlayParticle();
+	// Same, from a preset of a ParticleEffectBank, which also picks the texture and blend state.
+	bool InitParticleProperties(const ParticleEmitterRecord& record);
+
 	void Shutdown();
 	void SetDeletionRequested(bool value);
 	bool GetDeletionRequested();
-	void Pause();
-	void Play(bool reset);
 	bool IsLoaded();
 	void ForceShutdown();
 
@@ -159,6 +138,9 @@ private:
 	Platform::String^ m_particleFilePath;
 	LoadState m_loadingComplete;
 	bool m_deletionRequested;
+	bool m_batched;
+	bool m_pipelined;
+	ParticlePipeline m_pipeline;	// simulates the next frame while the last one is drawn, when pipelined
 
 	Microsoft::WRL::ComPtr<ID3D11Device1> m_d3dDevice;
 	Microsoft::WRL::ComPtr<ID3D11DeviceContext1> m_d3dContext;
@@ -167,8 +149,10 @@ private:
 
 	
 
+	// Shared with the other emitters through ParticleDeviceResources, except the vertex buffer.
 	Microsoft::WRL::ComPtr<ID3D11InputLayout> m_inputLayout;
-	Microsoft::WRL::ComPtr<ID3D11Buffer> m_vertexBuffer;
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_vertexBuffer;	// ParticleVertex, or ParticleInstance when instanced
+	Microsoft::WRL::ComPtr<ID3D11Buffer> m_cornerBuffer;	// static quad corners, instanced mode only
 	Microsoft::WRL::ComPtr<ID3D11Buffer> m_indexBuffer;
 	Microsoft::WRL::ComPtr<ID3D11VertexShader> m_vertexShader;
 	Microsoft::WRL::ComPtr<ID3D11PixelShader> m_pixelShader;
@@ -183,19 +167,11 @@ private:
 	void CreateResources();
 		
 	void CreateParticleResources(BasicLoader^ loader);
-	//================================================
-	// For particle system update
-	//================================================
-	int m_currentParticleCount;
-	float m_accumulatedTime; // in seconds
-	float m_elapsedTimeSinceEmitParticle;
-	State m_state;
-	
-	ParticleType* m_particleList;
+
 	int m_vertexCount;
 	int m_indexCount;
-	VertexType* m_vertices;
-	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> m_textureView;
+	int m_drawParticleCount;	// live particles written by the last UpdateBuffers
+	ParticleTextureHandle m_texture;	// shared with the other emitters drawing from the same texture
 
 	ID3D11BlendState* m_blendState;
     ID3D11DepthStencilState* m_depthStencilState;
@@ -203,117 +179,77 @@ private:
 	// Store results of calculations commonly used
 	int m_totalSizeVertices;
 	int m_sizeVertexType;
-	float ONE_OVER_EMISSIONRATE;
 	
-	DirectX::CommonStates * m_commonStates;
+	DirectX::CommonStates * m_commonStates;	// owned by ParticleDeviceResources
 		
 	void Frame(float frameTime, float deltaTime);
+
+	// Pipelined and not batched: the emitter is simulated by m_pipeline.
+	bool IsSimulatedInBackground();
+
+	// Swaps in the frame m_pipeline finished and uploads it to the vertex buffer.
+	void UploadPipelinedFrame();
 	void SetShaderParameters(); 
 
 	int GetIndexCount();
 
 	Concurrency::task<void> LoadTexture(BasicLoader^ basicLoader);
 
-	bool LoadTexture();
+	void LoadTexture();
 	void ReleaseTexture();
 
+	// Completes loading once the texture has loaded.
+	void UpdateLoadState();
+
 	bool InitializeParticleSystem();
 
 	void ShutdownBuffers();
 
-	void EmitParticles(float);
-	void UpdateParticles(float deltaTime);
-	void UpdateParticle(float delta, ParticleType *particle);
-	void KillParticles();
-	void AddParticle();
-
 	bool UpdateBuffers();
 	void RenderBuffers();
 	void RenderParticleShader();
 
-//#ifdef DEBUG // For tuning variables to change on the fly
-	PROPERTY_DEFINE(float, m_startPosX, StartPosX);
-	PROPERTY_DEFINE(float, m_startPosY, StartPosY);
-	PROPERTY_DEFINE(float, m_startPosXVar, StartPosXVar);
-	PROPERTY_DEFINE(float, m_startPosYVar, StartPosYVar);
-	PROPERTY_DEFINE(float, m_speed, Speed);
-	PROPERTY_DEFINE(float, m_speedVar, SpeedVar);
-	PROPERTY_DEFINE(float, m_startSize, StartSize);
-	PROPERTY_DEFINE(float, m_startSizeVar, StartSizeVar);
-	PROPERTY_DEFINE(float, m_middleSize, MiddleSize);
-	PROPERTY_DEFINE(float, m_middleSizeVar, MiddleSizeVar);
-	PROPERTY_DEFINE(float, m_endSize, EndSize);
-	PROPERTY_DEFINE(float, m_endSizeVar, EndSizeVar);
-	PROPERTY_DEFINE(float, m_angle, Angle);	// in degrees
-	PROPERTY_DEFINE(float, m_angleVar, AngleVar);
-	PROPERTY_DEFINE(float, m_startRed, StartRed);
-	PROPERTY_DEFINE(float, m_startGreen, StartGreen);
-	PROPERTY_DEFINE(float, m_startBlue, StartBlue);
-	PROPERTY_DEFINE(float, m_startAlpha, StartAlpha);
-	PROPERTY_DEFINE(float, m_startRedVar, StartRedVar);
-	PROPERTY_DEFINE(float, m_startGreenVar, StartGreenVar);
-	PROPERTY_DEFINE(float, m_startBlueVar, StartBlueVar);
-	PROPERTY_DEFINE(float, m_startAlphaVar, StartAlphaVar);
-	PROPERTY_DEFINE(float, m_middleRed, MiddleRed);
-	PROPERTY_DEFINE(float, m_middleGreen, MiddleGreen);
-	PROPERTY_DEFINE(float, m_middleBlue, MiddleBlue);
-	PROPERTY_DEFINE(float, m_middleAlpha, MiddleAlpha);
-	PROPERTY_DEFINE(float, m_middleRedVar, MiddleRedVar);
-	PROPERTY_DEFINE(float, m_middleGreenVar, MiddleGreenVar);
-	PROPERTY_DEFINE(float, m_middleBlueVar, MiddleBlueVar);
-	PROPERTY_DEFINE(float, m_middleAlphaVar, MiddleAlphaVar);	
-	PROPERTY_DEFINE(float, m_endRed, EndRed);
-	PROPERTY_DEFINE(float, m_endGreen, EndGreen);
-	PROPERTY_DEFINE(float, m_endBlue, EndBlue);
-	PROPERTY_DEFINE(float, m_endAlpha, EndAlpha);
-	PROPERTY_DEFINE(float, m_endRedVar, EndRedVar);
-	PROPERTY_DEFINE(float, m_endGreenVar, EndGreenVar);
-	PROPERTY_DEFINE(float, m_endBlueVar, EndBlueVar);
-	PROPERTY_DEFINE(float, m_endAlphaVar, EndAlphaVar);
-	PROPERTY_DEFINE(float, m_gravityX, GravityX);
-	PROPERTY_DEFINE(float, m_gravityY, GravityY);
-	PROPERTY_DEFINE(float, m_radialAccel, RadialAccel);
-	PROPERTY_DEFINE(float, m_radialAccelVar, RadialAccelVar);
-	PROPERTY_DEFINE(float, m_tangentialAccel, TangentialAccel);
-	PROPERTY_DEFINE(float, m_tangentialAccelVar, TangentialAccelVar);
-	PROPERTY_DEFINE(float, m_lifetimeVar, LifetimeVar);
-	PROPERTY_DEFINE(float, m_rotationSpeed, RotationSpeed);
-	PROPERTY_DEFINE(float, m_rotationSpeedVar, RotationSpeedVar);
-	PROPERTY_DEFINE(bool, m_enableTextureRotation, EnableTextureRotation);
-
-	
 private:
-	
-	int m_maxParticles;
-	int m_emissionRate;
-	float m_duration;
-	float m_lifetime;
-	float m_startTime;	// in seconds
+
 	LanguageGameWp8DxComponent::ParticleEffect m_particleEffect;
 	LanguageGameWp8DxComponent::BlendStates m_blendStateId;
-	bool m_isPartInfiniteLifetime;
+	RenderMode m_renderMode;
 public:
 
-	float GetDuration();
-	void SetDuration(float var);
-
-	int GetMaxParticles();
+	// Also recreates the particle storage and device resources for the new capacity if reload is set.
 	void SetMaxParticles(int var, bool reload);
-
-	int GetEmissionRate();
-	void SetEmissionRate(int var);
-
-	float GetLifetime();
-	void SetLifetime(float var);
-
-	// if this emitter is not auto play, then we will start the emitter after this time has passed by
-	float GetStartTime();
-	void SetStartTime(float var);
 	
 	LanguageGameWp8DxComponent::ParticleEffect GetParticleEffectId();
 	void SetParticleEffectId(LanguageGameWp8DxComponent::ParticleEffect effectId);
 
 	LanguageGameWp8DxComponent::BlendStates GetBlendStateId();
 	void SetBlendStateId(LanguageGameWp8DxComponent::BlendStates state);
+
+	// A batched emitter still simulates in Update, but no longer builds its own vertex buffer or draws
+	// in Render; ParticleBatchRenderer gathers its vertices and draws it with the emitters it shares state with.
+	void SetBatched(bool value);
+	bool IsBatched();
+
+	// A pipelined emitter is simulated, and its vertices built, on ParticleThreadPool while the frame
+	// before is drawn: Update only swaps in the frame that finished and starts the next, so the simulation
+	// is off the critical path at the cost of one frame of latency. Ignored while batched.
+	void SetPipelined(bool value);
+	bool IsPipelined();
+
+	// Waits for the frame simulating in the background, if any. The emitter's own methods do it, but it
+	// must be called before changing the emitter through ParticleSystem, e.g. Play, Pause, Burst or the
+	// properties, between Update and the next one.
+	void WaitForSimulation();
+
+	ID3D11ShaderResourceView* GetTextureView();
+
+	// Emitters with the same key draw from the same texture: the atlas page with PARTICLE_USE_ATLAS,
+	// otherwise the effect's own texture.
+	int GetTextureKey();
+	ID3D11BlendState* GetBlendState();
+
+	// Recreates the device resources for the new mode once they were created.
+	RenderMode GetRenderMode();
+	void SetRenderMode(RenderMode mode);
 	
 };
@@ -0,0 +1,185 @@
+﻿#pragma once
+
+// Thin wrapper over the SIMD instruction set the build targets, used by the particle kernels.
+// Only operations that round exactly like their scalar counterparts are exposed (no reciprocal
+// estimates, no fused multiply-add), and min/max/select follow the C ternary semantics,
+// so a vector kernel written with these matches its scalar version bit for bit, as long as the
+// compiler doesn't contract the scalar version's multiplies and adds either: the build turns that
+// off, see CMakeLists.txt.
+//
+// Define PARTICLE_NO_SIMD to force the scalar kernels.
+
+#if defined(PARTICLE_NO_SIMD)
+#define PARTICLE_SIMD_SCALAR
+#elif defined(__AVX__)
+#define PARTICLE_SIMD_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLE_SIMD_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM) || defined(_M_ARM64)
+#define PARTICLE_SIMD_NEON
+#include <arm_neon.h>
+#include <math.h>
+#else
+#define PARTICLE_SIMD_SCALAR
+#endif
+
+#if !defined(PARTICLE_SIMD_SCALAR)
+
+#include "ParticleMath.h"
+
+namespace ParticleSimd
+{
+
+#if defined(PARTICLE_SIMD_AVX)
+
+	typedef __m256 Float;
+	typedef __m256 Mask;
+	static const int WIDTH = 8;
+
+	inline Float Load(const float* p)				{ return _mm256_loadu_ps(p); }
+	inline void Store(float* p, Float a)			{ _mm256_storeu_ps(p, a); }
+	inline Float Set(float a)						{ return _mm256_set1_ps(a); }
+	inline Float Add(Float a, Float b)				{ return _mm256_add_ps(a, b); }
+	inline Float Sub(Float a, Float b)				{ return _mm256_sub_ps(a, b); }
+	inline Float Mul(Float a, Float b)				{ return _mm256_mul_ps(a, b); }
+	inline Float Div(Float a, Float b)				{ return _mm256_div_ps(a, b); }
+	inline Float Sqrt(Float a)						{ return _mm256_sqrt_ps(a); }
+	inline Float Neg(Float a)						{ return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+	inline Mask CmpGt(Float a, Float b)				{ return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	inline Mask CmpGe(Float a, Float b)				{ return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	inline Mask CmpLt(Float a, Float b)				{ return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline Mask CmpNeq(Float a, Float b)			{ return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+	inline Mask CmpEq(Float a, Float b)				{ return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	inline Mask Or(Mask a, Mask b)					{ return _mm256_or_ps(a, b); }
+	inline Mask AllTrue()							{ return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+	inline Mask Not(Mask a)							{ return _mm256_xor_ps(a, AllTrue()); }
+	inline Float Select(Mask m, Float a, Float b)	{ return _mm256_blendv_ps(b, a, m); }
+	inline bool Any(Mask m)							{ return _mm256_movemask_ps(m) != 0; }
+	inline int MoveMask(Mask m)						{ return _mm256_movemask_ps(m); }
+
+#elif defined(PARTICLE_SIMD_SSE2)
+
+	typedef __m128 Float;
+	typedef __m128 Mask;
+	static const int WIDTH = 4;
+
+	inline Float Load(const float* p)				{ return _mm_loadu_ps(p); }
+	inline void Store(float* p, Float a)			{ _mm_storeu_ps(p, a); }
+	inline Float Set(float a)						{ return _mm_set1_ps(a); }
+	inline Float Add(Float a, Float b)				{ return _mm_add_ps(a, b); }
+	inline Float Sub(Float a, Float b)				{ return _mm_sub_ps(a, b); }
+	inline Float Mul(Float a, Float b)				{ return _mm_mul_ps(a, b); }
+	inline Float Div(Float a, Float b)				{ return _mm_div_ps(a, b); }
+	inline Float Sqrt(Float a)						{ return _mm_sqrt_ps(a); }
+	inline Float Neg(Float a)						{ return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+	inline Mask CmpGt(Float a, Float b)				{ return _mm_cmpgt_ps(a, b); }
+	inline Mask CmpGe(Float a, Float b)				{ return _mm_cmpge_ps(a, b); }
+	inline Mask CmpLt(Float a, Float b)				{ return _mm_cmplt_ps(a, b); }
+	inline Mask CmpNeq(Float a, Float b)			{ return _mm_cmpneq_ps(a, b); }
+	inline Mask CmpEq(Float a, Float b)				{ return _mm_cmpeq_ps(a, b); }
+	inline Mask Or(Mask a, Mask b)					{ return _mm_or_ps(a, b); }
+	inline Mask AllTrue()							{ return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+	inline Mask Not(Mask a)							{ return _mm_xor_ps(a, AllTrue()); }
+	inline Float Select(Mask m, Float a, Float b)	{ return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	inline bool Any(Mask m)							{ return _mm_movemask_ps(m) != 0; }
+	inline int MoveMask(Mask m)						{ return _mm_movemask_ps(m); }
+
+#elif defined(PARTICLE_SIMD_NEON)
+
+	typedef float32x4_t Float;
+	typedef uint32x4_t Mask;
+	static const int WIDTH = 4;
+
+	inline Float Load(const float* p)				{ return vld1q_f32(p); }
+	inline void Store(float* p, Float a)			{ vst1q_f32(p, a); }
+	inline Float Set(float a)						{ return vdupq_n_f32(a); }
+	inline Float Add(Float a, Float b)				{ return vaddq_f32(a, b); }
+	inline Float Sub(Float a, Float b)				{ return vsubq_f32(a, b); }
+	inline Float Mul(Float a, Float b)				{ return vmulq_f32(a, b); }
+	inline Float Neg(Float a)						{ return vnegq_f32(a); }
+	inline Mask CmpGt(Float a, Float b)				{ return vcgtq_f32(a, b); }
+	inline Mask CmpGe(Float a, Float b)				{ return vcgeq_f32(a, b); }
+	inline Mask CmpLt(Float a, Float b)				{ return vcltq_f32(a, b); }
+	inline Mask CmpNeq(Float a, Float b)			{ return vmvnq_u32(vceqq_f32(a, b)); }
+	inline Mask CmpEq(Float a, Float b)				{ return vceqq_f32(a, b); }
+	inline Mask Or(Mask a, Mask b)					{ return vorrq_u32(a, b); }
+	inline Mask AllTrue()							{ return vdupq_n_u32(0xFFFFFFFF); }
+	inline Mask Not(Mask a)							{ return vmvnq_u32(a); }
+	inline Float Select(Mask m, Float a, Float b)	{ return vbslq_f32(m, a, b); }
+	inline bool Any(Mask m)
+	{
+		uint32x2_t folded = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+		return (vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1)) != 0;
+	}
+	// One bit per lane, lane 0 in bit 0, like _mm_movemask_ps.
+	inline int MoveMask(Mask m)
+	{
+		static const uint32_t LANE_BITS[4] = { 1, 2, 4, 8 };
+		uint32x4_t bits = vandq_u32(m, vld1q_u32(LANE_BITS));
+		uint32x2_t folded = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+		return (int)(vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1));
+	}
+
+	// Note ARMv7 NEON flushes denormals to zero, so there the vector kernels can differ from the
+	// scalar path for denormal inputs; AArch64 NEON is fully IEEE.
+#if defined(__aarch64__) || defined(_M_ARM64)
+	inline Float Div(Float a, Float b)				{ return vdivq_f32(a, b); }
+	inline Float Sqrt(Float a)						{ return vsqrtq_f32(a); }
+#else
+	// ARMv7 NEON only has reciprocal estimates, which do not round like the scalar path,
+	// so divide and square root lane by lane on the VFP unit instead.
+	inline Float Div(Float a, Float b)
+	{
+		float x[4], y[4];
+		vst1q_f32(x, a);
+		vst1q_f32(y, b);
+		x[0] /= y[0]; x[1] /= y[1]; x[2] /= y[2]; x[3] /= y[3];
+		return vld1q_f32(x);
+	}
+	inline Float Sqrt(Float a)
+	{
+		float x[4];
+		vst1q_f32(x, a);
+		x[0] = sqrtf(x[0]); x[1] = sqrtf(x[1]); x[2] = sqrtf(x[2]); x[3] = sqrtf(x[3]);
+		return vld1q_f32(x);
+	}
+#endif
+
+#endif
+
+	// NEON min/max treat -0 as smaller than +0, so spell them out as compare + select
+	// to keep the C "a < b ? a : b" result on every target.
+	inline Float Min(Float a, Float b)				{ return Select(CmpLt(a, b), a, b); }
+	inline Float Max(Float a, Float b)				{ return Select(CmpGt(a, b), a, b); }
+	inline Float Clamp(Float x, Float lo, Float hi)	{ return Max(lo, Min(x, hi)); }
+
+	// ParticleMath::SinCos, operation for operation, so every lane gets the scalar result.
+	inline void SinCos(Float x, Float* sine, Float* cosine)
+	{
+		using namespace ParticleMath;
+		const Float round = Set(SINCOS_ROUND);
+
+		Float quadrant = Sub(Add(Mul(x, Set(TWO_OVER_PI)), round), round);
+		Float r = Sub(Sub(Sub(x, Mul(quadrant, Set(PI_OVER_2_HI))), Mul(quadrant, Set(PI_OVER_2_MID))), Mul(quadrant, Set(PI_OVER_2_LO)));
+
+		Float turns = Sub(Add(Sub(Mul(quadrant, Set(0.25f)), Set(0.375f)), round), round);
+		Float q = Sub(quadrant, Mul(turns, Set(4.0f)));
+
+		Float z = Mul(r, r);
+		Float s = Add(Mul(Mul(Add(Mul(Add(Mul(Set(SIN_C3), z), Set(SIN_C2)), z), Set(SIN_C1)), z), r), r);
+		Float c = Add(Sub(Mul(Mul(Add(Mul(Add(Mul(Set(COS_C3), z), Set(COS_C2)), z), Set(COS_C1)), z), z), Mul(Set(0.5f), z)), Set(1.0f));
+
+		Mask q1 = CmpEq(q, Set(1.0f));
+		Mask q2 = CmpEq(q, Set(2.0f));
+		Mask q3 = CmpEq(q, Set(3.0f));
+		Mask swap = Or(q1, q3);
+		Float sinValue = Select(swap, c, s);
+		Float cosValue = Select(swap, s, c);
+		*sine = Select(CmpGe(q, Set(2.0f)), Neg(sinValue), sinValue);
+		*cosine = Select(Or(q1, q2), Neg(cosValue), cosValue);
+	}
+}
+
+#endif
@@ -0,0 +1,134 @@
+﻿#include "ParticleStats.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <vector>
+
+// Thread-local storage for a plain pointer; thread_local itself isn't supported by every compiler the
+// game builds with.
+#if defined(_MSC_VER)
+#define PARTICLE_THREAD_LOCAL __declspec(thread)
+#else
+#define PARTICLE_THREAD_LOCAL __thread
+#endif
+
+std::atomic<ParticleStats::Ring*> ParticleStats::s_rings(nullptr);
+std::atomic<uint64_t> ParticleStats::s_clearTicks(0);
+const uint64_t ParticleStats::s_startTicks = ParticleStats::GetTicks();
+const uint64_t ParticleStats::s_startNanoseconds = ParticleStats::GetNanoseconds();
+
+uint64_t ParticleStats::GetNanoseconds()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double ParticleStats::GetTickPeriod()
+{
+#ifdef PARTICLE_STATS_TSC
+	uint64_t ticks = GetTicks() - s_startTicks;
+	uint64_t nanoseconds = GetNanoseconds() - s_startNanoseconds;
+	return ticks > 0 ? (double)nanoseconds / (double)ticks : 1.0;
+#else
+	return 1.0;
+#endif
+}
+
+ParticleStats::Ring* ParticleStats::CreateThreadRing()
+{
+	Ring* ring = new Ring();
+	ring->written.store(0, std::memory_order_relaxed);
+
+	// Push it onto the list of rings; only ever pushed, so there is no ABA problem.
+	Ring* head = s_rings.load(std::memory_order_relaxed);
+	do
+	{
+		ring->next = head;
+	}
+	while (!s_rings.compare_exchange_weak(head, ring, std::memory_order_release, std::memory_order_relaxed));
+
+	return ring;
+}
+
+void ParticleStats::Record(const ParticleStageSample& sample)
+{
+	static PARTICLE_THREAD_LOCAL Ring* threadRing = nullptr;
+	if (threadRing == nullptr)
+	{
+		threadRing = CreateThreadRing();
+	}
+
+	// Only this thread writes the ring, so 'written' needs no read-modify-write.
+	uint64_t written = threadRing->written.load(std::memory_order_relaxed);
+	threadRing->samples[written % RING_CAPACITY] = sample;
+	threadRing->written.store(written + 1, std::memory_order_release);
+}
+
+bool ParticleStats::Query(const ParticleSystem* emitter, ParticleStage stage, ParticleStageSummary* summary)
+{
+	memset(summary, 0, sizeof(*summary));
+
+	uint64_t clearTicks = s_clearTicks.load(std::memory_order_relaxed);
+	std::vector<ParticleStageSample> copy(RING_CAPACITY);
+	std::vector<uint32_t> durations;
+	uint64_t totalTicks = 0;
+
+	for (Ring* ring = s_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+	{
+		// Copy what the ring holds, then keep only the samples its thread can't have overwritten
+		// meanwhile: the one it may be writing replaces the oldest.
+		uint64_t written = ring->written.load(std::memory_order_acquire);
+		uint64_t first = written > (uint64_t)RING_CAPACITY ? written - RING_CAPACITY : 0;
+		for (uint64_t n = first; n < written; ++n)
+		{
+			copy[n % RING_CAPACITY] = ring->samples[n % RING_CAPACITY];
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t writtenAfter = ring->written.load(std::memory_order_relaxed);
+		if (writtenAfter >= (uint64_t)RING_CAPACITY && writtenAfter - RING_CAPACITY + 1 > first)
+		{
+			first = writtenAfter - RING_CAPACITY + 1;
+		}
+
+		for (uint64_t n = first; n < written; ++n)
+		{
+			const ParticleStageSample& sample = copy[n % RING_CAPACITY];
+			if (sample.stage != (uint32_t)stage || sample.start < clearTicks || (emitter != nullptr && sample.emitter != emitter))
+			{
+				continue;
+			}
+
+			durations.push_back(sample.ticks);
+			totalTicks += sample.ticks;
+			summary->particles += sample.particles;
+			summary->spawned += sample.spawned;
+			summary->killed += sample.killed;
+			summary->bytes += sample.bytes;
+		}
+	}
+
+	if (durations.empty())
+	{
+		return false;
+	}
+
+	int count = (int)durations.size();
+	summary->samples = count;
+
+	// Nearest rank: the smallest duration at least 99% of the samples don't exceed.
+	int rank = (count * 99 + 99) / 100 - 1;
+	std::nth_element(durations.begin(), durations.begin() + rank, durations.end());
+
+	double period = GetTickPeriod();
+	summary->minNanoseconds = (uint32_t)(*std::min_element(durations.begin(), durations.end()) * period);
+	summary->maxNanoseconds = (uint32_t)(*std::max_element(durations.begin(), durations.end()) * period);
+	summary->averageNanoseconds = (uint32_t)((double)totalTicks / count * period);
+	summary->p99Nanoseconds = (uint32_t)(durations[rank] * period);
+	return true;
+}
+
+void ParticleStats::Clear()
+{
+	s_clearTicks.store(GetTicks(), std::memory_order_relaxed);
+}
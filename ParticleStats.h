@@ -0,0 +1,180 @@
+﻿#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// The time stamp counter is the cheapest clock there is where there is one.
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#define PARTICLE_STATS_TSC
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define PARTICLE_STATS_TSC
+#endif
+
+class ParticleSystem;
+
+// Hot-path counters of the particle emitters, for diagnosing frame spikes on devices in the field.
+// Every run of a stage of an emitter's frame is timed and recorded with what it processed, into a ring
+// buffer of the thread it ran on, and ParticleStats::Query summarizes the samples still in the rings.
+//
+// Recording takes two reads of a tick counter and a store into the thread's ring, without locks or
+// allocation beyond the ring itself, created by the first sample of each thread; ticks are only
+// converted to nanoseconds by Query. An emitter records four or five runs a frame, a fraction of a
+// microsecond all told, which stays under 1% of its frame from about a thousand particles. Building with PARTICLE_NO_STATS
+// removes the counters entirely: ParticleStageTimer compiles to nothing and Query finds no samples.
+
+// Stages of an emitter's frame that are timed.
+enum ParticleStage
+{
+	ParticleStageEmit,		// ParticleSystem::EmitParticles: particles spawned
+	ParticleStageUpdate,	// ParticleSystem::UpdateParticles: particles processed, particles that died
+	ParticleStageKill,		// ParticleSystem::KillParticles: particles that died
+	ParticleStageBuild,		// ParticleSystem::BuildVertices and the other builders: particles processed, bytes written
+	ParticleStageUpload,	// ParticleRenderer::UpdateBuffers, and the upload of pipelined and batched frames: particles, bytes
+							// uploaded; includes the build when the output is built straight into the vertex buffer
+	ParticleStageRender,	// ParticleRenderer::Render and ParticleBatchRenderer::Render: particles drawn
+
+	NUM_PARTICLE_STAGES
+};
+
+// One run of a stage. With a fixed time step every step is a run of its own.
+struct ParticleStageSample
+{
+	const ParticleSystem* emitter;	// nullptr for the batched draws, which cover several emitters
+	uint64_t start;					// ParticleStats::GetTicks() when the stage started
+	uint32_t ticks;
+	uint32_t stage;					// ParticleStage
+	uint32_t particles;
+	uint32_t spawned;
+	uint32_t killed;
+	uint32_t bytes;
+};
+
+// Summary of the samples of one stage.
+struct ParticleStageSummary
+{
+	int samples;
+	uint32_t minNanoseconds;
+	uint32_t averageNanoseconds;
+	uint32_t p99Nanoseconds;		// 99% of the runs took at most this long
+	uint32_t maxNanoseconds;
+
+	// Totals over the samples.
+	uint64_t particles;
+	uint64_t spawned;
+	uint64_t killed;
+	uint64_t bytes;
+};
+
+class ParticleStats
+{
+public:
+
+	// Samples kept per thread; the oldest are overwritten. At a few samples per emitter and frame this
+	// is the last several seconds of a scene with a handful of emitters.
+	static const int RING_CAPACITY = 4096;
+
+	// Monotonic time in ticks of a counter of unspecified frequency: the time stamp counter on x86,
+	// nanoseconds elsewhere.
+	static uint64_t GetTicks()
+	{
+#ifdef PARTICLE_STATS_TSC
+		return __rdtsc();
+#else
+		return GetNanoseconds();
+#endif
+	}
+
+	// Monotonic time in nanoseconds.
+	static uint64_t GetNanoseconds();
+
+	// Nanoseconds per tick, measured against GetNanoseconds since the process started.
+	static double GetTickPeriod();
+
+	// Appends a sample to the calling thread's ring.
+	static void Record(const ParticleStageSample& sample);
+
+	// Summarizes the samples of 'stage' recorded since the last Clear that are still in the rings, of
+	// 'emitter' or, for nullptr, of every emitter including the batched draws. Returns false, with an
+	// empty summary, if there are none. May be called from any thread while samples are recorded;
+	// samples overwritten while it reads are left out. Allocates, so it is meant for diagnostics, not
+	// for every frame.
+	static bool Query(const ParticleSystem* emitter, ParticleStage stage, ParticleStageSummary* summary);
+
+	// Leaves the samples recorded so far out of the next queries, e.g. at the start of a level.
+	static void Clear();
+
+private:
+
+	// Written only by its thread: the sample is stored first, then published by incrementing 'written'.
+	struct Ring
+	{
+		ParticleStageSample samples[RING_CAPACITY];
+		std::atomic<uint64_t> written;	// samples ever recorded; the last RING_CAPACITY of them are kept
+		Ring* next;						// rings of the other threads
+	};
+
+	static Ring* CreateThreadRing();
+
+	// Every ring ever created, newest first. Rings are only added, and live as long as the process,
+	// so Query can walk them while threads come and go.
+	static std::atomic<Ring*> s_rings;
+	static std::atomic<uint64_t> s_clearTicks;
+	static const uint64_t s_startTicks;
+	static const uint64_t s_startNanoseconds;
+
+	ParticleStats();
+};
+
+// Times the stage it is in scope for, for one emitter, and records it when it goes out of scope.
+#ifndef PARTICLE_NO_STATS
+class ParticleStageTimer
+{
+public:
+
+	ParticleStageTimer(const ParticleSystem* emitter, ParticleStage stage)
+	{
+		m_sample.emitter = emitter;
+		m_sample.stage = stage;
+		m_sample.particles = 0;
+		m_sample.spawned = 0;
+		m_sample.killed = 0;
+		m_sample.bytes = 0;
+		m_sample.start = ParticleStats::GetTicks();
+	}
+
+	~ParticleStageTimer()
+	{
+		uint64_t ticks = ParticleStats::GetTicks() - m_sample.start;
+		m_sample.ticks = ticks < UINT32_MAX ? (uint32_t)ticks : UINT32_MAX;
+		ParticleStats::Record(m_sample);
+	}
+
+	void SetParticles(int count) { m_sample.particles = (uint32_t)count; }
+	void SetSpawned(int count) { m_sample.spawned = (uint32_t)count; }
+	void SetKilled(int count) { m_sample.killed = (uint32_t)count; }
+	void SetBytes(size_t bytes) { m_sample.bytes = (uint32_t)bytes; }
+
+private:
+
+	ParticleStageSample m_sample;
+
+	// Copying is not allowed.
+	ParticleStageTimer(const ParticleStageTimer&);
+	ParticleStageTimer& operator=(const ParticleStageTimer&);
+};
+#else
+class ParticleStageTimer
+{
+public:
+
+	ParticleStageTimer(const ParticleSystem*, ParticleStage) {}
+
+	void SetParticles(int) {}
+	void SetSpawned(int) {}
+	void SetKilled(int) {}
+	void SetBytes(size_t) {}
+};
+#endif
@@ -0,0 +1,1718 @@
+﻿#include "ParticleSystem.h"
+#include "ParticleBudget.h"
+#include "ParticleMath.h"
+#include "ParticleStats.h"
+#include "ParticleUpdateKernel.h"
+#include <math.h>
+#include <string.h>
+
+using namespace ParticleMath;
+
+
+ParticleSystem::ParticleSystem() :
+	m_currentParticleCount(0)
+	,m_accumulatedTime(0.0f)
+	,m_elapsedTimeSinceEmitParticle(0.0f)
+	,m_state(Paused)
+	,m_random(ParticleRandom::NewSeed())
+	,ONE_OVER_EMISSIONRATE(0.0f)
+	,m_enableTextureRotation(false)
+	,m_maxParticles(0)
+	,m_emissionRate(0)
+	,m_duration(0.0f)
+	,m_lifetime(0.0f)
+	,m_startTime(0.0f)
+	,m_isPartInfiniteLifetime(false)
+	,m_keyMode(IntegrateKeys)
+	,m_rotationMode(AngleRotation)
+	,m_rotationStepDelta(0.0f)
+	,m_parallelThreshold(DEFAULT_PARALLEL_THRESHOLD)
+	,m_fixedTimeStep(0.0f)
+	,m_maxSteps(1)
+	,m_stepTime(0.0f)
+	,m_interpolation(1.0f)
+	,m_boundsSize(0.0f)
+	,m_hasBounds(false)
+	,m_hasViewBounds(false)
+	,m_budgeted(false)
+	,m_budgetPriority(0)
+	,m_budgetShare(1.0f)
+	,m_budgetTicks(0)
+	,m_budgetParticles(0)
+{
+	m_textureRect.left = 0.0f;
+	m_textureRect.top = 0.0f;
+	m_textureRect.right = 1.0f;
+	m_textureRect.bottom = 1.0f;
+	memset(&m_bounds, 0, sizeof(m_bounds));
+	memset(&m_viewBounds, 0, sizeof(m_viewBounds));
+}
+
+ParticleSystem::~ParticleSystem()
+{
+	if (m_budgeted)
+	{
+		ParticleBudget::GetInstance().Remove(this);
+	}
+}
+
+bool ParticleSystem::InitParticleProperties(
+		float startPosX, float startPosY, 
+		float devPosX, float devPosY, 
+		int maxNumParticles,
+		int numParticlesPerSec,
+		float angle, float angleVar,
+		float speed, float speedVar,
+		float startSize, float startSizeVar,
+		float middleSize, float middleSizeVar,
+		float endSize, float endSizeVar,
+		float lifetime, float lifetimeVar,
+		float startRed, float startGreen, float startBlue, float startAlpha,
+		float startRedVar, float startGreenVar, float startBlueVar, float startAlphaVar,
+		float middleRed, float middleGreen, float middleBlue, float middleAlpha,
+		float middleRedVar, float middleGreenVar, float middleBlueVar, float middleAlphaVar,
+		float endRed, float endGreen, float endBlue, float endAlpha,
+		float endRedVar, float endGreenVar, float endBlueVar, float endAlphaVar,		
+		float gravityX, float gravityY,
+		float radialAccel, float radialAccelVar,
+		float tangentialAccel, float tangentialAccelVar,
+		float duration,
+		bool autoPlay,
+		float startTime,
+		float rotationSpeed,
+		float rotationSpeedVar,
+		bool enableTextureRotation
+		)
+{
+	//==================================
+	// Set Particle's Properties
+	//==================================
+	m_startPosX = startPosX;
+	m_startPosY = startPosY;
+
+	// Set the random deviation of where the particles can be located when emitted.
+	m_startPosXVar = devPosX;
+	m_startPosYVar = devPosY;
+
+	// Set the maximsum number of particles allowed in the particle system.
+	m_maxParticles = maxNumParticles;
+
+	// Set the number of particles to emit per second.
+	m_emissionRate = numParticlesPerSec;
+
+	m_angle = angle;
+	m_angleVar = angleVar;
+
+	// Set the speed and speed variation of particles.
+	m_speed = speed; 
+	m_speedVar = speedVar;
+
+	// Set the physical size of the particles.
+	m_startSize = startSize; 
+	m_startSizeVar = startSizeVar;
+	m_middleSize = middleSize; 
+	m_middleSizeVar = middleSizeVar;
+	m_endSize = endSize; 
+	m_endSizeVar = endSizeVar;
+
+	if (lifetime < 0.0f)
+	{
+		m_isPartInfiniteLifetime = true;
+	}
+	else
+	{
+		m_isPartInfiniteLifetime = false;
+	}
+
+	m_lifetime = fabsf(lifetime);
+	m_lifetimeVar = lifetimeVar;
+
+	// Set start, middle, and end colors
+	m_startRed = startRed;
+	m_startGreen = startGreen;
+	m_startBlue = startBlue;
+	m_startAlpha = startAlpha;
+	m_startRedVar = startRedVar;
+	m_startGreenVar = startGreenVar;
+	m_startBlueVar = startBlueVar;
+	m_startAlphaVar = startAlphaVar;
+	m_middleRed = middleRed;
+	m_middleGreen = middleGreen;
+	m_middleBlue = middleBlue;
+	m_middleAlpha = middleAlpha;
+	m_middleRedVar = middleRedVar;
+	m_middleGreenVar = middleGreenVar;
+	m_middleBlueVar = middleBlueVar;
+	m_middleAlphaVar = middleAlphaVar;
+	m_endRed = endRed;
+	m_endGreen = endGreen;
+	m_endBlue = endBlue;
+	m_endAlpha = endAlpha;
+	m_endRedVar = endRedVar;
+	m_endGreenVar = endGreenVar;
+	m_endBlueVar = endBlueVar;
+	m_endAlphaVar = endAlphaVar;
+
+	m_gravityX = gravityX;
+	m_gravityY = gravityY;
+
+	m_radialAccel = radialAccel;
+	m_radialAccelVar = radialAccelVar;
+
+	m_tangentialAccel = tangentialAccel;
+	m_tangentialAccelVar = tangentialAccelVar;
+
+	m_duration = duration;
+	
+	ONE_OVER_EMISSIONRATE = 1.0f / m_emissionRate;
+
+	if (autoPlay)
+	{
+		m_state = Playing;
+	}
+	else
+	{
+		m_state = Paused;
+	}
+
+	m_startTime = startTime;
+
+	m_rotationSpeed = rotationSpeed;
+	m_rotationSpeedVar = rotationSpeedVar;
+
+	m_enableTextureRotation = enableTextureRotation;
+	return ResetParticles();
+}
+
+bool ParticleSystem::InitParticleProperties(const ParticleEmitterRecord& record)
+{
+	// Set directly rather than through SetKeyMode and the others, which would each clear and reallocate
+	// the particles that ResetParticles allocates once for all of them.
+	m_keyMode = (record.flags & EmitterEvaluateKeys) != 0 ? EvaluateKeys : IntegrateKeys;
+	m_rotationMode = (record.flags & EmitterComplexRotation) != 0 ? ComplexRotation : AngleRotation;
+	m_fixedTimeStep = record.fixedTimeStep > 0.0f ? record.fixedTimeStep : 0.0f;
+	m_maxSteps = record.maxSteps > 1 ? record.maxSteps : 1;
+
+	return InitParticleProperties(
+		record.startPosX, record.startPosY,
+		record.devPosX, record.devPosY,
+		record.maxParticles,
+		record.emissionRate,
+		record.angle, record.angleVar,
+		record.speed, record.speedVar,
+		record.startSize, record.startSizeVar,
+		record.middleSize, record.middleSizeVar,
+		record.endSize, record.endSizeVar,
+		record.lifetime, record.lifetimeVar,
+		record.startColor[0], record.startColor[1], record.startColor[2], record.startColor[3],
+		record.startColorVar[0], record.startColorVar[1], record.startColorVar[2], record.startColorVar[3],
+		record.middleColor[0], record.middleColor[1], record.middleColor[2], record.middleColor[3],
+		record.middleColorVar[0], record.middleColorVar[1], record.middleColorVar[2], record.middleColorVar[3],
+		record.endColor[0], record.endColor[1], record.endColor[2], record.endColor[3],
+		record.endColorVar[0], record.endColorVar[1], record.endColorVar[2], record.endColorVar[3],
+		record.gravityX, record.gravityY,
+		record.radialAccel, record.radialAccelVar,
+		record.tangentialAccel, record.tangentialAccelVar,
+		record.duration,
+		(record.flags & EmitterAutoPlay) != 0,
+		record.startTime,
+		record.rotationSpeed, record.rotationSpeedVar,
+		(record.flags & EmitterTextureRotation) != 0
+		);
+}
+
+
+void ParticleSystem::ShutdownParticleSystem()
+{
+	// Release the particle storage.
+	m_particles.Release();
+}
+
+bool ParticleSystem::Simulate(float deltaTime)
+{
+	if (m_state != Playing)
+	{
+		return false;
+	}
+
+	if (!m_budgeted)
+	{
+		Advance(deltaTime);
+		return true;
+	}
+
+	uint64_t start = ParticleStats::GetTicks();
+	Advance(deltaTime);
+	m_budgetTicks.fetch_add(ParticleStats::GetTicks() - start, std::memory_order_relaxed);
+	m_budgetParticles.store(m_currentParticleCount, std::memory_order_relaxed);
+	return true;
+}
+
+void ParticleSystem::Advance(float deltaTime)
+{
+	if (m_fixedTimeStep <= 0.0f)
+	{
+		// Emit new particles.
+		EmitParticles(deltaTime);
+
+		// Update the position of the particles, then release the ones that ran out of lifetime in the same frame.
+		KillParticles(UpdateParticles(deltaTime));
+		UpdateBounds();
+		return;
+	}
+
+	// Take the whole steps the time passed covers, at most m_maxSteps.
+	m_stepTime += deltaTime;
+	int numSteps = (int)(m_stepTime / m_fixedTimeStep);
+	if (numSteps > m_maxSteps)
+	{
+		numSteps = m_maxSteps;
+	}
+
+	for (int step = 0; step < numSteps && m_state == Playing; ++step)
+	{
+		EmitParticles(m_fixedTimeStep);
+
+		// The vertices are drawn in between the state before the last step and the state after it.
+		if (step == numSteps - 1)
+		{
+			SavePreviousState(0, m_currentParticleCount);
+		}
+
+		KillParticles(UpdateParticles(m_fixedTimeStep));
+	}
+
+	// Drop the time the steps couldn't catch up with.
+	m_stepTime -= numSteps * m_fixedTimeStep;
+	if (m_stepTime >= m_fixedTimeStep)
+	{
+		m_stepTime = fmodf(m_stepTime, m_fixedTimeStep);
+	}
+	m_interpolation = m_stepTime / m_fixedTimeStep;
+	UpdateBounds();
+}
+
+void ParticleSystem::SavePreviousState(int first, int count)
+{
+	ParticlePool& p = m_particles;
+	size_t bytes = sizeof(float) * count;
+
+	memcpy(p.previousPositionX + first, p.positionX + first, bytes);
+	memcpy(p.previousPositionY + first, p.positionY + first, bytes);
+	memcpy(p.previousLifetime + first, p.lifetime + first, bytes);
+
+	// Evaluated keys are interpolated through the lifetime.
+	if (m_keyMode == IntegrateKeys)
+	{
+		memcpy(p.previousRed + first, p.red + first, bytes);
+		memcpy(p.previousGreen + first, p.green + first, bytes);
+		memcpy(p.previousBlue + first, p.blue + first, bytes);
+		memcpy(p.previousAlpha + first, p.alpha + first, bytes);
+		memcpy(p.previousSize + first, p.size + first, bytes);
+	}
+}
+
+void ParticleSystem::SetFixedTimeStep(float timeStep, int maxSteps)
+{
+	bool wasFixed = m_fixedTimeStep > 0.0f;
+	m_fixedTimeStep = timeStep > 0.0f ? timeStep : 0.0f;
+	m_maxSteps = maxSteps > 1 ? maxSteps : 1;
+	m_stepTime = 0.0f;
+	m_interpolation = 1.0f;
+
+	if (wasFixed != (m_fixedTimeStep > 0.0f))
+	{
+		// Only a fixed time step has storage for the previous state.
+		m_currentParticleCount = 0;
+		m_particles.Allocate(m_maxParticles, GetOptionalStreams());
+	}
+}
+
+bool ParticleSystem::HasConstantKeys() const
+{
+	// Same tests as SpawnBatch: without middle and end keys every delta is zero.
+	return m_startRed == m_middleRed && m_startGreen == m_middleGreen && m_startBlue == m_middleBlue && m_startAlpha == m_middleAlpha
+		&& m_middleRed == m_endRed && m_middleGreen == m_endGreen && m_middleBlue == m_endBlue && m_middleAlpha == m_endAlpha
+		&& m_startSize == m_middleSize && m_endSize == m_middleSize;
+}
+
+int ParticleSystem::GetOptionalStreams() const
+{
+	int optionalStreams = 0;
+	if (m_rotationMode == ComplexRotation)
+	{
+		optionalStreams |= ParticlePool::ComplexRotationStreams;
+	}
+	if (m_fixedTimeStep > 0.0f)
+	{
+		optionalStreams |= ParticlePool::InterpolationStreams;
+	}
+	return optionalStreams;
+}
+
+void ParticleSystem::EmitParticles(float delta)
+{
+	ParticleStageTimer timer(this, ParticleStageEmit);
+	m_accumulatedTime += delta;
+
+	if (m_startTime > 0.0f)
+	{
+		// Start playing a paused emitter after m_startTime has passed
+		if (m_accumulatedTime >= m_startTime)
+		{
+			m_state = Playing;
+		}
+		else
+		{
+			return;
+		}
+	}
+	else if ((m_duration < 0.0f) || (m_accumulatedTime < m_duration))	// If duration < 0, go into infinity mode, emit particles forever
+	{
+		m_state = Playing;
+	}
+	else
+	{
+		m_state = Finished;
+		return;
+	}
+
+	// ParticleBudget scales the emission rate and the capacity emitted up to. Without a share, the time
+	// doesn't accumulate either, or the emitter would burst once it gets one back.
+	float share = m_budgetShare.load(std::memory_order_relaxed);
+	if (share <= 0.0f)
+	{
+		m_elapsedTimeSinceEmitParticle = 0.0f;
+		return;
+	}
+
+	if (m_emissionRate > 0.0f) 
+	{
+		// emit new particles based on how much time has passed and the emission rate
+		float rate = ONE_OVER_EMISSIONRATE; //1.0 / m_emissionRate;
+		int maxParticles = m_maxParticles;
+		if (share < 1.0f)
+		{
+			rate /= share;
+			maxParticles = (int)(m_maxParticles * share);
+		}
+		m_elapsedTimeSinceEmitParticle += delta;
+
+		// Count the particles due this frame first, then spawn them all in one pass.
+		int numToSpawn = 0;
+		int numFree = maxParticles - m_currentParticleCount;
+		while (		(numToSpawn < numFree)
+				&&	(m_elapsedTimeSinceEmitParticle > rate) )
+		{
+			++numToSpawn;
+			m_elapsedTimeSinceEmitParticle -= rate;
+		}
+
+		timer.SetSpawned(SpawnParticles(numToSpawn));
+	}
+}
+
+int ParticleSystem::Burst(int count)
+{
+	return SpawnParticles(count);
+}
+
+// Particles spawned per SpawnBatch, which bounds its buffer of random inputs on the stack.
+const int SPAWN_BATCH_SIZE = 64;
+
+// Random inputs per particle without and with the middle and end colors.
+const int MIN_SPAWN_INPUTS = 18;
+const int MAX_SPAWN_INPUTS = MIN_SPAWN_INPUTS + 8;
+
+// Particles whose corner rotations the vertex builders compute at once.
+const int ROTATION_BATCH_SIZE = 64;
+
+// Chunks the live particles are split into for the thread pool: a few per thread, at most MAX_CHUNKS,
+// which bounds the expired counts of the update on the stack, and at least MIN_CHUNK_SIZE particles
+// each. Chunks are whole rotation batches, so they also start on a SIMD vector.
+const int CHUNKS_PER_THREAD = 4;
+const int MAX_CHUNKS = 64;
+const int MIN_CHUNK_SIZE = 1024;
+
+// A quad rotated by any angle reaches this much further out than its half size, and a hair more so
+// that rounding can't put a corner of a culled quad back in the view.
+const float ROTATED_QUAD_REACH = 1.4143f;
+const float QUAD_REACH = 1.0001f;
+
+int ParticleSystem::SpawnParticles(int count)
+{
+	// The new particles are outside the bounds until the next UpdateBounds.
+	m_hasBounds = false;
+
+	int numFree = m_maxParticles - m_currentParticleCount;
+	if (count > numFree)
+	{
+		count = numFree;
+	}
+
+	int numSpawned = 0;
+	while (numSpawned < count)
+	{
+		int batchSize = count - numSpawned < SPAWN_BATCH_SIZE ? count - numSpawned : SPAWN_BATCH_SIZE;
+		SpawnBatch(m_currentParticleCount, batchSize);
+
+		// Particles spawned in between steps, by a burst, are drawn where they spawned until the next step.
+		if (m_fixedTimeStep > 0.0f)
+		{
+			SavePreviousState(m_currentParticleCount, batchSize);
+		}
+
+		m_currentParticleCount += batchSize;
+		numSpawned += batchSize;
+	}
+	return numSpawned;
+}
+
+void ParticleSystem::SpawnBatch(int first, int count)
+{
+	// The new particles take slots [first, first + count). All their random inputs are drawn at once,
+	// one row of 'count' values per input, then every attribute is generated in its own loop over the
+	// batch, so each loop is branch free and vectorizable. The emitter level comparisons are made once
+	// per batch instead of once per particle.
+	ParticlePool& p = m_particles;
+
+	float* positionX = p.positionX + first;
+	float* positionY = p.positionY + first;
+	float* velocityX = p.velocityX + first;
+	float* velocityY = p.velocityY + first;
+	float* red = p.red + first;
+	float* green = p.green + first;
+	float* blue = p.blue + first;
+	float* alpha = p.alpha + first;
+	float* redDelta1 = p.redDelta1 + first;
+	float* greenDelta1 = p.greenDelta1 + first;
+	float* blueDelta1 = p.blueDelta1 + first;
+	float* alphaDelta1 = p.alphaDelta1 + first;
+	float* redDelta2 = p.redDelta2 + first;
+	float* greenDelta2 = p.greenDelta2 + first;
+	float* blueDelta2 = p.blueDelta2 + first;
+	float* alphaDelta2 = p.alphaDelta2 + first;
+	float* size = p.size + first;
+	float* sizeDelta1 = p.sizeDelta1 + first;
+	float* sizeDelta2 = p.sizeDelta2 + first;
+	float* lifetime = p.lifetime + first;
+	float* halfLifeTime = p.halfLifeTime + first;
+	float* radialAccel = p.radialAccel + first;
+	float* tangentialAccel = p.tangentialAccel + first;
+	float* rotation = p.rotation + first;
+	float* rotateSpeed = p.rotateSpeed + first;
+
+	// if there is no middle or end color, then the particle will end up staying at startColor the whole time
+	const bool hasMiddleColor =
+			m_startRed != m_middleRed 
+		||	m_startGreen != m_middleGreen 
+		||	m_startBlue != m_middleBlue 
+		||	m_startAlpha != m_middleAlpha;
+	const bool hasEndColor =
+			m_middleRed != m_endRed 
+		||	m_middleGreen != m_endGreen 
+		||	m_middleBlue != m_endBlue 
+		||	m_middleAlpha != m_endAlpha;
+	const bool hasMiddleSize = (m_startSize != m_middleSize);
+	const bool hasEndSize = (m_endSize != m_middleSize);
+	const bool evaluateKeys = (m_keyMode == EvaluateKeys);
+	const bool clampStartColor = !evaluateKeys && HasConstantKeys();
+
+	// Random inputs in [-1, 1), except the accelerations and the lifetime in [0, 1). The middle and end
+	// colors only draw theirs when the effect has them; otherwise their rows point at the rows of the
+	// previous color and are not used.
+	float inputs[MAX_SPAWN_INPUTS * SPAWN_BATCH_SIZE];
+	const int numInputs = MIN_SPAWN_INPUTS + (hasMiddleColor ? 4 : 0) + (hasEndColor ? 4 : 0);
+	m_random.Fill0To1(inputs, numInputs * count);
+
+	const float* randomPositionX = inputs;
+	const float* randomPositionY = randomPositionX + count;
+	const float* randomAngle = randomPositionY + count;
+	const float* randomSpeed = randomAngle + count;
+	const float* randomRadialAccel = randomSpeed + count;
+	const float* randomTangentialAccel = randomRadialAccel + count;
+	const float* randomLifetime = randomTangentialAccel + count;
+	const float* randomStartSize = randomLifetime + count;
+	const float* randomMiddleSize = randomStartSize + count;
+	const float* randomEndSize = randomMiddleSize + count;
+	const float* randomStartColor = randomEndSize + count;		// red, green, blue, alpha rows
+	const float* randomMiddleColor = hasMiddleColor ? randomStartColor + 4 * count : randomStartColor;
+	const float* randomEndColor = hasEndColor ? randomMiddleColor + 4 * count : randomMiddleColor;
+	const float* randomRotateSpeed = randomEndColor + 4 * count;
+
+	// The emitter properties are copied to locals: the streams are floats too, so the compiler would
+	// otherwise have to reload them after every store.
+	{
+		const float startPosX = m_startPosX, startPosXVar = m_startPosXVar;
+		const float startPosY = m_startPosY, startPosYVar = m_startPosYVar;
+		for (int i = 0; i < count; ++i)
+		{
+			positionX[i] = startPosX + startPosXVar * ToMinus1To1(randomPositionX[i]);
+			positionY[i] = startPosY + startPosYVar * ToMinus1To1(randomPositionY[i]);
+		}
+	}
+
+	// The launch angles go through the rotation stream, so their sines and cosines are computed for the
+	// whole batch at once.
+	{
+		const float angle = m_angle, angleVar = m_angleVar;
+		for (int i = 0; i < count; ++i)
+		{
+			rotation[i] = DegreesToRadians(angle + angleVar * ToMinus1To1(randomAngle[i]));
+		}
+	}
+
+	SinCosSimd(rotation, velocityY, velocityX, count);
+
+	if (m_rotationMode == ComplexRotation)
+	{
+		float* rotationCos = p.rotationCos + first;
+		float* rotationSin = p.rotationSin + first;
+		const bool enableTextureRotation = m_enableTextureRotation;
+		for (int i = 0; i < count; ++i)
+		{
+			rotationCos[i] = enableTextureRotation ? velocityX[i] : 1.0f;
+			rotationSin[i] = enableTextureRotation ? velocityY[i] : 0.0f;
+		}
+	}
+
+	{
+		const float speed = m_speed, speedVar = m_speedVar;
+		const bool enableTextureRotation = m_enableTextureRotation;
+		for (int i = 0; i < count; ++i)
+		{
+			float particleSpeed = speed + speedVar * ToMinus1To1(randomSpeed[i]);
+
+			// rotate the texture in this direction, so the particle will move in this direction.
+			rotation[i] = enableTextureRotation ? rotation[i] : 0.0f;
+
+			velocityX[i] = velocityX[i] * particleSpeed;
+			velocityY[i] = -velocityY[i] * particleSpeed;
+		}
+	}
+
+	{
+		const float accel = m_radialAccel, accelVar = m_radialAccelVar;
+		const float tangential = m_tangentialAccel, tangentialVar = m_tangentialAccelVar;
+		const float life = m_lifetime, lifeVar = m_lifetimeVar;
+		const float rotationSpeed = m_rotationSpeed, rotationSpeedVar = m_rotationSpeedVar;
+		for (int i = 0; i < count; ++i)
+		{
+			radialAccel[i] = Max(0.0f, accel + accelVar * randomRadialAccel[i]);
+			tangentialAccel[i] = Max(0.0f, tangential + tangentialVar * randomTangentialAccel[i]);
+
+			float particleLifetime = life + lifeVar * randomLifetime[i];
+			lifetime[i] = particleLifetime;
+			halfLifeTime[i] = particleLifetime * 0.5f;
+
+			rotateSpeed[i] = DegreesToRadians(rotationSpeed + rotationSpeedVar * ToMinus1To1(randomRotateSpeed[i]));
+		}
+	}
+
+	if (m_rotationMode == ComplexRotation)
+	{
+		// Rotation over the time step the live particles are stepped by, until it changes.
+		float* rotationStepCos = p.rotationStepCos + first;
+		float* rotationStepSin = p.rotationStepSin + first;
+		const float stepDelta = m_rotationStepDelta;
+		for (int i = 0; i < count; ++i)
+		{
+			rotationStepSin[i] = rotateSpeed[i] * stepDelta;
+		}
+		SinCosSimd(rotationStepSin, rotationStepSin, rotationStepCos, count);
+	}
+
+	{
+		const float startSize = m_startSize, startSizeVar = m_startSizeVar;
+		const float middleSize = m_middleSize, middleSizeVar = m_middleSizeVar;
+		const float endSize = m_endSize, endSizeVar = m_endSizeVar;
+		for (int i = 0; i < count; ++i)
+		{
+			const float OVER_HALF_LIFETIME = 1.0f / halfLifeTime[i];
+
+			float particleStart = Max(startSize + startSizeVar * ToMinus1To1(randomStartSize[i]), 0.0f);
+			float particleMiddle = Max(middleSize + middleSizeVar * ToMinus1To1(randomMiddleSize[i]), 0.0f);
+			float particleEnd = Max(endSize + endSizeVar * ToMinus1To1(randomEndSize[i]), 0.0f);
+
+			size[i] = particleStart;
+			if (evaluateKeys)
+			{
+				// The keys the deltas below would reach.
+				float middleKey = hasMiddleSize ? particleMiddle : particleStart;
+				sizeDelta1[i] = middleKey;
+				sizeDelta2[i] = hasEndSize ? particleEnd : middleKey;
+			}
+			else
+			{
+				sizeDelta1[i] = hasMiddleSize ? (particleMiddle - particleStart) * OVER_HALF_LIFETIME : 0.0f;
+				sizeDelta2[i] = hasEndSize ? (particleEnd - particleMiddle) * OVER_HALF_LIFETIME : 0.0f;
+			}
+		}
+	}
+
+	{
+		const float startR = m_startRed, startRVar = m_startRedVar;
+		const float startG = m_startGreen, startGVar = m_startGreenVar;
+		const float startB = m_startBlue, startBVar = m_startBlueVar;
+		const float startA = m_startAlpha, startAVar = m_startAlphaVar;
+		const float* randomRed = randomStartColor;
+		const float* randomGreen = randomRed + count;
+		const float* randomBlue = randomGreen + count;
+		const float* randomAlpha = randomBlue + count;
+		for (int i = 0; i < count; ++i)
+		{
+			red[i] = startR + startRVar * ToMinus1To1(randomRed[i]);
+			green[i] = startG + startGVar * ToMinus1To1(randomGreen[i]);
+			blue[i] = startB + startBVar * ToMinus1To1(randomBlue[i]);
+			alpha[i] = startA + startAVar * ToMinus1To1(randomAlpha[i]);
+		}
+
+		// Integrated keys are clamped by every update, but the update skips constant keys, so they are
+		// clamped here once instead.
+		if (clampStartColor)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				red[i] = Clamp(red[i], 0.0f, 1.0f);
+				green[i] = Clamp(green[i], 0.0f, 1.0f);
+				blue[i] = Clamp(blue[i], 0.0f, 1.0f);
+				alpha[i] = Clamp(alpha[i], 0.0f, 1.0f);
+			}
+		}
+	}
+
+	// The end color is relative to the middle color, which is the start color without a middle color.
+	{
+		const float middleR = m_middleRed, middleRVar = m_middleRedVar;
+		const float middleG = m_middleGreen, middleGVar = m_middleGreenVar;
+		const float middleB = m_middleBlue, middleBVar = m_middleBlueVar;
+		const float middleA = m_middleAlpha, middleAVar = m_middleAlphaVar;
+		const float endR = m_endRed, endRVar = m_endRedVar;
+		const float endG = m_endGreen, endGVar = m_endGreenVar;
+		const float endB = m_endBlue, endBVar = m_endBlueVar;
+		const float endA = m_endAlpha, endAVar = m_endAlphaVar;
+		const float* randomMiddleRed = randomMiddleColor;
+		const float* randomMiddleGreen = randomMiddleRed + count;
+		const float* randomMiddleBlue = randomMiddleGreen + count;
+		const float* randomMiddleAlpha = randomMiddleBlue + count;
+		const float* randomEndRed = randomEndColor;
+		const float* randomEndGreen = randomEndRed + count;
+		const float* randomEndBlue = randomEndGreen + count;
+		const float* randomEndAlpha = randomEndBlue + count;
+		for (int i = 0; i < count; ++i)
+		{
+			const float OVER_HALF_LIFETIME = 1.0f / halfLifeTime[i];
+
+			float particleMiddleR = hasMiddleColor ? middleR + middleRVar * ToMinus1To1(randomMiddleRed[i]) : red[i];
+			float particleMiddleG = hasMiddleColor ? middleG + middleGVar * ToMinus1To1(randomMiddleGreen[i]) : green[i];
+			float particleMiddleB = hasMiddleColor ? middleB + middleBVar * ToMinus1To1(randomMiddleBlue[i]) : blue[i];
+			float particleMiddleA = hasMiddleColor ? middleA + middleAVar * ToMinus1To1(randomMiddleAlpha[i]) : alpha[i];
+
+			float particleEndR = hasEndColor ? endR + endRVar * ToMinus1To1(randomEndRed[i]) : particleMiddleR;
+			float particleEndG = hasEndColor ? endG + endGVar * ToMinus1To1(randomEndGreen[i]) : particleMiddleG;
+			float particleEndB = hasEndColor ? endB + endBVar * ToMinus1To1(randomEndBlue[i]) : particleMiddleB;
+			float particleEndA = hasEndColor ? endA + endAVar * ToMinus1To1(randomEndAlpha[i]) : particleMiddleA;
+
+			if (evaluateKeys)
+			{
+				redDelta1[i] = particleMiddleR;
+				greenDelta1[i] = particleMiddleG;
+				blueDelta1[i] = particleMiddleB;
+				alphaDelta1[i] = particleMiddleA;
+
+				redDelta2[i] = particleEndR;
+				greenDelta2[i] = particleEndG;
+				blueDelta2[i] = particleEndB;
+				alphaDelta2[i] = particleEndA;
+			}
+			else
+			{
+				redDelta1[i] = (particleMiddleR - red[i]) * OVER_HALF_LIFETIME;
+				greenDelta1[i] = (particleMiddleG - green[i]) * OVER_HALF_LIFETIME;
+				blueDelta1[i] = (particleMiddleB - blue[i]) * OVER_HALF_LIFETIME;
+				alphaDelta1[i] = (particleMiddleA - alpha[i]) * OVER_HALF_LIFETIME;
+
+				redDelta2[i] = (particleEndR - particleMiddleR) * OVER_HALF_LIFETIME;
+				greenDelta2[i] = (particleEndG - particleMiddleG) * OVER_HALF_LIFETIME;
+				blueDelta2[i] = (particleEndB - particleMiddleB) * OVER_HALF_LIFETIME;
+				alphaDelta2[i] = (particleEndA - particleMiddleA) * OVER_HALF_LIFETIME;
+			}
+		}
+	}
+}
+
+
+int ParticleSystem::UpdateParticles(float delta)
+{
+	ParticleStageTimer timer(this, ParticleStageUpdate);
+	timer.SetParticles(m_currentParticleCount);
+
+	ParticleUpdateParams params;
+	params.delta = delta;
+	params.startPosX = m_startPosX;
+	params.startPosY = m_startPosY;
+	params.gravityX = m_gravityX;
+	params.gravityY = m_gravityY;
+	params.radialEnabled = (m_radialAccel > 0.0f || m_tangentialAccel > 0.0f);
+	params.infiniteLifetime = m_isPartInfiniteLifetime;
+	params.evaluateKeys = (m_keyMode == EvaluateKeys);
+	params.constantKeys = HasConstantKeys();
+	params.rotationEnabled = m_enableTextureRotation;
+	params.complexRotation = (m_rotationMode == ComplexRotation);
+
+	if (params.rotationEnabled && params.complexRotation && delta != m_rotationStepDelta)
+	{
+		UpdateRotationSteps(delta);
+	}
+
+	// Each frame we update all the particles by making them move using their position, velocity, and the frame time.
+	// Particles that expire are recorded in m_particles.expired instead of being found by a second scan.
+	int chunkSize = GetChunkSize();
+	if (chunkSize >= m_currentParticleCount)
+	{
+		int numExpired = UpdateParticlesSimd(m_particles, 0, m_currentParticleCount, params, m_particles.expired);
+		timer.SetKilled(numExpired);
+		return numExpired;
+	}
+
+	// Every chunk records its expired particles at the start of its own range of the list.
+	struct Job
+	{
+		ParticlePool* particles;
+		const ParticleUpdateParams* params;
+		int chunkSize;
+		int numExpired[MAX_CHUNKS];
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			job->numExpired[begin / job->chunkSize] =
+				UpdateParticlesSimd(*job->particles, begin, end, *job->params, job->particles->expired + begin);
+		}
+	};
+
+	Job job;
+	job.particles = &m_particles;
+	job.params = &params;
+	job.chunkSize = chunkSize;
+	ParticleThreadPool::GetInstance().ParallelFor(m_currentParticleCount, chunkSize, &Job::Run, &job);
+
+	// Join the lists in chunk order, so the expired particles stay in ascending order.
+	int* expired = m_particles.expired;
+	int numExpired = 0;
+	for (int chunk = 0; chunk * chunkSize < m_currentParticleCount; ++chunk)
+	{
+		memmove(expired + numExpired, expired + chunk * chunkSize, sizeof(int) * job.numExpired[chunk]);
+		numExpired += job.numExpired[chunk];
+	}
+	timer.SetKilled(numExpired);
+	return numExpired;
+}
+
+void ParticleSystem::UpdateRotationSteps(float delta)
+{
+	ParticlePool& p = m_particles;
+	for (int i = 0; i < m_currentParticleCount; ++i)
+	{
+		p.rotationStepSin[i] = p.rotateSpeed[i] * delta;
+	}
+	SinCosSimd(p.rotationStepSin, p.rotationStepSin, p.rotationStepCos, m_currentParticleCount);
+
+	m_rotationStepDelta = delta;
+}
+
+void ParticleSystem::KillParticles(int numExpired)
+{
+	ParticleStageTimer timer(this, ParticleStageKill);
+	timer.SetKilled(numExpired);
+
+	// Kill the particles the last update recorded as expired, in ascending index order. Live particles stay
+	// packed into [0, m_currentParticleCount) by swapping the last live particle into each freed slot.
+	const int* expired = m_particles.expired;
+	int first = 0;
+	int last = numExpired;
+	while (first < last)
+	{
+		// Drop expired particles that are already at the end, so only live particles get swapped in.
+		while (last > first && expired[last - 1] == m_currentParticleCount - 1)
+		{
+			--m_currentParticleCount;
+			--last;
+		}
+
+		if (first == last)
+		{
+			break;
+		}
+
+		--m_currentParticleCount;
+
+		// Swap the last particle to the newly inactive particle
+		m_particles.Move(expired[first], m_currentParticleCount);
+		++first;
+	}
+
+}
+
+// The 16 specializations of a vertex builder, indexed by BuildFeatures.
+#define PARTICLE_BUILD_KERNELS(function) \
+	&ParticleSystem::function<0>, &ParticleSystem::function<1>, &ParticleSystem::function<2>, &ParticleSystem::function<3>, \
+	&ParticleSystem::function<4>, &ParticleSystem::function<5>, &ParticleSystem::function<6>, &ParticleSystem::function<7>, \
+	&ParticleSystem::function<8>, &ParticleSystem::function<9>, &ParticleSystem::function<10>, &ParticleSystem::function<11>, \
+	&ParticleSystem::function<12>, &ParticleSystem::function<13>, &ParticleSystem::function<14>, &ParticleSystem::function<15>
+
+int ParticleSystem::GetBuildFeatures() const
+{
+	// Particles are only tested against the view when some of them may be outside it.
+	bool culled = false;
+	if (m_hasViewBounds && m_hasBounds)
+	{
+		ParticleBounds cull = GetCullBounds();
+		culled = m_bounds.minX < cull.minX || m_bounds.minY < cull.minY || m_bounds.maxX > cull.maxX || m_bounds.maxY > cull.maxY;
+	}
+
+	return (m_enableTextureRotation ? BuildRotated : 0) | (m_keyMode == EvaluateKeys ? BuildEvaluatedKeys : 0)
+		| (m_fixedTimeStep > 0.0f ? BuildInterpolated : 0) | (culled ? BuildCulled : 0);
+}
+
+ParticleBounds ParticleSystem::GetCullBounds() const
+{
+	float reach = m_boundsSize * (m_enableTextureRotation ? ROTATED_QUAD_REACH : QUAD_REACH);
+	ParticleBounds cull = { m_viewBounds.minX - reach, m_viewBounds.minY - reach, m_viewBounds.maxX + reach, m_viewBounds.maxY + reach };
+	return cull;
+}
+
+bool ParticleSystem::GetBounds(ParticleBounds* bounds) const
+{
+	if (!m_hasBounds || m_currentParticleCount == 0)
+	{
+		return false;
+	}
+
+	float reach = m_boundsSize * (m_enableTextureRotation ? ROTATED_QUAD_REACH : QUAD_REACH);
+	bounds->minX = m_bounds.minX - reach;
+	bounds->minY = m_bounds.minY - reach;
+	bounds->maxX = m_bounds.maxX + reach;
+	bounds->maxY = m_bounds.maxY + reach;
+	return true;
+}
+
+void ParticleSystem::SetViewBounds(const ParticleBounds& view)
+{
+	m_viewBounds = view;
+	m_hasViewBounds = true;
+}
+
+bool ParticleSystem::IsOffscreen() const
+{
+	if (!m_hasViewBounds || !m_hasBounds || m_currentParticleCount == 0)
+	{
+		return false;
+	}
+
+	ParticleBounds cull = GetCullBounds();
+	return m_bounds.maxX < cull.minX || m_bounds.maxY < cull.minY || m_bounds.minX > cull.maxX || m_bounds.minY > cull.maxY;
+}
+
+void ParticleSystem::UpdateBounds()
+{
+	m_hasBounds = m_currentParticleCount > 0;
+	if (!m_hasBounds)
+	{
+		return;
+	}
+
+	struct Job
+	{
+		const ParticleSystem* system;
+		int chunkSize;
+		ParticleBounds bounds[MAX_CHUNKS];
+		float maxSize[MAX_CHUNKS];
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			int chunk = begin / job->chunkSize;
+			job->system->GetRangeBounds(begin, end, &job->bounds[chunk], &job->maxSize[chunk]);
+		}
+	};
+
+	Job job;
+	job.system = this;
+	job.chunkSize = GetChunkSize();
+	ForEachChunk(&Job::Run, &job);
+
+	m_bounds = job.bounds[0];
+	m_boundsSize = job.maxSize[0];
+	for (int chunk = 1; chunk * job.chunkSize < m_currentParticleCount; ++chunk)
+	{
+		const ParticleBounds& bounds = job.bounds[chunk];
+		m_bounds.minX = Min(m_bounds.minX, bounds.minX);
+		m_bounds.minY = Min(m_bounds.minY, bounds.minY);
+		m_bounds.maxX = Max(m_bounds.maxX, bounds.maxX);
+		m_bounds.maxY = Max(m_bounds.maxY, bounds.maxY);
+		m_boundsSize = Max(m_boundsSize, job.maxSize[chunk]);
+	}
+}
+
+void ParticleSystem::GetRangeBounds(int begin, int end, ParticleBounds* bounds, float* maxSize) const
+{
+	const ParticlePool& p = m_particles;
+	float minX = p.positionX[begin], maxX = minX;
+	float minY = p.positionY[begin], maxY = minY;
+	float size = 0.0f;
+	for (int i = begin; i < end; ++i)
+	{
+		minX = Min(minX, p.positionX[i]);
+		maxX = Max(maxX, p.positionX[i]);
+		minY = Min(minY, p.positionY[i]);
+		maxY = Max(maxY, p.positionY[i]);
+		size = Max(size, fabsf(p.size[i]));
+	}
+
+	// Interpolated positions are in between the previous and current ones.
+	if (m_fixedTimeStep > 0.0f)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			minX = Min(minX, p.previousPositionX[i]);
+			maxX = Max(maxX, p.previousPositionX[i]);
+			minY = Min(minY, p.previousPositionY[i]);
+			maxY = Max(maxY, p.previousPositionY[i]);
+		}
+	}
+
+	// The size is evaluated in between the keys, or interpolated in between the previous and current size.
+	if (m_keyMode == EvaluateKeys)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			size = Max(size, Max(fabsf(p.sizeDelta1[i]), fabsf(p.sizeDelta2[i])));
+		}
+	}
+	else if (m_fixedTimeStep > 0.0f)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			size = Max(size, fabsf(p.previousSize[i]));
+		}
+	}
+
+	bounds->minX = minX;
+	bounds->minY = minY;
+	bounds->maxX = maxX;
+	bounds->maxY = maxY;
+	*maxSize = size;
+}
+
+int ParticleSystem::GetChunkOffsets(int features, int chunkSize, int* offsets) const
+{
+	if ((features & BuildCulled) == 0)
+	{
+		for (int chunk = 0; chunk * chunkSize < m_currentParticleCount; ++chunk)
+		{
+			offsets[chunk] = chunk * chunkSize;
+		}
+		return m_currentParticleCount;
+	}
+
+	if (IsOffscreen())
+	{
+		return 0;
+	}
+
+	// Count what each chunk keeps first, so every chunk can write straight to its place in the output
+	// without reading it back to close the gaps.
+	struct Job
+	{
+		const ParticleSystem* system;
+		int (ParticleSystem::*count)(int, int) const;
+		int chunkSize;
+		int* counts;
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			job->counts[begin / job->chunkSize] = (job->system->*job->count)(begin, end);
+		}
+	};
+
+	Job job;
+	job.system = this;
+	job.count = (features & BuildInterpolated) != 0 ? &ParticleSystem::CountUnculledRange<BuildCulled | BuildInterpolated>
+		: &ParticleSystem::CountUnculledRange<BuildCulled>;
+	job.chunkSize = chunkSize;
+	job.counts = offsets;
+	ForEachChunk(&Job::Run, &job);
+
+	int numParticles = 0;
+	for (int chunk = 0; chunk * chunkSize < m_currentParticleCount; ++chunk)
+	{
+		int count = offsets[chunk];
+		offsets[chunk] = numParticles;
+		numParticles += count;
+	}
+	return numParticles;
+}
+
+template <int Features>
+int ParticleSystem::CountUnculledRange(int begin, int end) const
+{
+	ParticleBounds cull = GetCullBounds();
+
+	int count = 0;
+	for (int i = begin; i < end; ++i)
+	{
+		count += IsParticleCulled<Features>(i, cull) ? 0 : 1;
+	}
+	return count;
+}
+
+int ParticleSystem::BuildVertices(ParticleVertex* vertices) const
+{
+	typedef int (ParticleSystem::*Range)(ParticleVertex*, int, int) const;
+	static const Range RANGES[NUM_BUILD_KERNELS] = { PARTICLE_BUILD_KERNELS(BuildVertexRange) };
+
+	struct Job
+	{
+		const ParticleSystem* system;
+		Range range;
+		ParticleVertex* vertices;
+		int chunkSize;
+		int offsets[MAX_CHUNKS];
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			ParticleVertex* out = job->vertices + job->offsets[begin / job->chunkSize] * 4;
+			(job->system->*job->range)(out, begin, end);
+		}
+	};
+
+	ParticleStageTimer timer(this, ParticleStageBuild);
+	timer.SetParticles(m_currentParticleCount);
+
+	int features = GetBuildFeatures();
+	Job job;
+	job.system = this;
+	job.range = RANGES[features];
+	job.vertices = vertices;
+	job.chunkSize = GetChunkSize();
+	int numParticles = GetChunkOffsets(features, job.chunkSize, job.offsets);
+	if (numParticles > 0)
+	{
+		ForEachChunk(&Job::Run, &job);
+	}
+
+	timer.SetBytes(sizeof(ParticleVertex) * numParticles * 4);
+	return numParticles * 4;
+}
+
+int ParticleSystem::BuildQuantizedVertices(ParticleQuantizedVertex* vertices) const
+{
+	typedef int (ParticleSystem::*Range)(ParticleQuantizedVertex*, int, int) const;
+	static const Range RANGES[NUM_BUILD_KERNELS] = { PARTICLE_BUILD_KERNELS(BuildQuantizedVertexRange) };
+
+	struct Job
+	{
+		const ParticleSystem* system;
+		Range range;
+		ParticleQuantizedVertex* vertices;
+		int chunkSize;
+		int offsets[MAX_CHUNKS];
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			ParticleQuantizedVertex* out = job->vertices + job->offsets[begin / job->chunkSize] * 4;
+			(job->system->*job->range)(out, begin, end);
+		}
+	};
+
+	ParticleStageTimer timer(this, ParticleStageBuild);
+	timer.SetParticles(m_currentParticleCount);
+
+	int features = GetBuildFeatures();
+	Job job;
+	job.system = this;
+	job.range = RANGES[features];
+	job.vertices = vertices;
+	job.chunkSize = GetChunkSize();
+	int numParticles = GetChunkOffsets(features, job.chunkSize, job.offsets);
+	if (numParticles > 0)
+	{
+		ForEachChunk(&Job::Run, &job);
+	}
+
+	timer.SetBytes(sizeof(ParticleQuantizedVertex) * numParticles * 4);
+	return numParticles * 4;
+}
+
+int ParticleSystem::BuildInstances(ParticleInstance* instances) const
+{
+	typedef int (ParticleSystem::*Range)(ParticleInstance*, int, int) const;
+	static const Range RANGES[NUM_BUILD_KERNELS] = { PARTICLE_BUILD_KERNELS(BuildInstanceRange) };
+
+	struct Job
+	{
+		const ParticleSystem* system;
+		Range range;
+		ParticleInstance* instances;
+		int chunkSize;
+		int offsets[MAX_CHUNKS];
+
+		static void Run(void* context, int begin, int end)
+		{
+			Job* job = (Job*)context;
+			ParticleInstance* out = job->instances + job->offsets[begin / job->chunkSize];
+			(job->system->*job->range)(out, begin, end);
+		}
+	};
+
+	ParticleStageTimer timer(this, ParticleStageBuild);
+	timer.SetParticles(m_currentParticleCount);
+
+	int features = GetBuildFeatures();
+	Job job;
+	job.system = this;
+	job.range = RANGES[features];
+	job.instances = instances;
+	job.chunkSize = GetChunkSize();
+	int numParticles = GetChunkOffsets(features, job.chunkSize, job.offsets);
+	if (numParticles > 0)
+	{
+		ForEachChunk(&Job::Run, &job);
+	}
+
+	timer.SetBytes(sizeof(ParticleInstance) * numParticles);
+	return numParticles;
+}
+
+int ParticleSystem::GetChunkSize() const
+{
+	if (m_currentParticleCount < m_parallelThreshold)
+	{
+		return m_currentParticleCount;
+	}
+
+	// A few chunks per thread, so the threads that finish first can steal from the others.
+	int numChunks = ParticleThreadPool::GetInstance().GetThreadCount() * CHUNKS_PER_THREAD;
+	if (numChunks > MAX_CHUNKS)
+	{
+		numChunks = MAX_CHUNKS;
+	}
+
+	int chunkSize = (m_currentParticleCount + numChunks - 1) / numChunks;
+	chunkSize = (chunkSize + ROTATION_BATCH_SIZE - 1) & ~(ROTATION_BATCH_SIZE - 1);
+	return chunkSize > MIN_CHUNK_SIZE ? chunkSize : MIN_CHUNK_SIZE;
+}
+
+void ParticleSystem::ForEachChunk(ParticleRangeFunction function, void* context) const
+{
+	int chunkSize = GetChunkSize();
+	if (chunkSize >= m_currentParticleCount)
+	{
+		function(context, 0, m_currentParticleCount);
+		return;
+	}
+
+	ParticleThreadPool::GetInstance().ParallelFor(m_currentParticleCount, chunkSize, function, context);
+}
+
+template <int Features>
+int ParticleSystem::BuildVertexRange(ParticleVertex* vertices, int begin, int end) const
+{
+	// Build the vertex array from the particle list. Each particle is a quad made out of two triangles.
+	float textureU[4];
+	float textureV[4];
+	GetCornerTexcoords(textureU, textureV);
+
+	float rotationCos[ROTATION_BATCH_SIZE];
+	float rotationSin[ROTATION_BATCH_SIZE];
+
+	ParticleBounds cull = GetCullBounds();
+
+	int index = 0;
+	for (int first = begin; first < end; first += ROTATION_BATCH_SIZE)
+	{
+		int count = end - first < ROTATION_BATCH_SIZE ? end - first : ROTATION_BATCH_SIZE;
+		if ((Features & BuildRotated) != 0)
+		{
+			GetCornerRotations(first, count, rotationCos, rotationSin);
+		}
+
+		for (int n = 0; n < count; ++n)
+		{
+			int i = first + n;
+			if ((Features & BuildCulled) != 0 && IsParticleCulled<Features>(i, cull))
+			{
+				continue;
+			}
+
+			float red, green, blue, alpha, size;
+			GetParticleAppearance<Features>(i, &red, &green, &blue, &alpha, &size);
+
+			// Corner positions in the order bottom right, bottom left, top left, top right.
+			float cornerX[4];
+			float cornerY[4];
+			GetQuadCorners<Features>(i, size, rotationCos[n], rotationSin[n], cornerX, cornerY);
+
+			for (int corner = 0; corner < 4; ++corner)
+			{
+				ParticleVertex& vertex = vertices[index++];
+				vertex.positionX = cornerX[corner];
+				vertex.positionY = cornerY[corner];
+				vertex.textureU = textureU[corner];
+				vertex.textureV = textureV[corner];
+				vertex.red = red;
+				vertex.green = green;
+				vertex.blue = blue;
+				vertex.alpha = alpha;
+			}
+		}
+	}
+
+	return index / 4;
+}
+
+template <int Features>
+int ParticleSystem::BuildQuantizedVertexRange(ParticleQuantizedVertex* vertices, int begin, int end) const
+{
+	float cornerU[4];
+	float cornerV[4];
+	GetCornerTexcoords(cornerU, cornerV);
+
+	int16_t textureU[4];
+	int16_t textureV[4];
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		textureU[corner] = (int16_t)(cornerU[corner] * 32767.0f + 0.5f);
+		textureV[corner] = (int16_t)(cornerV[corner] * 32767.0f + 0.5f);
+	}
+
+	float rotationCos[ROTATION_BATCH_SIZE];
+	float rotationSin[ROTATION_BATCH_SIZE];
+
+	ParticleBounds cull = GetCullBounds();
+
+	int index = 0;
+	for (int first = begin; first < end; first += ROTATION_BATCH_SIZE)
+	{
+		int count = end - first < ROTATION_BATCH_SIZE ? end - first : ROTATION_BATCH_SIZE;
+		if ((Features & BuildRotated) != 0)
+		{
+			GetCornerRotations(first, count, rotationCos, rotationSin);
+		}
+
+		for (int n = 0; n < count; ++n)
+		{
+			int i = first + n;
+			if ((Features & BuildCulled) != 0 && IsParticleCulled<Features>(i, cull))
+			{
+				continue;
+			}
+
+			float red, green, blue, alpha, size;
+			GetParticleAppearance<Features>(i, &red, &green, &blue, &alpha, &size);
+			uint32_t color = PackParticleColor(red, green, blue, alpha);
+
+			float cornerX[4];
+			float cornerY[4];
+			GetQuadCorners<Features>(i, size, rotationCos[n], rotationSin[n], cornerX, cornerY);
+
+			for (int corner = 0; corner < 4; ++corner)
+			{
+				ParticleQuantizedVertex& vertex = vertices[index++];
+				vertex.positionX = FloatToHalf(cornerX[corner]);
+				vertex.positionY = FloatToHalf(cornerY[corner]);
+				vertex.color = color;
+				vertex.textureU = textureU[corner];
+				vertex.textureV = textureV[corner];
+			}
+		}
+	}
+
+	return index / 4;
+}
+
+void ParticleSystem::GetCornerTexcoords(float* textureU, float* textureV) const
+{
+	// Bottom right, bottom left, top left, top right.
+	textureU[0] = m_textureRect.right;	textureV[0] = m_textureRect.bottom;
+	textureU[1] = m_textureRect.left;	textureV[1] = m_textureRect.bottom;
+	textureU[2] = m_textureRect.left;	textureV[2] = m_textureRect.top;
+	textureU[3] = m_textureRect.right;	textureV[3] = m_textureRect.top;
+}
+
+float ParticleSystem::GetInterpolation(int i) const
+{
+	// A particle that restarted its infinite lifetime in the last step jumps to its new state.
+	const ParticlePool& p = m_particles;
+	if (p.previousLifetime[i] < p.lifetime[i])
+	{
+		return 1.0f;
+	}
+
+	return m_interpolation;
+}
+
+template <int Features>
+void ParticleSystem::GetParticlePosition(int i, float* positionX, float* positionY) const
+{
+	const ParticlePool& p = m_particles;
+	if ((Features & BuildInterpolated) == 0)
+	{
+		*positionX = p.positionX[i];
+		*positionY = p.positionY[i];
+		return;
+	}
+
+	float t = GetInterpolation(i);
+	*positionX = p.previousPositionX[i] + (p.positionX[i] - p.previousPositionX[i]) * t;
+	*positionY = p.previousPositionY[i] + (p.positionY[i] - p.previousPositionY[i]) * t;
+}
+
+template <int Features>
+bool ParticleSystem::IsParticleCulled(int i, const ParticleBounds& cull) const
+{
+	float positionX, positionY;
+	GetParticlePosition<Features>(i, &positionX, &positionY);
+	return positionX < cull.minX || positionY < cull.minY || positionX > cull.maxX || positionY > cull.maxY;
+}
+
+template <int Features>
+void ParticleSystem::GetParticleAppearance(int i, float* red, float* green, float* blue, float* alpha, float* size) const
+{
+	const ParticlePool& p = m_particles;
+
+	if ((Features & BuildEvaluatedKeys) == 0)
+	{
+		if ((Features & BuildInterpolated) != 0)
+		{
+			// Particles spawned in the last step start from their unclamped start colors.
+			float t = GetInterpolation(i);
+			*red = Clamp(p.previousRed[i] + (p.red[i] - p.previousRed[i]) * t, 0.0f, 1.0f);
+			*green = Clamp(p.previousGreen[i] + (p.green[i] - p.previousGreen[i]) * t, 0.0f, 1.0f);
+			*blue = Clamp(p.previousBlue[i] + (p.blue[i] - p.previousBlue[i]) * t, 0.0f, 1.0f);
+			*alpha = Clamp(p.previousAlpha[i] + (p.alpha[i] - p.previousAlpha[i]) * t, 0.0f, 1.0f);
+			*size = p.previousSize[i] + (p.size[i] - p.previousSize[i]) * t;
+			return;
+		}
+
+		*red = p.red[i];
+		*green = p.green[i];
+		*blue = p.blue[i];
+		*alpha = p.alpha[i];
+		*size = p.size[i];
+		return;
+	}
+
+	// Lifetime left in half lifetimes: 2 when spawned, 1 halfway, 0 when it expires. Same halves as the
+	// integrated keys: start->middle while at least half the lifetime remains, middle->end afterwards.
+	float lifetime = p.lifetime[i];
+	if ((Features & BuildInterpolated) != 0)
+	{
+		lifetime = p.previousLifetime[i] + (lifetime - p.previousLifetime[i]) * GetInterpolation(i);
+	}
+	float remaining = lifetime / p.halfLifeTime[i];
+	if (remaining >= 1.0f)
+	{
+		float t = remaining - 1.0f;
+		*red = Clamp(p.redDelta1[i] + (p.red[i] - p.redDelta1[i]) * t, 0.0f, 1.0f);
+		*green = Clamp(p.greenDelta1[i] + (p.green[i] - p.greenDelta1[i]) * t, 0.0f, 1.0f);
+		*blue = Clamp(p.blueDelta1[i] + (p.blue[i] - p.blueDelta1[i]) * t, 0.0f, 1.0f);
+		*alpha = Clamp(p.alphaDelta1[i] + (p.alpha[i] - p.alphaDelta1[i]) * t, 0.0f, 1.0f);
+		*size = Max(0.0f, p.sizeDelta1[i] + (p.size[i] - p.sizeDelta1[i]) * t);
+	}
+	else
+	{
+		float t = remaining;
+		*red = Clamp(p.redDelta2[i] + (p.redDelta1[i] - p.redDelta2[i]) * t, 0.0f, 1.0f);
+		*green = Clamp(p.greenDelta2[i] + (p.greenDelta1[i] - p.greenDelta2[i]) * t, 0.0f, 1.0f);
+		*blue = Clamp(p.blueDelta2[i] + (p.blueDelta1[i] - p.blueDelta2[i]) * t, 0.0f, 1.0f);
+		*alpha = Clamp(p.alphaDelta2[i] + (p.alphaDelta1[i] - p.alphaDelta2[i]) * t, 0.0f, 1.0f);
+		*size = Max(0.0f, p.sizeDelta2[i] + (p.sizeDelta1[i] - p.sizeDelta2[i]) * t);
+	}
+}
+
+void ParticleSystem::GetCornerRotations(int first, int count, float* cosines, float* sines) const
+{
+	if (!m_enableTextureRotation)
+	{
+		return;
+	}
+
+	// The corners rotate by the negated particle rotation: same cosine, negated sine.
+	const ParticlePool& p = m_particles;
+	if (m_rotationMode == ComplexRotation)
+	{
+		for (int n = 0; n < count; ++n)
+		{
+			cosines[n] = p.rotationCos[first + n];
+			sines[n] = -p.rotationSin[first + n];
+		}
+	}
+	else
+	{
+		SinCosSimd(p.rotation + first, sines, cosines, count);
+		for (int n = 0; n < count; ++n)
+		{
+			sines[n] = -sines[n];
+		}
+	}
+}
+
+template <int Features>
+void ParticleSystem::GetQuadCorners(int i, float size, float cr, float sr, float* cornerX, float* cornerY) const
+{
+	if ((Features & BuildRotated) == 0)
+	{
+		float positionX, positionY;
+		GetParticlePosition<Features>(i, &positionX, &positionY);
+
+		cornerX[0] = positionX + size;	cornerY[0] = positionY - size;
+		cornerX[1] = positionX - size;	cornerY[1] = positionY - size;
+		cornerX[2] = positionX - size;	cornerY[2] = positionY + size;
+		cornerX[3] = positionX + size;	cornerY[3] = positionY + size;
+	}
+	else
+	{
+		// Code from Cocos2dx CCParticleSystemQuad.cpp updateQuadWithParticle()
+		float size_2 = size;
+		float x1 = -size_2;
+		float y1 = -size_2;
+
+		float x2 = size_2;
+		float y2 = size_2;
+		float x, y;
+		GetParticlePosition<Features>(i, &x, &y);
+
+		float ax = x1 * cr - y1 * sr + x;
+		float ay = x1 * sr + y1 * cr + y;
+		float bx = x2 * cr - y1 * sr + x;
+		float by = x2 * sr + y1 * cr + y;
+		float cx = x2 * cr - y2 * sr + x;
+		float cy = x2 * sr + y2 * cr + y;
+		float dx = x1 * cr - y2 * sr + x;
+		float dy = x1 * sr + y2 * cr + y;
+
+		cornerX[0] = bx;	cornerY[0] = by;
+		cornerX[1] = ax;	cornerY[1] = ay;
+		cornerX[2] = dx;	cornerY[2] = dy;
+		cornerX[3] = cx;	cornerY[3] = cy;
+	}
+}
+
+template <int Features>
+int ParticleSystem::BuildInstanceRange(ParticleInstance* instances, int begin, int end) const
+{
+	const ParticlePool& p = m_particles;
+	ParticleBounds cull = GetCullBounds();
+
+	int index = 0;
+	for (int i = begin; i < end; ++i)
+	{
+		if ((Features & BuildCulled) != 0 && IsParticleCulled<Features>(i, cull))
+		{
+			continue;
+		}
+
+		float red, green, blue, alpha, size;
+		GetParticleAppearance<Features>(i, &red, &green, &blue, &alpha, &size);
+
+		ParticleInstance& instance = instances[index++];
+		GetParticlePosition<Features>(i, &instance.positionX, &instance.positionY);
+		instance.size = size;
+
+		// BuildVertices rotates the corners by the negated particle rotation. The vertex shader needs it
+		// as an angle.
+		float rotation = 0.0f;
+		if ((Features & BuildRotated) != 0)
+		{
+			rotation = m_rotationMode == ComplexRotation ? atan2f(p.rotationSin[i], p.rotationCos[i]) : p.rotation[i];
+		}
+		instance.rotation = -rotation;
+		instance.color = PackParticleColor(red, green, blue, alpha);
+	}
+
+	return index;
+}
+
+uint32_t PackParticleColor(float red, float green, float blue, float alpha)
+{
+	// Start colors are not clamped when particles are emitted, so clamp before quantizing.
+	uint32_t r = (uint32_t)(Clamp(red, 0.0f, 1.0f) * 255.0f + 0.5f);
+	uint32_t g = (uint32_t)(Clamp(green, 0.0f, 1.0f) * 255.0f + 0.5f);
+	uint32_t b = (uint32_t)(Clamp(blue, 0.0f, 1.0f) * 255.0f + 0.5f);
+	uint32_t a = (uint32_t)(Clamp(alpha, 0.0f, 1.0f) * 255.0f + 0.5f);
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+void ExpandParticleInstance(const ParticleInstance& instance, const ParticleTextureRect& textureRect, ParticleVertex* vertices)
+{
+	// Corner directions and texture coordinates in the order bottom right, bottom left, top left, top right,
+	// matching the static corner buffer the instance vertex shader reads. The shader maps the texture
+	// coordinates into the texture rect the same way.
+	static const float CORNER_X[4] = { 1.0f, -1.0f, -1.0f, 1.0f };
+	static const float CORNER_Y[4] = { -1.0f, -1.0f, 1.0f, 1.0f };
+	static const float TEXTURE_U[4] = { 1.0f, 0.0f, 0.0f, 1.0f };
+	static const float TEXTURE_V[4] = { 1.0f, 1.0f, 0.0f, 0.0f };
+	float rectWidth = textureRect.right - textureRect.left;
+	float rectHeight = textureRect.bottom - textureRect.top;
+	const float ONE_OVER_255 = 1.0f / 255.0f;
+
+	// Same operation order as the rotated path of BuildVertices, so the positions match exactly.
+	float cr, sr;
+	SinCos(instance.rotation, &sr, &cr);
+
+	float red = (float)(instance.color & 0xFF) * ONE_OVER_255;
+	float green = (float)((instance.color >> 8) & 0xFF) * ONE_OVER_255;
+	float blue = (float)((instance.color >> 16) & 0xFF) * ONE_OVER_255;
+	float alpha = (float)(instance.color >> 24) * ONE_OVER_255;
+
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		float x = CORNER_X[corner] * instance.size;
+		float y = CORNER_Y[corner] * instance.size;
+
+		ParticleVertex& vertex = vertices[corner];
+		vertex.positionX = x * cr - y * sr + instance.positionX;
+		vertex.positionY = x * sr + y * cr + instance.positionY;
+		vertex.textureU = textureRect.left + TEXTURE_U[corner] * rectWidth;
+		vertex.textureV = textureRect.top + TEXTURE_V[corner] * rectHeight;
+		vertex.red = red;
+		vertex.green = green;
+		vertex.blue = blue;
+		vertex.alpha = alpha;
+	}
+}
+
+void ParticleSystem::SetKeyMode(KeyMode mode)
+{
+	if (mode != m_keyMode)
+	{
+		// The color and size streams mean something else in the other mode.
+		m_keyMode = mode;
+		m_currentParticleCount = 0;
+	}
+}
+
+void ParticleSystem::SetRotationMode(RotationMode mode)
+{
+	if (mode != m_rotationMode)
+	{
+		// The live particles only have the rotation of the current mode, and only complex rotation has
+		// storage for its rotors.
+		m_rotationMode = mode;
+		m_currentParticleCount = 0;
+		m_particles.Allocate(m_maxParticles, GetOptionalStreams());
+	}
+}
+
+bool ParticleSystem::ResetParticles()
+{
+	m_elapsedTimeSinceEmitParticle = 0.0f;
+	m_accumulatedTime = 0.0f;	
+
+	// Initialize the current particle count to zero since none are emitted yet.
+	m_currentParticleCount = 0;
+
+	// Play the same particles again.
+	m_random.Seed(m_random.GetSeed());
+	m_stepTime = 0.0f;
+	m_interpolation = 1.0f;
+
+	// Reuses the current storage in place when the capacity didn't change size class.
+	return m_particles.Allocate(m_maxParticles, GetOptionalStreams());
+}
+
+float ParticleSystem::GetDuration()
+{
+	return m_duration;
+}
+
+void ParticleSystem::SetDuration(float var)
+{
+	m_duration = var;
+	m_elapsedTimeSinceEmitParticle = 0.0f;
+	m_accumulatedTime = 0.0f;
+	m_state = Playing;
+}
+
+int ParticleSystem::GetEmissionRate()
+{
+	return m_emissionRate;
+}
+
+void ParticleSystem::SetEmissionRate(int var)
+{
+	m_emissionRate = var;
+	ONE_OVER_EMISSIONRATE = 1.0f / m_emissionRate;
+}
+
+float ParticleSystem::GetLifetime()
+{
+	if (m_isPartInfiniteLifetime)
+	{
+		return -m_lifetime;
+	}
+
+	return m_lifetime;
+}
+void ParticleSystem::SetLifetime(float var)
+{
+	if (var < 0.0f)
+	{
+		m_isPartInfiniteLifetime = true;
+	}
+	else
+	{
+		m_isPartInfiniteLifetime = false;
+	}
+
+	m_lifetime = fabsf(var);
+}
+
+float ParticleSystem::GetStartTime()
+{
+	return m_startTime;
+}
+void ParticleSystem::SetStartTime(float var)
+{
+	m_accumulatedTime = 0.0f; // reset
+	m_startTime = var;
+}
+
+int ParticleSystem::GetMaxParticles()
+{
+	return m_maxParticles;
+}
+
+void ParticleSystem::SetMaxParticles(int var)
+{
+	m_maxParticles = var;
+}
+
+bool ParticleSystem::IsParticlesUpdating()
+{
+	return (m_state != Finished);
+}
+
+void ParticleSystem::PlayParticle()
+{
+	m_state = Playing;
+}
+
+void ParticleSystem::Pause()
+{
+	m_state = Paused;
+}
+
+void ParticleSystem::Play(bool reset)
+{
+	if (reset)
+	{
+		ResetParticles();
+	}
+	m_state = Playing;
+}
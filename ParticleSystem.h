@@ -0,0 +1,444 @@
+﻿#pragma once
+
+#include "ParticleEffectBank.h"
+#include "ParticlePool.h"
+#include "ParticleRandom.h"
+#include "ParticleThreadPool.h"
+#include <atomic>
+#include <stdint.h>
+
+// One corner of a particle quad, laid out to match the POSITION/TEXCOORD/COLOR input layout.
+struct ParticleVertex
+{
+	float positionX, positionY;
+	float textureU, textureV;
+	float red, green, blue, alpha;
+};
+
+// Compact version of ParticleVertex for bandwidth limited GPUs, 12 bytes instead of 32: R16G16_FLOAT position,
+// R8G8B8A8_UNORM color and R16G16_SNORM texcoord. The texcoords are only ever the corners of the effect's
+// texture rect, but feature level 9_3 has no SV_VertexID to derive them from.
+struct ParticleQuantizedVertex
+{
+	uint16_t positionX, positionY;	// half floats
+	uint32_t color;					// red in the lowest byte
+	int16_t textureU, textureV;		// [0, 1] scaled to [0, 32767]
+};
+
+// Part of the bound texture the particle quads map to, in texture coordinates. The whole texture,
+// unless the effect is packed into a texture atlas by ParticleAtlasTool.
+struct ParticleTextureRect
+{
+	float left, top, right, bottom;
+};
+
+// One particle for instanced rendering, expanded into a quad by ParticleInstanceVertexShader.hlsl:
+// 20 bytes per particle instead of the 128 bytes of four ParticleVertex.
+struct ParticleInstance
+{
+	float positionX, positionY;		// quad center
+	float size;						// half the quad width
+	float rotation;					// angle in radians the corners are rotated by, 0 without texture rotation
+	uint32_t color;					// R8G8B8A8_UNORM, red in the lowest byte
+};
+
+// Axis-aligned box in the space of the particle positions, which the view and projection map to the screen.
+struct ParticleBounds
+{
+	float minX, minY, maxX, maxY;
+};
+
+// Pack a color with components in [0, 1] into R8G8B8A8_UNORM.
+uint32_t PackParticleColor(float red, float green, float blue, float alpha);
+
+// CPU reference of the instance vertex shader: write the four vertices of the instance's quad,
+// in the same corner order and with the same positions as ParticleSystem::BuildVertices.
+void ExpandParticleInstance(const ParticleInstance& instance, const ParticleTextureRect& textureRect, ParticleVertex* vertices);
+
+#define PROPERTY_DEFINE_MEMBER(varType, varName) private: varType varName
+
+#define PROPERTY_DEFINE_FUNC(varType, varName, funcName) \
+public: varType Get##funcName(void) { return varName; } \
+public: void Set##funcName(varType var) { varName = var; } \
+
+#define PROPERTY_DEFINE(varType, varName, funcName) \
+private: varType varName; \
+public: varType Get##funcName(void) { return varName; } \
+public: void Set##funcName(varType var) { varName = var; } \
+
+// This class simulates a particle emitter on the CPU: emission, aging, integration and
+// quad generation. It has no dependency on Direct3D or WinRT, so it also builds headless
+// for profiling and load testing; ParticleRenderer draws it.
+class ParticleSystem
+{
+public:
+
+	ParticleSystem();
+	~ParticleSystem();
+
+	enum State
+	{
+		Paused,		// particles are not emitted, can play particle, to be active
+		Playing,	// active particles playing/emitting
+		Finished	// inactive, finished playing particles, can't emit any more particles, ready for deletion
+	};
+
+	// How the color and size of the particles follow their start, middle and end values.
+	enum KeyMode
+	{
+		IntegrateKeys,	// every update adds the per particle color and size deltas
+		EvaluateKeys	// the particles keep their keys; color and size are evaluated from the age only when the vertices are built
+	};
+
+	bool InitParticleProperties(
+		float startPosX, float startPosY,
+		float devPosX, float devPosY,
+		int maxNumParticles,
+		int numParticlesPerSec,
+		float angle, float angleVar,
+		float speed, float speedVar,
+		float startSize, float startSizeVar,
+		float middleSize, float middleSizeVar,
+		float endSize, float endSizeVar,
+		float lifetime, float lifetimeVar,
+		float startRed, float startGreen, float startBlue, float startAlpha,
+		float startRedVar, float startGreenVar, float startBlueVar, float startAlphaVar,
+		float middleRed, float middleGreen, float middleBlue, float middleAlpha,
+		float middleRedVar, float middleGreenVar, float middleBlueVar, float middleAlphaVar,
+		float endRed, float endGreen, float endBlue, float endAlpha,
+		float endRedVar, float endGreenVar, float endBlueVar, float endAlphaVar,
+		float gravityX, float gravityY,
+		float radialAccel, float radialAccelVar,
+		float tangentialAccel, float tangentialAccelVar,
+		float duration,
+		bool autoPlay,
+		float startTime,
+		float rotationSpeed, float rotationSpeedVar,
+		bool enableTextureRotation
+		);
+
+	// Same, from a preset of a ParticleEffectBank, along with its key mode, rotation mode and time step.
+	// The emitter keeps no reference to the record.
+	bool InitParticleProperties(const ParticleEmitterRecord& record);
+
+	// Advance the simulation by deltaTime seconds while playing: emit, move the live particles and
+	// kill the ones that expired. Returns true if the particles changed and need new vertices.
+	bool Simulate(float deltaTime);
+
+	// Write four vertices per live particle (bottom right, bottom left, top left, top right)
+	// and return the number of vertices written. With view bounds, the particles whose quads are
+	// entirely outside them are left out. The vertices are only written, never read, so they
+	// can go straight into a mapped dynamic vertex buffer. Above the parallel threshold, chunks of
+	// particles are written from several threads at once, each to its own range of the buffer.
+	int BuildVertices(ParticleVertex* vertices) const;
+
+	// Same as BuildVertices, in the ParticleQuantizedVertex format.
+	int BuildQuantizedVertices(ParticleQuantizedVertex* vertices) const;
+
+	// Write one instance per live particle for instanced rendering and return the number written.
+	// Like BuildVertices, the instances are only written.
+	int BuildInstances(ParticleInstance* instances) const;
+
+	int GetParticleCount() const { return m_currentParticleCount; }
+
+	// Sub-rectangle of the texture the quad corners map to, the whole texture by default.
+	const ParticleTextureRect& GetTextureRect() const { return m_textureRect; }
+	void SetTextureRect(const ParticleTextureRect& textureRect) { m_textureRect = textureRect; }
+	State GetState() const { return m_state; }
+
+	// Seed of the emitter's random numbers. Every emitter gets its own seed by default; with the same seed,
+	// properties and time steps an emitter plays the exact same effect. Takes effect immediately, and
+	// ResetParticles restarts the sequence from it, so a replayed effect repeats itself.
+	uint32_t GetRandomSeed() const { return m_random.GetSeed(); }
+	void SetRandomSeed(uint32_t seed) { m_random.Seed(seed); }
+
+	// How the texture rotation of the particles is stored and advanced.
+	enum RotationMode
+	{
+		AngleRotation,		// an angle, advanced by addition; the vertices need its sine and cosine
+		ComplexRotation		// a unit complex number, advanced by multiplication; nothing to evaluate for the vertices
+	};
+
+	// EvaluateKeys makes updates cheaper, skips the colors and sizes entirely for emitters that aren't
+	// drawn, and doesn't drift with the time step. Switching the mode clears the live particles.
+	KeyMode GetKeyMode() const { return m_keyMode; }
+	void SetKeyMode(KeyMode mode);
+
+	// ComplexRotation suits rotated effects drawn as quad vertices: the rotation step of every particle
+	// is only recomputed when the time step changes. Instanced rendering needs the angle, so there
+	// AngleRotation is cheaper. Switching the mode clears the live particles.
+	RotationMode GetRotationMode() const { return m_rotationMode; }
+	void SetRotationMode(RotationMode mode);
+
+	// From this many live particles the update and the vertex builds are split into chunks that run on
+	// ParticleThreadPool; below it they stay on the calling thread, where they finish sooner than it takes
+	// to wake the workers. The output is the same either way, whatever the number of threads.
+	static const int DEFAULT_PARALLEL_THRESHOLD = 8192;
+	int GetParallelThreshold() const { return m_parallelThreshold; }
+	void SetParallelThreshold(int threshold) { m_parallelThreshold = threshold; }
+
+	// Opt-in fixed time step: Simulate advances the particles in steps of 'timeStep' seconds, as many as
+	// the time passed covers, and the vertices are interpolated between the last two steps. An ambient
+	// effect stepped at 30 Hz then costs half as much at 60 Hz and still moves smoothly, and plays the
+	// same at any frame rate. At most 'maxSteps' steps are taken per Simulate; time beyond them is
+	// dropped, so a slow frame doesn't make the next ones slower still. Drawing in between steps puts
+	// the particles up to one step behind. A time step of 0, the default, updates by the time passed
+	// instead. Turning it on or off clears the live particles.
+	float GetFixedTimeStep() const { return m_fixedTimeStep; }
+	int GetMaxSteps() const { return m_maxSteps; }
+	void SetFixedTimeStep(float timeStep, int maxSteps);
+
+	// Conservative box around the quads of the live particles as the last Simulate left them, including
+	// where they are drawn from with a fixed time step. Returns false, leaving 'bounds' as is, while there
+	// is no box: without live particles, or after particles were spawned outside Simulate.
+	bool GetBounds(ParticleBounds* bounds) const;
+
+	// Part of the particle space that is on screen, see ParticleRenderer::CreateWindowSizeDependentResources.
+	// With one set, the builders leave out the particles whose quads are entirely outside it, so they
+	// may write fewer particles than are alive. None by default.
+	void SetViewBounds(const ParticleBounds& view);
+	void ClearViewBounds() { m_hasViewBounds = false; }
+	bool HasViewBounds() const { return m_hasViewBounds; }
+
+	// Has view bounds, and every particle is outside them: there is nothing to build or draw.
+	bool IsOffscreen() const;
+
+	// Emitters of a higher priority keep their share of ParticleBudget longer; 0 by default.
+	int GetBudgetPriority() const { return m_budgetPriority; }
+	void SetBudgetPriority(int priority) { m_budgetPriority = priority; }
+
+	// Share of its emission rate and capacity ParticleBudget lets the emitter use, from 0 to 1. Always 1
+	// for an emitter that isn't in the budget.
+	float GetBudgetShare() const { return m_budgetShare.load(std::memory_order_relaxed); }
+
+	// Spawn 'count' particles at once, on top of the emission rate, e.g. for a firework or a flash.
+	// Limited by the free capacity; returns the number spawned. They move once the emitter is playing.
+	int Burst(int count);
+
+	bool ResetParticles();
+	void ShutdownParticleSystem();
+	bool IsParticlesUpdating();
+	void PlayParticle();
+	void Pause();
+	void Play(bool reset);
+
+protected:
+
+	// Body of Simulate while playing.
+	void Advance(float deltaTime);
+
+	void EmitParticles(float delta);
+	int UpdateParticles(float delta);			// returns the number of particles that expired
+	void KillParticles(int numExpired);		// compacts the slots recorded by UpdateParticles
+	int SpawnParticles(int count);			// returns the number spawned, limited by the free slots
+	void SpawnBatch(int first, int count);	// initializes slots [first, first + count), at most SPAWN_BATCH_SIZE
+
+	// Features the vertex builders below are specialized for, so the per particle code doesn't test the
+	// emitter's modes. Picked once per build.
+	enum BuildFeatures
+	{
+		BuildRotated = 1,			// texture rotation on
+		BuildEvaluatedKeys = 2,		// EvaluateKeys
+		BuildInterpolated = 4,		// fixed time step
+		BuildCulled = 8,			// the bounds of the particles reach outside the view bounds
+		NUM_BUILD_KERNELS = 16
+	};
+	int GetBuildFeatures() const;
+
+	// Recompute m_bounds from the live particles.
+	void UpdateBounds();
+
+	// The view bounds grown by the most a quad reaches out from its particle's position: a particle
+	// whose position is outside it has its whole quad outside the view.
+	ParticleBounds GetCullBounds() const;
+
+	// Position and largest half size of particles [begin, end) as drawn, with a fixed time step where they
+	// are drawn from too.
+	void GetRangeBounds(int begin, int end, ParticleBounds* bounds, float* maxSize) const;
+
+	// Where in the output of a build each chunk of the live particles starts, in particles, and the
+	// number of particles the build writes: the unculled particles of the chunks before and in total.
+	int GetChunkOffsets(int features, int chunkSize, int* offsets) const;
+
+	// Particles of [begin, end) that IsParticleCulled keeps.
+	template <int Features>
+	int CountUnculledRange(int begin, int end) const;
+
+	// Color and half size particle i is drawn with.
+	template <int Features>
+	void GetParticleAppearance(int i, float* red, float* green, float* blue, float* alpha, float* size) const;
+
+	// Position particle i is drawn at.
+	template <int Features>
+	void GetParticlePosition(int i, float* positionX, float* positionY) const;
+
+	// Whether particle i is drawn outside the region GetCullBounds returns.
+	template <int Features>
+	bool IsParticleCulled(int i, const ParticleBounds& cull) const;
+
+	// With a fixed time step, how far from its previous state to its current one particle i is drawn.
+	float GetInterpolation(int i) const;
+
+	// Copy the state the vertices are interpolated from into the previous* streams, for particles
+	// [first, first + count).
+	void SavePreviousState(int first, int count);
+
+	// OptionalStreams of ParticlePool the current modes need.
+	int GetOptionalStreams() const;
+
+	// The colors and size of the particles never change: no middle or end keys.
+	bool HasConstantKeys() const;
+
+	// Cosine and sine of the angle the quad corners of particles [first, first + count) are rotated by,
+	// when the texture rotates. 'count' is at most ROTATION_BATCH_SIZE.
+	void GetCornerRotations(int first, int count, float* cosines, float* sines) const;
+
+	// Corner positions of particle i's quad of half size 'size', in the order bottom right, bottom left,
+	// top left, top right. The corners are rotated by the angle of cosine 'cr' and sine 'sr' if the
+	// texture rotates.
+	template <int Features>
+	void GetQuadCorners(int i, float size, float cr, float sr, float* cornerX, float* cornerY) const;
+
+	// Recompute the rotation step of the live particles for time step 'delta', with ComplexRotation.
+	void UpdateRotationSteps(float delta);
+
+	// Texture coordinates of the quad corners, in the same order.
+	void GetCornerTexcoords(float* textureU, float* textureV) const;
+
+	// Write the output of the particles of [begin, end) that aren't culled, one after the other from the
+	// start of the given output, and return the number of particles written.
+	template <int Features>
+	int BuildVertexRange(ParticleVertex* vertices, int begin, int end) const;
+	template <int Features>
+	int BuildQuantizedVertexRange(ParticleQuantizedVertex* vertices, int begin, int end) const;
+	template <int Features>
+	int BuildInstanceRange(ParticleInstance* instances, int begin, int end) const;
+
+	// Particles per chunk when the live particles are split across the thread pool; all of them when
+	// there are fewer than the parallel threshold.
+	int GetChunkSize() const;
+
+	// Call 'function' for the live particles in chunks of GetChunkSize(), on the thread pool if there
+	// is more than one chunk.
+	void ForEachChunk(ParticleRangeFunction function, void* context) const;
+
+	//================================================
+	// For particle system update
+	//================================================
+	int m_currentParticleCount;
+	float m_accumulatedTime; // in seconds
+	float m_elapsedTimeSinceEmitParticle;
+	State m_state;
+
+	ParticlePool m_particles;
+	ParticleRandom m_random;
+
+	// Store results of calculations commonly used
+	float ONE_OVER_EMISSIONRATE;
+
+//#ifdef DEBUG // For tuning variables to change on the fly
+	PROPERTY_DEFINE(float, m_startPosX, StartPosX);
+	PROPERTY_DEFINE(float, m_startPosY, StartPosY);
+	PROPERTY_DEFINE(float, m_startPosXVar, StartPosXVar);
+	PROPERTY_DEFINE(float, m_startPosYVar, StartPosYVar);
+	PROPERTY_DEFINE(float, m_speed, Speed);
+	PROPERTY_DEFINE(float, m_speedVar, SpeedVar);
+	PROPERTY_DEFINE(float, m_startSize, StartSize);
+	PROPERTY_DEFINE(float, m_startSizeVar, StartSizeVar);
+	PROPERTY_DEFINE(float, m_middleSize, MiddleSize);
+	PROPERTY_DEFINE(float, m_middleSizeVar, MiddleSizeVar);
+	PROPERTY_DEFINE(float, m_endSize, EndSize);
+	PROPERTY_DEFINE(float, m_endSizeVar, EndSizeVar);
+	PROPERTY_DEFINE(float, m_angle, Angle);	// in degrees
+	PROPERTY_DEFINE(float, m_angleVar, AngleVar);
+	PROPERTY_DEFINE(float, m_startRed, StartRed);
+	PROPERTY_DEFINE(float, m_startGreen, StartGreen);
+	PROPERTY_DEFINE(float, m_startBlue, StartBlue);
+	PROPERTY_DEFINE(float, m_startAlpha, StartAlpha);
+	PROPERTY_DEFINE(float, m_startRedVar, StartRedVar);
+	PROPERTY_DEFINE(float, m_startGreenVar, StartGreenVar);
+	PROPERTY_DEFINE(float, m_startBlueVar, StartBlueVar);
+	PROPERTY_DEFINE(float, m_startAlphaVar, StartAlphaVar);
+	PROPERTY_DEFINE(float, m_middleRed, MiddleRed);
+	PROPERTY_DEFINE(float, m_middleGreen, MiddleGreen);
+	PROPERTY_DEFINE(float, m_middleBlue, MiddleBlue);
+	PROPERTY_DEFINE(float, m_middleAlpha, MiddleAlpha);
+	PROPERTY_DEFINE(float, m_middleRedVar, MiddleRedVar);
+	PROPERTY_DEFINE(float, m_middleGreenVar, MiddleGreenVar);
+	PROPERTY_DEFINE(float, m_middleBlueVar, MiddleBlueVar);
+	PROPERTY_DEFINE(float, m_middleAlphaVar, MiddleAlphaVar);
+	PROPERTY_DEFINE(float, m_endRed, EndRed);
+	PROPERTY_DEFINE(float, m_endGreen, EndGreen);
+	PROPERTY_DEFINE(float, m_endBlue, EndBlue);
+	PROPERTY_DEFINE(float, m_endAlpha, EndAlpha);
+	PROPERTY_DEFINE(float, m_endRedVar, EndRedVar);
+	PROPERTY_DEFINE(float, m_endGreenVar, EndGreenVar);
+	PROPERTY_DEFINE(float, m_endBlueVar, EndBlueVar);
+	PROPERTY_DEFINE(float, m_endAlphaVar, EndAlphaVar);
+	PROPERTY_DEFINE(float, m_gravityX, GravityX);
+	PROPERTY_DEFINE(float, m_gravityY, GravityY);
+	PROPERTY_DEFINE(float, m_radialAccel, RadialAccel);
+	PROPERTY_DEFINE(float, m_radialAccelVar, RadialAccelVar);
+	PROPERTY_DEFINE(float, m_tangentialAccel, TangentialAccel);
+	PROPERTY_DEFINE(float, m_tangentialAccelVar, TangentialAccelVar);
+	PROPERTY_DEFINE(float, m_lifetimeVar, LifetimeVar);
+	PROPERTY_DEFINE(float, m_rotationSpeed, RotationSpeed);
+	PROPERTY_DEFINE(float, m_rotationSpeedVar, RotationSpeedVar);
+	PROPERTY_DEFINE(bool, m_enableTextureRotation, EnableTextureRotation);
+
+
+protected:
+
+	int m_maxParticles;
+	int m_emissionRate;
+	float m_duration;
+	float m_lifetime;
+	float m_startTime;	// in seconds
+	bool m_isPartInfiniteLifetime;
+	KeyMode m_keyMode;
+	RotationMode m_rotationMode;
+	float m_rotationStepDelta;	// time step the rotation steps of the particles are for
+	int m_parallelThreshold;
+	float m_fixedTimeStep;		// 0 without a fixed time step
+	int m_maxSteps;
+	float m_stepTime;			// time passed since the last step, less than m_fixedTimeStep
+	float m_interpolation;		// m_stepTime in steps: where in between the last two steps the particles are drawn
+	ParticleTextureRect m_textureRect;
+	ParticleBounds m_bounds;	// positions the live particles are drawn at, without their quads
+	float m_boundsSize;			// largest half size of the live particles
+	bool m_hasBounds;			// m_bounds and m_boundsSize cover every live particle
+	ParticleBounds m_viewBounds;
+	bool m_hasViewBounds;
+public:
+
+	float GetDuration();
+	void SetDuration(float var);
+
+	int GetMaxParticles();
+	void SetMaxParticles(int var);
+
+	int GetEmissionRate();
+	void SetEmissionRate(int var);
+
+	float GetLifetime();
+	void SetLifetime(float var);
+
+	// if this emitter is not auto play, then we will start the emitter after this time has passed by
+	float GetStartTime();
+	void SetStartTime(float var);
+
+private:
+
+	friend class ParticleBudget;
+
+	// Kept by ParticleBudget. Simulate reads the share and reports its cost and live particles on
+	// whatever thread it runs, so those are atomic.
+	bool m_budgeted;
+	int m_budgetPriority;
+	std::atomic<float> m_budgetShare;
+	std::atomic<uint64_t> m_budgetTicks;	// ParticleStats ticks spent in Simulate since the last ParticleBudget::Update
+	std::atomic<int> m_budgetParticles;		// live particles after the last Simulate
+
+	ParticleSystem(const ParticleSystem&);
+	ParticleSystem& operator=(const ParticleSystem&);
+};
@@ -0,0 +1,1066 @@
+﻿// Correctness checks of the particle simulation core, registered with CTest. Every preset is played
+// in every variant and the checks fail the run if:
+// - the quantized vertices and the expanded instances don't give the same quads as BuildVertices, within
+//   the precision of their formats, at capacities from 100 up to --max-count (1000 by default);
+// - UpdateParticlesSimd differs from UpdateParticlesScalar in any bit of any stream or of the expired
+//   list, for any of the kernel specializations, over pools whose sizes leave a partial vector, or
+//   either lets a rotation angle leave [-2 pi, 2 pi];
+// - the polynomial sine and cosine stray from libm beyond their error bound, or SinCosSimd differs
+//   from ParticleMath::SinCos in any bit;
+// - emitters split across ParticleThreadPool don't give the exact output of emitters that aren't;
+// - ParticlePipeline doesn't present the exact frames of an emitter simulated in place, one frame later;
+// - emitters initialized from a mapped ParticleEffectBank don't play the same as the ones initialized
+//   argument by argument;
+// - the ParticleStats counters don't add up to what the emitters did;
+// - ParticleBudget doesn't keep emitters of different priorities within a particle and a time budget,
+//   or doesn't give their capacity back after;
+// - culling against view bounds leaves out a quad that isn't entirely outside the view;
+// - ParticleBatchOrder merges emitters into a batch where drawing them out of submission order changes
+//   the image, or doesn't merge consecutive emitters of the same texture and blend state;
+// - creating, resetting and retiring emitters makes any heap allocation once the particle storage is
+//   warmed up. This check replaces the global operator new, which is why it lives here and not in
+//   ParticleBenchmark.
+// --threads sets the number of threads of ParticleThreadPool, counting the calling thread.
+//
+// Usage: ParticleSystemTests [--max-count n] [--threads n]
+
+#include "ParticleBenchmarkPresets.h"
+#include "ParticleBatchOrder.h"
+#include "ParticleBudget.h"
+#include "ParticleEffectBank.h"
+#include "ParticleMath.h"
+#include "ParticlePool.h"
+#include "ParticlePipeline.h"
+#include "ParticleRandom.h"
+#include "ParticleStats.h"
+#include "ParticleSystem.h"
+#include "ParticleThreadPool.h"
+#include "ParticleUpdateKernel.h"
+
+#include <atomic>
+#include <climits>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+
+// Every operator new of the process, so the allocation check can see any heap use, not only the
+// particle storage of ParticlePool.
+static std::atomic<int> newCount(0);
+
+void* operator new(size_t bytes)
+{
+	++newCount;
+	void* memory = malloc(bytes != 0 ? bytes : 1);
+	if (memory == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void operator delete(void* memory) throw()
+{
+	free(memory);
+}
+
+namespace
+{
+	// Largest capacity of the format check by default. The checks are per particle, so larger emitters
+	// find nothing smaller ones don't.
+	const int DEFAULT_MAX_COUNT = 1000;
+
+	// Capacity and length of the thread check, enough for several chunks of every preset.
+	const int THREAD_CHECK_CAPACITY = 16384;
+	const int THREAD_CHECK_FRAMES = 120;
+
+	// Length of the pipeline check.
+	const int PIPELINE_CHECK_FRAMES = 120;
+
+	// Capacity and length of the effect bank check.
+	const int BANK_CHECK_CAPACITY = 1000;
+	const int BANK_CHECK_FRAMES = 120;
+
+	// Capacity and length of the counter check.
+	const int STATS_CHECK_CAPACITY = 1000;
+	const int STATS_CHECK_FRAMES = 120;
+
+	// Emitters, their capacity and the frames given to settle into or out of the budget in the budget check.
+	const int BUDGET_CHECK_EMITTERS = 3;
+	const int BUDGET_CHECK_CAPACITY = 1000;
+	const int BUDGET_CHECK_FRAMES = 240;
+
+	// Frames of the culling check; every preset is played at THREAD_CHECK_CAPACITY.
+	const int CULL_CHECK_FRAMES = 120;
+
+	// Pool sizes and length of the update kernel check. The sizes are odd, so every vector width leaves
+	// a partial vector at the end, and the first particles are skipped so the vectors start unaligned.
+	const int KERNEL_CHECK_SIZES[] = { 1, 7, 13, 1003 };
+	const int KERNEL_CHECK_BEGIN = 3;
+	const int KERNEL_CHECK_FRAMES = 300;
+
+	// Smallest normal half float, 2^-14. Below it half precision has a fixed absolute error.
+	const float MIN_NORMAL_HALF = 6.103515625e-5f;
+
+	// Largest differences between the quads of BuildVertices and the other formats.
+	struct ExpandError
+	{
+		float position;				// expanded instances, absolute
+		float quantizedPosition;	// quantized vertices, relative to the position
+		float color;				// both, absolute
+		float texcoord;				// both, absolute
+	};
+
+	// Runs the preset for a while and compares every frame's BuildVertices output with the output of
+	// BuildQuantizedVertices and with the quads ExpandParticleInstance makes from BuildInstances.
+	ExpandError VerifyPreset(const BenchmarkPreset& preset, Variant variant, int maxParticles,
+		OutputBuffers& buffers)
+	{
+		ExpandError error;
+		memset(&error, 0, sizeof(error));
+
+		BenchmarkParticleSystem system;
+		if (!InitPreset(system, preset, variant, maxParticles))
+		{
+			fprintf(stderr, "Can't create particle list for %d particles\n", maxParticles);
+			return error;
+		}
+
+		// Map the quads into a sub-rect, as for an effect packed into the texture atlas.
+		ParticleTextureRect textureRect = { 0.25f, 0.5f, 0.375f, 0.6875f };
+		system.SetTextureRect(textureRect);
+
+		int frames = (int)((preset.lifetime + preset.lifetimeVar) / FRAME_TIME) * 2 + 1;
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			if (!system.Simulate(FRAME_TIME))
+			{
+				continue;
+			}
+
+			system.BuildVertices(&buffers.vertices[0]);
+			system.BuildQuantizedVertices(&buffers.quantized[0]);
+			int numInstances = system.BuildInstances(&buffers.instances[0]);
+
+			for (int i = 0; i < numInstances; ++i)
+			{
+				ParticleVertex expanded[4];
+				ExpandParticleInstance(buffers.instances[i], textureRect, expanded);
+
+				for (int corner = 0; corner < 4; ++corner)
+				{
+					const ParticleVertex& a = buffers.vertices[i * 4 + corner];
+					const ParticleVertex& b = expanded[corner];
+					float position = (float)fmax(fabs(a.positionX - b.positionX), fabs(a.positionY - b.positionY));
+					float color = (float)fmax(fmax(fabs(a.red - b.red), fabs(a.green - b.green)),
+						fmax(fabs(a.blue - b.blue), fabs(a.alpha - b.alpha)));
+
+					error.position = (float)fmax(error.position, position);
+					error.color = (float)fmax(error.color, color);
+					error.texcoord = (float)fmax(error.texcoord, fmax(fabs(a.textureU - b.textureU), fabs(a.textureV - b.textureV)));
+
+					// Unpack the quantized vertex the way the input assembler does.
+					const ParticleQuantizedVertex& q = buffers.quantized[i * 4 + corner];
+					float quantizedX = ParticleMath::HalfToFloat(q.positionX);
+					float quantizedY = ParticleMath::HalfToFloat(q.positionY);
+					float relative = (float)fmax(
+						fabs(quantizedX - a.positionX) / fmax(fabs(a.positionX), MIN_NORMAL_HALF),
+						fabs(quantizedY - a.positionY) / fmax(fabs(a.positionY), MIN_NORMAL_HALF));
+					error.quantizedPosition = (float)fmax(error.quantizedPosition, relative);
+
+					float channels[4] = { a.red, a.green, a.blue, a.alpha };
+					for (int channel = 0; channel < 4; ++channel)
+					{
+						float unpacked = (float)((q.color >> (channel * 8)) & 0xFF) / 255.0f;
+						error.color = (float)fmax(error.color, fabs(unpacked - channels[channel]));
+					}
+
+					float quantizedU = (float)q.textureU / 32767.0f;
+					float quantizedV = (float)q.textureV / 32767.0f;
+					error.texcoord = (float)fmax(error.texcoord, fmax(fabs(quantizedU - a.textureU), fabs(quantizedV - a.textureV)));
+				}
+			}
+		}
+
+		return error;
+	}
+
+	// Plays the preset on two emitters with the same seed, one that always runs on the calling thread and
+	// one that is split into chunks as soon as it has more than one, and returns the number of frames
+	// whose particle count or output differ.
+	int VerifyThreads(const BenchmarkPreset& preset, Variant variant, int maxParticles,
+		OutputBuffers& buffers, OutputBuffers& threadedBuffers)
+	{
+		BenchmarkParticleSystem systems[2];
+		for (int s = 0; s < 2; ++s)
+		{
+			if (!InitPreset(systems[s], preset, variant, maxParticles))
+			{
+				fprintf(stderr, "Can't create particle list for %d particles\n", maxParticles);
+				return 1;
+			}
+		}
+		systems[0].SetParallelThreshold(INT_MAX);
+		systems[1].SetParallelThreshold(0);
+
+		int mismatches = 0;
+		for (int frame = 0; frame < THREAD_CHECK_FRAMES; ++frame)
+		{
+			systems[0].Simulate(FRAME_TIME);
+			systems[1].Simulate(FRAME_TIME);
+
+			int count = systems[0].GetParticleCount();
+			if (count != systems[1].GetParticleCount())
+			{
+				++mismatches;
+				continue;
+			}
+
+			// Building every frame would make the check several times slower for little more coverage.
+			if (frame % 8 != 7)
+			{
+				continue;
+			}
+
+			systems[0].BuildVertices(&buffers.vertices[0]);
+			systems[1].BuildVertices(&threadedBuffers.vertices[0]);
+			systems[0].BuildQuantizedVertices(&buffers.quantized[0]);
+			systems[1].BuildQuantizedVertices(&threadedBuffers.quantized[0]);
+			systems[0].BuildInstances(&buffers.instances[0]);
+			systems[1].BuildInstances(&threadedBuffers.instances[0]);
+
+			if (memcmp(&buffers.vertices[0], &threadedBuffers.vertices[0], sizeof(ParticleVertex) * count * 4) != 0 ||
+				memcmp(&buffers.quantized[0], &threadedBuffers.quantized[0], sizeof(ParticleQuantizedVertex) * count * 4) != 0 ||
+				memcmp(&buffers.instances[0], &threadedBuffers.instances[0], sizeof(ParticleInstance) * count) != 0)
+			{
+				++mismatches;
+			}
+		}
+
+		return mismatches;
+	}
+
+	// Plays the preset on two emitters with the same seed, one simulated in place and one through a
+	// ParticlePipeline in 'format', and returns the number of frames whose front buffer isn't the output
+	// the emitter simulated in place built the frame before.
+	int VerifyPipeline(const BenchmarkPreset& preset, Variant variant, int maxParticles,
+		ParticlePipeline::Format format, OutputBuffers& buffers)
+	{
+		BenchmarkParticleSystem systems[2];
+		for (int s = 0; s < 2; ++s)
+		{
+			if (!InitPreset(systems[s], preset, variant, maxParticles))
+			{
+				fprintf(stderr, "Can't create particle list for %d particles\n", maxParticles);
+				return 1;
+			}
+		}
+
+		ParticlePipeline pipeline(systems[1]);
+		pipeline.SetFormat(format);
+
+		int mismatches = 0;
+		int expectedCount = 0;
+		for (int frame = 0; frame < PIPELINE_CHECK_FRAMES; ++frame)
+		{
+			pipeline.Swap();
+			if (pipeline.GetFrontCount() != expectedCount)
+			{
+				++mismatches;
+			}
+			else if (expectedCount > 0)
+			{
+				const void* expected = &buffers.vertices[0];
+				if (format == ParticlePipeline::QuantizedVertices)
+				{
+					expected = &buffers.quantized[0];
+				}
+				else if (format == ParticlePipeline::Instances)
+				{
+					expected = &buffers.instances[0];
+				}
+
+				if (memcmp(pipeline.GetFrontBuffer(), expected, pipeline.GetFrontBytes()) != 0)
+				{
+					++mismatches;
+				}
+			}
+
+			pipeline.Start(FRAME_TIME);
+
+			// The frame the pipeline is simulating meanwhile, in place.
+			if (systems[0].Simulate(FRAME_TIME))
+			{
+				if (format == ParticlePipeline::QuantizedVertices)
+				{
+					expectedCount = systems[0].BuildQuantizedVertices(&buffers.quantized[0]) / 4;
+				}
+				else if (format == ParticlePipeline::Instances)
+				{
+					expectedCount = systems[0].BuildInstances(&buffers.instances[0]);
+				}
+				else
+				{
+					expectedCount = systems[0].BuildVertices(&buffers.vertices[0]) / 4;
+				}
+			}
+		}
+
+		pipeline.Wait();
+		return mismatches;
+	}
+
+	// The preset as a ParticleEffectBank record: the same emitter InitPreset makes, by the other path.
+	ParticleEmitterRecord MakeRecord(const BenchmarkPreset& preset, Variant variant, int maxParticles)
+	{
+		ParticleEmitterRecord record;
+		memset(&record, 0, sizeof(record));
+		strncpy(record.name, preset.name, sizeof(record.name) - 1);
+
+		float averageLifetime = preset.lifetime + preset.lifetimeVar * 0.5f;
+		record.maxParticles = maxParticles;
+		record.emissionRate = (int)(maxParticles / averageLifetime) + 1;
+		record.flags = EmitterAutoPlay;
+		record.flags |= variant == VariantRotated || variant == VariantComplex ? EmitterTextureRotation : 0;
+		record.flags |= variant == VariantKeyed ? EmitterEvaluateKeys : 0;
+		record.flags |= variant == VariantComplex ? EmitterComplexRotation : 0;
+		record.fixedTimeStep = variant == VariantFixed ? FIXED_TIME_STEP : 0.0f;
+		record.maxSteps = FIXED_MAX_STEPS;
+
+		record.devPosX = 0.05f;
+		record.devPosY = 0.05f;
+		record.angle = preset.angle;
+		record.angleVar = preset.angleVar;
+		record.speed = preset.speed;
+		record.speedVar = preset.speedVar;
+		record.startSize = preset.startSize;
+		record.startSizeVar = preset.startSize * 0.25f;
+		record.middleSize = preset.middleSize;
+		record.middleSizeVar = preset.middleSize * 0.25f;
+		record.endSize = preset.endSize;
+		record.endSizeVar = preset.endSize * 0.25f;
+		record.lifetime = variant == VariantInfinite ? -preset.lifetime : preset.lifetime;
+		record.lifetimeVar = preset.lifetimeVar;
+
+		const float startColor[4] = { 1.0f, 1.0f, 1.0f, preset.startAlpha };
+		const float middleColor[4] = { 1.0f, 0.8f, 0.6f, preset.middleAlpha };
+		const float endColor[4] = { 1.0f, 0.5f, 0.2f, preset.endAlpha };
+		const float colorVar[4] = { 0.0f, 0.1f, 0.1f, 0.0f };
+		memcpy(record.startColor, startColor, sizeof(startColor));
+		memcpy(record.middleColor, middleColor, sizeof(middleColor));
+		memcpy(record.endColor, endColor, sizeof(endColor));
+		memcpy(record.startColorVar, colorVar, sizeof(colorVar));
+		memcpy(record.middleColorVar, colorVar, sizeof(colorVar));
+		memcpy(record.endColorVar, colorVar, sizeof(colorVar));
+
+		record.gravityX = preset.gravityX;
+		record.gravityY = preset.gravityY;
+		record.radialAccel = preset.radialAccel;
+		record.radialAccelVar = preset.radialAccel * 0.5f;
+		record.tangentialAccel = preset.tangentialAccel;
+		record.tangentialAccelVar = preset.tangentialAccel * 0.5f;
+		record.duration = -1.0f;
+		record.rotationSpeed = preset.rotationSpeed;
+		record.rotationSpeedVar = preset.rotationSpeed * 0.5f;
+		return record;
+	}
+
+	// Writes every preset into an effect bank, maps it, and plays each preset on an emitter initialized
+	// from the mapped record and on one initialized by InitPreset. Returns the number of frames whose
+	// vertices differ, or of presets the bank doesn't find.
+	int VerifyBank(OutputBuffers& buffers, OutputBuffers& bankBuffers)
+	{
+		// One file per thread count, so the runs CTest starts side by side don't share it.
+		char path[64];
+		sprintf(path, "ParticleSystemTests%d.pfxb", ParticleThreadPool::GetInstance().GetThreadCount());
+		std::vector<ParticleEmitterRecord> records;
+		for (int e = 0; e < NUM_PRESETS; ++e)
+		{
+			records.push_back(MakeRecord(PRESETS[e], (Variant)(e % NumVariants), BANK_CHECK_CAPACITY));
+		}
+
+		ParticleEffectBank bank;
+		if (!ParticleEffectBank::Write(path, &records[0], NUM_PRESETS) || !bank.Open(path))
+		{
+			fprintf(stderr, "Can't write and map %s\n", path);
+			remove(path);
+			return 1;
+		}
+
+		int mismatches = 0;
+		for (int e = 0; e < NUM_PRESETS; ++e)
+		{
+			const ParticleEmitterRecord* record = bank.FindEffect(PRESETS[e].name);
+			if (record == nullptr || bank.GetEffectCount() != NUM_PRESETS)
+			{
+				++mismatches;
+				continue;
+			}
+
+			BenchmarkParticleSystem systems[2];
+			systems[1].SetRandomSeed(1);
+			if (!InitPreset(systems[0], PRESETS[e], (Variant)(e % NumVariants), BANK_CHECK_CAPACITY) ||
+				!systems[1].InitParticleProperties(*record))
+			{
+				fprintf(stderr, "Can't create particle list for %d particles\n", BANK_CHECK_CAPACITY);
+				++mismatches;
+				continue;
+			}
+
+			for (int frame = 0; frame < BANK_CHECK_FRAMES; ++frame)
+			{
+				systems[0].Simulate(FRAME_TIME);
+				systems[1].Simulate(FRAME_TIME);
+				int numVertices = systems[0].BuildVertices(&buffers.vertices[0]);
+				if (systems[1].BuildVertices(&bankBuffers.vertices[0]) != numVertices ||
+					memcmp(&buffers.vertices[0], &bankBuffers.vertices[0], sizeof(ParticleVertex) * numVertices) != 0)
+				{
+					++mismatches;
+				}
+			}
+		}
+
+		bank.Close();
+		remove(path);
+		return mismatches;
+	}
+
+	// Plays an emitter stage by stage, counting what it does, and returns the number of ParticleStats
+	// summaries of it that disagree: one sample per stage and frame, with the particles it spawned,
+	// updated, killed and built, and durations in order. Without the counters there must be no samples.
+	int VerifyStats(OutputBuffers& buffers)
+	{
+		ParticleStats::Clear();
+
+		BenchmarkParticleSystem system;
+		if (!InitPreset(system, PRESETS[0], VariantBase, STATS_CHECK_CAPACITY))
+		{
+			fprintf(stderr, "Can't create particle list for %d particles\n", STATS_CHECK_CAPACITY);
+			return 1;
+		}
+
+		uint64_t expected[NUM_PARTICLE_STAGES][3];	// particles, spawned, killed
+		memset(expected, 0, sizeof(expected));
+		for (int frame = 0; frame < STATS_CHECK_FRAMES; ++frame)
+		{
+			int before = system.GetParticleCount();
+			system.Emit(FRAME_TIME);
+			expected[ParticleStageEmit][1] += system.GetParticleCount() - before;
+
+			expected[ParticleStageUpdate][0] += system.GetParticleCount();
+			int numExpired = system.Update(FRAME_TIME);
+			expected[ParticleStageUpdate][2] += numExpired;
+
+			system.Kill(numExpired);
+			expected[ParticleStageKill][2] += numExpired;
+
+			expected[ParticleStageBuild][0] += system.BuildVertices(&buffers.vertices[0]) / 4;
+		}
+
+		int mismatches = 0;
+		for (int stage = ParticleStageEmit; stage <= ParticleStageBuild; ++stage)
+		{
+			ParticleStageSummary summary;
+			bool found = ParticleStats::Query(&system, (ParticleStage)stage, &summary);
+#ifdef PARTICLE_NO_STATS
+			mismatches += found ? 1 : 0;
+#else
+			bool ordered = summary.minNanoseconds <= summary.averageNanoseconds && summary.averageNanoseconds <= summary.maxNanoseconds &&
+				summary.minNanoseconds <= summary.p99Nanoseconds && summary.p99Nanoseconds <= summary.maxNanoseconds;
+			if (!found || summary.samples != STATS_CHECK_FRAMES || !ordered || summary.particles != expected[stage][0] ||
+				summary.spawned != expected[stage][1] || summary.killed != expected[stage][2])
+			{
+				++mismatches;
+			}
+#endif
+		}
+
+		return mismatches;
+	}
+
+	// Simulates the budget check emitters for 'frames' frames, updating ParticleBudget after each, and
+	// returns their live particles.
+	int RunBudgetFrames(BenchmarkParticleSystem* systems, int frames)
+	{
+		int liveParticles = 0;
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			liveParticles = 0;
+			for (int s = 0; s < BUDGET_CHECK_EMITTERS; ++s)
+			{
+				systems[s].Simulate(FRAME_TIME);
+				liveParticles += systems[s].GetParticleCount();
+			}
+			ParticleBudget::GetInstance().Update(FRAME_TIME);
+		}
+		return liveParticles;
+	}
+
+	// Plays emitters of decreasing priority in ParticleBudget: within a particle budget of half their
+	// capacity the first keeps all of its share, the second gets half and the third none; without it they
+	// all get their share back. Within a time budget of half of what they take, they must spend clearly
+	// less. Emitting a tenth as fast, they need far less than their capacity and must keep all of their
+	// share within the same particle budget. Returns the number of checks that failed.
+	int VerifyBudget()
+	{
+		ParticleBudget& budget = ParticleBudget::GetInstance();
+		BenchmarkParticleSystem systems[BUDGET_CHECK_EMITTERS];
+		for (int s = 0; s < BUDGET_CHECK_EMITTERS; ++s)
+		{
+			if (!InitPreset(systems[s], PRESETS[1], VariantBase, BUDGET_CHECK_CAPACITY))
+			{
+				fprintf(stderr, "Can't create particle list for %d particles\n", BUDGET_CHECK_CAPACITY);
+				return 1;
+			}
+			systems[s].SetBudgetPriority(BUDGET_CHECK_EMITTERS - s);
+			budget.Add(&systems[s]);
+		}
+
+		int failures = 0;
+		const int particleBudget = BUDGET_CHECK_EMITTERS * BUDGET_CHECK_CAPACITY / 2;
+		budget.SetParticleBudget(particleBudget);
+		int throttled = RunBudgetFrames(systems, BUDGET_CHECK_FRAMES);
+		printf("budget check: %d live particles within a budget of %d, shares %g %g %g\n", throttled, particleBudget,
+			systems[0].GetBudgetShare(), systems[1].GetBudgetShare(), systems[2].GetBudgetShare());
+		if (throttled > particleBudget || systems[0].GetBudgetShare() != 1.0f || systems[1].GetBudgetShare() != 0.5f ||
+			systems[2].GetBudgetShare() != 0.0f)
+		{
+			++failures;
+		}
+
+		budget.SetParticleBudget(0);
+		int restored = RunBudgetFrames(systems, BUDGET_CHECK_FRAMES);
+		float unthrottledTime = budget.GetSimulationTime();
+		printf("budget check: %d live particles without a budget, %g ms\n", restored, unthrottledTime);
+		if (restored <= particleBudget || systems[1].GetBudgetShare() != 1.0f || systems[2].GetBudgetShare() != 1.0f)
+		{
+			++failures;
+		}
+
+		budget.SetTimeBudget(unthrottledTime * 0.5f);
+		throttled = RunBudgetFrames(systems, BUDGET_CHECK_FRAMES);
+		printf("budget check: %d live particles within a budget of %g ms, %g ms\n", throttled, budget.GetTimeBudget(),
+			budget.GetSimulationTime());
+		if (throttled > restored * 3 / 4)
+		{
+			++failures;
+		}
+
+		budget.SetTimeBudget(0.0f);
+		budget.SetParticleBudget(particleBudget);
+		for (int s = 0; s < BUDGET_CHECK_EMITTERS; ++s)
+		{
+			systems[s].SetEmissionRate(systems[s].GetEmissionRate() / 10);
+		}
+		int sparse = RunBudgetFrames(systems, BUDGET_CHECK_FRAMES);
+		printf("budget check: %d live particles emitting a tenth as fast, shares %g %g %g\n", sparse,
+			systems[0].GetBudgetShare(), systems[1].GetBudgetShare(), systems[2].GetBudgetShare());
+		if (sparse > particleBudget || systems[0].GetBudgetShare() != 1.0f || systems[1].GetBudgetShare() != 1.0f ||
+			systems[2].GetBudgetShare() != 1.0f)
+		{
+			++failures;
+		}
+
+		budget.SetParticleBudget(0);
+		for (int s = 0; s < BUDGET_CHECK_EMITTERS; ++s)
+		{
+			budget.Remove(&systems[s]);
+		}
+		return failures;
+	}
+
+	// Whether the quad of 'vertices' is entirely outside 'view'.
+	bool IsQuadOutside(const ParticleVertex* vertices, const ParticleBounds& view)
+	{
+		bool left = true, right = true, below = true, above = true;
+		for (int corner = 0; corner < 4; ++corner)
+		{
+			left = left && vertices[corner].positionX < view.minX;
+			right = right && vertices[corner].positionX > view.maxX;
+			below = below && vertices[corner].positionY < view.minY;
+			above = above && vertices[corner].positionY > view.maxY;
+		}
+		return left || right || below || above;
+	}
+
+	// Plays the preset on two emitters with the same seed, the second split into chunks and culled against
+	// the left half of the bounds of the first. The quads it builds must be the ones of the first, in the
+	// same order, less only quads entirely outside the view, and the bounds must hold every quad. A view
+	// away from all the particles must leave nothing to build. Returns the number of frames that fail.
+	int VerifyCulling(const BenchmarkPreset& preset, Variant variant, OutputBuffers& buffers,
+		OutputBuffers& culledBuffers, int* numQuads, int* numCulled)
+	{
+		BenchmarkParticleSystem systems[2];
+		for (int s = 0; s < 2; ++s)
+		{
+			if (!InitPreset(systems[s], preset, variant, THREAD_CHECK_CAPACITY))
+			{
+				fprintf(stderr, "Can't create particle list for %d particles\n", THREAD_CHECK_CAPACITY);
+				return 1;
+			}
+		}
+		systems[1].SetParallelThreshold(0);
+
+		int failures = 0;
+		for (int frame = 0; frame < CULL_CHECK_FRAMES; ++frame)
+		{
+			systems[0].Simulate(FRAME_TIME);
+			systems[1].Simulate(FRAME_TIME);
+
+			ParticleBounds bounds;
+			if (frame % 8 != 7 || !systems[0].GetBounds(&bounds))
+			{
+				continue;
+			}
+
+			ParticleBounds view = { bounds.minX, bounds.minY, (bounds.minX + bounds.maxX) * 0.5f, bounds.maxY };
+			systems[1].SetViewBounds(view);
+
+			int count = systems[0].BuildVertices(&buffers.vertices[0]) / 4;
+			int culledCount = systems[1].BuildVertices(&culledBuffers.vertices[0]) / 4;
+			bool failed = systems[1].BuildInstances(&culledBuffers.instances[0]) != culledCount;
+
+			int kept = 0;
+			for (int q = 0; q < count && !failed; ++q)
+			{
+				const ParticleVertex* quad = &buffers.vertices[q * 4];
+				for (int corner = 0; corner < 4; ++corner)
+				{
+					failed = failed || quad[corner].positionX < bounds.minX || quad[corner].positionX > bounds.maxX ||
+						quad[corner].positionY < bounds.minY || quad[corner].positionY > bounds.maxY;
+				}
+
+				if (kept < culledCount && memcmp(quad, &culledBuffers.vertices[kept * 4], sizeof(ParticleVertex) * 4) == 0)
+				{
+					++kept;
+				}
+				else if (!IsQuadOutside(quad, view))
+				{
+					failed = true;
+				}
+			}
+			failed = failed || kept != culledCount;
+
+			// Nothing is built for a view away from the particles.
+			ParticleBounds away = { bounds.maxX + 1.0f, bounds.maxY + 1.0f, bounds.maxX + 2.0f, bounds.maxY + 2.0f };
+			systems[1].SetViewBounds(away);
+			failed = failed || !systems[1].IsOffscreen() || systems[1].BuildVertices(&culledBuffers.vertices[0]) != 0;
+			systems[1].ClearViewBounds();
+
+			*numQuads += count;
+			*numCulled += count - culledCount;
+			failures += failed ? 1 : 0;
+		}
+
+		return failures;
+	}
+
+	// Creates, plays, replays and retires emitters of every preset and capacity, like a level does, and
+	// returns the heap allocations the second round made. The first round warms the block cache up.
+	int VerifyAllocations(int maxCount)
+	{
+		int allocations = 0;
+
+		for (int round = 0; round < 2; ++round)
+		{
+			int heapBefore = ParticlePool::GetHeapAllocationCount();
+			int newBefore = newCount;
+
+			for (int e = 0; e < NUM_PRESETS; ++e)
+			{
+				for (int count = 100; count <= maxCount && count <= 10000; count *= 10)
+				{
+					// Several emitters alive at once, the way overlapping effects are.
+					BenchmarkParticleSystem systems[3];
+					for (int s = 0; s < 3; ++s)
+					{
+						InitPreset(systems[s], PRESETS[e], (Variant)(s % NumVariants), count);
+						for (int frame = 0; frame < 10; ++frame)
+						{
+							systems[s].Simulate(FRAME_TIME);
+						}
+
+						// Replay resets the particles in place.
+						systems[s].Play(true);
+						systems[s].Simulate(FRAME_TIME);
+					}
+				}
+			}
+
+			allocations = (ParticlePool::GetHeapAllocationCount() - heapBefore) + (newCount - newBefore);
+			printf("allocation check round %d: %d pool blocks, %d operator new\n", round,
+				ParticlePool::GetHeapAllocationCount() - heapBefore, newCount - newBefore);
+		}
+
+		return allocations;
+	}
+
+	// Runs every specialization of the update kernels on two copies of a random pool, one scalar and one
+	// SIMD, and counts the frames whose expired lists differ and the values that differ in any bit at
+	// the end. Some particles sit on the start position, where radial acceleration has no direction,
+	// and some have a size of -0, so the edge cases are covered too. Some turn fast the negative way,
+	// as rotationSpeedVar often makes them, and the angles of both kernels must still stay in
+	// [-2 pi, 2 pi], where ParticleMath::SinCos is accurate: they start in [-1, 1] and wrap by 2 pi.
+	int VerifyUpdateKernels()
+	{
+		#define PARTICLE_ALL_UPDATE_STREAMS(X) PARTICLE_POOL_STREAMS(X) PARTICLE_POOL_COMPLEX_ROTATION_STREAMS(X)
+
+		int mismatches = 0;
+		ParticleRandom random(1);
+		ParticlePool scalarPool;
+		ParticlePool simdPool;
+
+		// Same order as the kernel table: radial, gravity, infinite lifetime, then the key and rotation modes.
+		for (int kernel = 0; kernel < 8 * 9; ++kernel)
+		{
+			int keys = (kernel >> 3) % 3;
+			int rotation = (kernel >> 3) / 3;
+
+			ParticleUpdateParams params;
+			params.startPosX = 0.1f;
+			params.startPosY = -0.2f;
+			params.gravityX = (kernel & 2) != 0 ? 0.01f : 0.0f;
+			params.gravityY = (kernel & 2) != 0 ? -0.3f : 0.0f;
+			params.radialEnabled = (kernel & 1) != 0;
+			params.infiniteLifetime = (kernel & 4) != 0;
+			params.constantKeys = keys == 0;
+			params.evaluateKeys = keys == 2;
+			params.rotationEnabled = rotation != 0;
+			params.complexRotation = rotation == 2;
+
+			for (int s = 0; s < (int)(sizeof(KERNEL_CHECK_SIZES) / sizeof(KERNEL_CHECK_SIZES[0])); ++s)
+			{
+				int size = KERNEL_CHECK_SIZES[s];
+				int begin = size > KERNEL_CHECK_BEGIN ? KERNEL_CHECK_BEGIN : 0;
+				scalarPool.Allocate(size, ParticlePool::ComplexRotationStreams);
+				simdPool.Allocate(size, ParticlePool::ComplexRotationStreams);
+
+				#define PARTICLE_FILL_STREAM(name) random.FillMinus1To1(scalarPool.name, size);
+				PARTICLE_ALL_UPDATE_STREAMS(PARTICLE_FILL_STREAM)
+				#undef PARTICLE_FILL_STREAM
+
+				for (int i = 0; i < size; ++i)
+				{
+					scalarPool.lifetime[i] = 2.0f * random.Next0To1();
+					scalarPool.halfLifeTime[i] = scalarPool.lifetime[i] * 0.5f;
+					scalarPool.size[i] = i % 11 == 0 ? -0.0f : 0.1f * random.Next0To1();
+					scalarPool.radialAccel[i] = random.Next0To1();
+					scalarPool.tangentialAccel[i] = random.Next0To1();
+					if (i % 3 == 0)
+					{
+						scalarPool.rotateSpeed[i] = -10.0f * random.Next0To1();
+					}
+					if (i % 7 == 0)
+					{
+						scalarPool.positionX[i] = params.startPosX;
+						scalarPool.positionY[i] = params.startPosY;
+					}
+				}
+
+				#define PARTICLE_COPY_STREAM(name) memcpy(simdPool.name, scalarPool.name, size * sizeof(float));
+				PARTICLE_ALL_UPDATE_STREAMS(PARTICLE_COPY_STREAM)
+				#undef PARTICLE_COPY_STREAM
+
+				for (int frame = 0; frame < KERNEL_CHECK_FRAMES; ++frame)
+				{
+					params.delta = 0.001f + 0.049f * random.Next0To1();
+					int scalarExpired = UpdateParticlesScalar(scalarPool, begin, size, params, scalarPool.expired);
+					int simdExpired = UpdateParticlesSimd(simdPool, begin, size, params, simdPool.expired);
+					if (scalarExpired != simdExpired ||
+						memcmp(scalarPool.expired, simdPool.expired, scalarExpired * sizeof(int)) != 0)
+					{
+						++mismatches;
+					}
+				}
+
+				for (int i = 0; i < size; ++i)
+				{
+					#define PARTICLE_COMPARE_STREAM(name) \
+						mismatches += memcmp(&scalarPool.name[i], &simdPool.name[i], sizeof(float)) != 0 ? 1 : 0;
+					PARTICLE_ALL_UPDATE_STREAMS(PARTICLE_COMPARE_STREAM)
+					#undef PARTICLE_COMPARE_STREAM
+
+					if (rotation == 1 && (fabsf(scalarPool.rotation[i]) > ParticleMath::TWO_PI ||
+						fabsf(simdPool.rotation[i]) > ParticleMath::TWO_PI))
+					{
+						++mismatches;
+					}
+				}
+			}
+		}
+
+		#undef PARTICLE_ALL_UPDATE_STREAMS
+		return mismatches;
+	}
+
+	// One emitter of a batch order case, in submission order, and the batch it must be drawn in.
+	struct BatchOrderEmitter
+	{
+		int textureKey;
+		bool additive;
+		bool hasBounds;
+		ParticleBounds bounds;
+		int batch;
+	};
+
+	// Batch order cases of three emitters each. Alpha blended emitters are only merged past the emitters
+	// in between when they don't overlap, additive ones also past other additive ones.
+	const int BATCH_ORDER_CASES = 6;
+	const BatchOrderEmitter BATCH_ORDER_EMITTERS[BATCH_ORDER_CASES][3] =
+	{
+		// A, B, A, on top of each other: C must stay above B.
+		{ { 1, false, true, { 0, 0, 1, 1 }, 0 }, { 2, false, true, { 0, 0, 1, 1 }, 1 }, { 1, false, true, { 0, 0, 1, 1 }, 2 } },
+		// The same additively: the sums don't depend on the order.
+		{ { 1, true, true, { 0, 0, 1, 1 }, 0 }, { 2, true, true, { 0, 0, 1, 1 }, 1 }, { 1, true, true, { 0, 0, 1, 1 }, 0 } },
+		// B is elsewhere on screen.
+		{ { 1, false, true, { 0, 0, 1, 1 }, 0 }, { 2, false, true, { 2, 2, 3, 3 }, 1 }, { 1, false, true, { 0, 0, 1, 1 }, 0 } },
+		// Additive A and C around an alpha blended B.
+		{ { 1, true, true, { 0, 0, 1, 1 }, 0 }, { 2, false, true, { 0, 0, 1, 1 }, 1 }, { 1, true, true, { 0, 0, 1, 1 }, 2 } },
+		// B has no bounds, so it overlaps everything.
+		{ { 1, false, true, { 0, 0, 1, 1 }, 0 }, { 2, false, false, { 0, 0, 0, 0 }, 1 }, { 1, false, true, { 2, 2, 3, 3 }, 2 } },
+		// Consecutive emitters always share a batch.
+		{ { 1, false, true, { 0, 0, 1, 1 }, 0 }, { 1, false, true, { 0, 0, 1, 1 }, 0 }, { 2, false, true, { 0, 0, 1, 1 }, 1 } },
+	};
+
+	// Returns the number of emitters of BATCH_ORDER_EMITTERS that ParticleBatchOrder puts in another batch.
+	int VerifyBatchOrder()
+	{
+		// Values of BlendStates, which the headless build doesn't have.
+		const int BLEND_ADDITIVE = 0;
+		const int BLEND_ALPHA = 2;
+
+		int mismatches = 0;
+		ParticleBatchOrder order;
+		for (int c = 0; c < BATCH_ORDER_CASES; ++c)
+		{
+			order.Clear();
+			for (int e = 0; e < 3; ++e)
+			{
+				const BatchOrderEmitter& emitter = BATCH_ORDER_EMITTERS[c][e];
+				int batch = order.Add(emitter.textureKey, emitter.additive ? BLEND_ADDITIVE : BLEND_ALPHA, emitter.additive,
+					emitter.hasBounds ? &emitter.bounds : nullptr);
+				if (batch != emitter.batch)
+				{
+					printf("batch order case %d: emitter %d drawn in batch %d instead of %d\n", c, e, batch, emitter.batch);
+					++mismatches;
+				}
+			}
+		}
+
+		return mismatches;
+	}
+
+	// Largest difference between SinCosSimd and libm over [-8192, 8192], in steps fine enough to hit every
+	// quadrant boundary from both sides. Counts the results that differ from ParticleMath::SinCos, which
+	// the vector version must match exactly.
+	float VerifySinCos(int* mismatches)
+	{
+		const int BATCH = 1024;
+		float angles[BATCH];
+		float sines[BATCH];
+		float cosines[BATCH];
+		double maxError = 0.0;
+		*mismatches = 0;
+
+		double angle = -8192.0;
+		while (angle <= 8192.0)
+		{
+			for (int i = 0; i < BATCH; ++i)
+			{
+				angles[i] = (float)angle;
+				angle += fabs(angle) < 8.0 ? 1.0e-5 : 1.0e-3;
+			}
+
+			SinCosSimd(angles, sines, cosines, BATCH);
+
+			for (int i = 0; i < BATCH; ++i)
+			{
+				float sine, cosine;
+				ParticleMath::SinCos(angles[i], &sine, &cosine);
+				if (memcmp(&sine, &sines[i], sizeof(float)) != 0 || memcmp(&cosine, &cosines[i], sizeof(float)) != 0)
+				{
+					++*mismatches;
+				}
+
+				maxError = fmax(maxError, fabs(sines[i] - sin((double)angles[i])));
+				maxError = fmax(maxError, fabs(cosines[i] - cos((double)angles[i])));
+			}
+		}
+
+		return (float)maxError;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int maxCount = DEFAULT_MAX_COUNT;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--max-count") == 0 && i + 1 < argc)
+		{
+			maxCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			ParticleThreadPool::GetInstance().SetThreadCount(atoi(argv[++i]));
+		}
+		else
+		{
+			printf("Usage: %s [--max-count n] [--threads n]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	OutputBuffers buffers;
+	buffers.vertices.resize((size_t)maxCount * 4);
+	buffers.quantized.resize((size_t)maxCount * 4);
+	buffers.instances.resize((size_t)maxCount);
+
+	// Colors lose precision when packed into 8 bits per channel, and quantized positions when rounded to
+	// half precision, and quantized texcoords when scaled to 16 bits; instance positions must match exactly.
+	const float MAX_COLOR_ERROR = 0.5f / 255.0f + 1e-6f;
+	const float MAX_TEXCOORD_ERROR = 0.5f / 32767.0f + 1e-6f;
+	const float MAX_HALF_ERROR = 1.0f / 2048.0f;
+	const float MAX_SINCOS_ERROR = 2.0e-7f;
+
+	// Instances carry the rotation as an angle, which ComplexRotation recovers with atan2, so there the
+	// expanded corners can be a few ulps off.
+	const float MAX_COMPLEX_POSITION_ERROR = 1.0e-5f;
+	int failures = 0;
+
+	printf("%-18s %-9s %9s %14s %14s %14s %14s\n",
+		"effect", "variant", "capacity", "position err", "half rel err", "color err", "texcoord err");
+
+	for (int e = 0; e < NUM_PRESETS; ++e)
+	{
+		for (int v = 0; v < NumVariants; ++v)
+		{
+			for (int count = 100; count <= maxCount; count *= 10)
+			{
+				const BenchmarkPreset& preset = PRESETS[e];
+				ExpandError error = VerifyPreset(preset, (Variant)v, count, buffers);
+				float maxPositionError = v == VariantComplex ? MAX_COMPLEX_POSITION_ERROR : 0.0f;
+				bool failed = error.position > maxPositionError || error.quantizedPosition > MAX_HALF_ERROR ||
+					error.color > MAX_COLOR_ERROR || error.texcoord > MAX_TEXCOORD_ERROR;
+				printf("%-18s %-9s %9d %14g %14g %14g %14g%s\n",
+					preset.name, VARIANT_NAMES[v], count, error.position, error.quantizedPosition, error.color,
+					error.texcoord, failed ? "  FAILED" : "");
+				failures += failed ? 1 : 0;
+			}
+		}
+	}
+
+	int kernelMismatches = VerifyUpdateKernels();
+	printf("update kernel check: %d frames or values differ between the SIMD and the scalar kernels, or angles out of range\n",
+		kernelMismatches);
+	if (kernelMismatches != 0)
+	{
+		printf("FAILED: update kernels\n");
+		++failures;
+	}
+
+	int mismatches = 0;
+	float sinCosError = VerifySinCos(&mismatches);
+	printf("sincos check: %g max error against libm, %d results differ from the scalar version\n", sinCosError, mismatches);
+	if (sinCosError > MAX_SINCOS_ERROR || mismatches != 0)
+	{
+		printf("FAILED: sincos\n");
+		++failures;
+	}
+
+	OutputBuffers threadedBuffers;
+	if (buffers.vertices.size() < (size_t)THREAD_CHECK_CAPACITY * 4)
+	{
+		buffers.vertices.resize((size_t)THREAD_CHECK_CAPACITY * 4);
+		buffers.quantized.resize((size_t)THREAD_CHECK_CAPACITY * 4);
+		buffers.instances.resize((size_t)THREAD_CHECK_CAPACITY);
+	}
+	threadedBuffers.vertices.resize((size_t)THREAD_CHECK_CAPACITY * 4);
+	threadedBuffers.quantized.resize((size_t)THREAD_CHECK_CAPACITY * 4);
+	threadedBuffers.instances.resize((size_t)THREAD_CHECK_CAPACITY);
+
+	int threadMismatches = 0;
+	for (int e = 0; e < NUM_PRESETS; ++e)
+	{
+		threadMismatches += VerifyThreads(PRESETS[e], (Variant)(e % NumVariants), THREAD_CHECK_CAPACITY, buffers, threadedBuffers);
+	}
+	printf("thread check: %d threads, %d frames differ from a single thread\n",
+		ParticleThreadPool::GetInstance().GetThreadCount(), threadMismatches);
+	if (threadMismatches != 0)
+	{
+		printf("FAILED: threads\n");
+		++failures;
+	}
+
+	int pipelineMismatches = 0;
+	for (int e = 0; e < NUM_PRESETS; ++e)
+	{
+		ParticlePipeline::Format format = (ParticlePipeline::Format)(e % 3);
+		pipelineMismatches += VerifyPipeline(PRESETS[e], (Variant)(e % NumVariants), THREAD_CHECK_CAPACITY, format, buffers);
+	}
+	printf("pipeline check: %d frames differ from the emitter simulated in place\n", pipelineMismatches);
+	if (pipelineMismatches != 0)
+	{
+		printf("FAILED: pipeline\n");
+		++failures;
+	}
+
+	int bankMismatches = VerifyBank(buffers, threadedBuffers);
+	printf("bank check: %d frames differ from emitters initialized by InitParticleProperties\n", bankMismatches);
+	if (bankMismatches != 0)
+	{
+		printf("FAILED: bank\n");
+		++failures;
+	}
+
+	int statsMismatches = VerifyStats(buffers);
+	printf("stats check: %d stage summaries disagree with the emitter\n", statsMismatches);
+	if (statsMismatches != 0)
+	{
+		printf("FAILED: stats\n");
+		++failures;
+	}
+
+	int budgetFailures = VerifyBudget();
+	if (budgetFailures != 0)
+	{
+		printf("FAILED: budget\n");
+		++failures;
+	}
+
+	int cullFailures = 0;
+	int numQuads = 0;
+	int numCulled = 0;
+	for (int e = 0; e < NUM_PRESETS; ++e)
+	{
+		cullFailures += VerifyCulling(PRESETS[e], (Variant)(e % NumVariants), buffers, threadedBuffers, &numQuads, &numCulled);
+	}
+	printf("cull check: %d of %d quads culled, %d frames culled quads in view\n", numCulled, numQuads, cullFailures);
+	if (cullFailures != 0 || numCulled == 0)
+	{
+		printf("FAILED: culling\n");
+		++failures;
+	}
+
+	int batchOrderMismatches = VerifyBatchOrder();
+	printf("batch order check: %d of %d emitters in the wrong batch\n", batchOrderMismatches, BATCH_ORDER_CASES * 3);
+	if (batchOrderMismatches != 0)
+	{
+		printf("FAILED: batch order\n");
+		++failures;
+	}
+
+	int allocations = VerifyAllocations(maxCount);
+	if (allocations != 0)
+	{
+		printf("FAILED: %d heap allocations after warm-up\n", allocations);
+		++failures;
+	}
+
+	printf(failures != 0 ? "%d checks FAILED\n" : "all checks passed\n", failures);
+	return failures != 0 ? 1 : 0;
+}
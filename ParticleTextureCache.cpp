@@ -0,0 +1,128 @@
+﻿#include "pch.h"
+#include "ParticleTextureCache.h"
+#ifdef PARTICLE_USE_ATLAS
+#include "ParticleAtlas.h"
+#endif
+
+using namespace Microsoft::WRL;
+using namespace LanguageGameWp8DxComponent;
+
+#ifdef PARTICLE_USE_ATLAS
+const int NUM_TEXTURE_KEYS = PARTICLE_ATLAS_NUM_PAGES;
+#else
+const int NUM_TEXTURE_KEYS = (int)ParticleEffect::NumOfEffects;
+#endif
+
+ParticleTexture::ParticleTexture() :
+	m_state(Loading)
+{
+}
+
+ParticleTextureCache& ParticleTextureCache::GetInstance()
+{
+	static ParticleTextureCache instance;
+	return instance;
+}
+
+ParticleTextureCache::ParticleTextureCache() :
+	m_loader(nullptr)
+	,m_textures(NUM_TEXTURE_KEYS)
+	,m_loadCount(0)
+{
+}
+
+int ParticleTextureCache::GetTextureKey(ParticleEffect effectId)
+{
+#ifdef PARTICLE_USE_ATLAS
+	return PARTICLE_ATLAS_ENTRIES[(int)effectId].page;
+#else
+	return (int)effectId;
+#endif
+}
+
+ParticleTextureHandle ParticleTextureCache::Acquire(ComPtr<ID3D11Device1> d3dDevice, ParticleEffect effectId)
+{
+	// Textures belong to the device that created them; after a device change they are all recreated.
+	if (m_d3dDevice.Get() != d3dDevice.Get())
+	{
+		Clear();
+		m_d3dDevice = d3dDevice;
+		m_loader = ref new BasicLoader(m_d3dDevice.Get());
+	}
+
+	int textureKey = GetTextureKey(effectId);
+	if (m_textures[textureKey] == nullptr)
+	{
+		m_textures[textureKey] = Load(textureKey);
+	}
+
+	return m_textures[textureKey];
+}
+
+Concurrency::task<void> ParticleTextureCache::Preload(ComPtr<ID3D11Device1> d3dDevice, const ParticleEffect* effectIds, int numEffects)
+{
+	std::vector<Concurrency::task<void>> loadTasks;
+	for (int i = 0; i < numEffects; ++i)
+	{
+		ParticleTextureHandle texture = Acquire(d3dDevice, effectIds[i]);
+		loadTasks.push_back(texture->m_loadTask);
+	}
+
+	if (loadTasks.empty())
+	{
+		return Concurrency::create_task([] {});
+	}
+
+	return Concurrency::when_all(loadTasks.begin(), loadTasks.end());
+}
+
+void ParticleTextureCache::Trim()
+{
+	for (size_t i = 0; i < m_textures.size(); ++i)
+	{
+		// Only the cache holds it.
+		if (m_textures[i] != nullptr && m_textures[i].use_count() == 1 && m_textures[i]->GetState() != ParticleTexture::Loading)
+		{
+			m_textures[i] = nullptr;
+		}
+	}
+}
+
+void ParticleTextureCache::Clear()
+{
+	for (size_t i = 0; i < m_textures.size(); ++i)
+	{
+		m_textures[i] = nullptr;
+	}
+}
+
+ParticleTextureHandle ParticleTextureCache::Load(int textureKey)
+{
+#ifdef PARTICLE_USE_ATLAS
+	Platform::String^ fileName = ref new Platform::String(PARTICLE_ATLAS_PAGES[textureKey]);
+#else
+	Platform::String^ fileName = ref new Platform::String(PARTICLE_TEXTURES[textureKey]);
+#endif
+
+	ParticleTextureHandle texture = std::make_shared<ParticleTexture>();
+	++m_loadCount;
+
+	// The file is read asynchronously and the texture created on the thread pool. The continuation holds
+	// the texture, so the view it is written to stays alive even if the cache and emitters drop it meanwhile.
+	texture->m_loadTask = m_loader->LoadTextureAsync(fileName, nullptr, &texture->m_textureView).then([texture](Concurrency::task<void> loadTask)
+	{
+		try
+		{
+			loadTask.get();
+			texture->m_state = ParticleTexture::Ready;
+		}
+		catch (Platform::Exception^)
+		{
+			OutputDebugString(L"FAILED to LoadTexture");
+			texture->m_textureView = nullptr;
+			texture->m_state = ParticleTexture::Failed;
+		}
+	});
+
+	return texture;
+}
@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "ParticleEnums.h"
+#include "Engine\Common\BasicLoader.h"
+
+// A particle texture shared by every emitter whose effect draws from it. Textures are created by
+// ParticleTextureCache and load asynchronously, so the view is only valid once IsReady returns true.
+class ParticleTexture
+{
+public:
+
+	enum State
+	{
+		Loading,
+		Ready,
+		Failed
+	};
+
+	ParticleTexture();
+
+	State GetState() const { return (State)m_state.load(); }
+	bool IsReady() const { return GetState() == Ready; }
+
+	// nullptr until the texture is ready.
+	ID3D11ShaderResourceView* GetView() const { return IsReady() ? m_textureView.Get() : nullptr; }
+
+private:
+
+	friend class ParticleTextureCache;
+
+	// Written by the load continuation, before m_state is set to Ready or Failed.
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> m_textureView;
+	std::atomic<int> m_state;
+
+	Concurrency::task<void> m_loadTask;
+
+	// Copying is not allowed.
+	ParticleTexture(const ParticleTexture&);
+	ParticleTexture& operator=(const ParticleTexture&);
+};
+
+// Emitters hold a handle for as long as they draw with the texture.
+typedef std::shared_ptr<ParticleTexture> ParticleTextureHandle;
+
+// Process-wide cache of the particle textures, so every file is read and uploaded once no matter how
+// many emitters use it. Textures stay cached after their last emitter releases them, until Trim, so
+// emitters spawned again later don't reload them either.
+//
+// The cache is used from the rendering thread; only the file reads and texture creation run on the
+// thread pool.
+class ParticleTextureCache
+{
+public:
+
+	static ParticleTextureCache& GetInstance();
+
+	// Texture an effect draws from: its atlas page with PARTICLE_USE_ATLAS, otherwise its own texture.
+	// Effects with the same key share a texture.
+	static int GetTextureKey(LanguageGameWp8DxComponent::ParticleEffect effectId);
+
+	// Returns the effect's texture, starting to load it if it isn't cached. The returned texture may
+	// still be loading. A different device than the one of the cached textures empties the cache first.
+	ParticleTextureHandle Acquire(
+		Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice,
+		LanguageGameWp8DxComponent::ParticleEffect effectId);
+
+	// Starts loading the textures of the effects, typically ahead of a scene, so emitters of these
+	// effects don't wait on them when they are spawned. The task completes once they have all loaded
+	// or failed; it doesn't need to be waited on.
+	Concurrency::task<void> Preload(
+		Microsoft::WRL::ComPtr<ID3D11Device1> d3dDevice,
+		const LanguageGameWp8DxComponent::ParticleEffect* effectIds,
+		int numEffects);
+
+	// Releases the cached textures no emitter holds anymore, e.g. when leaving a scene. Textures that are
+	// still loading are kept.
+	void Trim();
+
+	// Releases every cached texture; emitters keep the ones they hold until they release them.
+	void Clear();
+
+	// Number of texture loads started since the cache was created, for profiling.
+	int GetLoadCount() const { return m_loadCount; }
+
+private:
+
+	ParticleTextureCache();
+
+	ParticleTextureHandle Load(int textureKey);
+
+	Microsoft::WRL::ComPtr<ID3D11Device1> m_d3dDevice;
+	BasicLoader^ m_loader;
+
+	std::vector<ParticleTextureHandle> m_textures;	// indexed by texture key, nullptr when not cached
+	int m_loadCount;
+
+	// Copying is not allowed.
+	ParticleTextureCache(const ParticleTextureCache&);
+	ParticleTextureCache& operator=(const ParticleTextureCache&);
+};
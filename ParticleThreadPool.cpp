@@ -0,0 +1,262 @@
+﻿#include "ParticleThreadPool.h"
+
+ParticleThreadPool& ParticleThreadPool::GetInstance()
+{
+	static ParticleThreadPool instance;
+	return instance;
+}
+
+ParticleThreadPool::ParticleThreadPool() :
+	m_queuedChunks(0)
+	,m_nextQueue(0)
+	,m_stopping(false)
+{
+	int count = (int)std::thread::hardware_concurrency();
+	StartWorkers(count > 0 ? count - 1 : 0);
+}
+
+ParticleThreadPool::~ParticleThreadPool()
+{
+	StopWorkers();
+}
+
+void ParticleThreadPool::SetThreadCount(int count)
+{
+	if (count < 1)
+	{
+		count = 1;
+	}
+
+	if (count != GetThreadCount())
+	{
+		StopWorkers();
+		StartWorkers(count - 1);
+	}
+}
+
+void ParticleThreadPool::StartWorkers(int count)
+{
+	m_queues.resize(count);
+	for (int worker = 0; worker < count; ++worker)
+	{
+		m_queues[worker].reset(new Queue());
+		m_queues[worker]->first = 0;
+		m_queues[worker]->count = 0;
+	}
+
+	m_workers.reserve(count);
+	for (int worker = 0; worker < count; ++worker)
+	{
+		m_workers.push_back(std::thread(&ParticleThreadPool::WorkerMain, this, worker));
+	}
+}
+
+void ParticleThreadPool::StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_wakeLock);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+
+	for (size_t worker = 0; worker < m_workers.size(); ++worker)
+	{
+		m_workers[worker].join();
+	}
+
+	m_workers.clear();
+	m_queues.clear();
+	m_stopping = false;
+}
+
+void ParticleThreadPool::ParallelFor(int count, int chunkSize, ParticleRangeFunction function, void* context)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	if (chunkSize <= 0 || chunkSize > count)
+	{
+		chunkSize = count;
+	}
+
+	// Without workers the chunks run one after the other, still split the same way.
+	int numChunks = (count + chunkSize - 1) / chunkSize;
+	if (numChunks == 1 || m_queues.empty())
+	{
+		for (int begin = 0; begin < count; begin += chunkSize)
+		{
+			function(context, begin, begin + chunkSize < count ? begin + chunkSize : count);
+		}
+		return;
+	}
+
+	Task task;
+	task.m_function = function;
+	task.m_context = context;
+	task.m_remaining = numChunks;
+
+	// The calling thread runs the first chunk itself instead of queuing it.
+	QueueChunks(task, count, chunkSize, 1);
+
+	Chunk first;
+	first.task = &task;
+	first.begin = 0;
+	first.end = chunkSize;
+	RunChunk(first);
+
+	Wait(task);
+}
+
+void ParticleThreadPool::Start(Task& task, int count, int chunkSize, ParticleRangeFunction function, void* context)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	if (chunkSize <= 0 || chunkSize > count)
+	{
+		chunkSize = count;
+	}
+
+	task.m_function = function;
+	task.m_context = context;
+	task.m_remaining = (count + chunkSize - 1) / chunkSize;
+
+	if (m_queues.empty())
+	{
+		for (int begin = 0; begin < count; begin += chunkSize)
+		{
+			Chunk chunk;
+			chunk.task = &task;
+			chunk.begin = begin;
+			chunk.end = begin + chunkSize < count ? begin + chunkSize : count;
+			RunChunk(chunk);
+		}
+		return;
+	}
+
+	QueueChunks(task, count, chunkSize, 0);
+}
+
+void ParticleThreadPool::Wait(Task& task)
+{
+	// Help with whatever is queued, this task's chunks or not, until the last chunk of the task is done.
+	while (task.m_remaining > 0)
+	{
+		Chunk chunk;
+		if (TakeChunk(task.m_firstQueue, &chunk))
+		{
+			RunChunk(chunk);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ParticleThreadPool::QueueChunks(Task& task, int count, int chunkSize, int firstChunk)
+{
+	// Chunks are dealt out in contiguous runs, one run per queue, starting from a different queue
+	// every time so concurrent loops spread out.
+	int numQueues = (int)m_queues.size();
+	int numChunks = (count + chunkSize - 1) / chunkSize;
+	int numQueued = numChunks - firstChunk;
+	task.m_firstQueue = m_nextQueue++ % numQueues;
+
+	for (int c = firstChunk; c < numChunks; ++c)
+	{
+		Chunk chunk;
+		chunk.task = &task;
+		chunk.begin = c * chunkSize;
+		chunk.end = chunk.begin + chunkSize < count ? chunk.begin + chunkSize : count;
+
+		Queue& queue = *m_queues[(task.m_firstQueue + (c - firstChunk) * numQueues / numQueued) % numQueues];
+		bool queued = false;
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.count < QUEUE_CAPACITY)
+			{
+				queue.chunks[(queue.first + queue.count) % QUEUE_CAPACITY] = chunk;
+				++queue.count;
+				++m_queuedChunks;
+				queued = true;
+			}
+		}
+
+		if (!queued)
+		{
+			RunChunk(chunk);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_wakeLock);
+	}
+	m_wake.notify_all();
+}
+
+void ParticleThreadPool::WorkerMain(int worker)
+{
+	for (;;)
+	{
+		Chunk chunk;
+		if (TakeChunk(worker, &chunk))
+		{
+			RunChunk(chunk);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_wakeLock);
+		m_wake.wait(lock, [this] { return m_stopping || m_queuedChunks > 0; });
+		if (m_stopping)
+		{
+			return;
+		}
+	}
+}
+
+bool ParticleThreadPool::TakeChunk(int worker, Chunk* chunk)
+{
+	if (m_queuedChunks <= 0)
+	{
+		return false;
+	}
+
+	int numQueues = (int)m_queues.size();
+	for (int n = 0; n < numQueues; ++n)
+	{
+		Queue& queue = *m_queues[(worker + n) % numQueues];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.count == 0)
+		{
+			continue;
+		}
+
+		if (n == 0)
+		{
+			*chunk = queue.chunks[queue.first];
+			queue.first = (queue.first + 1) % QUEUE_CAPACITY;
+		}
+		else
+		{
+			*chunk = queue.chunks[(queue.first + queue.count - 1) % QUEUE_CAPACITY];
+		}
+		--queue.count;
+		--m_queuedChunks;
+		return true;
+	}
+
+	return false;
+}
+
+void ParticleThreadPool::RunChunk(const Chunk& chunk)
+{
+	chunk.task->m_function(chunk.task->m_context, chunk.begin, chunk.end);
+
+	// Last use of the task: once every chunk is done, Wait returns and the task may go away.
+	--chunk.task->m_remaining;
+}
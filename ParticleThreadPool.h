@@ -0,0 +1,117 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Called for the items [begin, end) of a ParticleThreadPool::ParallelFor.
+typedef void (*ParticleRangeFunction)(void* context, int begin, int end);
+
+// Process-wide pool of worker threads that splits the loops over the particles of one large emitter,
+// so its update and vertex build use every core instead of one.
+//
+// A loop is cut into chunks, dealt out in contiguous runs to the queues of the workers. A worker runs
+// the chunks of its own queue front to back and, once it is empty, steals from the back of the others,
+// so threads that finish early take over the work of slower ones. A thread waiting for a loop steals
+// chunks too until the loop is done, so it never just waits.
+class ParticleThreadPool
+{
+public:
+
+	// A loop started with Start. It must stay alive until Wait returns.
+	class Task
+	{
+	public:
+
+		Task() : m_function(nullptr), m_context(nullptr), m_remaining(0), m_firstQueue(0) {}
+
+		bool IsDone() const { return m_remaining == 0; }
+
+	private:
+
+		friend class ParticleThreadPool;
+
+		ParticleRangeFunction m_function;
+		void* m_context;
+		std::atomic<int> m_remaining;	// chunks that haven't finished
+		int m_firstQueue;				// queue the first chunks were dealt to
+
+		// Copying is not allowed.
+		Task(const Task&);
+		Task& operator=(const Task&);
+	};
+
+	static ParticleThreadPool& GetInstance();
+
+	// Threads that run the chunks of a loop, counting the calling thread. Defaults to the number of
+	// hardware threads.
+	int GetThreadCount() const { return (int)m_workers.size() + 1; }
+
+	// Replaces the workers with count - 1 new ones; 1 runs every loop on the calling thread.
+	// Must not be called while a loop is running.
+	void SetThreadCount(int count);
+
+	// Calls 'function' for chunks of 'chunkSize' items covering [0, count) and returns once they have
+	// all run. The chunks run in any order and on any thread, so each must only write its own items.
+	// Loops may be started from several threads at once. Doesn't allocate.
+	void ParallelFor(int count, int chunkSize, ParticleRangeFunction function, void* context);
+
+	// Same as ParallelFor, but returns as soon as the chunks are queued, so the caller can work on
+	// something else meanwhile. Without workers the loop runs before Start returns.
+	void Start(Task& task, int count, int chunkSize, ParticleRangeFunction function, void* context);
+
+	// Runs queued chunks, of this task or others, until every chunk of the task is done. Returns at once
+	// for a task that is done or was never started.
+	void Wait(Task& task);
+
+private:
+
+	// Chunks queued per worker before further ones run on the calling thread instead.
+	static const int QUEUE_CAPACITY = 256;
+
+	struct Chunk
+	{
+		Task* task;
+		int begin, end;
+	};
+
+	// Ring buffer of the chunks waiting to run. The owner takes them from the front, thieves from the back.
+	struct Queue
+	{
+		std::mutex lock;
+		Chunk chunks[QUEUE_CAPACITY];
+		int first;
+		int count;
+	};
+
+	ParticleThreadPool();
+	~ParticleThreadPool();
+
+	void StartWorkers(int count);
+	void StopWorkers();
+	void WorkerMain(int worker);
+
+	// Queues chunks [firstChunk, numChunks) of the task and wakes the workers.
+	void QueueChunks(Task& task, int count, int chunkSize, int firstChunk);
+
+	// Takes the next chunk of queue 'worker', or steals one from another queue.
+	bool TakeChunk(int worker, Chunk* chunk);
+	static void RunChunk(const Chunk& chunk);
+
+	std::vector<std::thread> m_workers;
+	std::vector<std::unique_ptr<Queue>> m_queues;	// one per worker
+	std::atomic<int> m_queuedChunks;				// in every queue
+	std::atomic<int> m_nextQueue;					// first queue the next loop deals chunks to
+
+	// Idle workers sleep until chunks are queued or they are stopped.
+	std::mutex m_wakeLock;
+	std::condition_variable m_wake;
+	bool m_stopping;
+
+	// Copying is not allowed.
+	ParticleThreadPool(const ParticleThreadPool&);
+	ParticleThreadPool& operator=(const ParticleThreadPool&);
+};
@@ -0,0 +1,57 @@
+﻿#include "ParticleToolFiles.h"
+
+#include <stdio.h>
+
+bool ReadFile(const std::string& path, std::vector<uint8_t>& data)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data.resize(size > 0 ? (size_t)size : 0);
+	bool ok = size > 0 && fread(&data[0], 1, data.size(), file) == data.size();
+	fclose(file);
+	return ok;
+}
+
+bool ReadTextureNames(const std::string& enumsPath, std::vector<std::string>& names)
+{
+	std::vector<uint8_t> data;
+	if (!ReadFile(enumsPath, data))
+	{
+		fprintf(stderr, "Can't read %s\n", enumsPath.c_str());
+		return false;
+	}
+
+	std::string text(data.begin(), data.end());
+	size_t table = text.find("PARTICLE_TEXTURES[]");
+	if (table == std::string::npos)
+	{
+		fprintf(stderr, "%s has no PARTICLE_TEXTURES table\n", enumsPath.c_str());
+		return false;
+	}
+
+	size_t end = text.find("};", table);
+	size_t pos = table;
+	while ((pos = text.find("L\"", pos)) != std::string::npos && pos < end)
+	{
+		size_t close = text.find('"', pos + 2);
+		std::string path = text.substr(pos + 2, close - pos - 2);
+
+		// Keep the file name only: "Assets\\Particles\\bubble.dds" -> "bubble".
+		size_t slash = path.find_last_of("\\/");
+		std::string file = (slash == std::string::npos) ? path : path.substr(slash + 1);
+		size_t dot = file.rfind('.');
+		names.push_back(dot == std::string::npos ? file : file.substr(0, dot));
+
+		pos = close + 1;
+	}
+
+	return !names.empty();
+}
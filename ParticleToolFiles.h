@@ -0,0 +1,15 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// File helpers shared by the offline build steps, ParticleAtlasTool and ParticleBankTool. Both index the
+// textures by their position in PARTICLE_TEXTURES, so they read the table with the same parser.
+
+// Read a whole file. Returns false if it can't be read or is empty.
+bool ReadFile(const std::string& path, std::vector<uint8_t>& data);
+
+// The texture file names listed in the PARTICLE_TEXTURES table of ParticleEnums.h, in ParticleEffect
+// order, without folder or extension: "Assets\\Particles\\bubble.dds" gives "bubble".
+bool ReadTextureNames(const std::string& enumsPath, std::vector<std::string>& names);
@@ -0,0 +1,487 @@
+﻿#include "ParticleUpdateKernel.h"
+#include "ParticleMath.h"
+#include "ParticleSimd.h"
+#include <math.h>
+
+using namespace ParticleMath;
+
+namespace
+{
+	enum KeyFeature
+	{
+		KeysConstant,		// nothing to do
+		KeysIntegrated,		// colors and size advanced by their deltas
+		KeysEvaluated		// keys only reversed when an infinite particle restarts
+	};
+
+	enum RotationFeature
+	{
+		RotationNone,
+		RotationAngle,
+		RotationComplex
+	};
+
+	// Kernel index: radial | gravity << 1 | infinite << 2 | (keys + 3 * rotation) << 3.
+	const int NUM_KERNELS = 8 * 9;
+
+	// The features of kernel 'Index', as compile-time constants, so the branches on them fold away.
+	template <int Index>
+	struct Features
+	{
+		static const bool radial = (Index & 1) != 0;
+		static const bool gravity = (Index & 2) != 0;
+		static const bool infinite = (Index & 4) != 0;
+		static const int keys = (Index >> 3) % 3;
+		static const int rotation = (Index >> 3) / 3;
+	};
+
+	int GetKernelIndex(const ParticleUpdateParams& params)
+	{
+		int keys = params.constantKeys ? KeysConstant : (params.evaluateKeys ? KeysEvaluated : KeysIntegrated);
+		int rotation = !params.rotationEnabled ? RotationNone : (params.complexRotation ? RotationComplex : RotationAngle);
+		bool gravity = params.gravityX != 0.0f || params.gravityY != 0.0f;
+		return (params.radialEnabled ? 1 : 0) | (gravity ? 2 : 0) | (params.infiniteLifetime ? 4 : 0) | ((keys + 3 * rotation) << 3);
+	}
+
+	// Table of the 72 specializations of a kernel template, in index order.
+	#define PARTICLE_KERNELS_8(kernel, first) \
+		&kernel<(first)>, &kernel<(first) + 1>, &kernel<(first) + 2>, &kernel<(first) + 3>, \
+		&kernel<(first) + 4>, &kernel<(first) + 5>, &kernel<(first) + 6>, &kernel<(first) + 7>
+	#define PARTICLE_KERNELS(kernel) \
+		PARTICLE_KERNELS_8(kernel, 0), PARTICLE_KERNELS_8(kernel, 8), PARTICLE_KERNELS_8(kernel, 16), \
+		PARTICLE_KERNELS_8(kernel, 24), PARTICLE_KERNELS_8(kernel, 32), PARTICLE_KERNELS_8(kernel, 40), \
+		PARTICLE_KERNELS_8(kernel, 48), PARTICLE_KERNELS_8(kernel, 56), PARTICLE_KERNELS_8(kernel, 64)
+
+	typedef int (*UpdateKernel)(ParticlePool& pool, int begin, int end, const ParticleUpdateParams& params, int* expired);
+
+	template <int Index>
+	void UpdateParticle(ParticlePool& p, int i, const ParticleUpdateParams& params)
+	{
+		typedef Features<Index> F;
+		const float delta = params.delta;
+
+		if (F::radial || F::gravity)
+		{
+			float forcesX = 0.0f;
+			float forcesY = 0.0f;
+
+			if (F::radial)
+			{
+				float radialX = 0.0f;
+				float radialY = 0.0f;
+
+				// dont apply radial forces until moved away from the emitter
+				if (p.positionX[i] != params.startPosX || p.positionY[i] != params.startPosY)
+				{
+					radialX = p.positionX[i] - params.startPosX;
+					radialY = p.positionY[i] - params.startPosY;
+
+					// normalize
+					float length = sqrtf(radialX * radialX + radialY * radialY);
+					radialX /= length;
+					radialY /= length;
+				}
+
+				float tangentialX = -radialY * p.tangentialAccel[i];
+				float tangentialY = radialX * p.tangentialAccel[i];
+
+				forcesX = radialX * p.radialAccel[i] + tangentialX;
+				forcesY = radialY * p.radialAccel[i] + tangentialY;
+			}
+
+			if (F::gravity)
+			{
+				forcesX += params.gravityX;
+				forcesY += params.gravityY;
+			}
+
+			p.velocityX[i] += forcesX * delta;
+			p.velocityY[i] += forcesY * delta;
+		}
+
+		p.positionX[i] += p.velocityX[i] * delta;
+		p.positionY[i] += p.velocityY[i] * delta;
+
+		if (F::rotation == RotationComplex)
+		{
+			// Rotate by the step, then scale back onto the unit circle (one Newton step towards 1 / length),
+			// so rounding errors don't accumulate into a scale.
+			float rotationCos = p.rotationCos[i] * p.rotationStepCos[i] - p.rotationSin[i] * p.rotationStepSin[i];
+			float rotationSin = p.rotationSin[i] * p.rotationStepCos[i] + p.rotationCos[i] * p.rotationStepSin[i];
+			float scale = 1.5f - 0.5f * (rotationCos * rotationCos + rotationSin * rotationSin);
+			p.rotationCos[i] = rotationCos * scale;
+			p.rotationSin[i] = rotationSin * scale;
+		}
+		else if (F::rotation == RotationAngle)
+		{
+			// Continuous rotation in a circle based on speed in radians. Wrapped both ways, so the angle
+			// stays in the range ParticleMath::SinCos is accurate in whichever way the particle turns.
+			p.rotation[i] += (p.rotateSpeed[i] * delta);
+			if (p.rotation[i] > TWO_PI)
+			{
+				p.rotation[i] -= TWO_PI;
+			}
+			else if (p.rotation[i] < 0.0f)
+			{
+				p.rotation[i] += TWO_PI;
+			}
+		}
+
+		// Evaluated from the age when the vertices are built instead, or constant.
+		if (F::keys != KeysIntegrated)
+		{
+			return;
+		}
+
+		if (p.lifetime[i] >= p.halfLifeTime[i])
+		{
+			p.red[i] += Clamp(p.redDelta1[i] * delta, -1.0f, 1.0f);
+			p.green[i] += Clamp(p.greenDelta1[i] * delta, -1.0f, 1.0f);
+			p.blue[i] += Clamp(p.blueDelta1[i] * delta, -1.0f, 1.0f);
+			p.alpha[i] += Clamp(p.alphaDelta1[i] * delta, -1.0f, 1.0f);
+
+			p.size[i] += (p.sizeDelta1[i] * delta);
+		}
+		else
+		{
+			p.red[i] += Clamp(p.redDelta2[i] * delta, -1.0f, 1.0f);
+			p.green[i] += Clamp(p.greenDelta2[i] * delta, -1.0f, 1.0f);
+			p.blue[i] += Clamp(p.blueDelta2[i] * delta, -1.0f, 1.0f);
+			p.alpha[i] += Clamp(p.alphaDelta2[i] * delta, -1.0f, 1.0f);
+
+			p.size[i] += (p.sizeDelta2[i] * delta);
+		}
+
+		p.red[i] = Clamp(p.red[i], 0.0f, 1.0f);
+		p.green[i] = Clamp(p.green[i], 0.0f, 1.0f);
+		p.blue[i] = Clamp(p.blue[i], 0.0f, 1.0f);
+		p.alpha[i] = Clamp(p.alpha[i], 0.0f, 1.0f);
+
+		p.size[i] = Max(0.0f, p.size[i]);
+	}
+
+	// Swap the start and end keys, so the particle plays them backwards on its next lifetime.
+	void ReverseKeys(ParticlePool& p, int i)
+	{
+		float* starts[5] = { p.red, p.green, p.blue, p.alpha, p.size };
+		float* ends[5] = { p.redDelta2, p.greenDelta2, p.blueDelta2, p.alphaDelta2, p.sizeDelta2 };
+		for (int key = 0; key < 5; ++key)
+		{
+			float temp = starts[key][i];
+			starts[key][i] = ends[key][i];
+			ends[key][i] = temp;
+		}
+	}
+
+	template <int Index>
+	int UpdateParticlesScalarKernel(ParticlePool& p, int begin, int end, const ParticleUpdateParams& params, int* expired)
+	{
+		typedef Features<Index> F;
+		float* lifetime = p.lifetime;
+		int numExpired = 0;
+
+		for (int i = begin; i < end; ++i)
+		{
+			lifetime[i] -= params.delta;
+			if (lifetime[i] > 0.0f)
+			{
+				UpdateParticle<Index>(p, i, params);
+			}
+			else if (F::infinite)
+			{
+				// Ran out of time on previous particle, but continue to update particle by resetting lifetime
+				// back to original time and playing the color/size keys in reverse.
+				lifetime[i] = p.halfLifeTime[i] * 2.0f;
+
+				if (F::keys == KeysEvaluated)
+				{
+					ReverseKeys(p, i);
+				}
+				else if (F::keys == KeysIntegrated)
+				{
+					float temp = -p.sizeDelta2[i];
+					p.sizeDelta2[i] = -p.sizeDelta1[i];
+					p.sizeDelta1[i] = temp;
+
+					temp = -p.redDelta2[i];
+					p.redDelta2[i] = -p.redDelta1[i];
+					p.redDelta1[i] = temp;
+
+					temp = -p.greenDelta2[i];
+					p.greenDelta2[i] = -p.greenDelta1[i];
+					p.greenDelta1[i] = temp;
+
+					temp = -p.blueDelta2[i];
+					p.blueDelta2[i] = -p.blueDelta1[i];
+					p.blueDelta1[i] = temp;
+
+					temp = -p.alphaDelta2[i];
+					p.alphaDelta2[i] = -p.alphaDelta1[i];
+					p.alphaDelta1[i] = temp;
+				}
+
+				UpdateParticle<Index>(p, i, params);
+			}
+			else
+			{
+				expired[numExpired++] = i;
+			}
+		}
+
+		return numExpired;
+	}
+
+	const UpdateKernel SCALAR_KERNELS[NUM_KERNELS] = { PARTICLE_KERNELS(UpdateParticlesScalarKernel) };
+}
+
+int UpdateParticlesScalar(ParticlePool& p, int begin, int end, const ParticleUpdateParams& params, int* expired)
+{
+	return SCALAR_KERNELS[GetKernelIndex(params)](p, begin, end, params, expired);
+}
+
+#if defined(PARTICLE_SIMD_SCALAR)
+
+void SinCosSimd(const float* angles, float* sines, float* cosines, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		SinCos(angles[i], sines + i, cosines + i);
+	}
+}
+
+int UpdateParticlesSimd(ParticlePool& p, int begin, int end, const ParticleUpdateParams& params, int* expired)
+{
+	return UpdateParticlesScalar(p, begin, end, params, expired);
+}
+
+#else
+
+namespace
+{
+	using namespace ParticleSimd;
+
+	// Swap the start->middle and middle->end deltas of the expired lanes, negated, so the
+	// particle plays its keys backwards on the next lifetime.
+	inline void ReverseDeltas(Mask expired, float* delta1, float* delta2, int i)
+	{
+		Float d1 = Load(delta1 + i);
+		Float d2 = Load(delta2 + i);
+		Store(delta1 + i, Select(expired, Neg(d2), d1));
+		Store(delta2 + i, Select(expired, Neg(d1), d2));
+	}
+
+	// Swap the start and end keys of the expired lanes.
+	inline void ReverseKeys(Mask expired, float* start, float* end, int i)
+	{
+		Float s = Load(start + i);
+		Float e = Load(end + i);
+		Store(start + i, Select(expired, e, s));
+		Store(end + i, Select(expired, s, e));
+	}
+
+	// Advance one color channel, picking the delta for the current half of the lifetime per lane.
+	inline Float UpdateColor(Float value, Mask firstHalf, Float delta1, Float delta2, Float delta, Float zero, Float one)
+	{
+		Float change = Mul(Select(firstHalf, delta1, delta2), delta);
+		value = Add(value, Clamp(change, Neg(one), one));
+		return Clamp(value, zero, one);
+	}
+}
+
+void SinCosSimd(const float* angles, float* sines, float* cosines, int count)
+{
+	int i = 0;
+	for (; i + WIDTH <= count; i += WIDTH)
+	{
+		Float sine, cosine;
+		SinCos(Load(angles + i), &sine, &cosine);
+		Store(sines + i, sine);
+		Store(cosines + i, cosine);
+	}
+
+	for (; i < count; ++i)
+	{
+		ParticleMath::SinCos(angles[i], sines + i, cosines + i);
+	}
+}
+
+namespace
+{
+	template <int Index>
+	int UpdateParticlesSimdKernel(ParticlePool& p, int begin, int end, const ParticleUpdateParams& params, int* expired)
+	{
+		typedef Features<Index> F;
+		const int ALL_LANES = (1 << WIDTH) - 1;
+		int numExpired = 0;
+
+		const Float zero = Set(0.0f);
+		const Float one = Set(1.0f);
+		const Float two = Set(2.0f);
+		const Float twoPi = Set(TWO_PI);
+		const Float delta = Set(params.delta);
+		const Float startPosX = Set(params.startPosX);
+		const Float startPosY = Set(params.startPosY);
+		const Float gravityX = Set(params.gravityX);
+		const Float gravityY = Set(params.gravityY);
+
+		int i = begin;
+		for (; i + WIDTH <= end; i += WIDTH)
+		{
+			Float lifetime = Sub(Load(p.lifetime + i), delta);
+			Mask alive = CmpGt(lifetime, zero);
+
+			// Lanes whose results are kept. Finite particles that just expired are left untouched
+			// and recorded for KillParticles; infinite ones restart and keep updating.
+			Mask update = alive;
+			if (!F::infinite)
+			{
+				int aliveLanes = MoveMask(alive);
+				if (aliveLanes != ALL_LANES)
+				{
+					for (int lane = 0; lane < WIDTH; ++lane)
+					{
+						if ((aliveLanes & (1 << lane)) == 0)
+						{
+							expired[numExpired++] = i + lane;
+						}
+					}
+				}
+			}
+			else
+			{
+				Float halfLifeTime = Load(p.halfLifeTime + i);
+				lifetime = Select(alive, lifetime, Mul(halfLifeTime, two));
+
+				Mask restarted = Not(alive);
+				if (F::keys == KeysEvaluated)
+				{
+					ReverseKeys(restarted, p.size, p.sizeDelta2, i);
+					ReverseKeys(restarted, p.red, p.redDelta2, i);
+					ReverseKeys(restarted, p.green, p.greenDelta2, i);
+					ReverseKeys(restarted, p.blue, p.blueDelta2, i);
+					ReverseKeys(restarted, p.alpha, p.alphaDelta2, i);
+				}
+				else if (F::keys == KeysIntegrated)
+				{
+					ReverseDeltas(restarted, p.sizeDelta1, p.sizeDelta2, i);
+					ReverseDeltas(restarted, p.redDelta1, p.redDelta2, i);
+					ReverseDeltas(restarted, p.greenDelta1, p.greenDelta2, i);
+					ReverseDeltas(restarted, p.blueDelta1, p.blueDelta2, i);
+					ReverseDeltas(restarted, p.alphaDelta1, p.alphaDelta2, i);
+				}
+
+				update = AllTrue();
+			}
+			Store(p.lifetime + i, lifetime);
+
+			if (!Any(update))
+			{
+				continue;
+			}
+
+			Float positionX = Load(p.positionX + i);
+			Float positionY = Load(p.positionY + i);
+			Float velocityX = Load(p.velocityX + i);
+			Float velocityY = Load(p.velocityY + i);
+
+			if (F::radial || F::gravity)
+			{
+				Float forcesX = zero;
+				Float forcesY = zero;
+
+				if (F::radial)
+				{
+					// dont apply radial forces until moved away from the emitter
+					Mask moved = Or(CmpNeq(positionX, startPosX), CmpNeq(positionY, startPosY));
+
+					Float offsetX = Sub(positionX, startPosX);
+					Float offsetY = Sub(positionY, startPosY);
+					Float length = Sqrt(Add(Mul(offsetX, offsetX), Mul(offsetY, offsetY)));
+
+					// Lanes still sitting on the emitter divide 0 by 0 here; their result is discarded.
+					Float radialX = Select(moved, Div(offsetX, length), zero);
+					Float radialY = Select(moved, Div(offsetY, length), zero);
+
+					Float radialAccel = Load(p.radialAccel + i);
+					Float tangentialAccel = Load(p.tangentialAccel + i);
+					forcesX = Add(Mul(radialX, radialAccel), Mul(Neg(radialY), tangentialAccel));
+					forcesY = Add(Mul(radialY, radialAccel), Mul(radialX, tangentialAccel));
+				}
+
+				if (F::gravity)
+				{
+					forcesX = Add(forcesX, gravityX);
+					forcesY = Add(forcesY, gravityY);
+				}
+
+				Float oldVelocityX = velocityX;
+				Float oldVelocityY = velocityY;
+				velocityX = Add(oldVelocityX, Mul(forcesX, delta));
+				velocityY = Add(oldVelocityY, Mul(forcesY, delta));
+				Store(p.velocityX + i, Select(update, velocityX, oldVelocityX));
+				Store(p.velocityY + i, Select(update, velocityY, oldVelocityY));
+			}
+
+			Store(p.positionX + i, Select(update, Add(positionX, Mul(velocityX, delta)), positionX));
+			Store(p.positionY + i, Select(update, Add(positionY, Mul(velocityY, delta)), positionY));
+
+			if (F::rotation == RotationComplex)
+			{
+				// Rotate by the step, then scale back onto the unit circle.
+				Float rotationCos = Load(p.rotationCos + i);
+				Float rotationSin = Load(p.rotationSin + i);
+				Float stepCos = Load(p.rotationStepCos + i);
+				Float stepSin = Load(p.rotationStepSin + i);
+				Float newCos = Sub(Mul(rotationCos, stepCos), Mul(rotationSin, stepSin));
+				Float newSin = Add(Mul(rotationSin, stepCos), Mul(rotationCos, stepSin));
+				Float scale = Sub(Set(1.5f), Mul(Set(0.5f), Add(Mul(newCos, newCos), Mul(newSin, newSin))));
+				Store(p.rotationCos + i, Select(update, Mul(newCos, scale), rotationCos));
+				Store(p.rotationSin + i, Select(update, Mul(newSin, scale), rotationSin));
+			}
+			else if (F::rotation == RotationAngle)
+			{
+				// Continuous rotation in a circle based on speed in radians, wrapped both ways.
+				Float rotation = Load(p.rotation + i);
+				Float newRotation = Add(rotation, Mul(Load(p.rotateSpeed + i), delta));
+				newRotation = Select(CmpGt(newRotation, twoPi), Sub(newRotation, twoPi),
+					Select(CmpLt(newRotation, zero), Add(newRotation, twoPi), newRotation));
+				Store(p.rotation + i, Select(update, newRotation, rotation));
+			}
+
+			// Evaluated from the age when the vertices are built instead, or constant.
+			if (F::keys != KeysIntegrated)
+			{
+				continue;
+			}
+
+			// Start->middle while at least half the lifetime remains, middle->end afterwards.
+			Mask firstHalf = CmpGe(lifetime, Load(p.halfLifeTime + i));
+
+			Float red = Load(p.red + i);
+			Float green = Load(p.green + i);
+			Float blue = Load(p.blue + i);
+			Float alpha = Load(p.alpha + i);
+			Store(p.red + i, Select(update, UpdateColor(red, firstHalf, Load(p.redDelta1 + i), Load(p.redDelta2 + i), delta, zero, one), red));
+			Store(p.green + i, Select(update, UpdateColor(green, firstHalf, Load(p.greenDelta1 + i), Load(p.greenDelta2 + i), delta, zero, one), green));
+			Store(p.blue + i, Select(update, UpdateColor(blue, firstHalf, Load(p.blueDelta1 + i), Load(p.blueDelta2 + i), delta, zero, one), blue));
+			Store(p.alpha + i, Select(update, UpdateColor(alpha, firstHalf, Load(p.alphaDelta1 + i), Load(p.alphaDelta2 + i), delta, zero, one), alpha));
+
+			Float size = Load(p.size + i);
+			Float sizeDelta = Select(firstHalf, Load(p.sizeDelta1 + i), Load(p.sizeDelta2 + i));
+			Float newSize = Max(zero, Add(size, Mul(sizeDelta, delta)));
+			Store(p.size + i, Select(update, newSize, size));
+		}
+
+		// Remainder that does not fill a whole vector.
+		return numExpired + UpdateParticlesScalarKernel<Index>(p, i, end, params, expired + numExpired);
+	}
+
+	const UpdateKernel SIMD_KERNELS[NUM_KERNELS] = { PARTICLE_KERNELS(UpdateParticlesSimdKernel) };
+}
+
+int UpdateParticlesSimd(ParticlePool& p, int begin, int end, const ParticleUpdateParams& params, int* expired)
+{
+	return SIMD_KERNELS[GetKernelIndex(params)](p, begin, end, params, expired);
+}
+
+#endif
@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include "ParticlePool.h"
+
+// Per-frame emitter values the update kernels need, gathered once instead of read per particle.
+struct ParticleUpdateParams
+{
+	float delta;
+	float startPosX, startPosY;
+	float gravityX, gravityY;
+	bool radialEnabled;			// emitter has radial or tangential acceleration
+	bool infiniteLifetime;		// particles ping-pong between their start and end values forever
+	bool evaluateKeys;			// color and size streams hold keys, evaluated when building vertices instead of integrated
+	bool constantKeys;			// no middle or end keys: color and size never change, nothing to integrate or reverse
+	bool rotationEnabled;		// the texture rotates; otherwise the rotation isn't drawn and isn't advanced
+	bool complexRotation;		// rotation is rotationCos/rotationSin, multiplied by the rotation step instead of advanced by rotateSpeed
+};
+
+// Both kernels come in one specialization per combination of the features above, and of zero or
+// nonzero gravity, so an emitter only runs the code of the features it uses: a preset with gravity
+// and a color fade doesn't test for radial acceleration or rotate anything per particle. The
+// specialization is picked once per call from the params.
+
+// Age and integrate particles [begin, end) of the pool, one particle at a time.
+// The indices of particles whose lifetime ran out are appended to 'expired' in ascending order,
+// and their count is returned; expired particles are left untouched otherwise.
+// This is the reference implementation the vector kernel must match bit for bit.
+int UpdateParticlesScalar(ParticlePool& pool, int begin, int end, const ParticleUpdateParams& params, int* expired);
+
+// ParticleMath::SinCos of 'count' angles, ParticleSimd::WIDTH at a time. 'sines' or 'cosines' may be
+// the same array as 'angles'.
+void SinCosSimd(const float* angles, float* sines, float* cosines, int count);
+
+// Same as UpdateParticlesScalar, but processes ParticleSimd::WIDTH particles per iteration with
+// masks instead of branches. Falls back to the scalar kernel when no SIMD instruction set is available.
+int UpdateParticlesSimd(ParticlePool& pool, int begin, int end, const ParticleUpdateParams& params, int* expired);